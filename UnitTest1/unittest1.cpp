@@ -42,6 +42,27 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
 	    }
 
+	    TEST_METHOD(test_picohash_oa)
+	    {
+            int ret = picohash_oa_test();
+
+            Assert::AreEqual(ret, 0);
+	    }
+
+	    TEST_METHOD(test_picohash_bench)
+	    {
+            int ret = picohash_bench_test();
+
+            Assert::AreEqual(ret, 0);
+	    }
+
+	    TEST_METHOD(test_picohash_siphash)
+	    {
+            int ret = picohash_siphash_test();
+
+            Assert::AreEqual(ret, 0);
+	    }
+
         TEST_METHOD(random_tester)
         {
             int ret = random_tester_test();
@@ -63,6 +84,48 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(wake_list)
+        {
+            int ret = wake_list_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(packet_pool)
+        {
+            int ret = packet_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(arena)
+        {
+            int ret = arena_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cnx_slab)
+        {
+            int ret = cnx_slab_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cnx_layout)
+        {
+            int ret = cnx_layout_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(frame_desc)
+        {
+            int ret = frame_desc_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_parse_header)
         {
             int ret = parseheadertest();
@@ -147,6 +210,48 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(stream_tree)
+        {
+            int ret = stream_tree_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ready_stream)
+        {
+            int ret = ready_stream_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_gc)
+        {
+            int ret = stream_gc_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_reassembly)
+        {
+            int ret = stream_reassembly_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(zero_copy_send)
+        {
+            int ret = zero_copy_send_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_retransmit)
+        {
+            int ret = stream_retransmit_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(split_stream_frame)
         {
             int ret = split_stream_frame_test();
@@ -168,6 +273,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_retransmit_index)
+        {
+            int ret = retransmit_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_sack_bound)
+        {
+            int ret = sack_bound_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_ack_of_ack)
         {
             int ret = ack_of_ack_test();
@@ -454,6 +573,69 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(test_socket_batch)
+        {
+            int ret = socket_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_send_batch)
+        {
+            int ret = socket_send_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_gso)
+        {
+            int ret = socket_gso_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_gro)
+        {
+            int ret = socket_gro_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_loop)
+        {
+            int ret = socket_loop_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_uring)
+        {
+            int ret = socket_uring_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_shard)
+        {
+            int ret = socket_shard_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_socket_command)
+        {
+            int ret = socket_command_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(test_crypto_pool)
+        {
+            int ret = crypto_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         
         TEST_METHOD(ticket_store)
         {
@@ -518,6 +700,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_gso_prepare)
+        {
+            int ret = gso_prepare_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_spurious_retransmit)
         {
             int ret = spurious_retransmit_test();
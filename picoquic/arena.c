@@ -0,0 +1,189 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "picoquic_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per connection arena for the small objects that live as long as the
+ * connection, or less: stream heads, queued control frames, stashed
+ * connection IDs, probes.
+ *
+ * Objects are carved from chunks of PICOQUIC_ARENA_CHUNK_SIZE bytes, and
+ * rounded up to a size class. The classes are 16 bytes apart up to 512
+ * bytes, so that the stream heads and probes waste little of each chunk,
+ * and 64 bytes apart above that. Freed objects are kept in the free list of
+ * their class, and reused for the next allocation of that class. Objects
+ * larger than the largest class get a chunk of their own, which is freed
+ * as soon as the object is. All the chunks are freed at once when the
+ * connection is deleted, so the owners do not need to free each object.
+ *
+ * The caller passes the size of the object when freeing it, the same size
+ * that was used for allocating it.
+ */
+
+#define PICOQUIC_ARENA_ALIGN 16
+#define PICOQUIC_ARENA_HEADER_SIZE ((sizeof(picoquic_arena_chunk_t) + PICOQUIC_ARENA_ALIGN - 1) & ~((size_t)PICOQUIC_ARENA_ALIGN - 1))
+
+#define PICOQUIC_ARENA_NB_FINE_CLASSES (PICOQUIC_ARENA_FINE_MAX / PICOQUIC_ARENA_FINE_STEP)
+
+static int picoquic_arena_class(size_t size)
+{
+    int size_class;
+
+    if (size <= PICOQUIC_ARENA_FINE_MAX) {
+        size_class = (size == 0) ? 0 : (int)((size - 1) / PICOQUIC_ARENA_FINE_STEP);
+    }
+    else {
+        size_class = PICOQUIC_ARENA_NB_FINE_CLASSES +
+            (int)((size - PICOQUIC_ARENA_FINE_MAX - 1) / PICOQUIC_ARENA_COARSE_STEP);
+    }
+
+    return size_class;
+}
+
+static size_t picoquic_arena_class_size(int size_class)
+{
+    size_t class_size;
+
+    if (size_class < PICOQUIC_ARENA_NB_FINE_CLASSES) {
+        class_size = ((size_t)size_class + 1) * PICOQUIC_ARENA_FINE_STEP;
+    }
+    else {
+        class_size = PICOQUIC_ARENA_FINE_MAX +
+            ((size_t)size_class - PICOQUIC_ARENA_NB_FINE_CLASSES + 1) * PICOQUIC_ARENA_COARSE_STEP;
+    }
+
+    return class_size;
+}
+
+static picoquic_arena_chunk_t* picoquic_arena_add_chunk(picoquic_arena_t* arena, size_t size)
+{
+    picoquic_arena_chunk_t* chunk = (picoquic_arena_chunk_t*)malloc(PICOQUIC_ARENA_HEADER_SIZE + size);
+
+    if (chunk != NULL) {
+        chunk->size = size;
+        chunk->previous_chunk = NULL;
+        chunk->next_chunk = arena->first_chunk;
+        if (arena->first_chunk != NULL) {
+            arena->first_chunk->previous_chunk = chunk;
+        }
+        arena->first_chunk = chunk;
+        arena->stats.nb_chunks++;
+        arena->stats.bytes_reserved += size;
+    }
+
+    return chunk;
+}
+
+void* picoquic_arena_alloc(picoquic_arena_t* arena, size_t size)
+{
+    uint8_t* block = NULL;
+
+    if (size > PICOQUIC_ARENA_MAX_CLASS_SIZE) {
+        /* Large objects get their own chunk */
+        picoquic_arena_chunk_t* chunk = picoquic_arena_add_chunk(arena, size);
+
+        if (chunk != NULL) {
+            block = ((uint8_t*)chunk) + PICOQUIC_ARENA_HEADER_SIZE;
+        }
+    }
+    else {
+        int size_class = picoquic_arena_class(size);
+        size_t class_size = picoquic_arena_class_size(size_class);
+
+        size = class_size;
+
+        if (arena->free_list[size_class] != NULL) {
+            picoquic_arena_block_t* free_block = arena->free_list[size_class];
+            arena->free_list[size_class] = free_block->next_block;
+            block = (uint8_t*)free_block;
+        }
+        else {
+            if (arena->chunk_free_length < class_size) {
+                picoquic_arena_chunk_t* chunk = picoquic_arena_add_chunk(arena, PICOQUIC_ARENA_CHUNK_SIZE);
+
+                if (chunk != NULL) {
+                    /* The rest of the previous chunk is lost until the arena is released */
+                    arena->chunk_free = ((uint8_t*)chunk) + PICOQUIC_ARENA_HEADER_SIZE;
+                    arena->chunk_free_length = PICOQUIC_ARENA_CHUNK_SIZE;
+                }
+            }
+
+            if (arena->chunk_free_length >= class_size) {
+                block = arena->chunk_free;
+                arena->chunk_free += class_size;
+                arena->chunk_free_length -= class_size;
+            }
+        }
+    }
+
+    if (block != NULL) {
+        arena->stats.nb_allocs++;
+        arena->stats.bytes_in_use += size;
+    }
+
+    return block;
+}
+
+void picoquic_arena_free(picoquic_arena_t* arena, void* ptr, size_t size)
+{
+    if (ptr != NULL) {
+        if (size > PICOQUIC_ARENA_MAX_CLASS_SIZE) {
+            picoquic_arena_chunk_t* chunk = (picoquic_arena_chunk_t*)(((uint8_t*)ptr) - PICOQUIC_ARENA_HEADER_SIZE);
+
+            if (chunk->previous_chunk == NULL) {
+                arena->first_chunk = chunk->next_chunk;
+            }
+            else {
+                chunk->previous_chunk->next_chunk = chunk->next_chunk;
+            }
+            if (chunk->next_chunk != NULL) {
+                chunk->next_chunk->previous_chunk = chunk->previous_chunk;
+            }
+            arena->stats.nb_chunks--;
+            arena->stats.bytes_reserved -= chunk->size;
+            arena->stats.bytes_in_use -= size;
+            free(chunk);
+        }
+        else {
+            int size_class = picoquic_arena_class(size);
+            picoquic_arena_block_t* free_block = (picoquic_arena_block_t*)ptr;
+
+            free_block->next_block = arena->free_list[size_class];
+            arena->free_list[size_class] = free_block;
+            arena->stats.bytes_in_use -= picoquic_arena_class_size(size_class);
+        }
+    }
+}
+
+/* Free all the chunks, and all the objects that they hold */
+void picoquic_arena_release(picoquic_arena_t* arena)
+{
+    while (arena->first_chunk != NULL) {
+        picoquic_arena_chunk_t* chunk = arena->first_chunk;
+        arena->first_chunk = chunk->next_chunk;
+        free(chunk);
+    }
+
+    memset(arena, 0, sizeof(picoquic_arena_t));
+}
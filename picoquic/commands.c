@@ -0,0 +1,208 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Commands queued by the application threads, and applied by the thread
+ * that runs the QUIC context. Each command is a single allocation, with
+ * the stream data following the structure. When the data is added to the
+ * stream, the transport references it without copying, and frees the
+ * command when the data is released.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "util.h"
+
+/* Maximum number of commands applied in one call, so that a busy producer
+ * does not delay the processing of the network events */
+#define PICOQUIC_COMMAND_BATCH_MAX 256
+
+typedef enum {
+    picoquic_command_add_to_stream = 0,
+    picoquic_command_mark_active_stream,
+    picoquic_command_reset_stream,
+    picoquic_command_close
+} picoquic_command_enum;
+
+typedef struct st_picoquic_command_t {
+    picoquic_mpsc_node_t node;
+    picoquic_command_enum command_type;
+    uint64_t cnx_serial;
+    uint64_t stream_id;
+    uint64_t param; /* set_fin, is_active or error code */
+    size_t length;
+} picoquic_command_t;
+
+void picoquic_set_command_wakeup(picoquic_quic_t* quic, picoquic_command_wakeup_fn wakeup_fn, void* wakeup_ctx)
+{
+    quic->command_wakeup_fn = wakeup_fn;
+    quic->command_wakeup_ctx = wakeup_ctx;
+}
+
+static int picoquic_queue_command(picoquic_quic_t* quic, picoquic_command_enum command_type,
+    uint64_t cnx_serial, uint64_t stream_id, uint64_t param, const uint8_t* data, size_t length)
+{
+    int ret = 0;
+    picoquic_command_t* command = (picoquic_command_t*)malloc(sizeof(picoquic_command_t) + length);
+
+    if (command == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(command, 0, sizeof(picoquic_command_t));
+        command->command_type = command_type;
+        command->cnx_serial = cnx_serial;
+        command->stream_id = stream_id;
+        command->param = param;
+        command->length = length;
+        if (length > 0) {
+            memcpy(((uint8_t*)command) + sizeof(picoquic_command_t), data, length);
+        }
+
+        picoquic_mpsc_push(&quic->command_queue, &command->node);
+
+        if (quic->command_wakeup_fn != NULL) {
+            quic->command_wakeup_fn(quic->command_wakeup_ctx);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_queue_add_to_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, const uint8_t* data, size_t length, int set_fin)
+{
+    return picoquic_queue_command(quic, picoquic_command_add_to_stream, cnx_serial, stream_id,
+        (uint64_t)set_fin, data, length);
+}
+
+int picoquic_queue_mark_active_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, int is_active)
+{
+    return picoquic_queue_command(quic, picoquic_command_mark_active_stream, cnx_serial, stream_id,
+        (uint64_t)is_active, NULL, 0);
+}
+
+int picoquic_queue_reset_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, uint16_t local_stream_error)
+{
+    return picoquic_queue_command(quic, picoquic_command_reset_stream, cnx_serial, stream_id,
+        local_stream_error, NULL, 0);
+}
+
+int picoquic_queue_close(picoquic_quic_t* quic, uint64_t cnx_serial, uint16_t reason_code)
+{
+    return picoquic_queue_command(quic, picoquic_command_close, cnx_serial, 0,
+        reason_code, NULL, 0);
+}
+
+/* Release function of the zero copy stream data: the data is part of the command */
+static void picoquic_command_release(uint8_t* bytes, size_t length, void* release_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+#endif
+    free(release_ctx);
+}
+
+/* Apply one command. Returns 1 if the command memory was handed to the stream. */
+static int picoquic_apply_command(picoquic_quic_t* quic, picoquic_command_t* command)
+{
+    int is_kept = 0;
+    int ret = 0;
+    picoquic_cnx_t* cnx = picoquic_cnx_by_serial(quic, command->cnx_serial);
+
+    if (cnx == NULL) {
+        DBG_PRINTF("Command %d for deleted connection %" PRIu64 " ignored\n",
+            (int)command->command_type, command->cnx_serial);
+    }
+    else {
+        switch (command->command_type) {
+        case picoquic_command_add_to_stream:
+            if (command->length > 0) {
+                picoquic_iovec_t iov;
+
+                iov.base = ((uint8_t*)command) + sizeof(picoquic_command_t);
+                iov.len = command->length;
+                ret = picoquic_add_to_stream_zero_copy(cnx, command->stream_id, &iov, 1, (int)command->param,
+                    picoquic_command_release, command);
+                is_kept = (ret == 0);
+            }
+            else {
+                ret = picoquic_add_to_stream(cnx, command->stream_id, NULL, 0, (int)command->param);
+            }
+            break;
+        case picoquic_command_mark_active_stream:
+            ret = picoquic_mark_active_stream(cnx, command->stream_id, (int)command->param);
+            break;
+        case picoquic_command_reset_stream:
+            ret = picoquic_reset_stream(cnx, command->stream_id, (uint16_t)command->param);
+            break;
+        case picoquic_command_close:
+            ret = picoquic_close(cnx, (uint16_t)command->param);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+
+        if (ret != 0) {
+            DBG_PRINTF("Command %d on connection %" PRIu64 ", stream %" PRIu64 " returns 0x%x\n",
+                (int)command->command_type, command->cnx_serial, command->stream_id, ret);
+        }
+    }
+
+    return is_kept;
+}
+
+int picoquic_process_commands(picoquic_quic_t* quic)
+{
+    int nb_processed = 0;
+    picoquic_mpsc_node_t* node;
+
+    while (nb_processed < PICOQUIC_COMMAND_BATCH_MAX &&
+        (node = picoquic_mpsc_pop(&quic->command_queue)) != NULL) {
+        picoquic_command_t* command = (picoquic_command_t*)node;
+
+        if (!picoquic_apply_command(quic, command)) {
+            free(command);
+        }
+        nb_processed++;
+    }
+
+    if (nb_processed >= PICOQUIC_COMMAND_BATCH_MAX && quic->command_wakeup_fn != NULL) {
+        /* More commands may be waiting, do not let the network thread sleep */
+        quic->command_wakeup_fn(quic->command_wakeup_ctx);
+    }
+
+    return nb_processed;
+}
+
+void picoquic_free_commands(picoquic_quic_t* quic)
+{
+    picoquic_mpsc_node_t* node;
+
+    while ((node = picoquic_mpsc_pop(&quic->command_queue)) != NULL) {
+        free(node);
+    }
+}
@@ -148,15 +148,193 @@ static uint8_t* picoquic_frames_length_data_skip(uint8_t* bytes, const uint8_t*
 
 /* ****************************************************** */
 
+/* The streams are kept in a splay tree ordered by stream ID. The tree
+ * nodes are embedded in the stream heads, so that creating or finding a
+ * stream does not walk the list of streams. */
+
+static int picoquic_compare_stream_id(void* l, void* r)
+{
+    uint64_t id_l = ((picoquic_stream_head*)l)->stream_id;
+    uint64_t id_r = ((picoquic_stream_head*)r)->stream_id;
+
+    return (id_l < id_r) ? -1 : ((id_l > id_r) ? 1 : 0);
+}
+
+void picoquic_init_stream_tree(picoquic_cnx_t* cnx)
+{
+    picosplay_init_tree(&cnx->stream_tree, picoquic_compare_stream_id);
+
+    for (int i = 0; i < 4; i++) {
+        picoquic_init_sack_list(&cnx->closed_stream_ranks[i], 0);
+    }
+
+    for (int i = 0; i < PICOQUIC_STREAM_LISTS; i++) {
+        cnx->first_ready_stream[i] = NULL;
+        cnx->last_ready_stream[i] = NULL;
+    }
+}
+
+picoquic_stream_head* picoquic_first_stream(picoquic_cnx_t* cnx)
+{
+    picosplay_node* node = picosplay_first(&cnx->stream_tree);
+
+    return (node == NULL) ? NULL : (picoquic_stream_head*)node->value;
+}
+
+picoquic_stream_head* picoquic_next_stream(picoquic_stream_head* stream)
+{
+    picosplay_node* node = picosplay_next(&stream->stream_node);
+
+    return (node == NULL) ? NULL : (picoquic_stream_head*)node->value;
+}
+
+/*
+ * Streams that are ready to send are queued in one list per priority level.
+ * A stream is in the list if it has something to send and is not blocked by
+ * the stream flow control or by the stream ID limit. Blocked streams are
+ * removed from the list, and queued again when the credit arrives. Within a
+ * level, streams are served in round robin order: a stream is moved to the
+ * end of the list after it sends data.
+ *
+ * Streams with a pending reset or stop sending frame are queued in a separate
+ * control list, served first, because these frames are not subject to the
+ * connection flow control. Streams that only wait for the stream ID limit are
+ * queued in one list per direction, which is reviewed when the limit changes.
+ */
+
+/* Return the list in which the stream should be queued, or -1 if it has nothing to send */
+static int picoquic_get_stream_list(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
+{
+    int stream_list = -1;
+
+    if ((stream->reset_requested && !stream->reset_sent) ||
+        (stream->stop_sending_requested && !stream->stop_sending_sent)) {
+        stream_list = PICOQUIC_STREAM_LIST_CONTROL;
+    }
+    else if (stream->is_active ||
+        (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) ||
+        (stream->fin_requested && !stream->fin_sent)) {
+        if (stream->sent_offset < stream->maxdata_remote) {
+            stream_list = stream->priority;
+        }
+        else {
+            cnx->stream_blocked = 1;
+        }
+    }
+
+    /* if the stream is not open yet, verify that it fits under
+     * the max stream id limit, which depends of the type of stream */
+    if (stream_list >= 0 && IS_CLIENT_STREAM_ID(stream->stream_id) == cnx->client_mode) {
+        if (IS_BIDIR_STREAM_ID(stream->stream_id)) {
+            if (stream->stream_id > cnx->max_stream_id_bidir_remote) {
+                stream_list = PICOQUIC_STREAM_LIST_BLOCKED_BIDIR;
+            }
+        }
+        else if (stream->stream_id > cnx->max_stream_id_unidir_remote) {
+            stream_list = PICOQUIC_STREAM_LIST_BLOCKED_UNIDIR;
+        }
+    }
+
+    return stream_list;
+}
+
+static void picoquic_remove_ready_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
+{
+    if (stream->is_ready || stream->is_id_blocked) {
+        if (stream->previous_ready_stream == NULL) {
+            cnx->first_ready_stream[stream->ready_list] = stream->next_ready_stream;
+        }
+        else {
+            stream->previous_ready_stream->next_ready_stream = stream->next_ready_stream;
+        }
+
+        if (stream->next_ready_stream == NULL) {
+            cnx->last_ready_stream[stream->ready_list] = stream->previous_ready_stream;
+        }
+        else {
+            stream->next_ready_stream->previous_ready_stream = stream->previous_ready_stream;
+        }
+
+        stream->next_ready_stream = NULL;
+        stream->previous_ready_stream = NULL;
+        stream->is_ready = 0;
+        stream->is_id_blocked = 0;
+    }
+}
+
+static void picoquic_append_ready_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream, int stream_list)
+{
+    stream->next_ready_stream = NULL;
+    stream->previous_ready_stream = cnx->last_ready_stream[stream_list];
+
+    if (stream->previous_ready_stream == NULL) {
+        cnx->first_ready_stream[stream_list] = stream;
+    }
+    else {
+        stream->previous_ready_stream->next_ready_stream = stream;
+    }
+
+    cnx->last_ready_stream[stream_list] = stream;
+    stream->ready_list = (uint8_t)stream_list;
+
+    if (stream_list >= PICOQUIC_STREAM_LIST_BLOCKED_BIDIR) {
+        stream->is_id_blocked = 1;
+    }
+    else {
+        stream->is_ready = 1;
+    }
+}
+
+/* Queue or remove the stream after a change of state. If "move_to_end" is set,
+ * the stream is moved to the end of its list, so other streams get their turn.
+ */
+void picoquic_update_ready_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream, int move_to_end)
+{
+    int stream_list = picoquic_get_stream_list(cnx, stream);
+
+    if (stream_list < 0) {
+        picoquic_remove_ready_stream(cnx, stream);
+    }
+    else if ((!stream->is_ready && !stream->is_id_blocked) || stream->ready_list != stream_list ||
+        (move_to_end && stream->next_ready_stream != NULL)) {
+        picoquic_remove_ready_stream(cnx, stream);
+        picoquic_append_ready_stream(cnx, stream, stream_list);
+    }
+}
+
+/* Review the streams waiting for the stream ID limit, after a change of the limits.
+ * The streams that are still blocked keep their place in the list. */
+void picoquic_update_ready_stream_list(picoquic_cnx_t* cnx)
+{
+    for (int i = PICOQUIC_STREAM_LIST_BLOCKED_BIDIR; i <= PICOQUIC_STREAM_LIST_BLOCKED_UNIDIR; i++) {
+        picoquic_stream_head* stream = cnx->first_ready_stream[i];
+
+        while (stream != NULL) {
+            picoquic_stream_head* next_stream = stream->next_ready_stream;
+
+            picoquic_update_ready_stream(cnx, stream, 0);
+            stream = next_stream;
+        }
+    }
+}
+
+/* Change the priority level of the stream, and requeue it if it is ready */
+void picoquic_update_stream_priority(picoquic_cnx_t* cnx, picoquic_stream_head* stream, uint8_t priority)
+{
+    if (stream->priority != priority) {
+        picoquic_remove_ready_stream(cnx, stream);
+        stream->priority = priority;
+        picoquic_update_ready_stream(cnx, stream, 0);
+    }
+}
+
 picoquic_stream_head* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
 {
-    picoquic_stream_head* stream = (picoquic_stream_head*)malloc(sizeof(picoquic_stream_head));
+    picoquic_stream_head* stream = (picoquic_stream_head*)picoquic_arena_alloc(&cnx->arena, sizeof(picoquic_stream_head));
     if (stream != NULL) {
-        picoquic_stream_head* previous_stream = NULL;
-        picoquic_stream_head* next_stream = cnx->first_stream;
-
         memset(stream, 0, sizeof(picoquic_stream_head));
         stream->stream_id = stream_id;
+        stream->priority = PICOQUIC_DEFAULT_STREAM_PRIORITY;
 
         if (IS_LOCAL_STREAM_ID(stream_id, cnx->client_mode)) {
             if (IS_BIDIR_STREAM_ID(stream_id)) {
@@ -179,25 +357,88 @@ picoquic_stream_head* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t strea
             }
         }
 
-        /*
-         * Make sure that the streams are open in order.
-         */
+        picosplay_insert_node(&cnx->stream_tree, &stream->stream_node, stream);
+    }
 
-        while (next_stream != NULL && next_stream->stream_id < stream_id) {
-            previous_stream = next_stream;
-            next_stream = next_stream->next_stream;
-        }
+    return stream;
+}
 
-        stream->next_stream = next_stream;
+/* Remove the stream from the tree, and free the stream data */
+void picoquic_delete_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
+{
+    picoquic_remove_ready_stream(cnx, stream);
+    picosplay_remove_node(&cnx->stream_tree, &stream->stream_node);
+    picoquic_clear_stream(stream);
+    picoquic_arena_free(&cnx->arena, stream, sizeof(picoquic_stream_head));
+}
 
-        if (previous_stream == NULL) {
-            cnx->first_stream = stream;
-        } else {
-            previous_stream->next_stream = stream;
+/*
+ * Streams are deleted as soon as they are closed in both directions, instead of
+ * waiting for the end of the connection. The ranks of the deleted streams are
+ * remembered as ranges in a SACK list per stream type. Streams are mostly closed
+ * in order, so the lists stay short. This is used to recognize and ignore late
+ * or duplicate frames, instead of recreating the stream.
+ */
+
+int picoquic_is_stream_closed(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    uint64_t rank = STREAM_RANK_FROM_ID(stream_id);
+
+    return picoquic_check_sack_list(&cnx->closed_stream_ranks[stream_id & 3], rank, rank) != 0;
+}
+
+static int picoquic_is_stream_send_complete(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
+{
+    int is_complete = 0;
+
+    if (!IS_BIDIR_STREAM_ID(stream->stream_id) && !IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode)) {
+        /* Nothing is ever sent on remote unidir streams */
+        is_complete = 1;
+    }
+    else if (stream->reset_sent) {
+        /* The reset frame is repeated from the packet copy if lost, without the stream context */
+        is_complete = 1;
+    }
+    else if (stream->fin_sent && stream->fin_acked) {
+        /* All the data up to the fin must have been acknowledged */
+        is_complete = stream->sent_offset == 0 ||
+            (stream->sack_list.nb_ranges == 1 && stream->sack_list.ranges[0].start_of_sack_range == 0 &&
+                stream->sack_list.ranges[0].end_of_sack_range + 1 >= stream->sent_offset);
+    }
+
+    return is_complete;
+}
+
+int picoquic_delete_stream_if_closed(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
+{
+    int is_deleted = 0;
+
+    if ((stream->fin_signalled || stream->reset_received) && picoquic_is_stream_send_complete(cnx, stream)) {
+        uint64_t rank = STREAM_RANK_FROM_ID(stream->stream_id);
+
+        /* If the rank cannot be remembered, keep the stream until the end of the connection */
+        if (picoquic_update_sack_list(&cnx->closed_stream_ranks[stream->stream_id & 3], rank, rank) >= 0) {
+            if (!IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode) && !stream->max_stream_updated) {
+                /* Make sure that the peer gets credit for the closed stream */
+                stream->max_stream_updated = 1;
+                if (IS_BIDIR_STREAM_ID(stream->stream_id)) {
+                    cnx->max_stream_id_bidir_local_computed += 4;
+                }
+                else {
+                    cnx->max_stream_id_unidir_local_computed += 4;
+                }
+            }
+
+            if (cnx->high_priority_stream_id == stream->stream_id) {
+                cnx->high_priority_stream_id = (uint64_t)((int64_t)-1);
+            }
+
+            picoquic_delete_stream(cnx, stream);
+            is_deleted = 1;
         }
     }
 
-    return stream;
+    return is_deleted;
 }
 
 /* if the initial remote has changed, update the existing streams.
@@ -206,7 +447,7 @@ picoquic_stream_head* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t strea
 
 void picoquic_update_stream_initial_remote(picoquic_cnx_t* cnx)
 {
-    picoquic_stream_head* stream = cnx->first_stream;
+    picoquic_stream_head* stream = picoquic_first_stream(cnx);
 
     while (stream) {
         if (IS_LOCAL_STREAM_ID(stream->stream_id, cnx->client_mode)) {
@@ -220,24 +461,25 @@ void picoquic_update_stream_initial_remote(picoquic_cnx_t* cnx)
                     stream->maxdata_remote = cnx->remote_parameters.initial_max_stream_data_uni;
                 }
             }
+            picoquic_update_ready_stream(cnx, stream, 0);
         }
-        stream = stream->next_stream;
+        stream = picoquic_next_stream(stream);
     };
 }
 
 picoquic_stream_head* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id, int create)
 {
-    picoquic_stream_head* stream = cnx->first_stream;
+    picoquic_stream_head* stream = NULL;
+    picoquic_stream_head target;
+    picosplay_node* node;
 
-    while (stream) {
-        if (stream->stream_id == stream_id) {
-            break;
-        } else {
-            stream = stream->next_stream;
-        }
-    };
+    target.stream_id = stream_id;
+    node = picosplay_find(&cnx->stream_tree, &target);
 
-    if (create != 0 && stream == NULL) {
+    if (node != NULL) {
+        stream = (picoquic_stream_head*)node->value;
+    }
+    else if (create != 0) {
         stream = picoquic_create_stream(cnx, stream_id);
     }
 
@@ -338,15 +580,11 @@ int picoquic_prepare_stream_reset_frame(picoquic_cnx_t* cnx, picoquic_stream_hea
 
             picoquic_update_max_stream_ID_local(cnx, stream);
 
-            /* Free the queued data */
+            /* Free the queued data, and the data kept for retransmission */
             while (stream->send_queue != NULL) {
-                picoquic_stream_data* next = stream->send_queue->next_stream_data;
-                if (stream->send_queue->bytes != NULL) {
-                    free(stream->send_queue->bytes);
-                }
-                free(stream->send_queue);
-                stream->send_queue = next;
+                picoquic_dequeue_stream_data(stream);
             }
+            picoquic_release_retained_stream_data(stream);
         }
     }
 
@@ -367,6 +605,9 @@ uint8_t* picoquic_decode_stream_reset_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR,
             picoquic_frame_type_reset_stream);
 
+    } else if (picoquic_is_stream_closed(cnx, stream_id)) {
+        /* Late frame for a stream that was already closed and deleted, ignore it */
+
     } else if ((stream = picoquic_find_or_create_stream(cnx, stream_id, 1)) == NULL) {
         bytes = NULL;  // error already signaled
 
@@ -391,6 +632,8 @@ uint8_t* picoquic_decode_stream_reset_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
             }
             stream->reset_signalled = 1;
         }
+
+        (void)picoquic_delete_stream_if_closed(cnx, stream);
     }
 
     return bytes;
@@ -703,6 +946,9 @@ uint8_t* picoquic_decode_stop_sending_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR,
             picoquic_frame_type_stop_sending);
 
+    } else if (picoquic_is_stream_closed(cnx, stream_id)) {
+        /* Late frame for a stream that was already closed and deleted, ignore it */
+
     } else if ((stream = picoquic_find_or_create_stream(cnx, stream_id, 1)) == NULL) {
         bytes = NULL;  // Error already signaled
     } else if (!stream->stop_sending_received && !stream->reset_requested) {
@@ -801,13 +1047,49 @@ int picoquic_parse_stream_header(const uint8_t* bytes, size_t bytes_max,
     return ret;
 }
 
+/*
+ * Return the received data available at the specified offset, up to the end
+ * of the contiguous range or the end of the ring buffer, whichever comes first.
+ * The offset must not be lower than the consumed offset.
+ */
+uint8_t* picoquic_get_stream_data_span(picoquic_stream_head* stream, uint64_t offset, size_t* length)
+{
+    uint8_t* span = NULL;
+    picoquic_sack_list_t* ranges = &stream->receive_ranges;
+
+    *length = 0;
+
+    if (offset >= stream->consumed_offset) {
+        /* Ranges are sorted from highest to lowest, and data is received mostly in order */
+        for (size_t i = ranges->nb_ranges; i > 0; i--) {
+            picoquic_sack_item_t* range = &ranges->ranges[i - 1];
+
+            if (range->end_of_sack_range < offset) {
+                continue;
+            } else if (range->start_of_sack_range <= offset) {
+                size_t start = (size_t)(offset & (stream->receive_buffer_size - 1));
+                uint64_t available = range->end_of_sack_range + 1 - offset;
+
+                *length = stream->receive_buffer_size - start;
+                if (available < (uint64_t)*length) {
+                    *length = (size_t)available;
+                }
+                span = stream->receive_buffer + start;
+            }
+            break;
+        }
+    }
+
+    return span;
+}
+
 void picoquic_stream_data_callback(picoquic_cnx_t* cnx, picoquic_stream_head* stream)
 {
-    picoquic_stream_data* data = stream->stream_data;
+    uint8_t* data;
+    size_t data_length;
 
-    while (data != NULL && data->offset <= stream->consumed_offset) {
-        size_t start = (size_t)(stream->consumed_offset - data->offset);
-        size_t data_length = data->length - start;
+    /* In order data is delivered in at most two spans, before and after the end of the ring */
+    while ((data = picoquic_get_stream_data_span(stream, stream->consumed_offset, &data_length)) != NULL) {
         picoquic_call_back_event_t fin_now = picoquic_callback_stream_data;
 
         stream->consumed_offset += data_length;
@@ -817,15 +1099,10 @@ void picoquic_stream_data_callback(picoquic_cnx_t* cnx, picoquic_stream_head* st
             stream->fin_signalled = 1;
         }
 
-        if (cnx->callback_fn(cnx, stream->stream_id, data->bytes + start, data_length, fin_now,
+        if (cnx->callback_fn(cnx, stream->stream_id, data, data_length, fin_now,
             cnx->callback_ctx) != 0) {
             picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
         }
-
-        free(data->bytes);
-        stream->stream_data = data->next_stream_data;
-        free(data);
-        data = stream->stream_data;
     }
 
     /* handle the case where the fin frame does not carry any data */
@@ -839,12 +1116,73 @@ void picoquic_stream_data_callback(picoquic_cnx_t* cnx, picoquic_stream_head* st
     }
 }
 
+/*
+ * Grow the receive ring so that it covers the data from the consumed offset
+ * to the end offset. The bytes not yet consumed keep their offset, but move
+ * to their position in the larger ring.
+ */
+static int picoquic_grow_receive_buffer(picoquic_stream_head* stream, uint64_t end_offset)
+{
+    int ret = 0;
+    uint64_t needed = end_offset - stream->consumed_offset;
+    size_t new_size = (stream->receive_buffer_size == 0) ? PICOQUIC_RECEIVE_BUFFER_MIN : stream->receive_buffer_size;
+    uint8_t* new_buffer = NULL;
+
+    while ((uint64_t)new_size < needed && new_size <= (SIZE_MAX >> 1)) {
+        new_size <<= 1;
+    }
+
+    if ((uint64_t)new_size < needed || (new_buffer = (uint8_t*)malloc(new_size)) == NULL) {
+        ret = -1;
+    } else {
+        if (stream->receive_buffer != NULL) {
+            uint64_t offset = stream->consumed_offset;
+            size_t remaining = stream->receive_buffer_size;
+
+            while (remaining > 0) {
+                size_t old_index = (size_t)(offset & (stream->receive_buffer_size - 1));
+                size_t new_index = (size_t)(offset & (new_size - 1));
+                size_t chunk = remaining;
+
+                if (chunk > stream->receive_buffer_size - old_index) {
+                    chunk = stream->receive_buffer_size - old_index;
+                }
+                if (chunk > new_size - new_index) {
+                    chunk = new_size - new_index;
+                }
+                memcpy(new_buffer + new_index, stream->receive_buffer + old_index, chunk);
+                offset += chunk;
+                remaining -= chunk;
+            }
+
+            free(stream->receive_buffer);
+        }
+        stream->receive_buffer = new_buffer;
+        stream->receive_buffer_size = new_size;
+    }
+
+    return ret;
+}
+
+/* Copy data in the ring, wrapping at the end of the buffer if needed */
+static void picoquic_write_receive_buffer(picoquic_stream_head* stream, uint64_t offset, const uint8_t* bytes, size_t length)
+{
+    size_t index = (size_t)(offset & (stream->receive_buffer_size - 1));
+    size_t first_length = stream->receive_buffer_size - index;
+
+    if (first_length > length) {
+        first_length = length;
+    }
+    memcpy(stream->receive_buffer + index, bytes, first_length);
+    if (first_length < length) {
+        memcpy(stream->receive_buffer, bytes + first_length, length - first_length);
+    }
+}
+
 /* Common code to data stream and crypto hs stream */
-static int picoquic_queue_network_input(picoquic_cnx_t* cnx, picoquic_stream_head* stream, size_t offset, uint8_t* bytes, size_t length, int * new_data_available)
+static int picoquic_queue_network_input(picoquic_cnx_t* cnx, picoquic_stream_head* stream, uint64_t offset, uint8_t* bytes, size_t length, int * new_data_available)
 {
     int ret = 0;
-    picoquic_stream_data** pprevious = &stream->stream_data;
-    picoquic_stream_data* next = stream->stream_data;
     size_t start = 0;
 
     if (offset <= stream->consumed_offset) {
@@ -857,45 +1195,47 @@ static int picoquic_queue_network_input(picoquic_cnx_t* cnx, picoquic_stream_hea
         }
     }
 
-    /* Queue of a block in the stream */
-
-    while (next != NULL && start < length && next->offset <= offset + start) {
-        if (offset + length <= next->offset + next->length) {
-            start = length;
-        } else if (offset < next->offset + next->length) {
-            start = (size_t)(next->offset + next->length - offset);
-        }
-        pprevious = &next->next_stream_data;
-        next = next->next_stream_data;
-    }
-
     if (start < length) {
-        size_t data_length = length - start;
+        uint64_t end_offset = offset + length;
 
-        if (next != NULL && next->offset < offset + length) {
-            data_length -= (size_t)(offset + length - next->offset);
-        }
+        if (end_offset - stream->consumed_offset > (uint64_t)stream->receive_buffer_size &&
+            picoquic_grow_receive_buffer(stream, end_offset) != 0) {
+            ret = picoquic_connection_error(cnx, PICOQUIC_ERROR_MEMORY, 0);
+        } else {
+            /* Only fill the holes, the data received first is kept */
+            uint64_t data_offset = offset + start;
+            uint64_t cursor = data_offset;
+            picoquic_sack_list_t* ranges = &stream->receive_ranges;
 
-        if (data_length > 0) {
-            picoquic_stream_data* data = (picoquic_stream_data*)malloc(sizeof(picoquic_stream_data));
+            for (size_t i = ranges->nb_ranges; i > 0 && cursor < end_offset; i--) {
+                picoquic_sack_item_t* range = &ranges->ranges[i - 1];
 
-            if (data == NULL) {
-                ret = picoquic_connection_error(cnx, PICOQUIC_ERROR_MEMORY, 0);
-            }
-            else {
-                data->length = data_length;
-                data->bytes = (uint8_t*)malloc(data_length);
-                if (data->bytes == NULL) {
-                    ret = picoquic_connection_error(cnx, PICOQUIC_ERROR_MEMORY, 0);
-                    free(data);
+                if (range->end_of_sack_range < cursor) {
+                    continue;
+                } else if (range->start_of_sack_range >= end_offset) {
+                    break;
                 }
-                else {
-                    data->offset = offset + start;
-                    memcpy(data->bytes, bytes + start, data_length);
-                    data->next_stream_data = next;
-                    *pprevious = data;
-                    *new_data_available = 1;
+                if (range->start_of_sack_range > cursor) {
+                    picoquic_write_receive_buffer(stream, cursor, bytes + (size_t)(cursor - offset),
+                        (size_t)(range->start_of_sack_range - cursor));
                 }
+                cursor = range->end_of_sack_range + 1;
+            }
+
+            if (cursor < end_offset) {
+                picoquic_write_receive_buffer(stream, cursor, bytes + (size_t)(cursor - offset),
+                    (size_t)(end_offset - cursor));
+            }
+
+            switch (picoquic_update_sack_list(&stream->receive_ranges, data_offset, end_offset - 1)) {
+            case 0:
+                *new_data_available = 1;
+                break;
+            case 1:
+                break;
+            default:
+                ret = picoquic_connection_error(cnx, PICOQUIC_ERROR_MEMORY, 0);
+                break;
             }
         }
     }
@@ -909,10 +1249,13 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
     int ret = 0;
     uint64_t should_notify = 0;
     /* Is there such a stream, is it still open? */
-    picoquic_stream_head* stream;
+    picoquic_stream_head* stream = NULL;
     uint64_t new_fin_offset = offset + length;
 
-    if ((stream = picoquic_find_or_create_stream(cnx, stream_id, 1)) == NULL) {
+    if (picoquic_is_stream_closed(cnx, stream_id)) {
+        /* Late or duplicate data for a stream that was already closed and deleted, ignore it */
+
+    } else if ((stream = picoquic_find_or_create_stream(cnx, stream_id, 1)) == NULL) {
         ret = 1;  // Error already signaled
 
     } else if (stream->fin_received) {
@@ -934,10 +1277,10 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
         }
     }
 
-    if (ret == 0) {
+    if (ret == 0 && stream != NULL) {
         int new_data_available = 0;
 
-        ret = picoquic_queue_network_input(cnx, stream, (size_t)offset, bytes, length, &new_data_available);
+        ret = picoquic_queue_network_input(cnx, stream, offset, bytes, length, &new_data_available);
 
         if (new_data_available) {
             should_notify = 1;
@@ -950,6 +1293,10 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
         picoquic_stream_data_callback(cnx, stream);
     }
 
+    if (ret == 0 && stream != NULL) {
+        (void)picoquic_delete_stream_if_closed(cnx, stream);
+    }
+
     return ret;
 }
 
@@ -972,17 +1319,26 @@ uint8_t* picoquic_decode_stream_frame(picoquic_cnx_t* cnx, uint8_t* bytes, const
     return bytes;
 }
 
+/* Return the first stream of the list that is still ready for that list.
+ * Streams whose state changed are moved to their new list, or removed. */
+static picoquic_stream_head* picoquic_first_ready_stream_in_list(picoquic_cnx_t* cnx, int stream_list)
+{
+    picoquic_stream_head* stream = cnx->first_ready_stream[stream_list];
+
+    while (stream != NULL && picoquic_get_stream_list(cnx, stream) != stream_list) {
+        picoquic_update_ready_stream(cnx, stream, 0);
+        stream = cnx->first_ready_stream[stream_list];
+    }
+
+    return stream;
+}
+
 picoquic_stream_head* picoquic_find_ready_stream(picoquic_cnx_t* cnx)
 {
-    picoquic_stream_head* start_stream = cnx->first_stream;
     picoquic_stream_head* found_stream = NULL;
 
     if (cnx->high_priority_stream_id != (uint64_t)((int64_t)-1)) {
-        picoquic_stream_head* hi_pri_stream = cnx->first_stream;
-
-        while (hi_pri_stream && hi_pri_stream->stream_id != cnx->high_priority_stream_id) {
-            hi_pri_stream = hi_pri_stream->next_stream;
-        }
+        picoquic_stream_head* hi_pri_stream = picoquic_find_stream(cnx, cnx->high_priority_stream_id, 0);
 
         if (hi_pri_stream == NULL) {
             cnx->high_priority_stream_id = (uint64_t)((int64_t)-1);
@@ -1005,44 +1361,25 @@ picoquic_stream_head* picoquic_find_ready_stream(picoquic_cnx_t* cnx)
         }
     }
 
-    /* Skip to the first non visited stream */
-    while (start_stream && start_stream->stream_id <= cnx->last_visited_stream_id) {
-        start_stream = start_stream->next_stream;
-    }
-
-    if (start_stream == NULL) {
-        start_stream = cnx->first_stream;
-    }
+    /* The reset and stop sending frames are sent first. Then, if the connection
+     * flow control allows, serve the most urgent level first. When the connection
+     * is blocked, the streams stay in their lists until the credit arrives. */
+    found_stream = picoquic_first_ready_stream_in_list(cnx, PICOQUIC_STREAM_LIST_CONTROL);
 
-    /* Look for a ready stream */
-    if (start_stream != NULL) {
-        picoquic_stream_head* stream = start_stream;
-        do {
-            if ((cnx->maxdata_remote > cnx->data_sent && stream->sent_offset < stream->maxdata_remote && (stream->is_active || 
-                    (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) ||
-                    (stream->fin_requested && !stream->fin_sent))) ||
-                (stream->reset_requested && !stream->reset_sent) ||
-                (stream->stop_sending_requested && !stream->stop_sending_sent)) {
-                /* Something can be sent */
-                /* if the stream is not active yet, verify that it fits under
-                 * the max stream id limit, which depends of the type of stream */
-                if (IS_CLIENT_STREAM_ID(stream->stream_id) != cnx->client_mode ||
-                    stream->stream_id <= ((IS_BIDIR_STREAM_ID(stream->stream_id))? cnx->max_stream_id_bidir_remote : cnx->max_stream_id_unidir_remote)){
-                    found_stream = stream;
-                    break;
-                }
+    if (found_stream == NULL) {
+        if (cnx->maxdata_remote > cnx->data_sent) {
+            for (int i = 0; found_stream == NULL && i < PICOQUIC_STREAM_PRIORITY_LEVELS; i++) {
+                found_stream = picoquic_first_ready_stream_in_list(cnx, i);
             }
-            else if (stream->is_active ||
-                (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset)) {
-                if (stream->sent_offset >= stream->maxdata_remote) {
-                    cnx->stream_blocked = 1;
-                }
-                else if (cnx->maxdata_remote <= cnx->data_sent){
+        }
+        else {
+            for (int i = 0; i < PICOQUIC_STREAM_PRIORITY_LEVELS; i++) {
+                if (cnx->first_ready_stream[i] != NULL) {
                     cnx->flow_blocked = 1;
+                    break;
                 }
             }
-            stream = stream->next_stream != NULL ? stream->next_stream : cnx->first_stream;
-        } while (stream != start_stream);
+        }
     }
 
     return found_stream;
@@ -1158,14 +1495,12 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head* str
     }
 
     if (stream->reset_requested && !stream->reset_sent) {
-        return picoquic_prepare_stream_reset_frame(cnx, stream, bytes, bytes_max, consumed);
+        ret = picoquic_prepare_stream_reset_frame(cnx, stream, bytes, bytes_max, consumed);
     }
-
-    if (stream->stop_sending_requested && !stream->stop_sending_sent) {
-        return picoquic_prepare_stop_sending_frame(stream, bytes, bytes_max, consumed);
+    else if (stream->stop_sending_requested && !stream->stop_sending_sent) {
+        ret = picoquic_prepare_stop_sending_frame(stream, bytes, bytes_max, consumed);
     }
-    
-    if (!stream->is_active &&
+    else if (!stream->is_active &&
         (stream->send_queue == NULL || stream->send_queue->length <= stream->send_queue->offset) &&
         (!stream->fin_requested || stream->fin_sent)) {
         *consumed = 0;
@@ -1217,6 +1552,8 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head* str
                     stream->sent_offset += stream_data_context.length;
                     cnx->data_sent += stream_data_context.length;
                     *consumed = byte_index;
+                    /* This data is only kept in the sent packet */
+                    stream->send_not_retained = 1;
 
                     if (stream_data_context.is_fin) {
                         stream->is_active = 0;
@@ -1258,15 +1595,17 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head* str
                     byte_index += length;
 
                     stream->send_queue->offset += length;
-                    if (stream->send_queue->offset >= stream->send_queue->length) {
-                        picoquic_stream_data* next = stream->send_queue->next_stream_data;
-                        free(stream->send_queue->bytes);
-                        free(stream->send_queue);
-                        stream->send_queue = next;
-                    }
-
                     stream->sent_offset += length;
                     cnx->data_sent += length;
+
+                    if (stream->send_queue->offset >= stream->send_queue->length) {
+                        if (stream->send_not_retained) {
+                            picoquic_dequeue_stream_data(stream);
+                        } else {
+                            /* Keep the data until acknowledged, so lost frames can be rebuilt */
+                            picoquic_retain_stream_data(stream);
+                        }
+                    }
                 }
                 *consumed = byte_index;
 
@@ -1287,10 +1626,12 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head* str
             }
         }
 
-        if (ret == 0) {
-            /* remember the last stream on which data is sent so each stream is visited in turn. */
-            cnx->last_visited_stream_id = stream->stream_id;
-        }
+    }
+
+    if (ret == 0) {
+        /* Move the stream to the end of its priority list so each stream is visited in turn,
+         * or remove it if there is nothing more to send. */
+        picoquic_update_ready_stream(cnx, stream, 1);
     }
 
     return ret;
@@ -1377,6 +1718,105 @@ int picoquic_split_stream_frame(uint8_t* frame, size_t frame_length, uint8_t* b1
     }
     return ret;
 }
+/*
+ * Rebuild a stream frame that was not stored in the sent packet, from the
+ * data that the stream retains for retransmission. That data starts with the
+ * retained items, followed by the part of the first queued item that was
+ * already sent. The bytes below the retained data were acknowledged and are
+ * left out. If nothing is left to repeat, the frame is not rebuilt and the
+ * consumed length is set to 0.
+ */
+int picoquic_rebuild_stream_frame(picoquic_stream_head* stream, const picoquic_frame_desc_t* desc,
+    uint8_t* bytes, size_t bytes_max, size_t* consumed)
+{
+    int ret = 0;
+    uint64_t offset = desc->offset;
+    uint64_t end_offset = desc->offset + desc->data_length;
+    picoquic_stream_data* stream_data = stream->send_retained;
+    uint64_t data_offset = stream->retained_offset;
+    int in_send_queue = 0;
+    size_t byte_index = 0;
+
+    *consumed = 0;
+
+    if (stream_data == NULL) {
+        stream_data = stream->send_queue;
+        data_offset = stream->sent_offset - ((stream_data == NULL) ? 0 : stream_data->offset);
+        in_send_queue = 1;
+    }
+    else if (stream->send_retained_hint != NULL && stream->retained_hint_offset <= offset) {
+        /* Losses are mostly detected in order, start from the previous frame */
+        stream_data = stream->send_retained_hint;
+        data_offset = stream->retained_hint_offset;
+    }
+
+    if (offset < data_offset) {
+        offset = (data_offset < end_offset) ? data_offset : end_offset;
+    }
+
+    if (offset >= end_offset && (desc->flags & PICOQUIC_FRAME_DESC_FIN) == 0) {
+        /* All the data was acknowledged */
+    }
+    else if ((ret = picoquic_prepare_stream_frame_header(bytes, bytes_max, stream->stream_id, (size_t)offset, &byte_index)) == 0) {
+        size_t length = (size_t)(end_offset - offset);
+        size_t start_index = 0;
+
+        /* Leave room for the length field, so it is always present */
+        if (byte_index + length + 8 > bytes_max) {
+            ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+        }
+        else {
+            byte_index = picoquic_encode_length_of_stream_frame(bytes, byte_index, bytes_max - byte_index, length, &start_index);
+
+            if ((desc->flags & PICOQUIC_FRAME_DESC_FIN) != 0) {
+                bytes[start_index] |= 1;
+            }
+
+            while (offset < end_offset) {
+                size_t available;
+
+                if (stream_data == NULL) {
+                    if (in_send_queue || stream->send_queue == NULL) {
+                        /* The data is not retained */
+                        ret = -1;
+                        break;
+                    }
+                    stream_data = stream->send_queue;
+                    data_offset = stream->sent_offset - stream_data->offset;
+                    in_send_queue = 1;
+                }
+
+                available = (in_send_queue) ? (size_t)stream_data->offset : stream_data->length;
+
+                if (offset < data_offset + available) {
+                    size_t skip = (size_t)(offset - data_offset);
+                    size_t copied = available - skip;
+
+                    if (copied > end_offset - offset) {
+                        copied = (size_t)(end_offset - offset);
+                    }
+                    if (!in_send_queue && copied == (size_t)(end_offset - offset)) {
+                        stream->send_retained_hint = stream_data;
+                        stream->retained_hint_offset = data_offset;
+                    }
+                    memcpy(bytes + byte_index, stream_data->bytes + skip, copied);
+                    byte_index += copied;
+                    offset += copied;
+                }
+
+                data_offset += available;
+                stream_data = (in_send_queue) ? NULL : stream_data->next_stream_data;
+            }
+
+            if (ret == 0) {
+                *consumed = byte_index;
+            }
+        }
+    }
+
+    return ret;
+}
+
 /*
  * Crypto HS frames
  */
@@ -1416,7 +1856,12 @@ uint8_t* picoquic_decode_crypto_hs_frame(picoquic_cnx_t* cnx, uint8_t* bytes, co
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, picoquic_frame_type_crypto_hs);
         bytes = NULL;
 
-    } else if (picoquic_queue_network_input(cnx, &cnx->tls_stream[epoch], (size_t)offset, bytes, (size_t)data_length, &new_data_available) != 0) {
+    } else if (offset + data_length > cnx->tls_stream[epoch].consumed_offset + PICOQUIC_MAX_CRYPTO_BUFFER_GAP) {
+        /* Do not let the peer force the allocation of an arbitrarily large reassembly buffer */
+        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, picoquic_frame_type_crypto_hs);
+        bytes = NULL;
+
+    } else if (picoquic_queue_network_input(cnx, &cnx->tls_stream[epoch], offset, bytes, (size_t)data_length, &new_data_available) != 0) {
         bytes = NULL;  // Error signaled
 
     } else {
@@ -1488,10 +1933,7 @@ int picoquic_prepare_crypto_hs_frame(picoquic_cnx_t* cnx, int epoch,
 
                 stream->send_queue->offset += length;
                 if (stream->send_queue->offset >= stream->send_queue->length) {
-                    picoquic_stream_data* next = stream->send_queue->next_stream_data;
-                    free(stream->send_queue->bytes);
-                    free(stream->send_queue);
-                    stream->send_queue = next;
+                    picoquic_dequeue_stream_data(stream);
                 }
 
                 stream->sent_offset += length;
@@ -1621,14 +2063,14 @@ void picoquic_check_spurious_retransmission(picoquic_cnx_t* cnx,
     }
 }
 
-static picoquic_packet_t* picoquic_update_rtt(picoquic_cnx_t* cnx, uint64_t largest,
+static void picoquic_update_rtt(picoquic_cnx_t* cnx, uint64_t largest,
     uint64_t current_time, uint64_t ack_delay, picoquic_packet_context_enum pc)
 {
     picoquic_packet_context_t * pkt_ctx = &cnx->pkt_ctx[pc];
-    picoquic_packet_t* packet = pkt_ctx->retransmit_newest;
+    picoquic_packet_t* packet;
 
     /* Check whether this is a new acknowledgement */
-    if (largest > pkt_ctx->highest_acknowledged || pkt_ctx->first_sack_item.start_of_sack_range == (uint64_t)((int64_t)-1)) {
+    if (largest > pkt_ctx->highest_acknowledged || picoquic_sack_list_is_empty(&pkt_ctx->sack_list)) {
         pkt_ctx->highest_acknowledged = largest;
         pkt_ctx->highest_acknowledged_time = current_time;
         pkt_ctx->ack_of_ack_requested = 0;
@@ -1636,10 +2078,7 @@ static picoquic_packet_t* picoquic_update_rtt(picoquic_cnx_t* cnx, uint64_t larg
         if (ack_delay < PICOQUIC_ACK_DELAY_MAX) {
             /* if the ACK is reasonably recent, use it to update the RTT */
             /* find the stored copy of the largest acknowledged packet */
-
-            while (packet != NULL && packet->sequence_number > largest) {
-                packet = packet->next_packet;
-            }
+            packet = picoquic_find_retransmit_packet_at_or_below(pkt_ctx, largest);
 
             if (packet == NULL || packet->sequence_number < largest) {
                 /* There is no copy of this packet in store. It may have
@@ -1720,41 +2159,10 @@ static picoquic_packet_t* picoquic_update_rtt(picoquic_cnx_t* cnx, uint64_t larg
             }
         }
     }
-
-    return packet;
-}
-
-static void picoquic_process_ack_of_ack_range(picoquic_sack_item_t* first_sack,
-    uint64_t start_of_range, uint64_t end_of_range)
-{
-    if (first_sack->start_of_sack_range == start_of_range) {
-        if (end_of_range < first_sack->end_of_sack_range) {
-            first_sack->start_of_sack_range = end_of_range + 1;
-        } else {
-            first_sack->start_of_sack_range = first_sack->end_of_sack_range;
-        }
-    } else {
-        picoquic_sack_item_t* previous = first_sack;
-        picoquic_sack_item_t* next = previous->next_sack;
-
-        while (next != NULL) {
-            if (next->end_of_sack_range == end_of_range && next->start_of_sack_range == start_of_range) {
-                /* Matching range should be removed */
-                previous->next_sack = next->next_sack;
-                free(next);
-                break;
-            } else if (next->end_of_sack_range > end_of_range) {
-                previous = next;
-                next = next->next_sack;
-            } else {
-                break;
-            }
-        }
-    }
 }
 
 int picoquic_process_ack_of_ack_frame(
-    picoquic_sack_item_t* first_sack,
+    picoquic_sack_list_t* sack_list,
     uint8_t* bytes, size_t bytes_max, size_t* consumed, int is_ecn_14)
 {
     int ret;
@@ -1763,14 +2171,6 @@ int picoquic_process_ack_of_ack_frame(
     uint64_t num_block;
     uint64_t ecnx3[3];
 
-    /* Find the oldest ACK range, in order to calibrate the
-     * extension of the largest number to 64 bits */
-
-    picoquic_sack_item_t* target_sack = first_sack;
-    while (target_sack->next_sack != NULL) {
-        target_sack = target_sack->next_sack;
-    }
-
     ret = picoquic_parse_ack_header(bytes, bytes_max,
         &num_block, (is_ecn_14)? ecnx3 : NULL,
         &largest, &ack_delay, consumed, 0);
@@ -1807,7 +2207,7 @@ int picoquic_process_ack_of_ack_frame(
             }
 
             if (range > 0) {
-                picoquic_process_ack_of_ack_range(first_sack, largest + 1 - range, largest);
+                picoquic_process_ack_of_ack_range(sack_list, largest + 1 - range, largest);
             }
 
             if (num_block-- == 0)
@@ -1847,83 +2247,59 @@ int picoquic_process_ack_of_ack_frame(
     return ret;
 }
 
-int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, uint8_t* bytes,
-    size_t bytes_max, int* no_need_to_repeat)
+int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const picoquic_frame_desc_t* desc,
+    int* no_need_to_repeat)
 {
     int ret = 0;
-    int fin;
-    size_t data_length;
-    uint64_t stream_id;
-    uint64_t offset;
-    uint64_t maxdata;
-    uint64_t max_stream_rank;
     picoquic_stream_head* stream = NULL;
-    size_t consumed = 0;
 
     *no_need_to_repeat = 0;
 
-    if (PICOQUIC_IN_RANGE(bytes[0], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
-        ret = picoquic_parse_stream_header(bytes, bytes_max,
-            &stream_id, &offset, &data_length, &fin, &consumed);
-
-        if (ret == 0) {
-            stream = picoquic_find_stream(cnx, stream_id, 0);
-            if (stream == NULL) {
-                /* this is weird -- the stream was destroyed. */
+    if (PICOQUIC_IN_RANGE(desc->frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+        stream = picoquic_find_stream(cnx, desc->stream_id, 0);
+        if (stream == NULL) {
+            /* this is weird -- the stream was destroyed. */
+            *no_need_to_repeat = 1;
+        } else {
+            if (stream->reset_sent) {
                 *no_need_to_repeat = 1;
             } else {
-                if (stream->reset_sent) {
-                    *no_need_to_repeat = 1;
-                } else {
-                    /* Check whether the ack was already received */
-                    *no_need_to_repeat = picoquic_check_sack_list(&stream->first_sack_item, offset, offset + data_length);
-                }
+                /* Check whether the ack was already received */
+                *no_need_to_repeat = picoquic_check_sack_list(&stream->sack_list, desc->offset, desc->offset + desc->data_length);
             }
         }
     }
     else {
-        uint8_t * p_last_byte = bytes + bytes_max;
-        switch (bytes[0]) {
+        switch (desc->frame_type) {
         case picoquic_frame_type_max_data:
-            if ((bytes = picoquic_frames_varint_decode(bytes + 1, p_last_byte, &maxdata)) != NULL) {
-                if (maxdata < cnx->maxdata_local) {
-                    *no_need_to_repeat = 1;
-                }
+            if (desc->offset < cnx->maxdata_local) {
+                *no_need_to_repeat = 1;
             }
             break;
         case picoquic_frame_type_max_stream_data:
-            if ((bytes = picoquic_frames_varint_decode(bytes + 1, p_last_byte, &stream_id)) == NULL ||
-                (bytes = picoquic_frames_varint_decode(bytes, p_last_byte, &maxdata)) == NULL) {
-                /* Malformed frame, do not retransmit */
-                *no_need_to_repeat = 1;
-            }
-            else if ((stream = picoquic_find_stream(cnx, stream_id, 1)) == NULL) {
+            if ((stream = picoquic_find_stream(cnx, desc->stream_id, 0)) == NULL) {
                 /* No such stream do not retransmit */
+                *no_need_to_repeat = 1;
             }
             else if (stream->fin_received || stream->reset_received || stream->stop_sending_sent) {
                 /* Stream stopped, no need to increase the window */
                 *no_need_to_repeat = 1;
             }
-            else if (maxdata < stream->maxdata_local) {
+            else if (desc->offset < stream->maxdata_local) {
                 /* Stream max data already increased */
                 *no_need_to_repeat = 1;
             }
             break;
         case picoquic_frame_type_max_streams_bidir:
-        case picoquic_frame_type_max_streams_unidir:
-            if ((bytes = picoquic_frames_varint_decode(bytes + 1, p_last_byte, &max_stream_rank)) == NULL) {
-                /* Malformed frame, do not retransmit */
-                *no_need_to_repeat = 1;
-            }
-            else if (bytes[0] == picoquic_frame_type_max_streams_bidir &&
-                cnx->max_stream_id_bidir_local > STREAM_ID_FROM_RANK(max_stream_rank, cnx->client_mode, 0)) {
+            if (cnx->max_stream_id_bidir_local > STREAM_ID_FROM_RANK(desc->offset, cnx->client_mode, 0)) {
                 /* Streams bidir already increased */
                 *no_need_to_repeat = 1;
             }
-            else if (cnx->max_stream_id_unidir_local > STREAM_ID_FROM_RANK(max_stream_rank, cnx->client_mode, 1)) {
+            break;
+        case picoquic_frame_type_max_streams_unidir:
+            if (cnx->max_stream_id_unidir_local > STREAM_ID_FROM_RANK(desc->offset, cnx->client_mode, 1)) {
                 /* Streams unidir already increased */
                 *no_need_to_repeat = 1;
-
             }
             break;
         default:
@@ -1934,63 +2310,62 @@ int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, uint8_t* bytes,
     return ret;
 }
 
-static int picoquic_process_ack_of_stream_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
-    size_t bytes_max, size_t* consumed)
+static void picoquic_process_ack_of_stream_frame(picoquic_cnx_t* cnx, const picoquic_frame_desc_t* desc)
 {
-    int ret;
-    int fin;
-    size_t data_length;
-    uint64_t stream_id;
-    uint64_t offset;
-    picoquic_stream_head* stream = NULL;
+    /* record the ack range for the stream */
+    picoquic_stream_head* stream = picoquic_find_stream(cnx, desc->stream_id, 0);
 
-    /* skip stream frame */
-    ret = picoquic_parse_stream_header(bytes, bytes_max,
-        &stream_id, &offset, &data_length, &fin, consumed);
-
-    if (ret == 0) {
-        *consumed += data_length;
+    if (stream != NULL) {
+        if (desc->data_length > 0) {
+            (void)picoquic_update_sack_list(&stream->sack_list,
+                desc->offset, desc->offset + desc->data_length - 1);
+            picoquic_release_acked_stream_data(stream);
+        }
 
-        /* record the ack range for the stream */
-        stream = picoquic_find_stream(cnx, stream_id, 0);
-        if (stream != NULL) {
-            (void)picoquic_update_sack_list(&stream->first_sack_item,
-                offset, offset + data_length - 1);
+        if ((desc->flags & PICOQUIC_FRAME_DESC_FIN) != 0) {
+            stream->fin_acked = 1;
         }
+
+        (void)picoquic_delete_stream_if_closed(cnx, stream);
     }
+}
 
-    return ret;
+static void picoquic_process_ack_of_reset_stream_frame(picoquic_cnx_t* cnx, const picoquic_frame_desc_t* desc)
+{
+    /* The reset was received, the stream can be deleted if the receive side is closed */
+    picoquic_stream_head* stream = picoquic_find_stream(cnx, desc->stream_id, 0);
+
+    if (stream != NULL) {
+        (void)picoquic_delete_stream_if_closed(cnx, stream);
+    }
 }
 
 void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t* cnx, picoquic_packet_t* p)
 {
     int ret = 0;
-    size_t byte_index;
-    int frame_is_pure_ack = 0;
-    size_t frame_length = 0;
+    size_t cursor = 0;
+    picoquic_frame_desc_t scratch;
+    picoquic_frame_desc_t* desc;
 
     if (p->ptype == picoquic_packet_0rtt_protected) {
         cnx->nb_zero_rtt_acked++;
     }
 
-    byte_index = p->offset;
-
-    while (ret == 0 && byte_index < p->length) {
-        if (p->bytes[byte_index] == picoquic_frame_type_ack) {
-            ret = picoquic_process_ack_of_ack_frame(&cnx->pkt_ctx[p->pc].first_sack_item,
-                &p->bytes[byte_index], p->length - byte_index, &frame_length, 0);
-            byte_index += frame_length;
-        } else if (p->bytes[byte_index] == picoquic_frame_type_ack_ecn) {
-            ret = picoquic_process_ack_of_ack_frame(&cnx->pkt_ctx[p->pc].first_sack_item,
-                &p->bytes[byte_index], p->length - byte_index, &frame_length, 1);
-            byte_index += frame_length;
-        } else if (PICOQUIC_IN_RANGE(p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
-            ret = picoquic_process_ack_of_stream_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
-            byte_index += frame_length;
-        } else {
-            ret = picoquic_skip_frame(&p->bytes[byte_index],
-                p->length - byte_index, &frame_length, &frame_is_pure_ack);
-            byte_index += frame_length;
+    while (ret == 0 && (desc = picoquic_next_frame_desc(p, &cursor, &scratch)) != NULL) {
+        if (desc->frame_type == picoquic_frame_type_ack || desc->frame_type == picoquic_frame_type_ack_ecn) {
+            if (desc->data_length == 0) {
+                /* Single range, no need to look at the frame */
+                picoquic_process_ack_of_ack_range(&cnx->pkt_ctx[p->pc].sack_list, desc->offset, desc->stream_id);
+            } else {
+                size_t frame_length = 0;
+                ret = picoquic_process_ack_of_ack_frame(&cnx->pkt_ctx[p->pc].sack_list,
+                    &p->bytes[desc->frame_index], desc->frame_length, &frame_length,
+                    desc->frame_type == picoquic_frame_type_ack_ecn);
+            }
+        } else if (PICOQUIC_IN_RANGE(desc->frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+            picoquic_process_ack_of_stream_frame(cnx, desc);
+        } else if (desc->frame_type == picoquic_frame_type_reset_stream) {
+            picoquic_process_ack_of_reset_stream_frame(cnx, desc);
         }
     }
 }
@@ -2000,57 +2375,56 @@ static int picoquic_process_ack_range(
     uint64_t current_time)
 {
     picoquic_packet_t* p = *ppacket;
+    uint64_t lowest = highest + 1 - range;
     int ret = 0;
-    /* Compare the range to the retransmit queue */
-    while (p != NULL && range > 0) {
-        if (p->sequence_number > highest) {
-            p = p->next_packet;
-        } else {
-            if (p->sequence_number == highest) {
-                /* TODO: RTT Estimate */
-                picoquic_packet_t* next = p->next_packet;
-                picoquic_path_t * old_path = p->send_path;
 
-                if (p->is_ack_trap) {
-                    ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, picoquic_frame_type_ack);
-                    break;
-                }
-
-                if (old_path != NULL) {
-                    if (cnx->congestion_alg != NULL) {
-                        cnx->congestion_alg->alg_notify(old_path,
-                            picoquic_congestion_notification_acknowledgement,
-                            0, p->length, 0, current_time);
-                    }
+    /* Skip the packets in the gap above the range. The queue is ordered by
+     * decreasing sequence number, so the packets in the range follow. */
+    while (p != NULL && p->sequence_number > highest) {
+        p = p->next_packet;
+    }
 
+    /* Compare the range to the retransmit queue */
+    while (p != NULL && p->sequence_number >= lowest) {
+        /* TODO: RTT Estimate */
+        picoquic_packet_t* next = p->next_packet;
+        picoquic_path_t * old_path = p->send_path;
 
-                    /* If packet is larger than the current MTU, update the MTU */
-                    if ((p->length + p->checksum_overhead) > old_path->send_mtu) {
-                        old_path->send_mtu = (uint32_t)(p->length + p->checksum_overhead);
-                        old_path->mtu_probe_sent = 0;
-                    }
-                }
+        if (p->is_ack_trap) {
+            ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, picoquic_frame_type_ack);
+            break;
+        }
 
-                /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
-                picoquic_process_possible_ack_of_ack_frame(cnx, p);
+        if (old_path != NULL) {
+            if (cnx->congestion_alg != NULL) {
+                cnx->congestion_alg->alg_notify(old_path,
+                    picoquic_congestion_notification_acknowledgement,
+                    0, p->length, 0, current_time);
+            }
 
-                /* Keep track of reception of ACK of 1RTT data */
-                if (p->ptype == picoquic_packet_1rtt_protected &&
-                    cnx->cnx_state == picoquic_state_client_ready_start) {
-                    /* Transition to client ready state.
-                     * The handshake is complete, all the handshake packets are implicitly acknowledged */
-                    picoquic_ready_state_transition(cnx, current_time);
-                }
 
-                (void)picoquic_dequeue_retransmit_packet(cnx, p, 1);
-                p = next;
-                /* Any acknowledgement shows progress */
-                cnx->pkt_ctx[pc].nb_retransmit = 0;
+            /* If packet is larger than the current MTU, update the MTU */
+            if ((p->length + p->checksum_overhead) > old_path->send_mtu) {
+                old_path->send_mtu = (uint32_t)(p->length + p->checksum_overhead);
+                old_path->mtu_probe_sent = 0;
             }
+        }
 
-            range--;
-            highest--;
+        /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic */
+        picoquic_process_possible_ack_of_ack_frame(cnx, p);
+
+        /* Keep track of reception of ACK of 1RTT data */
+        if (p->ptype == picoquic_packet_1rtt_protected &&
+            cnx->cnx_state == picoquic_state_client_ready_start) {
+            /* Transition to client ready state.
+             * The handshake is complete, all the handshake packets are implicitly acknowledged */
+            picoquic_ready_state_transition(cnx, current_time);
         }
+
+        (void)picoquic_dequeue_retransmit_packet(cnx, p, 1);
+        p = next;
+        /* Any acknowledgement shows progress */
+        cnx->pkt_ctx[pc].nb_retransmit = 0;
     }
 
     *ppacket = p;
@@ -2079,8 +2453,14 @@ uint8_t* picoquic_decode_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint8_t* bytes
     } else {
         bytes += consumed;
 
+        picoquic_packet_t* top_packet;
+
         /* Attempt to update the RTT */
-        picoquic_packet_t* top_packet = picoquic_update_rtt(cnx, largest, current_time, ack_delay, pc);
+        picoquic_update_rtt(cnx, largest, current_time, ack_delay, pc);
+
+        /* Find the first acknowledged packet through the sequence number index,
+         * the following ranges are reached from there */
+        top_packet = picoquic_find_retransmit_packet_at_or_below(&cnx->pkt_ctx[pc], largest);
 
         while (bytes != NULL) {
             uint64_t range;
@@ -2154,7 +2534,7 @@ uint8_t* picoquic_decode_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint8_t* bytes
 
             cnx->congestion_alg->alg_notify(cnx->path[0],
                 picoquic_congestion_notification_ecn_ec,
-                0, 0, cnx->pkt_ctx[pc].first_sack_item.end_of_sack_range, current_time);
+                0, 0, picoquic_sack_list_last(&cnx->pkt_ctx[pc].sack_list), current_time);
         }
     }
 
@@ -2210,7 +2590,8 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
     size_t l_delay = 0;
     size_t l_first_range = 0;
     picoquic_packet_context_t * pkt_ctx = &cnx->pkt_ctx[pc];
-    picoquic_sack_item_t* next_sack = pkt_ctx->first_sack_item.next_sack;
+    picoquic_sack_list_t* sack_list = &pkt_ctx->sack_list;
+    size_t range_index = 1;
     uint64_t ack_delay = 0;
     uint64_t ack_range = 0;
     uint64_t ack_gap = 0;
@@ -2219,7 +2600,7 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
     uint8_t ack_type_byte = ((is_ecn) ? picoquic_frame_type_ack_ecn : picoquic_frame_type_ack);
 
     /* Check that there is enough room in the packet, and something to acknowledge */
-    if (pkt_ctx->first_sack_item.start_of_sack_range == (uint64_t)((int64_t)-1)) {
+    if (picoquic_sack_list_is_empty(sack_list)) {
         *consumed = 0;
     } else if (bytes_max < 13) {
         /* A valid ACK, with our encoding, uses at least 13 bytes.
@@ -2232,7 +2613,7 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
         bytes[byte_index++] = ack_type_byte;
         /* Encode the largest seen */
         l_largest = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index,
-            pkt_ctx->first_sack_item.end_of_sack_range);
+            sack_list->ranges[0].end_of_sack_range);
         byte_index += l_largest;
         /* Encode the ack delay */
         if (byte_index < bytes_max) {
@@ -2250,7 +2631,7 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
         byte_index++;
         /* Encode the size of the first ack range */
         if (byte_index < bytes_max) {
-            ack_range = pkt_ctx->first_sack_item.end_of_sack_range - pkt_ctx->first_sack_item.start_of_sack_range;
+            ack_range = sack_list->ranges[0].end_of_sack_range - sack_list->ranges[0].start_of_sack_range;
             l_first_range = picoquic_varint_encode(bytes + byte_index, bytes_max - byte_index,
                 ack_range);
             byte_index += l_first_range;
@@ -2262,9 +2643,10 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
             ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
         } else {
             /* Set the lowest acknowledged */
-            lowest_acknowledged = pkt_ctx->first_sack_item.start_of_sack_range;
+            lowest_acknowledged = sack_list->ranges[0].start_of_sack_range;
             /* Encode the ack blocks that fit in the allocated space */
-            while (num_block < 63 && next_sack != NULL) {
+            while (num_block < 63 && range_index < sack_list->nb_ranges) {
+                picoquic_sack_item_t* next_sack = &sack_list->ranges[range_index];
                 size_t l_gap = 0;
                 size_t l_range = 0;
 
@@ -2286,7 +2668,7 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
                 } else {
                     byte_index += l_gap + l_range;
                     lowest_acknowledged = next_sack->start_of_sack_range;
-                    next_sack = next_sack->next_sack;
+                    range_index++;
                     num_block++;
                 }
             }
@@ -2294,7 +2676,7 @@ int picoquic_prepare_ack_frame_maybe_ecn(picoquic_cnx_t* cnx, uint64_t current_t
             bytes[num_block_index] = (uint8_t)num_block;
 
             /* Remember the ACK value and time */
-            pkt_ctx->highest_ack_sent = pkt_ctx->first_sack_item.end_of_sack_range;
+            pkt_ctx->highest_ack_sent = sack_list->ranges[0].end_of_sack_range;
             pkt_ctx->highest_ack_sent_time = current_time;
 
             *consumed = byte_index;
@@ -2343,7 +2725,7 @@ int picoquic_is_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t
     picoquic_packet_context_t * pkt_ctx = &cnx->pkt_ctx[pc];
 
     if (pkt_ctx->ack_needed) {
-        if (pkt_ctx->highest_ack_sent + 2 <= pkt_ctx->first_sack_item.end_of_sack_range ||
+        if (pkt_ctx->highest_ack_sent + 2 <= picoquic_sack_list_last(&pkt_ctx->sack_list) ||
             pkt_ctx->highest_ack_sent_time + pkt_ctx->ack_delay_local <= current_time) {
             ret = 1;
         }
@@ -2351,10 +2733,10 @@ int picoquic_is_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t
             *next_wake_time = pkt_ctx->highest_ack_sent_time + pkt_ctx->ack_delay_local;
         }
     }
-    else if (pkt_ctx->highest_ack_sent + 8 <= pkt_ctx->first_sack_item.end_of_sack_range &&
+    else if (pkt_ctx->highest_ack_sent + 8 <= picoquic_sack_list_last(&pkt_ctx->sack_list) &&
         pkt_ctx->highest_ack_sent_time + pkt_ctx->ack_delay_local <= current_time) {
         /* Force sending an ack-of-ack from time to time, as a low priority action */
-        if (pkt_ctx->first_sack_item.end_of_sack_range == (uint64_t)((int64_t)-1)) {
+        if (picoquic_sack_list_is_empty(&pkt_ctx->sack_list)) {
             ret = 0;
         }
         else {
@@ -2550,6 +2932,9 @@ uint8_t* picoquic_decode_max_stream_data_frame(picoquic_cnx_t* cnx, uint8_t* byt
     {
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, picoquic_frame_type_max_stream_data);
 
+    } else if (picoquic_is_stream_closed(cnx, stream_id)) {
+        /* Late frame for a stream that was already closed and deleted, ignore it */
+
     } else if ((stream = picoquic_find_stream(cnx, stream_id, 1)) == NULL) {
         picoquic_connection_error(cnx, PICOQUIC_ERROR_MEMORY, picoquic_frame_type_max_stream_data);
         bytes = NULL;
@@ -2557,6 +2942,7 @@ uint8_t* picoquic_decode_max_stream_data_frame(picoquic_cnx_t* cnx, uint8_t* byt
     } else if (maxdata > stream->maxdata_remote) {
         /* TODO: call back if the stream was blocked? */
         stream->maxdata_remote = maxdata;
+        picoquic_update_ready_stream(cnx, stream, 0);
     }
 
     return bytes;
@@ -2567,7 +2953,7 @@ int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t* cnx,
 {
     int ret = 0;
     size_t byte_index = 0;
-    picoquic_stream_head* stream = cnx->first_stream;
+    picoquic_stream_head* stream = picoquic_first_stream(cnx);
 
     while (stream != NULL && ret == 0 && byte_index < bytes_max) {
         if (!stream->fin_received && !stream->reset_received && 2 * stream->consumed_offset > stream->maxdata_local) {
@@ -2583,7 +2969,7 @@ int picoquic_prepare_required_max_stream_data_frames(picoquic_cnx_t* cnx,
                 break;
             }
         }
-        stream = stream->next_stream;
+        stream = picoquic_next_stream(stream);
     }
 
     if (ret == PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL) {
@@ -2695,6 +3081,11 @@ uint8_t* picoquic_decode_max_streams_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
         cnx->max_stream_id_unidir_remote = STREAM_ID_FROM_RANK(max_stream_rank, cnx->client_mode, 1);
     }
 
+    if (bytes != NULL) {
+        /* Streams waiting for the new limit can now be sent */
+        picoquic_update_ready_stream_list(cnx);
+    }
+
     return bytes;
 }
 
@@ -2712,7 +3103,7 @@ int picoquic_prepare_first_misc_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
     if (ret == 0) {
         picoquic_misc_frame_header_t* misc_frame = cnx->first_misc_frame;
         cnx->first_misc_frame = misc_frame->next_misc_frame;
-        free(misc_frame);
+        picoquic_delete_misc_frame(cnx, misc_frame);
     }
 
     return ret;
@@ -3297,6 +3688,147 @@ int picoquic_skip_frame(uint8_t* bytes, size_t bytes_maxsize, size_t* consumed,
     return bytes == NULL;
 }
 
+/*
+ * Frame descriptors summarize the frames of a sent packet, so that the
+ * processing of acknowledgements and losses does not need to parse the
+ * packet again. If a frame cannot be described, or if the packet contains
+ * too many frames, the packet is parsed on the fly instead.
+ */
+
+int picoquic_parse_frame_desc(uint8_t* bytes, size_t bytes_max, picoquic_frame_desc_t* desc)
+{
+    int ret;
+    size_t consumed = 0;
+    int pure_ack = 0;
+    const uint8_t* p_last_byte = bytes + bytes_max;
+
+    memset(desc, 0, sizeof(picoquic_frame_desc_t));
+    desc->frame_type = bytes[0];
+
+    ret = picoquic_skip_frame(bytes, bytes_max, &consumed, &pure_ack);
+
+    if (ret == 0) {
+        desc->frame_length = (uint16_t)consumed;
+        if (pure_ack) {
+            desc->flags |= PICOQUIC_FRAME_DESC_PURE_ACK;
+        }
+
+        if (PICOQUIC_IN_RANGE(desc->frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+            size_t data_length = 0;
+            int fin = 0;
+
+            ret = picoquic_parse_stream_header(bytes, bytes_max,
+                &desc->stream_id, &desc->offset, &data_length, &fin, &consumed);
+            desc->data_length = (uint16_t)data_length;
+            if (fin) {
+                desc->flags |= PICOQUIC_FRAME_DESC_FIN;
+            }
+        } else {
+            switch (desc->frame_type) {
+            case picoquic_frame_type_ack:
+            case picoquic_frame_type_ack_ecn: {
+                uint64_t num_block;
+                uint64_t ecnx3[3];
+                uint64_t ack_delay;
+                uint64_t range;
+                size_t l_range;
+
+                ret = picoquic_parse_ack_header(bytes, bytes_max, &num_block,
+                    (desc->frame_type == picoquic_frame_type_ack_ecn) ? ecnx3 : NULL,
+                    &desc->stream_id, &ack_delay, &consumed, 0);
+                if (ret == 0) {
+                    l_range = picoquic_varint_decode(bytes + consumed, bytes_max - consumed, &range);
+                    if (l_range == 0 || range > desc->stream_id) {
+                        ret = -1;
+                    } else {
+                        desc->offset = desc->stream_id - range;
+                        desc->data_length = (num_block > UINT16_MAX) ? UINT16_MAX : (uint16_t)num_block;
+                    }
+                }
+                break;
+            }
+            case picoquic_frame_type_reset_stream:
+                if (picoquic_frames_varint_decode(bytes + 1, p_last_byte, &desc->stream_id) == NULL) {
+                    ret = -1;
+                }
+                break;
+            case picoquic_frame_type_max_data:
+            case picoquic_frame_type_max_streams_bidir:
+            case picoquic_frame_type_max_streams_unidir:
+                if (picoquic_frames_varint_decode(bytes + 1, p_last_byte, &desc->offset) == NULL) {
+                    ret = -1;
+                }
+                break;
+            case picoquic_frame_type_max_stream_data: {
+                uint8_t* bytes_next;
+                if ((bytes_next = picoquic_frames_varint_decode(bytes + 1, p_last_byte, &desc->stream_id)) == NULL ||
+                    picoquic_frames_varint_decode(bytes_next, p_last_byte, &desc->offset) == NULL) {
+                    ret = -1;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_describe_packet_frames(picoquic_packet_t* packet)
+{
+    size_t byte_index = packet->offset;
+    uint16_t nb_frame_desc = 0;
+
+    packet->is_described = 0;
+
+    while (byte_index < packet->length && nb_frame_desc < PICOQUIC_MAX_FRAME_DESC) {
+        picoquic_frame_desc_t* desc = &packet->frame_desc[nb_frame_desc];
+
+        if (picoquic_parse_frame_desc(&packet->bytes[byte_index], packet->length - byte_index, desc) != 0) {
+            break;
+        }
+        desc->frame_index = (uint16_t)byte_index;
+        byte_index += desc->frame_length;
+        nb_frame_desc++;
+    }
+
+    if (byte_index >= packet->length) {
+        packet->nb_frame_desc = nb_frame_desc;
+        packet->is_described = 1;
+    }
+}
+
+/*
+ * Iterate over the frames of a sent packet. The cursor is initialized to 0.
+ * Frames are read from the descriptors if the packet is described, or else
+ * parsed from the packet bytes into the scratch descriptor. Returns NULL
+ * after the last frame, or if a frame cannot be parsed.
+ */
+picoquic_frame_desc_t* picoquic_next_frame_desc(picoquic_packet_t* packet, size_t* cursor, picoquic_frame_desc_t* scratch)
+{
+    picoquic_frame_desc_t* desc = NULL;
+
+    if (packet->is_described) {
+        if (*cursor < packet->nb_frame_desc) {
+            desc = &packet->frame_desc[*cursor];
+            *cursor += 1;
+        }
+    } else {
+        size_t byte_index = packet->offset + *cursor;
+
+        if (byte_index < packet->length &&
+            picoquic_parse_frame_desc(&packet->bytes[byte_index], packet->length - byte_index, scratch) == 0) {
+            scratch->frame_index = (uint16_t)byte_index;
+            *cursor += scratch->frame_length;
+            desc = scratch;
+        }
+    }
+
+    return desc;
+}
+
 int picoquic_decode_closing_frames(uint8_t* bytes, size_t bytes_max, int* closing_received)
 {
     int ret = 0;
@@ -398,7 +398,7 @@ int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
 
             /* Build a packet number to 64 bits */
             ph->pn64 = picoquic_get_packet_number64(
-                cnx->pkt_ctx[ph->pc].first_sack_item.end_of_sack_range, ph->pnmask, ph->pn);
+                picoquic_sack_list_last(&cnx->pkt_ctx[ph->pc].sack_list), ph->pnmask, ph->pn);
         }
     }
     else {
@@ -440,9 +440,12 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
         /* Manage key rotation */
         /* TODO: simplify, now that we can rely on PN */
         if (ph->key_phase == cnx->key_phase_dec) {
-            /* AEAD Decrypt, in place */
-            decoded = picoquic_aead_decrypt_generic(bytes + ph->offset,
-                bytes + ph->offset, ph->payload_length, ph->pn64, bytes, ph->offset, cnx->crypto_context[3].aead_decrypt);
+            if (cnx->quic->crypto_received_pool == NULL ||
+                !picoquic_crypto_pool_take_decrypted(cnx, bytes, ph, &decoded)) {
+                /* AEAD Decrypt, in place */
+                decoded = picoquic_aead_decrypt_generic(bytes + ph->offset,
+                    bytes + ph->offset, ph->payload_length, ph->pn64, bytes, ph->offset, cnx->crypto_context[3].aead_decrypt);
+            }
         }
         else if (ph->pn64 < cnx->crypto_rotation_sequence) {
             /* This packet claims to be encoded with the old key */
@@ -541,6 +544,11 @@ int picoquic_parse_header_and_decrypt(
                     /* if listening is OK, listen */
                     *pcnx = picoquic_create_cnx(quic, ph->dest_cnx_id, ph->srce_cnx_id, addr_from, current_time, ph->vn, NULL, NULL, 0);
                     *new_ctx_created = (*pcnx == NULL) ? 0 : 1;
+                    if (*pcnx == NULL && quic->cnx_slab != NULL &&
+                        (quic->cnx_slab->cnx_free == NULL || quic->cnx_slab->path_free == NULL)) {
+                        /* No room for a new connection, the client will try again later */
+                        ret = PICOQUIC_ERROR_CNX_SLAB_EXHAUSTED;
+                    }
                 }
             }
         }
@@ -1395,7 +1403,7 @@ int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header * ph
                         memcpy(cnx->path[path_id]->reset_secret, available_cnxid->reset_secret,
                             PICOQUIC_RESET_SECRET_SIZE);
                         cnx->path[path_id]->path_is_activated = 1;
-                        free(available_cnxid);
+                        picoquic_delete_cnxid_stash(cnx, available_cnxid);
                         /* New challenge required there */
                         new_challenge_required = 1;
                         cnx->path[path_id]->peer_addr_len = picoquic_store_addr(&cnx->path[path_id]->peer_addr, addr_from);
@@ -1426,7 +1434,7 @@ int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header * ph
                 else if (((cnx->path[path_id]->alt_peer_addr_len == 0 &&
                     cnx->path[path_id]->alt_local_addr_len == 0) ||
                     cnx->path[path_id]->alt_challenge_timeout > current_time) &&
-                    ph->pn64 >= cnx->pkt_ctx[picoquic_packet_context_application].first_sack_item.end_of_sack_range) {
+                    ph->pn64 >= picoquic_sack_list_last(&cnx->pkt_ctx[picoquic_packet_context_application].sack_list)) {
                     /* The addresses are different, and this is a most recent
                      * packet. This probably indicates a NAT rebinding, but it could also be
                      * some kind of attack. */
@@ -1742,7 +1750,8 @@ int picoquic_incoming_segment(
         ret == PICOQUIC_ERROR_CNXID_CHECK || 
         ret == PICOQUIC_ERROR_RETRY || ret == PICOQUIC_ERROR_DETECTED ||
         ret == PICOQUIC_ERROR_CONNECTION_DELETED ||
-        ret == PICOQUIC_ERROR_CNXID_SEGMENT) {
+        ret == PICOQUIC_ERROR_CNXID_SEGMENT ||
+        ret == PICOQUIC_ERROR_CNX_SLAB_EXHAUSTED) {
         /* Bad packets are dropped silently */
 
         DBG_PRINTF("Packet (%d) dropped, t: %d, e: %d, pc: %d, pn: %d, l: %d, ret : %x\n",
@@ -1801,3 +1810,46 @@ int picoquic_incoming_packet(
 
     return ret;
 }
+
+/* Process a buffer holding several UDP datagrams of datagram_size bytes, the last
+ * one possibly shorter, as received with UDP_GRO. Each datagram is submitted
+ * separately, as it may hold its own coalesced QUIC packets. All the datagrams
+ * of the buffer were received with the same ECN marks. */
+int picoquic_incoming_datagrams(
+    picoquic_quic_t* quic,
+    uint8_t* bytes,
+    size_t length,
+    size_t datagram_size,
+    struct sockaddr* addr_from,
+    struct sockaddr* addr_to,
+    int if_index_to,
+    unsigned char received_ecn,
+    uint64_t current_time)
+{
+    int ret = 0;
+    size_t offset = 0;
+
+    if (datagram_size == 0 || datagram_size > length) {
+        datagram_size = length;
+    }
+
+    while (offset < length) {
+        size_t datagram_length = length - offset;
+        int datagram_ret;
+
+        if (datagram_length > datagram_size) {
+            datagram_length = datagram_size;
+        }
+
+        datagram_ret = picoquic_incoming_packet(quic, bytes + offset, (uint32_t)datagram_length,
+            addr_from, addr_to, if_index_to, received_ecn, current_time);
+
+        if (ret == 0) {
+            ret = datagram_ret;
+        }
+
+        offset += datagram_length;
+    }
+
+    return ret;
+}
@@ -0,0 +1,383 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picocrypto.h"
+#include "picoquic_internal.h"
+#include "tls_api.h"
+#include "util.h"
+
+void picoquic_crypto_job_run(picoquic_crypto_job_t* job)
+{
+    if (job->pn_enc != NULL) {
+        job->result = picoquic_aead_encrypt_generic(job->output, job->input, job->input_length,
+            job->sequence_number, job->header, job->header_length, job->aead_context);
+        picoquic_protect_packet_header(job->header, job->pn_offset, job->pn_enc);
+    }
+    else {
+        job->result = picoquic_aead_decrypt_generic(job->output, job->input, job->input_length,
+            job->sequence_number, job->header, job->header_length, job->aead_context);
+    }
+}
+
+static void picoquic_crypto_worker_run(void* arg)
+{
+    picoquic_crypto_worker_t* worker = (picoquic_crypto_worker_t*)arg;
+    picoquic_crypto_pool_t* pool = worker->pool;
+
+    while (!picoquic_atomic_load(&pool->stop_requested)) {
+        picoquic_crypto_batch_t* batch = (picoquic_crypto_batch_t*)picoquic_mpsc_pop(&worker->queue);
+
+        if (batch == NULL) {
+            picoquic_wait_signal(worker->signal);
+        }
+        else {
+            for (int i = 0; i < batch->nb_jobs; i++) {
+                picoquic_crypto_job_run(&batch->jobs[i]);
+            }
+
+            if (picoquic_atomic_decrement(&pool->nb_pending) == 0) {
+                picoquic_set_signal(pool->done_signal);
+            }
+        }
+    }
+}
+
+void picoquic_crypto_pool_submit(picoquic_crypto_pool_t* pool, picoquic_crypto_batch_t* batch, int worker_id)
+{
+    picoquic_crypto_worker_t* worker = &pool->workers[worker_id];
+
+    (void)picoquic_atomic_increment(&pool->nb_pending);
+    picoquic_mpsc_push(&worker->queue, &batch->node);
+    picoquic_set_signal(worker->signal);
+}
+
+void picoquic_crypto_pool_wait(picoquic_crypto_pool_t* pool)
+{
+    while (picoquic_atomic_load(&pool->nb_pending) > 0) {
+        picoquic_wait_signal(pool->done_signal);
+    }
+}
+
+void picoquic_crypto_pool_delete(picoquic_crypto_pool_t* pool)
+{
+    if (pool->workers != NULL) {
+        picoquic_atomic_store(&pool->stop_requested, 1);
+
+        for (int i = 0; i < pool->nb_workers; i++) {
+            picoquic_crypto_worker_t* worker = &pool->workers[i];
+
+            if (worker->thread != NULL) {
+                picoquic_set_signal(worker->signal);
+                picoquic_join_thread(worker->thread);
+            }
+
+            if (worker->signal != NULL) {
+                picoquic_delete_signal(worker->signal);
+            }
+        }
+
+        free(pool->workers);
+    }
+
+    if (pool->done_signal != NULL) {
+        picoquic_delete_signal(pool->done_signal);
+    }
+
+    if (pool->send_batches != NULL) {
+        free(pool->send_batches);
+    }
+
+    if (pool->send_datagrams != NULL) {
+        free(pool->send_datagrams);
+    }
+
+    if (pool->send_buffers != NULL) {
+        free(pool->send_buffers);
+    }
+
+    if (pool->send_jobs != NULL) {
+        free(pool->send_jobs);
+    }
+
+    if (pool->received != NULL) {
+        free(pool->received);
+    }
+
+    if (pool->receive_jobs != NULL) {
+        free(pool->receive_jobs);
+    }
+
+    if (pool->receive_buffers != NULL) {
+        free(pool->receive_buffers);
+    }
+
+    free(pool);
+}
+
+picoquic_crypto_pool_t* picoquic_crypto_pool_create(int nb_workers, int nb_connections, int nb_datagrams)
+{
+    picoquic_crypto_pool_t* pool = NULL;
+
+    if (nb_workers > 0 && nb_workers <= PICOQUIC_CRYPTO_POOL_MAX_WORKERS && nb_connections > 0 && nb_datagrams > 0) {
+        pool = (picoquic_crypto_pool_t*)malloc(sizeof(picoquic_crypto_pool_t));
+    }
+
+    if (pool != NULL) {
+        int ret = 0;
+        size_t nb_send = (size_t)nb_connections * nb_datagrams;
+
+        memset(pool, 0, sizeof(picoquic_crypto_pool_t));
+        pool->nb_workers = nb_workers;
+        pool->nb_send_batches = nb_connections;
+        pool->nb_datagrams_max = nb_datagrams;
+        pool->workers = (picoquic_crypto_worker_t*)calloc(nb_workers, sizeof(picoquic_crypto_worker_t));
+        pool->send_batches = (picoquic_crypto_send_batch_t*)calloc(nb_connections, sizeof(picoquic_crypto_send_batch_t));
+        pool->send_datagrams = (picoquic_send_datagram_t*)calloc(nb_send, sizeof(picoquic_send_datagram_t));
+        pool->send_buffers = (uint8_t*)malloc(nb_send * PICOQUIC_MAX_PACKET_SIZE);
+        pool->send_jobs = (picoquic_crypto_job_t*)calloc(nb_send, sizeof(picoquic_crypto_job_t));
+        pool->received = (picoquic_crypto_received_t*)calloc(PICOQUIC_CRYPTO_POOL_RECEIVE_MAX, sizeof(picoquic_crypto_received_t));
+        pool->receive_jobs = (picoquic_crypto_job_t*)calloc((size_t)nb_workers * PICOQUIC_CRYPTO_POOL_RECEIVE_MAX,
+            sizeof(picoquic_crypto_job_t));
+        pool->receive_buffers = (uint8_t*)malloc(PICOQUIC_CRYPTO_POOL_RECEIVE_MAX * PICOQUIC_MAX_PACKET_SIZE);
+
+        if (pool->workers == NULL || pool->send_batches == NULL || pool->send_datagrams == NULL ||
+            pool->send_buffers == NULL || pool->send_jobs == NULL || pool->received == NULL ||
+            pool->receive_jobs == NULL || pool->receive_buffers == NULL ||
+            picoquic_create_signal(&pool->done_signal) != 0) {
+            DBG_PRINTF("%s", "Cannot allocate the crypto pool\n");
+            ret = -1;
+        }
+        else {
+            for (size_t i = 0; i < nb_send; i++) {
+                pool->send_datagrams[i].bytes = pool->send_buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+                pool->send_datagrams[i].bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+            }
+
+            for (int i = 0; i < nb_connections; i++) {
+                pool->send_batches[i].datagrams = pool->send_datagrams + (size_t)i * nb_datagrams;
+                pool->send_batches[i].batch.jobs = pool->send_jobs + (size_t)i * nb_datagrams;
+            }
+        }
+
+        for (int i = 0; ret == 0 && i < nb_workers; i++) {
+            picoquic_crypto_worker_t* worker = &pool->workers[i];
+
+            worker->pool = pool;
+            worker->receive_batch.jobs = pool->receive_jobs + (size_t)i * PICOQUIC_CRYPTO_POOL_RECEIVE_MAX;
+            picoquic_mpsc_init(&worker->queue);
+
+            if (picoquic_create_signal(&worker->signal) != 0 ||
+                picoquic_create_thread(&worker->thread, picoquic_crypto_worker_run, worker) != 0) {
+                DBG_PRINTF("Cannot start crypto worker %d\n", i);
+                ret = -1;
+            }
+        }
+
+        if (ret != 0) {
+            picoquic_crypto_pool_delete(pool);
+            pool = NULL;
+        }
+    }
+
+    return pool;
+}
+
+/* Each connection is prepared at most once per call, since its contexts are
+ * used by the worker until the end of the call */
+static int picoquic_crypto_pool_is_prepared(picoquic_crypto_pool_t* pool, picoquic_cnx_t* cnx, int nb_batches)
+{
+    int is_prepared = 0;
+
+    for (int i = 0; !is_prepared && i < nb_batches; i++) {
+        is_prepared = (pool->send_batches[i].cnx == cnx);
+    }
+
+    return is_prepared;
+}
+
+static int picoquic_crypto_pool_get_worker_id(picoquic_crypto_pool_t* pool, picoquic_cnx_t* cnx)
+{
+    return (int)(picoquic_get_cnx_serial(cnx) % (uint64_t)pool->nb_workers);
+}
+
+int picoquic_crypto_pool_prepare(picoquic_crypto_pool_t* pool, picoquic_quic_t* quic, uint64_t current_time)
+{
+    int nb_batches = 0;
+    picoquic_cnx_t* cnx;
+
+    while (nb_batches < pool->nb_send_batches &&
+        (cnx = picoquic_get_earliest_cnx_to_wake(quic, current_time)) != NULL &&
+        !picoquic_crypto_pool_is_prepared(pool, cnx, nb_batches)) {
+        picoquic_crypto_send_batch_t* send_batch = &pool->send_batches[nb_batches++];
+
+        /* The 1-RTT packets are formatted, but their protection is left to the worker */
+        quic->crypto_jobs = send_batch->batch.jobs;
+        quic->nb_crypto_jobs = 0;
+        quic->nb_crypto_jobs_max = pool->nb_datagrams_max;
+
+        send_batch->cnx = cnx;
+        send_batch->ret = picoquic_prepare_packets(cnx, current_time, send_batch->datagrams, pool->nb_datagrams_max,
+            &send_batch->nb_prepared);
+        send_batch->batch.nb_jobs = quic->nb_crypto_jobs;
+
+        quic->crypto_jobs = NULL;
+        quic->nb_crypto_jobs = 0;
+        quic->nb_crypto_jobs_max = 0;
+
+        if (send_batch->batch.nb_jobs > 0) {
+            picoquic_crypto_pool_submit(pool, &send_batch->batch, picoquic_crypto_pool_get_worker_id(pool, cnx));
+        }
+    }
+
+    picoquic_crypto_pool_wait(pool);
+
+    return nb_batches;
+}
+
+/* Queue the decryption of a 1-RTT packet whose header protection can be removed
+ * with the current keys. The header protection is removed on a copy of the
+ * header, so that the packet is processed as usual by the context. */
+static void picoquic_crypto_pool_add_received(picoquic_crypto_pool_t* pool, picoquic_quic_t* quic,
+    uint8_t* bytes, size_t length, struct sockaddr* addr_from)
+{
+    picoquic_packet_header ph;
+    picoquic_cnx_t* cnx = NULL;
+
+    if (length > 0 && (bytes[0] & 0x80) == 0 &&
+        picoquic_parse_packet_header(quic, bytes, (uint32_t)length, addr_from, &ph, &cnx, 1) == 0 &&
+        cnx != NULL && ph.ptype == picoquic_packet_1rtt_protected &&
+        cnx->crypto_context[3].aead_decrypt != NULL && cnx->crypto_context[3].pn_dec != NULL) {
+        picoquic_crypto_received_t* received = &pool->received[pool->nb_received];
+        size_t header_copy = ph.pn_offset + 4 + picoquic_pn_iv_size(cnx->crypto_context[3].pn_dec);
+
+        if (header_copy <= PICOQUIC_CRYPTO_HEADER_MAX && header_copy <= length) {
+            memcpy(received->header, bytes, header_copy);
+
+            if (picoquic_remove_header_protection(cnx, received->header, &ph) == 0 &&
+                ph.key_phase == cnx->key_phase_dec) {
+                picoquic_crypto_worker_t* worker = &pool->workers[picoquic_crypto_pool_get_worker_id(pool, cnx)];
+                picoquic_crypto_job_t* job = &worker->receive_batch.jobs[worker->receive_batch.nb_jobs++];
+
+                job->aead_context = cnx->crypto_context[3].aead_decrypt;
+                job->pn_enc = NULL;
+                job->header = received->header;
+                job->header_length = ph.offset;
+                job->pn_offset = ph.pn_offset;
+                job->input = bytes + ph.offset;
+                job->input_length = ph.payload_length;
+                job->output = pool->receive_buffers + (size_t)pool->nb_received * PICOQUIC_MAX_PACKET_SIZE;
+                job->sequence_number = ph.pn64;
+                job->result = 0;
+
+                received->bytes = bytes;
+                received->cnx_serial = picoquic_get_cnx_serial(cnx);
+                received->pn64 = ph.pn64;
+                received->job = job;
+                pool->nb_received++;
+            }
+        }
+    }
+}
+
+int picoquic_crypto_pool_take_decrypted(picoquic_cnx_t* cnx, uint8_t* bytes, picoquic_packet_header* ph,
+    size_t* decoded)
+{
+    int is_found = 0;
+    picoquic_crypto_pool_t* pool = cnx->quic->crypto_received_pool;
+
+    /* The packets are processed in the order in which they were found, but some
+     * may have been skipped, for example after a change of keys */
+    for (int i = pool->received_next; i < pool->nb_received; i++) {
+        picoquic_crypto_received_t* received = &pool->received[i];
+
+        if (received->bytes == bytes) {
+            picoquic_crypto_job_t* job = received->job;
+
+            pool->received_next = i + 1;
+
+            if (job->result <= job->input_length && received->cnx_serial == picoquic_get_cnx_serial(cnx) &&
+                received->pn64 == ph->pn64 && job->aead_context == cnx->crypto_context[3].aead_decrypt &&
+                job->header_length == ph->offset && job->input_length == ph->payload_length) {
+                memcpy(bytes + ph->offset, job->output, job->result);
+                *decoded = job->result;
+                is_found = 1;
+            }
+            break;
+        }
+    }
+
+    return is_found;
+}
+
+int picoquic_crypto_pool_incoming(picoquic_crypto_pool_t* pool, picoquic_quic_t* quic,
+    picoquic_recv_datagram_t* datagrams, int nb_datagrams, uint64_t current_time)
+{
+    int ret = 0;
+
+    pool->nb_received = 0;
+    pool->received_next = 0;
+    for (int i = 0; i < pool->nb_workers; i++) {
+        pool->workers[i].receive_batch.nb_jobs = 0;
+    }
+
+    /* Find the 1-RTT packets, in each segment of the datagrams */
+    for (int i = 0; i < nb_datagrams; i++) {
+        picoquic_recv_datagram_t* datagram = &datagrams[i];
+        size_t segment_size = (datagram->segment_size == 0) ? (size_t)datagram->length : datagram->segment_size;
+
+        for (size_t offset = 0; offset < (size_t)datagram->length &&
+            pool->nb_received < PICOQUIC_CRYPTO_POOL_RECEIVE_MAX; offset += segment_size) {
+            size_t length = (size_t)datagram->length - offset;
+
+            picoquic_crypto_pool_add_received(pool, quic, datagram->buffer + offset,
+                (length > segment_size) ? segment_size : length, (struct sockaddr*)&datagram->addr_from);
+        }
+    }
+
+    for (int i = 0; i < pool->nb_workers; i++) {
+        if (pool->workers[i].receive_batch.nb_jobs > 0) {
+            picoquic_crypto_pool_submit(pool, &pool->workers[i].receive_batch, i);
+        }
+    }
+
+    picoquic_crypto_pool_wait(pool);
+
+    /* Process the datagrams in order, with the decrypted payloads */
+    quic->crypto_received_pool = pool;
+
+    for (int i = 0; i < nb_datagrams; i++) {
+        picoquic_recv_datagram_t* datagram = &datagrams[i];
+        int datagram_ret = picoquic_incoming_datagrams(quic, datagram->buffer, (size_t)datagram->length,
+            datagram->segment_size, (struct sockaddr*)&datagram->addr_from, (struct sockaddr*)&datagram->addr_dest,
+            (int)datagram->dest_if, datagram->received_ecn, current_time);
+
+        if (ret == 0) {
+            ret = datagram_ret;
+        }
+    }
+
+    quic->crypto_received_pool = NULL;
+    pool->nb_received = 0;
+
+    return ret;
+}
@@ -0,0 +1,163 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOCRYPTO_H
+#define PICOCRYPTO_H
+
+#include "picoquic.h"
+#include "picosocks.h"
+#include "picothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pool of crypto worker threads, for the servers whose network thread is
+ * bound by the packet encryption and decryption.
+ *
+ * On the send side, picoquic_crypto_pool_prepare prepares the packets of the
+ * connections that are due, one connection after the other. The network
+ * thread numbers and formats the 1-RTT packets as usual, but leaves their
+ * encryption and header protection to a worker, and prepares the next
+ * connection while the worker seals the packets of the previous one. The
+ * call returns once all the packets are sealed; the datagrams are then sent
+ * in the order in which they were prepared.
+ *
+ * On the receive side, picoquic_crypto_pool_incoming decrypts the 1-RTT
+ * packets of a batch of datagrams in the workers, then submits the datagrams
+ * to the QUIC context in order. The context uses the decrypted payloads
+ * instead of decrypting the packets again.
+ *
+ * The AEAD and header protection contexts keep state between calls, so they
+ * can only be used by one thread at a time. The packets of a connection are
+ * always handled by the same worker, and the network thread does not use the
+ * connection until the end of the call. Key updates thus only happen on the
+ * network thread, between calls. Packets protected with another key than the
+ * current one, and the packets of contexts that log them, are encrypted or
+ * decrypted by the network thread. The throughput only scales with the number
+ * of workers if several connections are active.
+ */
+
+#define PICOQUIC_CRYPTO_POOL_MAX_WORKERS 64
+#define PICOQUIC_CRYPTO_POOL_RECEIVE_MAX 64
+#define PICOQUIC_CRYPTO_HEADER_MAX 64
+
+/* Encryption or decryption of one packet. When sealing, the header is
+ * protected after the encryption, and the output is the input. */
+typedef struct st_picoquic_crypto_job_t {
+    void* aead_context;
+    void* pn_enc; /* Header protection, or NULL when opening */
+    uint8_t* header;
+    size_t header_length;
+    size_t pn_offset;
+    uint8_t* input;
+    size_t input_length;
+    uint8_t* output;
+    uint64_t sequence_number;
+    size_t result; /* Length of the output, larger than input_length on error */
+} picoquic_crypto_job_t;
+
+/* Jobs run in order by one worker */
+typedef struct st_picoquic_crypto_batch_t {
+    picoquic_mpsc_node_t node;
+    picoquic_crypto_job_t* jobs;
+    int nb_jobs;
+} picoquic_crypto_batch_t;
+
+/* Datagrams prepared for one connection */
+typedef struct st_picoquic_crypto_send_batch_t {
+    picoquic_crypto_batch_t batch;
+    picoquic_cnx_t* cnx;
+    picoquic_send_datagram_t* datagrams;
+    int nb_prepared;
+    int ret;
+} picoquic_crypto_send_batch_t;
+
+/* Decrypted 1-RTT packet of a received batch */
+typedef struct st_picoquic_crypto_received_t {
+    const uint8_t* bytes;
+    uint64_t cnx_serial;
+    uint64_t pn64;
+    picoquic_crypto_job_t* job;
+    uint8_t header[PICOQUIC_CRYPTO_HEADER_MAX];
+} picoquic_crypto_received_t;
+
+typedef struct st_picoquic_crypto_worker_t {
+    struct st_picoquic_crypto_pool_t* pool;
+    picoquic_thread_t thread;
+    picoquic_signal_t signal;
+    picoquic_mpsc_queue_t queue;
+    picoquic_crypto_batch_t receive_batch;
+} picoquic_crypto_worker_t;
+
+typedef struct st_picoquic_crypto_pool_t {
+    int nb_workers;
+    picoquic_crypto_worker_t* workers;
+    picoquic_signal_t done_signal;
+    volatile int nb_pending;
+    volatile int stop_requested;
+    /* Send side, one batch per connection */
+    int nb_send_batches;
+    int nb_datagrams_max;
+    picoquic_crypto_send_batch_t* send_batches;
+    picoquic_send_datagram_t* send_datagrams;
+    uint8_t* send_buffers;
+    picoquic_crypto_job_t* send_jobs;
+    /* Receive side, packets in the order of the datagrams, jobs grouped by worker */
+    int nb_received;
+    int received_next;
+    picoquic_crypto_received_t* received;
+    picoquic_crypto_job_t* receive_jobs;
+    uint8_t* receive_buffers;
+} picoquic_crypto_pool_t;
+
+/* Create a pool of nb_workers threads, able to prepare up to nb_datagrams
+ * datagrams for each of nb_connections connections per call */
+picoquic_crypto_pool_t* picoquic_crypto_pool_create(int nb_workers, int nb_connections, int nb_datagrams);
+
+/* Stop the workers and free the pool */
+void picoquic_crypto_pool_delete(picoquic_crypto_pool_t* pool);
+
+/* Prepare the packets of the connections of the context that are due, up to
+ * nb_connections connections, and seal them in the workers. Returns the number
+ * of connections in pool->send_batches. The datagrams of each batch should be
+ * sent even if its ret is an error; the connection shall be deleted if ret is
+ * PICOQUIC_ERROR_DISCONNECTED. */
+int picoquic_crypto_pool_prepare(picoquic_crypto_pool_t* pool, picoquic_quic_t* quic, uint64_t current_time);
+
+/* Decrypt the 1-RTT packets of the datagrams in the workers, then submit the
+ * datagrams to the context, in order. */
+int picoquic_crypto_pool_incoming(picoquic_crypto_pool_t* pool, picoquic_quic_t* quic,
+    picoquic_recv_datagram_t* datagrams, int nb_datagrams, uint64_t current_time);
+
+/* Lower level functions: run a batch of jobs in a worker, wait for all the
+ * batches submitted, or run one job in the current thread. The jobs of a
+ * batch shall not share their contexts with the jobs of other workers. */
+void picoquic_crypto_pool_submit(picoquic_crypto_pool_t* pool, picoquic_crypto_batch_t* batch, int worker_id);
+void picoquic_crypto_pool_wait(picoquic_crypto_pool_t* pool);
+void picoquic_crypto_job_run(picoquic_crypto_job_t* job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOCRYPTO_H */
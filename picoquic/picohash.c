@@ -133,4 +133,349 @@ uint64_t picohash_bytes(uint8_t* key, uint32_t length)
     }
 
     return hash;
-}
\ No newline at end of file
+}
+
+#define PICOHASH_ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define PICOHASH_SIPROUND(v0, v1, v2, v3) \
+    do {                                  \
+        v0 += v1;                         \
+        v1 = PICOHASH_ROTL64(v1, 13);     \
+        v1 ^= v0;                         \
+        v0 = PICOHASH_ROTL64(v0, 32);     \
+        v2 += v3;                         \
+        v3 = PICOHASH_ROTL64(v3, 16);     \
+        v3 ^= v2;                         \
+        v0 += v3;                         \
+        v3 = PICOHASH_ROTL64(v3, 21);     \
+        v3 ^= v0;                         \
+        v2 += v1;                         \
+        v1 = PICOHASH_ROTL64(v1, 17);     \
+        v1 ^= v2;                         \
+        v2 = PICOHASH_ROTL64(v2, 32);     \
+    } while (0)
+
+static uint64_t picohash_load64_le(const uint8_t* bytes)
+{
+    return ((uint64_t)bytes[0]) | ((uint64_t)bytes[1] << 8) | ((uint64_t)bytes[2] << 16) | ((uint64_t)bytes[3] << 24) | ((uint64_t)bytes[4] << 32) | ((uint64_t)bytes[5] << 40) | ((uint64_t)bytes[6] << 48) | ((uint64_t)bytes[7] << 56);
+}
+
+uint64_t picohash_siphash(const uint8_t* bytes, size_t length, const uint8_t* seed)
+{
+    uint64_t k0 = picohash_load64_le(seed);
+    uint64_t k1 = picohash_load64_le(seed + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+    uint64_t v3 = k1 ^ 0x7465646279746573ull;
+    uint64_t last = ((uint64_t)length) << 56;
+    size_t nb_full = length & ~((size_t)7);
+    size_t i;
+
+    /* One compression round per 8 byte word */
+    for (i = 0; i < nb_full; i += 8) {
+        uint64_t m = picohash_load64_le(bytes + i);
+        v3 ^= m;
+        PICOHASH_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    /* The remaining bytes are packed with the length in the last word */
+    for (size_t j = 0; i + j < length; j++) {
+        last |= ((uint64_t)bytes[i + j]) << (8 * j);
+    }
+
+    v3 ^= last;
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+
+    /* Three finalization rounds */
+    v2 ^= 0xff;
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Open addressing hash table.
+ */
+
+#define PICOHASH_OA_MIN_SLOTS 16
+#define PICOHASH_OA_MIGRATE_STEP 8
+#define PICOHASH_OA_CLEAR_STEP 64
+
+static uint64_t picohash_oa_hash(picohash_oa_table* hash_table, void* key)
+{
+    uint64_t hash = hash_table->picohash_hash(key, hash_table->hash_seed);
+
+    /* Values 0 and 1 are reserved for empty and deleted slots */
+    return (hash < 2) ? hash + 2 : hash;
+}
+
+/* Spread the hash over the slot index, even if the hash function
+ * only varies in the high order bits. */
+static size_t picohash_oa_home(uint64_t hash, size_t nb_slots)
+{
+    hash *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash ^ (hash >> 32)) & (nb_slots - 1);
+}
+
+static picohash_oa_slot_t* picohash_oa_find_slot(picohash_oa_table* hash_table,
+    picohash_oa_slot_t* slots, size_t nb_slots, uint64_t hash, void* key)
+{
+    size_t index = picohash_oa_home(hash, nb_slots);
+    picohash_oa_slot_t* slot = NULL;
+
+    while (slots[index].hash != 0) {
+        if (slots[index].hash == hash && hash_table->picohash_compare(key, slots[index].key) == 0) {
+            slot = &slots[index];
+            break;
+        }
+        index = (index + 1) & (nb_slots - 1);
+    }
+
+    return slot;
+}
+
+static void picohash_oa_place(picohash_oa_slot_t* slots, size_t nb_slots, uint64_t hash, void* key)
+{
+    size_t index = picohash_oa_home(hash, nb_slots);
+
+    while (slots[index].hash != 0) {
+        index = (index + 1) & (nb_slots - 1);
+    }
+
+    slots[index].hash = hash;
+    slots[index].key = key;
+}
+
+/* Remove the key at the index, and move back the following keys of the
+ * probe sequence so that there is no hole in it. */
+static void picohash_oa_shift_back(picohash_oa_slot_t* slots, size_t nb_slots, size_t index)
+{
+    size_t next = index;
+
+    for (;;) {
+        size_t home;
+
+        next = (next + 1) & (nb_slots - 1);
+        if (slots[next].hash == 0) {
+            break;
+        }
+
+        home = picohash_oa_home(slots[next].hash, nb_slots);
+        /* The key stays in place if its home is cyclically in ]index, next] */
+        if ((index <= next) ? (index < home && home <= next) : (index < home || home <= next)) {
+            continue;
+        }
+
+        slots[index] = slots[next];
+        index = next;
+    }
+
+    slots[index].hash = 0;
+    slots[index].key = NULL;
+}
+
+/* Move some keys from the old slots to the new ones. The migrated slots
+ * are marked deleted, so the probe sequences in the old slots stay valid. */
+static void picohash_oa_migrate(picohash_oa_table* hash_table, size_t nb_steps)
+{
+    while (hash_table->old_slots != NULL) {
+        if (hash_table->old_count == 0 || hash_table->migrate_index >= hash_table->old_nb_slots) {
+            free(hash_table->old_slots);
+            hash_table->old_slots = NULL;
+            hash_table->old_nb_slots = 0;
+            hash_table->old_count = 0;
+            hash_table->migrate_index = 0;
+        } else if (nb_steps == 0) {
+            break;
+        } else {
+            picohash_oa_slot_t* slot = &hash_table->old_slots[hash_table->migrate_index];
+
+            if (slot->hash > 1) {
+                picohash_oa_place(hash_table->slots, hash_table->nb_slots, slot->hash, slot->key);
+                hash_table->count++;
+                hash_table->old_count--;
+                slot->hash = 1;
+                slot->key = NULL;
+            }
+
+            hash_table->migrate_index++;
+            nb_steps--;
+        }
+    }
+}
+
+/* Clear some of the slots allocated for the next resize. Once they are all
+ * clear, they become the current slots, and the current slots are migrated.
+ * Nothing is done while the previous migration is still in progress. */
+static void picohash_oa_clear(picohash_oa_table* hash_table, size_t nb_steps)
+{
+    if (hash_table->next_slots != NULL && hash_table->old_slots == NULL) {
+        size_t nb_clear = hash_table->next_nb_slots - hash_table->clear_index;
+
+        if (nb_clear > nb_steps) {
+            nb_clear = nb_steps;
+        }
+        (void)memset(hash_table->next_slots + hash_table->clear_index, 0, sizeof(picohash_oa_slot_t) * nb_clear);
+        hash_table->clear_index += nb_clear;
+
+        if (hash_table->clear_index >= hash_table->next_nb_slots) {
+            hash_table->old_slots = hash_table->slots;
+            hash_table->old_nb_slots = hash_table->nb_slots;
+            hash_table->old_count = hash_table->count;
+            hash_table->migrate_index = 0;
+            hash_table->slots = hash_table->next_slots;
+            hash_table->nb_slots = hash_table->next_nb_slots;
+            hash_table->count = 0;
+            hash_table->next_slots = NULL;
+            hash_table->next_nb_slots = 0;
+            hash_table->clear_index = 0;
+        }
+    }
+}
+
+picohash_oa_table* picohash_oa_create(size_t nb_items,
+    uint64_t (*picohash_hash)(void*, const uint8_t*),
+    int (*picohash_compare)(void*, void*), const uint8_t* hash_seed)
+{
+    picohash_oa_table* t = (picohash_oa_table*)malloc(sizeof(picohash_oa_table));
+
+    if (t != NULL) {
+        size_t nb_slots = PICOHASH_OA_MIN_SLOTS;
+
+        while (nb_slots * 3 < nb_items * 4) {
+            nb_slots *= 2;
+        }
+
+        memset(t, 0, sizeof(picohash_oa_table));
+        t->slots = (picohash_oa_slot_t*)malloc(sizeof(picohash_oa_slot_t) * nb_slots);
+
+        if (t->slots == NULL) {
+            free(t);
+            t = NULL;
+        } else {
+            (void)memset(t->slots, 0, sizeof(picohash_oa_slot_t) * nb_slots);
+            t->nb_slots = nb_slots;
+            t->picohash_hash = picohash_hash;
+            t->picohash_compare = picohash_compare;
+            if (hash_seed != NULL) {
+                memcpy(t->hash_seed, hash_seed, PICOHASH_SEED_SIZE);
+            }
+        }
+    }
+
+    return t;
+}
+
+void* picohash_oa_retrieve(picohash_oa_table* hash_table, void* key)
+{
+    uint64_t hash = picohash_oa_hash(hash_table, key);
+    picohash_oa_slot_t* slot = picohash_oa_find_slot(hash_table, hash_table->slots, hash_table->nb_slots, hash, key);
+
+    if (slot == NULL && hash_table->old_slots != NULL) {
+        slot = picohash_oa_find_slot(hash_table, hash_table->old_slots, hash_table->old_nb_slots, hash, key);
+    }
+
+    return (slot == NULL) ? NULL : slot->key;
+}
+
+int picohash_oa_insert(picohash_oa_table* hash_table, void* key)
+{
+    int ret = 0;
+
+    picohash_oa_migrate(hash_table, PICOHASH_OA_MIGRATE_STEP);
+    picohash_oa_clear(hash_table, PICOHASH_OA_CLEAR_STEP);
+
+    if (4 * (hash_table->count + hash_table->old_count + 1) > 3 * hash_table->nb_slots &&
+        hash_table->next_slots == NULL) {
+        /* Complete the previous resize before starting a new one */
+        picohash_oa_migrate(hash_table, hash_table->old_nb_slots);
+
+        hash_table->next_slots = (picohash_oa_slot_t*)malloc(sizeof(picohash_oa_slot_t) * 2 * hash_table->nb_slots);
+        if (hash_table->next_slots != NULL) {
+            hash_table->next_nb_slots = 2 * hash_table->nb_slots;
+            hash_table->clear_index = 0;
+        }
+    }
+
+    if (8 * (hash_table->count + hash_table->old_count + 1) > 7 * hash_table->nb_slots) {
+        if (hash_table->next_slots != NULL) {
+            /* Too full to wait for the clearing to complete */
+            picohash_oa_clear(hash_table, hash_table->next_nb_slots);
+        } else {
+            /* Cannot grow, and too full to keep the probe sequences short */
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picohash_oa_place(hash_table->slots, hash_table->nb_slots, picohash_oa_hash(hash_table, key), key);
+        hash_table->count++;
+    }
+
+    return ret;
+}
+
+void* picohash_oa_remove(picohash_oa_table* hash_table, void* key)
+{
+    uint64_t hash = picohash_oa_hash(hash_table, key);
+    picohash_oa_slot_t* slot;
+    void* removed_key = NULL;
+
+    picohash_oa_migrate(hash_table, PICOHASH_OA_MIGRATE_STEP);
+    picohash_oa_clear(hash_table, PICOHASH_OA_CLEAR_STEP);
+
+    slot = picohash_oa_find_slot(hash_table, hash_table->slots, hash_table->nb_slots, hash, key);
+
+    if (slot != NULL) {
+        removed_key = slot->key;
+        picohash_oa_shift_back(hash_table->slots, hash_table->nb_slots, (size_t)(slot - hash_table->slots));
+        hash_table->count--;
+    } else if (hash_table->old_slots != NULL &&
+        (slot = picohash_oa_find_slot(hash_table, hash_table->old_slots, hash_table->old_nb_slots, hash, key)) != NULL) {
+        removed_key = slot->key;
+        slot->hash = 1;
+        slot->key = NULL;
+        hash_table->old_count--;
+        picohash_oa_migrate(hash_table, 0);
+    }
+
+    return removed_key;
+}
+
+size_t picohash_oa_count(picohash_oa_table* hash_table)
+{
+    return hash_table->count + hash_table->old_count;
+}
+
+void picohash_oa_delete(picohash_oa_table* hash_table, int delete_key_too)
+{
+    if (delete_key_too) {
+        for (size_t i = 0; i < hash_table->nb_slots; i++) {
+            if (hash_table->slots[i].hash > 1) {
+                free(hash_table->slots[i].key);
+            }
+        }
+
+        for (size_t i = 0; i < hash_table->old_nb_slots; i++) {
+            if (hash_table->old_slots[i].hash > 1) {
+                free(hash_table->old_slots[i].key);
+            }
+        }
+    }
+
+    if (hash_table->old_slots != NULL) {
+        free(hash_table->old_slots);
+    }
+
+    if (hash_table->next_slots != NULL) {
+        free(hash_table->next_slots);
+    }
+
+    free(hash_table->slots);
+    free(hash_table);
+}
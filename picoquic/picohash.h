@@ -62,6 +62,67 @@ void picohash_delete(picohash_table* hash_table, int delete_key_too);
 
 uint64_t picohash_bytes(uint8_t* key, uint32_t length);
 
+/*
+ * Keyed hash of a byte string, using SipHash-1-3. The seed is a secret
+ * chosen per context, so that peers who choose connection IDs or ports
+ * cannot predict which keys collide.
+ */
+#define PICOHASH_SEED_SIZE 16
+
+uint64_t picohash_siphash(const uint8_t* bytes, size_t length, const uint8_t* seed);
+
+/*
+ * Open addressing hash table. The keys are stored in an array of slots,
+ * together with their hash value, which is used as a fingerprint to avoid
+ * calling the compare function on non matching keys. Collisions are resolved
+ * by linear probing, and removal shifts the following keys back in place,
+ * so the probe sequences stay short. There is no allocation on insertion,
+ * lookup or removal, except when the table grows. The table doubles when
+ * it is 3/4 full. The new slots are allocated without being cleared; they
+ * are cleared a chunk at a time during the following insertions and
+ * removals, while keys are still placed in the current slots. The keys are
+ * then migrated a few slots at a time, so no single call pays for the whole
+ * resize. The only remaining cost proportional to the table size is the
+ * allocation itself.
+ */
+
+typedef struct st_picohash_oa_slot_t {
+    uint64_t hash; /* 0 if the slot is empty, 1 if deleted during migration */
+    void* key;
+} picohash_oa_slot_t;
+
+typedef struct st_picohash_oa_table_t {
+    picohash_oa_slot_t* slots;
+    size_t nb_slots; /* Always a power of 2 */
+    size_t count;
+    picohash_oa_slot_t* old_slots; /* Slots being migrated after a resize, or NULL */
+    size_t old_nb_slots;
+    size_t old_count;
+    size_t migrate_index;
+    picohash_oa_slot_t* next_slots; /* Slots being cleared before a resize, or NULL */
+    size_t next_nb_slots;
+    size_t clear_index;
+    uint8_t hash_seed[PICOHASH_SEED_SIZE];
+    uint64_t (*picohash_hash)(void*, const uint8_t*);
+    int (*picohash_compare)(void*, void*);
+} picohash_oa_table;
+
+/* The hash function receives the key and the seed of the table. If hash_seed
+ * is NULL, the seed is set to zero. */
+picohash_oa_table* picohash_oa_create(size_t nb_items,
+    uint64_t (*picohash_hash)(void*, const uint8_t*),
+    int (*picohash_compare)(void*, void*), const uint8_t* hash_seed);
+
+void* picohash_oa_retrieve(picohash_oa_table* hash_table, void* key);
+
+int picohash_oa_insert(picohash_oa_table* hash_table, void* key);
+
+void* picohash_oa_remove(picohash_oa_table* hash_table, void* key);
+
+size_t picohash_oa_count(picohash_oa_table* hash_table);
+
+void picohash_oa_delete(picohash_oa_table* hash_table, int delete_key_too);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,513 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _WINDOWS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* timerfd, epoll */
+#endif
+#endif
+#include "picoloop.h"
+#include "util.h"
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+#include "picothread.h"
+
+picoquic_event_loop_t* picoquic_event_loop_create(picoquic_quic_t* quic, int nb_datagrams, int buffer_size)
+{
+    picoquic_event_loop_t* loop = (picoquic_event_loop_t*)malloc(sizeof(picoquic_event_loop_t));
+
+    if (loop != NULL) {
+        int ret = 0;
+
+        memset(loop, 0, sizeof(picoquic_event_loop_t));
+        loop->quic = quic;
+        loop->epoll_fd = -1;
+        loop->timer_fd = -1;
+        loop->wake_fd = -1;
+        loop->nb_datagrams_max = nb_datagrams;
+        loop->buffer_size = buffer_size;
+        loop->datagrams = (picoquic_recv_datagram_t*)malloc(nb_datagrams * sizeof(picoquic_recv_datagram_t));
+        loop->recv_buffers = (uint8_t*)malloc((size_t)nb_datagrams * buffer_size);
+
+        if (loop->datagrams == NULL || loop->recv_buffers == NULL) {
+            ret = -1;
+        }
+        else {
+            for (int i = 0; i < nb_datagrams; i++) {
+                loop->datagrams[i].buffer = loop->recv_buffers + (size_t)i * buffer_size;
+                loop->datagrams[i].buffer_max = buffer_size;
+            }
+#if defined(__linux__)
+            if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+                (loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+                DBG_PRINTF("Cannot create the epoll or timer fd, error %d\n", errno);
+                ret = -1;
+            }
+            else {
+                struct epoll_event ev;
+
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = loop->timer_fd;
+                ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev);
+            }
+#endif
+        }
+
+        if (ret != 0) {
+            picoquic_event_loop_delete(loop);
+            loop = NULL;
+        }
+    }
+
+    return loop;
+}
+
+void picoquic_event_loop_delete(picoquic_event_loop_t* loop)
+{
+    if (loop->commands_enabled) {
+        /* The commands queued later are only freed with the context */
+        picoquic_set_command_wakeup(loop->quic, NULL, NULL);
+    }
+
+    if (loop->uring != NULL) {
+        picoquic_uring_delete(loop->uring);
+    }
+
+    for (int i = 0; i < loop->nb_sockets; i++) {
+        SOCKET_CLOSE(loop->s_socket[i]);
+    }
+#if defined(__linux__)
+    if (loop->timer_fd >= 0) {
+        close(loop->timer_fd);
+    }
+
+    if (loop->wake_fd >= 0) {
+        close(loop->wake_fd);
+    }
+
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+#endif
+
+    if (loop->datagrams != NULL) {
+        free(loop->datagrams);
+    }
+
+    if (loop->recv_buffers != NULL) {
+        free(loop->recv_buffers);
+    }
+
+    free(loop);
+}
+
+int picoquic_event_loop_set_io_uring(picoquic_event_loop_t* loop)
+{
+    int ret = 0;
+
+    if (loop->uring == NULL) {
+        /* Provide enough buffers for several waits worth of datagrams */
+        loop->uring = picoquic_uring_create(4 * loop->nb_datagrams_max, loop->buffer_size);
+
+        if (loop->uring == NULL) {
+            ret = -1;
+        }
+        else {
+            for (int i = 0; ret == 0 && i < loop->nb_sockets; i++) {
+                ret = picoquic_uring_add_socket(loop->uring, loop->s_socket[i]);
+            }
+
+            if (ret == 0 && loop->wake_fd >= 0) {
+                ret = picoquic_uring_add_wakeup(loop->uring, loop->wake_fd);
+            }
+
+            if (ret != 0) {
+                picoquic_uring_delete(loop->uring);
+                loop->uring = NULL;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_event_loop_enable_wakeup(picoquic_event_loop_t* loop)
+{
+    int ret = 0;
+
+    if (!loop->wakeup_enabled) {
+#if defined(__linux__)
+        if ((loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            DBG_PRINTF("Cannot create the event fd, error %d\n", errno);
+            ret = -1;
+        }
+        else {
+            struct epoll_event ev;
+
+            /* Edge triggered, so that a wake up that raced with the reset of
+             * wake_pending cannot leave the fd readable and spin the loop */
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.fd = loop->wake_fd;
+            ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+
+            if (ret == 0 && loop->uring != NULL) {
+                ret = picoquic_uring_add_wakeup(loop->uring, loop->wake_fd);
+            }
+
+            if (ret != 0) {
+                close(loop->wake_fd);
+                loop->wake_fd = -1;
+            }
+        }
+#endif
+        loop->wakeup_enabled = (ret == 0);
+    }
+
+    return ret;
+}
+
+void picoquic_event_loop_wakeup(picoquic_event_loop_t* loop)
+{
+    if (picoquic_atomic_exchange_int(&loop->wake_pending, 1) == 0) {
+#if defined(__linux__)
+        uint64_t one = 1;
+
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+            DBG_PRINTF("Cannot write the event fd, error %d\n", errno);
+        }
+#endif
+    }
+}
+
+/* Clear the wake up after a wait. The event fd is read before wake_pending is
+ * reset, so that the wake ups of the threads that see the reset value are not
+ * consumed. The threads that saw the old value had queued their data before,
+ * so the loop finds it when checking its queues after the wait. */
+static void picoquic_event_loop_clear_wakeup(picoquic_event_loop_t* loop)
+{
+    if (picoquic_atomic_load(&loop->wake_pending)) {
+#if defined(__linux__)
+        uint64_t count;
+
+        if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            DBG_PRINTF("Cannot read the event fd, error %d\n", errno);
+        }
+#endif
+        picoquic_atomic_store(&loop->wake_pending, 0);
+    }
+}
+
+static void picoquic_event_loop_command_wakeup(void* wakeup_ctx)
+{
+    picoquic_event_loop_wakeup((picoquic_event_loop_t*)wakeup_ctx);
+}
+
+int picoquic_event_loop_enable_commands(picoquic_event_loop_t* loop)
+{
+    int ret = -1;
+
+    if (loop->quic != NULL && (ret = picoquic_event_loop_enable_wakeup(loop)) == 0) {
+        picoquic_set_command_wakeup(loop->quic, picoquic_event_loop_command_wakeup, loop);
+        loop->commands_enabled = 1;
+    }
+
+    return ret;
+}
+
+int picoquic_event_loop_add_socket(picoquic_event_loop_t* loop, SOCKET_TYPE fd)
+{
+    int ret = 0;
+
+    if (fd == INVALID_SOCKET || loop->nb_sockets >= PICOQUIC_LOOP_MAX_SOCKETS) {
+        ret = -1;
+    }
+    else if (loop->uring != NULL) {
+        ret = picoquic_uring_add_socket(loop->uring, fd);
+    }
+
+    if (ret == 0) {
+#if defined(__linux__)
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            DBG_PRINTF("Cannot add socket %d to epoll, error %d\n", fd, errno);
+            ret = -1;
+        }
+#endif
+        if (ret == 0) {
+            struct sockaddr_storage addr;
+
+            loop->s_af[loop->nb_sockets] = (picoquic_get_local_address(fd, &addr) == 0) ? addr.ss_family : AF_UNSPEC;
+            loop->s_socket[loop->nb_sockets++] = fd;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_event_loop_remove_socket(picoquic_event_loop_t* loop, SOCKET_TYPE fd)
+{
+    for (int i = 0; i < loop->nb_sockets; i++) {
+        if (loop->s_socket[i] == fd) {
+            if (loop->uring != NULL) {
+                picoquic_uring_remove_socket(loop->uring, fd);
+            }
+#if defined(__linux__)
+            /* Fails harmlessly if the socket was already closed */
+            (void)epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+            loop->nb_sockets--;
+            for (int j = i; j < loop->nb_sockets; j++) {
+                loop->s_socket[j] = loop->s_socket[j + 1];
+                loop->s_af[j] = loop->s_af[j + 1];
+            }
+            break;
+        }
+    }
+}
+
+/* Add the server sockets to the loop, or close them on error */
+static int picoquic_event_loop_add_server_sockets(picoquic_event_loop_t* loop, picoquic_server_sockets_t* server_sockets, int ret)
+{
+    for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
+        if (server_sockets->s_socket[i] != INVALID_SOCKET) {
+            if (ret == 0) {
+                ret = picoquic_event_loop_add_socket(loop, server_sockets->s_socket[i]);
+                if (ret == 0) {
+                    continue;
+                }
+            }
+            SOCKET_CLOSE(server_sockets->s_socket[i]);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_event_loop_open_server_sockets(picoquic_event_loop_t* loop, int port)
+{
+    picoquic_server_sockets_t server_sockets;
+    int ret = picoquic_open_server_sockets(&server_sockets, port);
+
+    return picoquic_event_loop_add_server_sockets(loop, &server_sockets, ret);
+}
+
+int picoquic_event_loop_open_shared_server_sockets(picoquic_event_loop_t* loop, int port)
+{
+    picoquic_server_sockets_t server_sockets;
+    int ret = picoquic_open_shared_server_sockets(&server_sockets, port);
+
+    return picoquic_event_loop_add_server_sockets(loop, &server_sockets, ret);
+}
+
+#if defined(__linux__)
+/* Set the timer at the wake time, unless it is already set there. A delay
+ * of 0 or less means that the wait shall not block, and needs no timer. */
+static void picoquic_event_loop_set_timer(picoquic_event_loop_t* loop, int64_t delta_t, uint64_t current_time)
+{
+    uint64_t wake_time = current_time + delta_t;
+
+    if (delta_t > 0 && wake_time != loop->timer_wake_time) {
+        struct itimerspec timer;
+
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = (time_t)(delta_t / 1000000);
+        timer.it_value.tv_nsec = (long)((delta_t % 1000000) * 1000);
+
+        if (timerfd_settime(loop->timer_fd, 0, &timer, NULL) == 0) {
+            loop->timer_wake_time = wake_time;
+        }
+        else {
+            DBG_PRINTF("Cannot set timer, error %d\n", errno);
+            loop->timer_wake_time = 0;
+        }
+    }
+}
+
+/* Wait for the sockets and the timer with epoll, then receive from the readable sockets */
+static int picoquic_event_loop_epoll_wait(picoquic_event_loop_t* loop, int64_t delta_t, uint64_t current_time)
+{
+    int nb_received = 0;
+    struct epoll_event events[PICOQUIC_LOOP_MAX_SOCKETS + 1];
+    int nb_events;
+
+    picoquic_event_loop_set_timer(loop, delta_t, current_time);
+
+    nb_events = epoll_wait(loop->epoll_fd, events, PICOQUIC_LOOP_MAX_SOCKETS + 1, (delta_t > 0) ? -1 : 0);
+
+    if (nb_events < 0) {
+        if (errno != EINTR) {
+            DBG_PRINTF("Error: epoll_wait returns %d\n", errno);
+            nb_received = -1;
+        }
+    }
+    else {
+        for (int i = 0; i < nb_events; i++) {
+            if (events[i].data.fd == loop->timer_fd) {
+                uint64_t expirations;
+
+                /* The timer fired, read it so it stops being readable */
+                if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    DBG_PRINTF("Cannot read timer, error %d\n", errno);
+                }
+                loop->timer_wake_time = 0;
+            }
+            else if (events[i].data.fd == loop->wake_fd) {
+                /* Handled after the wait */
+                continue;
+            }
+            else if (nb_received < loop->nb_datagrams_max) {
+                int nb_batch = picoquic_recvmsg_batch(events[i].data.fd, loop->datagrams + nb_received,
+                    loop->nb_datagrams_max - nb_received);
+
+                if (nb_batch < 0) {
+                    DBG_PRINTF("Could not receive packet on UDP socket %d, error %d\n",
+                        events[i].data.fd, errno);
+                    if (nb_received == 0) {
+                        nb_received = -1;
+                    }
+                    break;
+                }
+                else {
+                    nb_received += nb_batch;
+                }
+            }
+        }
+    }
+
+    return nb_received;
+}
+#endif
+
+int picoquic_event_loop_wait(picoquic_event_loop_t* loop, int64_t delay_max, uint64_t* current_time)
+{
+    int nb_received = 0;
+    int64_t delta_t = (loop->quic == NULL) ? delay_max :
+        picoquic_get_next_wake_delay(loop->quic, *current_time, delay_max);
+
+    if (loop->wakeup_enabled) {
+        if (picoquic_atomic_load(&loop->wake_pending)) {
+            /* Woken up since the last wait */
+            delta_t = 0;
+        }
+#if !defined(__linux__)
+        else if (delta_t > PICOQUIC_LOOP_WAKEUP_POLL_DELAY) {
+            delta_t = PICOQUIC_LOOP_WAKEUP_POLL_DELAY;
+        }
+#endif
+    }
+
+#if defined(__linux__)
+    if (loop->uring != NULL) {
+        nb_received = picoquic_uring_wait(loop->uring, loop->datagrams, loop->nb_datagrams_max, delta_t, *current_time);
+    }
+    else {
+        nb_received = picoquic_event_loop_epoll_wait(loop, delta_t, *current_time);
+    }
+
+    *current_time = picoquic_current_time();
+#else
+    nb_received = picoquic_select_batch(loop->s_socket, loop->nb_sockets,
+        loop->datagrams, loop->nb_datagrams_max, delta_t, current_time);
+#endif
+    loop->current_time = *current_time;
+
+    if (loop->wakeup_enabled) {
+        picoquic_event_loop_clear_wakeup(loop);
+    }
+
+    if (loop->commands_enabled && picoquic_process_commands(loop->quic) > 0) {
+        /* The commands mark their connections as due at the current time of
+         * the context, which may be after the end of the wait */
+        *current_time = picoquic_get_quic_time(loop->quic);
+        loop->current_time = *current_time;
+    }
+
+    return nb_received;
+}
+
+int picoquic_event_loop_incoming(picoquic_event_loop_t* loop, int i)
+{
+    picoquic_recv_datagram_t* datagram = &loop->datagrams[i];
+
+    return picoquic_incoming_datagrams(loop->quic, datagram->buffer, (size_t)datagram->length, datagram->segment_size,
+        (struct sockaddr*)&datagram->addr_from, (struct sockaddr*)&datagram->addr_dest, datagram->dest_if,
+        datagram->received_ecn, loop->current_time);
+}
+
+int picoquic_event_loop_send_batch(picoquic_event_loop_t* loop, picoquic_send_datagram_t* datagrams, int nb_datagrams)
+{
+    int nb_sent = 0;
+    int nb_done = 0;
+
+    /* Consecutive datagrams of the same address family share a system call.
+     * Datagrams that cannot be sent are dropped, and the next runs are
+     * still sent. */
+    while (nb_done < nb_datagrams) {
+        int af = datagrams[nb_done].addr_to.ss_family;
+        SOCKET_TYPE fd = (loop->nb_sockets > 0) ? loop->s_socket[0] : INVALID_SOCKET;
+        int nb_batch = 1;
+        int sent;
+
+        for (int i = 0; i < loop->nb_sockets; i++) {
+            if (loop->s_af[i] == af) {
+                fd = loop->s_socket[i];
+                break;
+            }
+        }
+
+        while (nb_done + nb_batch < nb_datagrams && datagrams[nb_done + nb_batch].addr_to.ss_family == af) {
+            nb_batch++;
+        }
+
+        if (fd == INVALID_SOCKET) {
+            sent = -1;
+        }
+        else if (loop->uring != NULL) {
+            sent = picoquic_uring_send_batch(loop->uring, fd, datagrams + nb_done, nb_batch);
+        }
+        else {
+            sent = picoquic_sendmsg_batch(fd, datagrams + nb_done, nb_batch);
+        }
+
+        if (sent < nb_batch) {
+            DBG_PRINTF("Could only send %d packets out of %d\n", (sent < 0) ? 0 : sent, nb_batch);
+        }
+
+        nb_sent += (sent < 0) ? 0 : sent;
+        nb_done += nb_batch;
+    }
+
+    return nb_sent;
+}
+
+picoquic_cnx_t* picoquic_event_loop_next_cnx(picoquic_event_loop_t* loop)
+{
+    return picoquic_get_earliest_cnx_to_wake(loop->quic, loop->current_time);
+}
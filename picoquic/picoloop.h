@@ -0,0 +1,142 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOLOOP_H
+#define PICOLOOP_H
+
+#include "picosocks.h"
+#include "picouring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop for the sockets of a QUIC context.
+ *
+ * The loop owns the sockets that are added to it, waits until one of them
+ * is readable or the next connection is due, and receives the queued
+ * datagrams in batches. On Linux, the wait uses epoll, and a timerfd set at
+ * the next wake time provides microsecond precision. The timer is only reset
+ * when the wake time changes. On other systems, the loop uses select.
+ *
+ * On Linux 6.0 and later, the loop can use io_uring instead of epoll, see
+ * picoquic_event_loop_set_io_uring.
+ *
+ * Other threads can wake up the loop, for example after queuing data for
+ * its context, see picoquic_event_loop_enable_wakeup, and can queue commands
+ * for the connections of the context, see picoquic_event_loop_enable_commands.
+ */
+
+#define PICOQUIC_LOOP_MAX_SOCKETS 4
+/* Without an event fd, a loop that can be woken up checks at this interval */
+#define PICOQUIC_LOOP_WAKEUP_POLL_DELAY 1000
+
+typedef struct st_picoquic_event_loop_t {
+    picoquic_quic_t* quic;
+    int nb_sockets;
+    SOCKET_TYPE s_socket[PICOQUIC_LOOP_MAX_SOCKETS];
+    int s_af[PICOQUIC_LOOP_MAX_SOCKETS];
+    int epoll_fd;
+    int timer_fd;
+    uint64_t timer_wake_time;
+    int nb_datagrams_max;
+    picoquic_recv_datagram_t* datagrams;
+    uint8_t* recv_buffers;
+    int buffer_size;
+    picoquic_uring_t* uring;
+    int wakeup_enabled;
+    int wake_fd;
+    volatile int wake_pending;
+    int commands_enabled;
+    uint64_t current_time;
+} picoquic_event_loop_t;
+
+/* Create a loop for the QUIC context, receiving up to nb_datagrams datagrams
+ * of up to buffer_size bytes per wait. The quic context may be NULL, in which
+ * case the loop only waits for the sockets. */
+picoquic_event_loop_t* picoquic_event_loop_create(picoquic_quic_t* quic, int nb_datagrams, int buffer_size);
+
+/* Close the sockets of the loop and free it. The other threads shall no
+ * longer queue commands for the context. */
+void picoquic_event_loop_delete(picoquic_event_loop_t* loop);
+
+/* Switch the loop to the io_uring backend. The sockets already added and those
+ * added later receive through the ring, and the buffers of the received
+ * datagrams point to the ring until the next wait. Returns 0 if the ring is
+ * used, or -1 if it is not supported, in which case the loop is unchanged. */
+int picoquic_event_loop_set_io_uring(picoquic_event_loop_t* loop);
+
+/* Let other threads wake up the loop with picoquic_event_loop_wakeup. On
+ * Linux, the loop waits on an event fd; on other systems, the waits are
+ * capped at PICOQUIC_LOOP_WAKEUP_POLL_DELAY. */
+int picoquic_event_loop_enable_wakeup(picoquic_event_loop_t* loop);
+
+/* Wake up the loop, or make its next wait return immediately. This is the
+ * only function of the loop that can be called from other threads. The data
+ * for the loop shall be queued before the call, and the loop thread checks
+ * for it after each wait. Only the first call after a wait signals the loop. */
+void picoquic_event_loop_wakeup(picoquic_event_loop_t* loop);
+
+/* Let other threads queue commands for the context of the loop, such as
+ * picoquic_queue_add_to_stream. The commands wake up the loop, and each
+ * wait applies them before returning, so they are reflected in the next
+ * packets prepared. Must be called before the other threads start. */
+int picoquic_event_loop_enable_commands(picoquic_event_loop_t* loop);
+
+/* Add a socket to the loop, which closes it when deleted */
+int picoquic_event_loop_add_socket(picoquic_event_loop_t* loop, SOCKET_TYPE fd);
+
+/* Remove a socket from the loop, without closing it */
+void picoquic_event_loop_remove_socket(picoquic_event_loop_t* loop, SOCKET_TYPE fd);
+
+/* Open the IPv6 and IPv4 server sockets on the port, and add them to the loop.
+ * The sockets are set in the same order as in picoquic_server_sockets_t. */
+int picoquic_event_loop_open_server_sockets(picoquic_event_loop_t* loop, int port);
+
+/* Same as picoquic_event_loop_open_server_sockets, but the sockets share the port
+ * with those of other loops, see picoquic_open_shared_server_sockets. */
+int picoquic_event_loop_open_shared_server_sockets(picoquic_event_loop_t* loop, int port);
+
+/* Wait until a socket is readable, the next connection of the context is due,
+ * or delay_max expires, then receive the queued datagrams in loop->datagrams.
+ * Returns the number of datagrams received, which is 0 if the delay expired,
+ * or -1 on error. Sets current_time and loop->current_time on return. */
+int picoquic_event_loop_wait(picoquic_event_loop_t* loop, int64_t delay_max, uint64_t* current_time);
+
+/* Submit the datagram received at index i to the QUIC context, splitting it
+ * if it holds a series of segments. */
+int picoquic_event_loop_incoming(picoquic_event_loop_t* loop, int i);
+
+/* Send a batch of datagrams, each through the first socket of the loop with the
+ * same address family as its destination. Datagrams that cannot be sent are
+ * dropped without stopping the batch. Returns the number of datagrams sent,
+ * or queued if the loop uses io_uring. */
+int picoquic_event_loop_send_batch(picoquic_event_loop_t* loop, picoquic_send_datagram_t* datagrams, int nb_datagrams);
+
+/* Return the next connection that was due at the time of the last wait, or NULL */
+picoquic_cnx_t* picoquic_event_loop_next_cnx(picoquic_event_loop_t* loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOLOOP_H */
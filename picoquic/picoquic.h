@@ -77,6 +77,7 @@ extern "C" {
 #define PICOQUIC_ERROR_CANNOT_SET_ACTIVE_STREAM (PICOQUIC_ERROR_CLASS + 36)
 #define PICOQUIC_ERROR_CANNOT_CHANGE_ACTIVE_CONTEXT (PICOQUIC_ERROR_CLASS + 37)
 #define PICOQUIC_ERROR_INVALID_TOKEN (PICOQUIC_ERROR_CLASS + 38)
+#define PICOQUIC_ERROR_CNX_SLAB_EXHAUSTED (PICOQUIC_ERROR_CLASS + 39)
 
 /*
  * Protocol errors defined in the QUIC spec
@@ -196,11 +197,41 @@ typedef struct st_picoquic_stateless_packet_t {
     uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
 } picoquic_stateless_packet_t;
 
+/*
+ * Summary of a frame in a sent packet, recorded when the packet is queued
+ * for retransmission so that acknowledgements and losses can be processed
+ * without parsing the packet bytes again. For stream frames, the fields
+ * describe the stream data. For ACK frames, stream_id holds the largest
+ * acknowledged number, offset the start of the first range, and data_length
+ * the number of additional ranges. For MAX_DATA, MAX_STREAM_DATA and
+ * MAX_STREAMS frames, offset holds the advertised limit.
+ */
+#define PICOQUIC_MAX_FRAME_DESC 16
+#define PICOQUIC_FRAME_DESC_FIN 1
+#define PICOQUIC_FRAME_DESC_PURE_ACK 2
+#define PICOQUIC_FRAME_DESC_NOT_STORED 4 /* The frame bytes were not kept after sending */
+
+typedef struct st_picoquic_frame_desc_t {
+    uint64_t stream_id;
+    uint64_t offset;
+    uint16_t data_length;
+    uint16_t frame_index; /* Position of the frame in the packet bytes */
+    uint16_t frame_length;
+    uint8_t frame_type;
+    uint8_t flags;
+} picoquic_frame_desc_t;
+
 /*
  * The simple packet structure is used to store packets that
  * have been sent but are not yet acknowledged.
  * Packets are stored in unencrypted format.
  * The checksum length is the difference between encrypted and unencrypted.
+ * If is_described is set, frame_desc lists the frames of the packet.
+ * The bytes are prepared in a full size buffer. Once a described packet
+ * is queued for retransmission, the buffer is replaced by a compact copy of
+ * the frames that may have to be repeated and cannot be rebuilt: stream
+ * frames are rebuilt from the data retained by their stream until it is
+ * acknowledged, and padding is not repeated.
  */
 
 typedef struct st_picoquic_packet_t {
@@ -219,8 +250,13 @@ typedef struct st_picoquic_packet_t {
     unsigned int contains_crypto : 1;
     unsigned int is_mtu_probe : 1;
     unsigned int is_ack_trap : 1;
+    unsigned int is_described : 1;
+    unsigned int is_compacted : 1;
+    unsigned int is_small_buffer : 1; /* The compacted bytes are a small buffer from the pool */
+    uint16_t nb_frame_desc;
+    picoquic_frame_desc_t frame_desc[PICOQUIC_MAX_FRAME_DESC];
 
-    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t* bytes; /* PICOQUIC_MAX_PACKET_SIZE bytes, unless compacted */
 } picoquic_packet_t;
 
 typedef struct st_picoquic_quic_t picoquic_quic_t;
@@ -296,6 +332,9 @@ typedef struct st_picoquic_tp_t {
 #define PICOQUIC_STREAM_ID_CLIENT_MAX_INITIAL_UNIDIR (PICOQUIC_STREAM_ID_CLIENT_INITIATED_UNIDIR + ((65535-1)*4))
 #define PICOQUIC_STREAM_ID_SERVER_MAX_INITIAL_UNIDIR (PICOQUIC_STREAM_ID_SERVER_INITIATED_UNIDIR + ((65535-1)*4))
 
+#define PICOQUIC_STREAM_PRIORITY_LEVELS 8
+#define PICOQUIC_DEFAULT_STREAM_PRIORITY 3
+
 /* 
 * Time management. Internally, picoquic works in "virtual time", updated via the "current time" parameter
 * passed through picoquic_create(), picoquic_create_cnx(), picoquic_incoming_packet(), and picoquic_prepare_packet().
@@ -415,6 +454,63 @@ void picoquic_free(picoquic_quic_t* quic);
 /* Set cookie mode on QUIC context when under stress */
 void picoquic_set_cookie_mode(picoquic_quic_t* quic, int cookie_mode);
 
+/* Packet pools. Packets that are freed are kept for reuse by the QUIC context,
+ * up to the configured high water mark for each of the two pools, regular
+ * packets and stateless packets. The statistics count the allocations served
+ * by the pools (hits) and those that required a malloc (misses). The full
+ * size buffers released when sent packets are compacted are kept in a third
+ * pool, with the same high water mark.
+ */
+#define PICOQUIC_PACKET_POOL_MAX_DEFAULT 256
+
+typedef struct st_picoquic_packet_pool_stats_t {
+    uint64_t nb_packet_hits;
+    uint64_t nb_packet_misses;
+    size_t nb_packets_in_pool;
+    uint64_t nb_stateless_hits;
+    uint64_t nb_stateless_misses;
+    size_t nb_stateless_in_pool;
+    size_t nb_buffers_in_pool;
+    size_t nb_small_buffers_in_pool;
+} picoquic_packet_pool_stats_t;
+
+void picoquic_set_packet_pool_max(picoquic_quic_t* quic, size_t max_packets);
+void picoquic_get_packet_pool_stats(picoquic_quic_t* quic, picoquic_packet_pool_stats_t* stats);
+
+/* Connection slab. Once enabled, the connection and path objects are taken
+ * from arrays preallocated for the number of connections passed to
+ * picoquic_create, and returned there when connections are deleted.
+ * When the slab is exhausted, new connections are refused: creating a
+ * client connection fails, and the Initial packets that would create a
+ * server connection are dropped. The statistics give the size of the slab,
+ * the number of free objects, and the number of refused connections.
+ */
+typedef struct st_picoquic_cnx_slab_stats_t {
+    size_t nb_cnx;
+    size_t nb_cnx_free;
+    size_t nb_paths;
+    size_t nb_paths_free;
+    uint64_t nb_refused;
+} picoquic_cnx_slab_stats_t;
+
+int picoquic_enable_cnx_slab(picoquic_quic_t* quic);
+void picoquic_get_cnx_slab_stats(picoquic_quic_t* quic, picoquic_cnx_slab_stats_t* stats);
+
+/* Connection arena. Stream heads, queued control frames, stashed connection
+ * IDs and probes are allocated from a per connection arena, released at
+ * once when the connection is deleted. The statistics give the number of
+ * bytes reserved from the system, the number of bytes held by live
+ * objects, and the number of allocations served by the arena.
+ */
+typedef struct st_picoquic_arena_stats_t {
+    size_t bytes_reserved;
+    size_t bytes_in_use;
+    size_t nb_chunks;
+    uint64_t nb_allocs;
+} picoquic_arena_stats_t;
+
+void picoquic_get_arena_stats(picoquic_cnx_t* cnx, picoquic_arena_stats_t* stats);
+
 /* Set the transport parameters */
 void picoquic_set_transport_parameters(picoquic_cnx_t * cnx, picoquic_tp_t const * tp);
 
@@ -487,6 +583,10 @@ picoquic_cnx_t* picoquic_get_earliest_cnx_to_wake(picoquic_quic_t* quic, uint64_
 
 picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t* cnx);
 
+/* Serial number of the connection, unique in the QUIC context. Used by the
+ * other threads to refer to the connection in commands. */
+uint64_t picoquic_get_cnx_serial(picoquic_cnx_t* cnx);
+
 void picoquic_cnx_set_padding_policy(picoquic_cnx_t * cnx, uint32_t padding_multiple, uint32_t padding_minsize);
 void picoquic_cnx_get_padding_policy(picoquic_cnx_t * cnx, uint32_t * padding_multiple, uint32_t * padding_minsize);
 /* Set spin bit policy for the connection */
@@ -526,8 +626,12 @@ int picoquic_queue_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t
 
 /* Send and receive network packets */
 
+/* Stateless packets returned by picoquic_dequeue_stateless_packet are freed with
+ * picoquic_delete_stateless_packet, or returned to the pool of the QUIC context
+ * with picoquic_recycle_stateless_packet. */
 picoquic_stateless_packet_t* picoquic_dequeue_stateless_packet(picoquic_quic_t* quic);
 void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp);
+void picoquic_recycle_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp);
 
 int picoquic_incoming_packet(
     picoquic_quic_t* quic,
@@ -539,12 +643,61 @@ int picoquic_incoming_packet(
     unsigned char received_ecn,
     uint64_t current_time);
 
-picoquic_packet_t* picoquic_create_packet();
+/* Process a buffer of several UDP datagrams of datagram_size bytes, the last one
+ * possibly shorter, such as received with UDP_GRO */
+int picoquic_incoming_datagrams(
+    picoquic_quic_t* quic,
+    uint8_t* bytes,
+    size_t length,
+    size_t datagram_size,
+    struct sockaddr* addr_from,
+    struct sockaddr* addr_to,
+    int if_index_to,
+    unsigned char received_ecn,
+    uint64_t current_time);
+
+/* Packets and their buffers come from the pools of the QUIC context, and are
+ * released with picoquic_recycle_packet, not with free(). */
+picoquic_packet_t* picoquic_create_packet(picoquic_quic_t* quic);
+void picoquic_recycle_packet(picoquic_quic_t* quic, picoquic_packet_t* packet);
 
 int picoquic_prepare_packet(picoquic_cnx_t* cnx,
     uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
     struct sockaddr_storage * p_addr_to, int * to_len, struct sockaddr_storage * p_addr_from, int * from_len);
 
+/* Prepare several datagrams for the same connection, for sending in a single
+ * system call. The caller sets the bytes and bytes_max of each datagram, the
+ * other fields are filled by picoquic_prepare_packets. Preparation stops when
+ * the connection has nothing more to send, when all datagrams are filled, or
+ * on error. The datagrams prepared before an error, including
+ * PICOQUIC_ERROR_DISCONNECTED, should still be sent. */
+typedef struct st_picoquic_send_datagram_t {
+    uint8_t* bytes;
+    size_t bytes_max;
+    size_t length;
+    struct sockaddr_storage addr_to;
+    int addr_to_len;
+    struct sockaddr_storage addr_from;
+    int addr_from_len;
+    unsigned long if_index;
+} picoquic_send_datagram_t;
+
+int picoquic_prepare_packets(picoquic_cnx_t* cnx, uint64_t current_time,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams, int* nb_prepared);
+
+/* Prepare a series of packets for the same path, back to back in the send buffer,
+ * for sending with UDP segmentation offload. All the packets have the length
+ * segment_size, except the last one which may be shorter. A series only starts
+ * with a packet of at least the path MTU. It stops at the first packet shorter
+ * than the segment size, at the first packet that is not a
+ * 1-RTT packet, when another path or a probe is pending, or when the buffer is full.
+ * If an error is returned, the packets already in the buffer should still be sent. */
+#define PICOQUIC_MAX_SEGMENTS_PER_SEND 64
+
+int picoquic_prepare_segments(picoquic_cnx_t* cnx, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length, size_t* segment_size,
+    struct sockaddr_storage* p_addr_to, int* to_len, struct sockaddr_storage* p_addr_from, int* from_len);
+
 /* Mark stream as active, or not.
  * If a stream is active, it will be polled for data when the transport
  * is ready to send. The polling will only start after all currently
@@ -569,6 +722,16 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
 int picoquic_mark_high_priority_stream(picoquic_cnx_t* cnx,
     uint64_t stream_id, int is_high_priority);
 
+/* Set the priority of a stream. Streams that are ready to send are
+ * served in order of priority, from 0, the most urgent, to
+ * PICOQUIC_STREAM_PRIORITY_LEVELS - 1. Streams of the same priority
+ * share the bandwidth in round robin order. New streams are created
+ * with the priority PICOQUIC_DEFAULT_STREAM_PRIORITY. Setting the priority
+ * does not open the stream: the call fails if the stream does not exist yet.
+ */
+int picoquic_set_stream_priority(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t priority);
+
 /* If a stream is marked active, the application will receive a callback with
  * event type "picoquic_callback_prepare_to_send" when the transport is ready to
  * send data on a stream. The "length" argument in the call back indicates the
@@ -594,6 +757,27 @@ uint8_t* picoquic_provide_stream_data_buffer(void* context, size_t nb_bytes, int
 int picoquic_add_to_stream(picoquic_cnx_t* cnx,
     uint64_t stream_id, const uint8_t* data, size_t length, int set_fin);
 
+/* Queue data on a stream without copying it. Each element of the vector
+ * is referenced by the transport until all its bytes have been acknowledged,
+ * or until the stream is reset or deleted. The release function is then called
+ * once for that element, with its base address and length. The application
+ * must not modify or free the bytes before the release. If the function
+ * returns an error, nothing was queued, the release function will not be
+ * called and the application keeps ownership of the buffers.
+ * The copying API "picoquic_add_to_stream" remains the simpler choice for
+ * small writes.
+ */
+typedef struct st_picoquic_iovec_t {
+    uint8_t* base;
+    size_t len;
+} picoquic_iovec_t;
+
+typedef void (*picoquic_stream_data_release_fn)(uint8_t* bytes, size_t length, void* release_ctx);
+
+int picoquic_add_to_stream_zero_copy(picoquic_cnx_t* cnx,
+    uint64_t stream_id, const picoquic_iovec_t* iov, size_t iov_count, int set_fin,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx);
+
 /* Reset a stream, indicating that no more data will be sent on 
  * that stream and that any data currently queued can be abandoned. */
 int picoquic_reset_stream(picoquic_cnx_t* cnx,
@@ -604,6 +788,33 @@ int picoquic_reset_stream(picoquic_cnx_t* cnx,
 int picoquic_stop_sending(picoquic_cnx_t* cnx,
     uint64_t stream_id, uint16_t local_stream_error);
 
+/* Commands from other threads.
+ * The stream and connection APIs above may only be called by the thread
+ * that runs the QUIC context. Other threads queue commands instead, naming
+ * the connection by its serial number. The queue is lock free; each command
+ * is copied once when queued, and applied by the network thread when it
+ * calls "picoquic_process_commands", which the event loop does after each
+ * wait and before preparing packets. Commands for a connection that no
+ * longer exists are dropped. The wake up function, set before the other
+ * threads start, is called after each command is queued so that a network
+ * thread blocked in its wait can return immediately.
+ */
+typedef void (*picoquic_command_wakeup_fn)(void* wakeup_ctx);
+
+void picoquic_set_command_wakeup(picoquic_quic_t* quic, picoquic_command_wakeup_fn wakeup_fn, void* wakeup_ctx);
+
+int picoquic_queue_add_to_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, const uint8_t* data, size_t length, int set_fin);
+int picoquic_queue_mark_active_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, int is_active);
+int picoquic_queue_reset_stream(picoquic_quic_t* quic, uint64_t cnx_serial,
+    uint64_t stream_id, uint16_t local_stream_error);
+int picoquic_queue_close(picoquic_quic_t* quic, uint64_t cnx_serial, uint16_t reason_code);
+
+/* Apply the queued commands, in the order in which they were queued.
+ * Called by the network thread. Returns the number of commands processed. */
+int picoquic_process_commands(picoquic_quic_t* quic);
+
 /* Congestion algorithm definition */
 typedef enum {
     picoquic_congestion_notification_acknowledgement,
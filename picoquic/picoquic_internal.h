@@ -24,6 +24,8 @@
 
 #include "picohash.h"
 #include "picoquic.h"
+#include "picosplay.h"
+#include "picothread.h"
 #include "picotlsapi.h"
 #include "util.h"
 
@@ -298,10 +300,51 @@ typedef enum {
     picoquic_tp_server_preferred_address = 13
 } picoquic_tp_enum;
 
+/* Size of the small buffers that hold the frames kept by compacted packets,
+ * typically an ACK frame. Longer copies are allocated on their own. */
+#define PICOQUIC_SMALL_PACKET_BUFFER_SIZE 256
+
+/* Free packet buffers are linked through their first bytes */
+typedef struct st_picoquic_packet_buffer_t {
+    struct st_picoquic_packet_buffer_t* next_buffer;
+} picoquic_packet_buffer_t;
+
+/*
+ * Connection slab. The connection and path objects are preallocated in
+ * arrays, sized for the number of connections passed to picoquic_create,
+ * with PICOQUIC_CNX_SLAB_PATHS_PER_CNX paths per connection. Each slab
+ * connection also owns a table of path pointers of that size. Free objects
+ * are linked through their first bytes.
+ */
+#define PICOQUIC_CNX_SLAB_PATHS_PER_CNX 2
+
+typedef struct st_picoquic_slab_item_t {
+    struct st_picoquic_slab_item_t* next_item;
+} picoquic_slab_item_t;
+
+typedef struct st_picoquic_cnx_slab_t {
+    picoquic_cnx_t* cnx_array;
+    picoquic_path_t* path_array;
+    picoquic_path_t** path_table;
+    picoquic_slab_item_t* cnx_free;
+    picoquic_slab_item_t* path_free;
+    picoquic_cnx_slab_stats_t stats;
+} picoquic_cnx_slab_t;
+
 /*
  * QUIC context, defining the tables of connections,
  * open sockets, etc.
  */
+/*
+ * Key of the table of connections by serial number. The serial numbers
+ * are never reused in a context, so a command queued for a connection
+ * that was since deleted finds no entry instead of a dangling pointer.
+ */
+typedef struct st_picoquic_cnx_serial_key_t {
+    uint64_t serial;
+    struct st_picoquic_cnx_t* cnx;
+} picoquic_cnx_serial_key_t;
+
 typedef struct st_picoquic_quic_t {
     void * F_log;
     char const * cc_log_dir;
@@ -325,16 +368,40 @@ typedef struct st_picoquic_quic_t {
 
     picoquic_stateless_packet_t* pending_stateless_packet;
 
+    /* Pools of free packets, linked through next_packet, and of free packet buffers */
+    picoquic_packet_t* packet_pool;
+    picoquic_stateless_packet_t* stateless_packet_pool;
+    picoquic_packet_buffer_t* packet_buffer_pool;
+    picoquic_packet_buffer_t* small_buffer_pool;
+    size_t packet_pool_max;
+    picoquic_packet_pool_stats_t packet_pool_stats;
+
+    /* Number of connections used for sizing the tables, and optional slab */
+    uint32_t nb_connections;
+    picoquic_cnx_slab_t* cnx_slab;
+
     picoquic_congestion_algorithm_t const* default_congestion_alg;
 
     struct st_picoquic_cnx_t* cnx_list;
     struct st_picoquic_cnx_t* cnx_last;
 
-    struct st_picoquic_cnx_t* cnx_wake_first;
-    struct st_picoquic_cnx_t* cnx_wake_last;
+    picosplay_tree cnx_wake_tree; /* Connections ordered by next wake time */
+
+    picohash_oa_table* table_cnx_by_id;
+    picohash_oa_table* table_cnx_by_net;
+    picohash_oa_table* table_cnx_by_serial;
+    uint64_t cnx_serial_last;
+
+    /* Commands queued by application threads, applied by the network thread */
+    picoquic_mpsc_queue_t command_queue;
+    picoquic_command_wakeup_fn command_wakeup_fn;
+    void* command_wakeup_ctx;
 
-    picohash_table* table_cnx_by_id;
-    picohash_table* table_cnx_by_net;
+    /* Packets protected or decrypted by crypto workers, see picocrypto.h */
+    struct st_picoquic_crypto_job_t* crypto_jobs;
+    int nb_crypto_jobs;
+    int nb_crypto_jobs_max;
+    struct st_picoquic_crypto_pool_t* crypto_received_pool;
 
     picoquic_connection_id_cb_fn cnx_id_callback_fn;
     void* cnx_id_callback_ctx;
@@ -356,31 +423,66 @@ typedef struct st_picoquic_quic_t {
 picoquic_packet_context_enum picoquic_context_from_epoch(int epoch);
 
 /*
- * SACK dashboard item, part of connection context.
+ * SACK dashboard, part of connection context.
+ * The ranges are kept in a single array, sorted from the highest to the lowest,
+ * so that holes can be added or filled without allocating memory, duplicates
+ * can be found by binary search, and ACK frames can be built by walking the
+ * array from the start.
+ * If max_ranges is set, the list holds at most that many ranges. When a new
+ * hole would exceed the limit, the lowest range is forgotten and the horizon
+ * is raised above it: numbers below the horizon are treated as already received.
+ * An all-zero list is a valid empty list without limit.
  */
 
+#define PICOQUIC_MAX_SACK_RANGES 64
+
 typedef struct st_picoquic_sack_item_t {
-    struct st_picoquic_sack_item_t* next_sack;
     uint64_t start_of_sack_range;
     uint64_t end_of_sack_range;
 } picoquic_sack_item_t;
 
+typedef struct st_picoquic_sack_list_t {
+    picoquic_sack_item_t* ranges;
+    size_t nb_ranges;
+    size_t nb_ranges_allocated;
+    size_t max_ranges; /* 0 if the number of ranges is not bounded */
+    uint64_t horizon;
+} picoquic_sack_list_t;
+
 /*
  * Stream head.
  * Stream contains bytes of data, which are not always delivered in order.
  * When in order data is available, the application can read it,
  * or a callback can be set.
+ *
+ * Received data is reassembled in a ring buffer. The byte at a given offset is
+ * stored at (offset modulo size), which is valid because the buffer always
+ * covers the range from the consumed offset to the highest offset received.
+ * The buffer grows by powers of 2 when data arrives further ahead, which is
+ * limited by the flow control window, and is then reused for the life of
+ * the stream. The filled regions are tracked in a range list.
  */
 
+#define PICOQUIC_RECEIVE_BUFFER_MIN 2048
+#define PICOQUIC_MAX_CRYPTO_BUFFER_GAP 65536
+
 typedef struct _picoquic_stream_data {
     struct _picoquic_stream_data* next_stream_data;
     uint64_t offset;  /* Stream offset of the first octet in "bytes" */
     size_t length;    /* Number of octets in "bytes" */
     uint8_t* bytes;
+    picoquic_stream_data_release_fn release_fn; /* If set, the bytes belong to the application */
+    void* release_ctx;
 } picoquic_stream_data;
 
+/* Stream lists of the connection, after the lists of the priority levels */
+#define PICOQUIC_STREAM_LIST_CONTROL PICOQUIC_STREAM_PRIORITY_LEVELS /* Reset or stop sending pending */
+#define PICOQUIC_STREAM_LIST_BLOCKED_BIDIR (PICOQUIC_STREAM_PRIORITY_LEVELS + 1) /* Waiting for the stream ID limit */
+#define PICOQUIC_STREAM_LIST_BLOCKED_UNIDIR (PICOQUIC_STREAM_PRIORITY_LEVELS + 2)
+#define PICOQUIC_STREAM_LISTS (PICOQUIC_STREAM_PRIORITY_LEVELS + 3)
+
 typedef struct _picoquic_stream_head {
-    struct _picoquic_stream_head* next_stream;
+    picosplay_node stream_node; /* Node in the connection's stream tree, ordered by stream ID */
     uint64_t stream_id;
     uint64_t consumed_offset;
     uint64_t fin_offset;
@@ -390,10 +492,22 @@ typedef struct _picoquic_stream_head {
     uint32_t remote_error;
     uint32_t local_stop_error;
     uint32_t remote_stop_error;
-    picoquic_stream_data* stream_data;
+    uint8_t* receive_buffer;
+    size_t receive_buffer_size;
+    picoquic_sack_list_t receive_ranges; /* Ranges of received data, by offset */
     uint64_t sent_offset;
     picoquic_stream_data* send_queue;
-    picoquic_sack_item_t first_sack_item;
+    picoquic_stream_data* send_queue_last; /* Tail of the send queue, for appending */
+    picoquic_stream_data* send_retained; /* Data sent but not yet acknowledged, kept for retransmission */
+    picoquic_stream_data* send_retained_last;
+    uint64_t retained_offset; /* Stream offset of the first retained byte */
+    picoquic_stream_data* send_retained_hint; /* Retained item where the last rebuilt frame started */
+    uint64_t retained_hint_offset; /* Stream offset of that item */
+    picoquic_sack_list_t sack_list;
+    struct _picoquic_stream_head* next_ready_stream; /* Link in the ready list of the stream priority level */
+    struct _picoquic_stream_head* previous_ready_stream;
+    uint8_t priority; /* Urgency of the stream, 0 is the most urgent */
+    uint8_t ready_list; /* List in which the stream is queued, priority level or PICOQUIC_STREAM_LIST_XXX */
     /* Flags describing the state of the stream */
     unsigned int is_active : 1; /* The application is actively managing data sending through callbacks */
     unsigned int fin_requested : 1; /* Application has requested Fin of sending stream */
@@ -409,6 +523,10 @@ typedef struct _picoquic_stream_head {
     unsigned int stop_sending_received : 1; /* Stop sending received from peer */
     unsigned int stop_sending_signalled : 1; /* After stop sending received from peer, application was notified */
     unsigned int max_stream_updated : 1; /* After stream was closed in both directions, the max stream id number was updated */
+    unsigned int fin_acked : 1; /* The frame carrying the Fin was acknowledged by the peer */
+    unsigned int is_ready : 1; /* The stream is queued in the ready list of its priority level, or in the control list */
+    unsigned int is_id_blocked : 1; /* The stream is queued until the stream ID limit allows it */
+    unsigned int send_not_retained : 1; /* Some data was provided by callback, and is only kept in the sent packets */
 } picoquic_stream_head;
 
 #define IS_CLIENT_STREAM_ID(id) (unsigned int)(((id) & 1) == 0)
@@ -416,12 +534,51 @@ typedef struct _picoquic_stream_head {
 #define IS_LOCAL_STREAM_ID(id, client_mode)  (unsigned int)(((id)^(client_mode)) & 1)
 #define STREAM_ID_FROM_RANK(rank, client_mode, is_unidir) (((rank)<<2)|((is_unidir)<<1)|(client_mode))
 #define STREAM_RANK_FROM_ID(id) ((id)>>2)
+/*
+ * Per connection arena, used for the small objects owned by the connection.
+ * Allocations are rounded up to a size class, in steps of 16 bytes up to
+ * 512 bytes, then in steps of 64 bytes up to the maximum class size, and
+ * carved from chunks of fixed size. Larger allocations get a chunk of
+ * their own. All chunks are released at once when the connection is deleted.
+ */
+
+#define PICOQUIC_ARENA_CHUNK_SIZE 4096
+#define PICOQUIC_ARENA_FINE_STEP 16
+#define PICOQUIC_ARENA_FINE_MAX 512
+#define PICOQUIC_ARENA_COARSE_STEP 64
+#define PICOQUIC_ARENA_MAX_CLASS_SIZE 1024
+#define PICOQUIC_ARENA_NB_CLASSES (PICOQUIC_ARENA_FINE_MAX / PICOQUIC_ARENA_FINE_STEP + \
+    (PICOQUIC_ARENA_MAX_CLASS_SIZE - PICOQUIC_ARENA_FINE_MAX) / PICOQUIC_ARENA_COARSE_STEP)
+
+typedef struct st_picoquic_arena_block_t {
+    struct st_picoquic_arena_block_t* next_block;
+} picoquic_arena_block_t;
+
+typedef struct st_picoquic_arena_chunk_t {
+    struct st_picoquic_arena_chunk_t* next_chunk;
+    struct st_picoquic_arena_chunk_t* previous_chunk;
+    size_t size;
+} picoquic_arena_chunk_t;
+
+typedef struct st_picoquic_arena_t {
+    picoquic_arena_chunk_t* first_chunk;
+    uint8_t* chunk_free; /* Unused part of the most recent chunk */
+    size_t chunk_free_length;
+    picoquic_arena_block_t* free_list[PICOQUIC_ARENA_NB_CLASSES];
+    picoquic_arena_stats_t stats;
+} picoquic_arena_t;
+
+void* picoquic_arena_alloc(picoquic_arena_t* arena, size_t size);
+void picoquic_arena_free(picoquic_arena_t* arena, void* ptr, size_t size);
+void picoquic_arena_release(picoquic_arena_t* arena);
+
 /*
  * Frame queue. This is used for miscellaneous packets, such as the PONG
  * response to a PING.
  *
  * The misc frame are allocated in meory as blobs, starting with the
- * misc_frame_header, followed by the misc frame content.
+ * misc_frame_header, followed by the misc frame content. The blobs are
+ * allocated from the connection arena.
  */
 
 typedef struct st_picoquic_misc_frame_header_t {
@@ -461,42 +618,15 @@ typedef struct st_picoquic_misc_frame_header_t {
  */
 
 typedef struct st_picoquic_path_t {
+    /*
+     * Hot state, used when sending or receiving most packets on the path.
+     * These fields come first, so they share as few cache lines as possible.
+     */
+
     /* Local connection ID identifies a path */
     picoquic_connection_id_t local_cnxid;
     picoquic_connection_id_t remote_cnxid;
 
-    struct st_picoquic_cnx_id_key_t* first_cnx_id;
-    struct st_picoquic_net_id_key_t* first_net_id;
-
-    int path_sequence;
-    uint64_t remote_cnxid_sequence;
-
-    /* Peer address. */
-    struct sockaddr_storage peer_addr;
-    int peer_addr_len;
-    struct sockaddr_storage local_addr;
-    int local_addr_len;
-    unsigned long if_index_dest;
-    /* Public reset secret, provisioned by the peer */
-    uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
-    /* Challenge used for this path */
-    uint64_t challenge_response;
-    uint64_t challenge;
-    uint64_t challenge_time;
-    uint64_t demotion_time;
-    uint8_t challenge_repeat_count;
-    /* Alternative address, used when validating NAT rebinding */
-    struct sockaddr_storage alt_peer_addr;
-    int alt_peer_addr_len;
-    struct sockaddr_storage alt_local_addr;
-    int alt_local_addr_len;
-    unsigned long alt_if_index_dest;
-    /* Challenge used for the NAT rebinding tests */
-    uint64_t alt_challenge_response;
-    uint64_t alt_challenge;
-    uint64_t alt_challenge_timeout;
-    uint8_t alt_challenge_repeat_count;
-
 #define PICOQUIC_CHALLENGE_REPEAT_MAX 4
     /* flags */
     unsigned int mtu_probe_sent : 1;
@@ -511,8 +641,9 @@ typedef struct st_picoquic_path_t {
     unsigned int alt_response_required : 1;
     unsigned int current_spin : 1;
 
-    /* number of retransmissions observed on path */
-    uint64_t retrans_count;  
+    /* MTU */
+    uint32_t send_mtu;
+    uint32_t send_mtu_max_tried;
 
     /* Time measurement */
     uint64_t max_ack_delay;
@@ -524,10 +655,6 @@ typedef struct st_picoquic_path_t {
     uint64_t max_reorder_delay;
     uint64_t max_reorder_gap;
 
-    /* MTU */
-    uint32_t send_mtu;
-    uint32_t send_mtu_max_tried;
-
     /* Congestion control state */
     uint64_t cwin;
     uint64_t bytes_in_transit;
@@ -547,6 +674,44 @@ typedef struct st_picoquic_path_t {
     uint64_t pacing_packet_time_nanosec;
     uint64_t pacing_packet_time_microsec;
 
+    /* number of retransmissions observed on path */
+    uint64_t retrans_count;  
+
+    /* Peer address. Only the start of each storage is read for most packets. */
+    int peer_addr_len;
+    int local_addr_len;
+    unsigned long if_index_dest;
+    struct sockaddr_storage peer_addr;
+    struct sockaddr_storage local_addr;
+
+    /*
+     * Cold state, used when the path is created, validated or deleted.
+     */
+    struct st_picoquic_cnx_id_key_t* first_cnx_id;
+    struct st_picoquic_net_id_key_t* first_net_id;
+
+    int path_sequence;
+    uint64_t remote_cnxid_sequence;
+
+    /* Public reset secret, provisioned by the peer */
+    uint8_t reset_secret[PICOQUIC_RESET_SECRET_SIZE];
+    /* Challenge used for this path */
+    uint64_t challenge_response;
+    uint64_t challenge;
+    uint64_t challenge_time;
+    uint64_t demotion_time;
+    uint8_t challenge_repeat_count;
+    /* Alternative address, used when validating NAT rebinding */
+    struct sockaddr_storage alt_peer_addr;
+    int alt_peer_addr_len;
+    struct sockaddr_storage alt_local_addr;
+    int alt_local_addr_len;
+    unsigned long alt_if_index_dest;
+    /* Challenge used for the NAT rebinding tests */
+    uint64_t alt_challenge_response;
+    uint64_t alt_challenge;
+    uint64_t alt_challenge_timeout;
+    uint8_t alt_challenge_repeat_count;
 } picoquic_path_t;
 
 /* Per epoch crypto context. There are four such contexts:
@@ -572,7 +737,7 @@ typedef struct st_picoquic_crypto_context_t {
 typedef struct st_picoquic_packet_context_t {
     uint64_t send_sequence;
 
-    picoquic_sack_item_t first_sack_item;
+    picoquic_sack_list_t sack_list;
     uint64_t time_stamp_largest_received;
     uint64_t highest_ack_sent;
     uint64_t highest_ack_sent_time;
@@ -585,6 +750,12 @@ typedef struct st_picoquic_packet_context_t {
     uint64_t highest_acknowledged_time; /* time at which the highest ack was received */
     picoquic_packet_t* retransmit_newest;
     picoquic_packet_t* retransmit_oldest;
+    /* Ring of the packets in the retransmit queue, indexed by sequence number.
+     * If allocated, it holds every queued packet, at index sequence % size,
+     * and base <= sequence < base + size. */
+    picoquic_packet_t** retransmit_index;
+    uint64_t retransmit_index_base;
+    size_t retransmit_index_size;
     picoquic_packet_t* retransmitted_newest;
     picoquic_packet_t* retransmitted_oldest;
 
@@ -632,15 +803,16 @@ typedef struct st_picoquic_probe_t {
  * Per connection context.
  */
 typedef struct st_picoquic_cnx_t {
+    /*
+     * Hot state, read or updated when preparing or receiving most packets.
+     * These fields come first, so they share as few cache lines as possible.
+     * The cold state, used during the handshake, for logging or statistics,
+     * or at the end of the connection, comes after the packet contexts.
+     */
     picoquic_quic_t* quic;
 
-    /* Management of context retrieval tables */
-
-    struct st_picoquic_cnx_t* next_in_table;
-    struct st_picoquic_cnx_t* previous_in_table;
-
-    /* Proposed and negotiated version. Feature flags denote version dependent features */
-    uint32_t proposed_version;
+    /* connection state */
+    picoquic_state_enum cnx_state;
     int version_index;
 
     /* Series of flags showing the state or choices of the connection */
@@ -651,16 +823,82 @@ typedef struct st_picoquic_cnx_t {
     unsigned int key_phase_dec : 1; /* Key phase expected in incoming packets */
     unsigned int zero_rtt_data_accepted : 1; /* Peer confirmed acceptance of zero rtt data */
     unsigned int sending_ecn_ack : 1; /* ECN data has been received, should be cpoied in acks */
+    unsigned int cwin_blocked:1;
+    unsigned int flow_blocked:1;
+    unsigned int stream_blocked:1;
 
     /* Spin bit policy */
     picoquic_spinbit_version_enum spin_policy;
+    /* Padding policy */
+    uint32_t padding_multiple;
+    uint32_t padding_minsize;
+
+    /* Next time sending data is expected */
+    uint64_t next_wake_time;
+    /* Liveness detection */
+    uint64_t latest_progress_time; /* last local time at which the connection progressed */
+
+    /* Call back function and context */
+    picoquic_stream_data_cb_fn callback_fn;
+    void* callback_ctx;
+
+    /* Congestion algorithm */
+    picoquic_congestion_algorithm_t const* congestion_alg;
+
+    /* Management of paths */
+    picoquic_path_t ** path;
+    int nb_paths;
+    int nb_path_alloc;
+
+    /* Flow control information */
+    uint64_t data_sent;
+    uint64_t data_received;
+    uint64_t maxdata_local;
+    uint64_t maxdata_remote;
+    uint64_t max_stream_id_bidir_local;
+    uint64_t max_stream_id_bidir_local_computed;
+    uint64_t max_stream_id_unidir_local;
+    uint64_t max_stream_id_unidir_local_computed;
+    uint64_t max_stream_id_bidir_remote;
+    uint64_t max_stream_id_unidir_remote;
+
+    /* Queue for frames waiting to be sent */
+    picoquic_misc_frame_header_t* first_misc_frame;
+
+    /* Management of streams */
+    picosplay_tree stream_tree;
+    picoquic_stream_head* first_ready_stream[PICOQUIC_STREAM_LISTS]; /* Streams ready to send, by priority */
+    picoquic_stream_head* last_ready_stream[PICOQUIC_STREAM_LISTS];
+    uint64_t high_priority_stream_id;
+
+    /* If not `0`, the connection will send keep alive messages in the given interval. */
+    uint64_t keep_alive_interval;
+
+    /* Position in the wake up tree of the QUIC context */
+    picosplay_node cnx_wake_node;
+
+    /* Sequence and retransmission state */
+    picoquic_packet_context_t pkt_ctx[picoquic_nb_packet_context];
+
+    /* Encryption and decryption contexts */
+    picoquic_crypto_context_t crypto_context[PICOQUIC_NUMBER_OF_EPOCHS]; /* Encryption and decryption objects */
+    picoquic_crypto_context_t crypto_context_old; /* Old encryption and decryption context after key rotation */
+    picoquic_crypto_context_t crypto_context_new; /* New encryption and decryption context just before key rotation */
+
+    /*
+     * Cold state.
+     */
+
+    /* Management of context retrieval tables */
+    struct st_picoquic_cnx_t* next_in_table;
+    struct st_picoquic_cnx_t* previous_in_table;
+
+    /* Proposed and negotiated version. Feature flags denote version dependent features */
+    uint32_t proposed_version;
 
     /* Local and remote parameters */
     picoquic_tp_t local_parameters;
     picoquic_tp_t remote_parameters;
-    /* Padding policy */
-    uint32_t padding_multiple;
-    uint32_t padding_minsize;
 
     /* On clients, document the SNI and ALPN expected from the server */
     /* TODO: there may be a need to propose multiple ALPN */
@@ -668,12 +906,8 @@ typedef struct st_picoquic_cnx_t {
     char const* alpn;
     /* On clients, receives the maximum 0RTT size accepted by server */
     size_t max_early_data_size;
-    /* Call back function and context */
-    picoquic_stream_data_cb_fn callback_fn;
-    void* callback_ctx;
 
-    /* connection state, ID, etc. Todo: allow for multiple cnxid */
-    picoquic_state_enum cnx_state;
+    /* connection ID, errors, etc. Todo: allow for multiple cnxid */
     picoquic_connection_id_t initial_cnxid;
     picoquic_connection_id_t original_cnxid;
     uint64_t start_time;
@@ -685,12 +919,6 @@ typedef struct st_picoquic_cnx_t {
     uint16_t retry_token_length;
     uint8_t * retry_token;
 
-
-    /* Next time sending data is expected */
-    uint64_t next_wake_time;
-    struct st_picoquic_cnx_t* next_by_wake_time;
-    struct st_picoquic_cnx_t* previous_by_wake_time;
-
     /* TLS context, TLS Send Buffer, streams, epochs */
     void* tls_ctx;
     uint64_t crypto_rotation_sequence;
@@ -699,16 +927,6 @@ typedef struct st_picoquic_cnx_t {
     uint16_t psk_cipher_suite_id;
 
     picoquic_stream_head tls_stream[PICOQUIC_NUMBER_OF_EPOCHS]; /* Separate input/output from each epoch */
-    picoquic_crypto_context_t crypto_context[PICOQUIC_NUMBER_OF_EPOCHS]; /* Encryption and decryption objects */
-    picoquic_crypto_context_t crypto_context_old; /* Old encryption and decryption context after key rotation */
-    picoquic_crypto_context_t crypto_context_new; /* New encryption and decryption context just before key rotation */
-
-    /* Liveness detection */
-    uint64_t latest_progress_time; /* last local time at which the connection progressed */
-
-
-    /* Sequence and retransmission state */
-    picoquic_packet_context_t pkt_ctx[picoquic_nb_packet_context];
 
     /* Statistics */
     uint64_t nb_bytes_queued;
@@ -718,9 +936,6 @@ typedef struct st_picoquic_cnx_t {
     uint32_t nb_zero_rtt_acked;
     uint64_t nb_retransmission_total;
     uint64_t nb_spurious;
-    unsigned int cwin_blocked:1;
-    unsigned int flow_blocked:1;
-    unsigned int stream_blocked:1;
     FILE * cc_log; /* File where congestion control data is logged */
 
     /* ECN Counters */
@@ -731,40 +946,18 @@ typedef struct st_picoquic_cnx_t {
     uint64_t ecn_ect1_total_remote;
     uint64_t ecn_ce_total_remote;
 
-    /* Congestion algorithm */
-    picoquic_congestion_algorithm_t const* congestion_alg;
-
-    /* Flow control information */
-    uint64_t data_sent;
-    uint64_t data_received;
-    uint64_t maxdata_local;
-    uint64_t maxdata_remote;
-    uint64_t max_stream_id_bidir_local;
-    uint64_t max_stream_id_bidir_local_computed;
-    uint64_t max_stream_id_unidir_local;
-    uint64_t max_stream_id_unidir_local_computed;
-    uint64_t max_stream_id_bidir_remote;
-    uint64_t max_stream_id_unidir_remote;
-
-    /* Queue for frames waiting to be sent */
-    picoquic_misc_frame_header_t* first_misc_frame;
+    /* Arena for the small objects of the connection */
+    picoquic_arena_t arena;
 
-    /* Management of streams */
-    picoquic_stream_head * first_stream;
-    uint64_t last_visited_stream_id;
-    uint64_t high_priority_stream_id;
+    /* Entry in the table of connections by serial number */
+    picoquic_cnx_serial_key_t serial_key;
 
-    /* If not `0`, the connection will send keep alive messages in the given interval. */
-    uint64_t keep_alive_interval;
+    /* Ranks of deleted streams, indexed by stream type */
+    picoquic_sack_list_t closed_stream_ranks[4];
 
-    /* Management of paths */
-    picoquic_path_t ** path;
-    int nb_paths;
-    int nb_path_alloc;
+    /* Management of path creation, the CNX-ID stash and ongoing probes */
     int path_sequence_next;
-    /* Management of the CNX-ID stash */
     picoquic_cnxid_stash_t * cnxid_stash_first;
-    /* Management of ongoing probes */
     picoquic_probe_t * probe_first;
 } picoquic_cnx_t;
 
@@ -793,6 +986,7 @@ void picoquic_delete_abandoned_paths(picoquic_cnx_t* cnx, uint64_t current_time,
 
 /* Management of the CNX-ID stash */
 picoquic_cnxid_stash_t * picoquic_dequeue_cnxid_stash(picoquic_cnx_t* cnx);
+void picoquic_delete_cnxid_stash(picoquic_cnx_t* cnx, picoquic_cnxid_stash_t* stashed);
 
 int picoquic_enqueue_cnxid_stash(picoquic_cnx_t * cnx,
     const uint64_t sequence, const uint8_t cid_length, const uint8_t * cnxid_bytes,
@@ -808,8 +1002,15 @@ void picoquic_delete_probe(picoquic_cnx_t* cnx, picoquic_probe_t * probe);
 void picoquic_delete_failed_probes(picoquic_cnx_t* cnx);
 
 /* handling of retransmission queue */
+void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet,
+    size_t length, uint64_t current_time);
+picoquic_packet_t* picoquic_find_retransmit_packet_at_or_below(picoquic_packet_context_t* pkt_ctx, uint64_t sequence_number);
+void picoquic_clear_retransmit_index(picoquic_packet_context_t* pkt_ctx);
 picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx, picoquic_packet_t* p, int should_free);
 void picoquic_dequeue_retransmitted_packet(picoquic_cnx_t* cnx, picoquic_packet_t* p);
+int picoquic_retransmit_needed(picoquic_cnx_t* cnx, picoquic_packet_context_enum pc,
+    picoquic_path_t* path_x, uint64_t current_time, uint64_t* next_retransmit_time,
+    picoquic_packet_t* packet, size_t send_buffer_max, int* is_cleartext_mode, uint32_t* header_length);
 
 /* Reset connection after receiving version negotiation */
 int picoquic_reset_cnx_version(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length, uint64_t current_time);
@@ -826,11 +1027,15 @@ int picoquic_connection_error(picoquic_cnx_t* cnx, uint16_t local_error, uint64_
 
 /* Connection context retrieval functions */
 picoquic_cnx_t* picoquic_cnx_by_id(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id);
+picoquic_cnx_t* picoquic_cnx_by_serial(picoquic_quic_t* quic, uint64_t serial);
 picoquic_cnx_t* picoquic_cnx_by_net(picoquic_quic_t* quic, struct sockaddr* addr);
 
 int picoquic_retrieve_by_cnx_id_or_net_id(picoquic_quic_t* quic, picoquic_connection_id_t* cnx_id,
     struct sockaddr* addr, picoquic_cnx_t ** pcnx);
 
+/* Release the commands that were queued but not processed */
+void picoquic_free_commands(picoquic_quic_t* quic);
+
 /* Reset the pacing data after CWIN is updated */
 void picoquic_update_pacing_data(picoquic_path_t * path_x);
 
@@ -890,8 +1095,8 @@ void picoquic_update_payload_length(
 uint32_t picoquic_get_checksum_length(picoquic_cnx_t* cnx, int is_cleartext_mode);
 
 int picoquic_is_stream_frame_unlimited(const uint8_t* bytes);
-int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, uint8_t* bytes,
-    size_t bytes_max, int* no_need_to_repeat);
+int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const picoquic_frame_desc_t* desc,
+    int* no_need_to_repeat);
 
 int picoquic_parse_stream_header(
     const uint8_t* bytes, size_t bytes_max,
@@ -910,6 +1115,17 @@ size_t  picoquic_decrypt_packet(picoquic_cnx_t* cnx,
     uint8_t* bytes, picoquic_packet_header* ph,
     void * pn_enc, void* aead_context, int * already_received);
 
+int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
+    uint8_t* bytes, picoquic_packet_header* ph);
+
+/* Use the payload decrypted by a crypto worker, if it matches the packet and
+ * the current keys. Returns 1 and sets decoded if the payload was found. */
+int picoquic_crypto_pool_take_decrypted(picoquic_cnx_t* cnx, uint8_t* bytes, picoquic_packet_header* ph,
+    size_t* decoded);
+
+/* Header protection, applied once the packet is encrypted */
+void picoquic_protect_packet_header(uint8_t* send_buffer, size_t pn_offset, void* pn_enc);
+
 uint32_t picoquic_protect_packet(picoquic_cnx_t* cnx,
     picoquic_packet_type_enum ptype,
     uint8_t * bytes, uint64_t sequence_number,
@@ -985,25 +1201,42 @@ int picoquic_record_pn_received(picoquic_cnx_t* cnx,
 uint16_t picoquic_deltat_to_float16(uint64_t delta_t);
 uint64_t picoquic_float16_to_deltat(uint16_t float16);
 
-int picoquic_update_sack_list(picoquic_sack_item_t* sack,
+void picoquic_init_sack_list(picoquic_sack_list_t* sack_list, size_t max_ranges);
+int picoquic_update_sack_list(picoquic_sack_list_t* sack_list,
     uint64_t pn64_min, uint64_t pn64_max);
 /*
      * Check whether the data fills a hole. returns 0 if it does, -1 otherwise.
      */
-int picoquic_check_sack_list(picoquic_sack_item_t* sack,
+int picoquic_check_sack_list(picoquic_sack_list_t* sack_list,
     uint64_t pn64_min, uint64_t pn64_max);
+void picoquic_clear_sack_list(picoquic_sack_list_t* sack_list);
+/* Highest number in the list, or 0 if the list is empty */
+uint64_t picoquic_sack_list_last(const picoquic_sack_list_t* sack_list);
+int picoquic_sack_list_is_empty(const picoquic_sack_list_t* sack_list);
 
 /*
      * Process ack of ack
      */
+void picoquic_process_ack_of_ack_range(picoquic_sack_list_t* sack_list,
+    uint64_t start_of_range, uint64_t end_of_range);
 int picoquic_process_ack_of_ack_frame(
-    picoquic_sack_item_t* first_sack,
+    picoquic_sack_list_t* sack_list,
     uint8_t* bytes, size_t bytes_max, size_t* consumed, int is_ecn_14);
+void picoquic_process_possible_ack_of_ack_frame(picoquic_cnx_t* cnx, picoquic_packet_t* p);
 
 /* stream management */
+void picoquic_init_stream_tree(picoquic_cnx_t* cnx);
+picoquic_stream_head* picoquic_first_stream(picoquic_cnx_t* cnx);
+picoquic_stream_head* picoquic_next_stream(picoquic_stream_head* stream);
 picoquic_stream_head* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t stream_id);
+void picoquic_delete_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream);
+int picoquic_is_stream_closed(picoquic_cnx_t* cnx, uint64_t stream_id);
+int picoquic_delete_stream_if_closed(picoquic_cnx_t* cnx, picoquic_stream_head* stream);
 void picoquic_update_stream_initial_remote(picoquic_cnx_t* cnx);
 picoquic_stream_head* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id, int create);
+void picoquic_update_ready_stream(picoquic_cnx_t* cnx, picoquic_stream_head* stream, int move_to_end);
+void picoquic_update_ready_stream_list(picoquic_cnx_t* cnx);
+void picoquic_update_stream_priority(picoquic_cnx_t* cnx, picoquic_stream_head* stream, uint8_t priority);
 picoquic_stream_head* picoquic_find_ready_stream(picoquic_cnx_t* cnx);
 int picoquic_is_tls_stream_ready(picoquic_cnx_t* cnx);
 uint8_t* picoquic_decode_stream_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
@@ -1012,6 +1245,8 @@ int picoquic_prepare_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head* str
     uint8_t* bytes, size_t bytes_max, size_t* consumed, int* is_still_active);
 int picoquic_split_stream_frame(uint8_t* frame, size_t frame_length,
     uint8_t* b1, size_t b1_max, size_t *lb1, uint8_t* b2, size_t b2_max, size_t *lb2);
+int picoquic_rebuild_stream_frame(picoquic_stream_head* stream, const picoquic_frame_desc_t* desc,
+    uint8_t* bytes, size_t bytes_max, size_t* consumed);
 uint8_t* picoquic_decode_crypto_hs_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
     const uint8_t* bytes_max, int epoch);
 int picoquic_prepare_crypto_hs_frame(picoquic_cnx_t* cnx, int epoch,
@@ -1034,6 +1269,14 @@ void picoquic_update_max_stream_ID_local(picoquic_cnx_t* cnx, picoquic_stream_he
 int picoquic_prepare_max_streams_frame_if_needed(picoquic_cnx_t* cnx,
     uint8_t* bytes, size_t bytes_max, size_t* consumed);
 void picoquic_clear_stream(picoquic_stream_head* stream);
+int picoquic_queue_stream_data(picoquic_stream_head* stream, const uint8_t* data, size_t length,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx);
+void picoquic_dequeue_stream_data(picoquic_stream_head* stream);
+void picoquic_retain_stream_data(picoquic_stream_head* stream);
+void picoquic_release_acked_stream_data(picoquic_stream_head* stream);
+void picoquic_release_retained_stream_data(picoquic_stream_head* stream);
+/* Received data available at the specified offset, up to the end of the ring buffer */
+uint8_t* picoquic_get_stream_data_span(picoquic_stream_head* stream, uint64_t offset, size_t* length);
 int picoquic_prepare_path_challenge_frame(uint8_t* bytes,
     size_t bytes_max, size_t* consumed, uint64_t challenge);
 int picoquic_prepare_path_response_frame(uint8_t* bytes,
@@ -1054,6 +1297,9 @@ int picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x, uint8_
     int epoch, struct sockaddr* addr_from, struct sockaddr* addr_to, uint64_t current_time);
 
 int picoquic_skip_frame(uint8_t* bytes, size_t bytes_max, size_t* consumed, int* pure_ack);
+int picoquic_parse_frame_desc(uint8_t* bytes, size_t bytes_max, picoquic_frame_desc_t* desc);
+void picoquic_describe_packet_frames(picoquic_packet_t* packet);
+picoquic_frame_desc_t* picoquic_next_frame_desc(picoquic_packet_t* packet, size_t* cursor, picoquic_frame_desc_t* scratch);
 
 int picoquic_decode_closing_frames(uint8_t* bytes,
     size_t bytes_max, int* closing_received);
@@ -1067,7 +1313,8 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
 int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
     uint8_t* bytes, size_t bytes_max, size_t* consumed);
 
-picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, size_t length);
+picoquic_misc_frame_header_t* picoquic_create_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length);
+void picoquic_delete_misc_frame(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t* misc_frame);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,401 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoshard.h"
+#include "picoquic_internal.h"
+#include "tls_api.h"
+#include "util.h"
+
+#define PICOQUIC_SHARD_MAX_DELAY 10000000
+
+/* Datagram forwarded to another worker. The buffer follows the structure. */
+typedef struct st_picoquic_shard_datagram_t {
+    picoquic_mpsc_node_t node;
+    picoquic_recv_datagram_t datagram;
+} picoquic_shard_datagram_t;
+
+int picoquic_shard_get_worker_id(picoquic_shard_server_t* server, const uint8_t* bytes, size_t length)
+{
+    int worker_id = -1;
+    const uint8_t* dcid = NULL;
+
+    if (length > 0) {
+        if ((bytes[0] & 0x80) == 0) {
+            /* Short header, with the local connection id length */
+            if (length >= 1 + PICOQUIC_SHARD_CID_LENGTH) {
+                dcid = bytes + 1;
+            }
+        }
+        else if (length >= 6 + PICOQUIC_SHARD_CID_LENGTH) {
+            uint8_t dest_len;
+            uint8_t srce_len;
+
+            picoquic_parse_packet_header_cnxid_lengths(bytes[5], &dest_len, &srce_len);
+            if (dest_len == PICOQUIC_SHARD_CID_LENGTH) {
+                dcid = bytes + 6;
+            }
+        }
+    }
+
+    if (dcid != NULL && dcid[0] == PICOQUIC_SHARD_CID_MAGIC && dcid[1] < server->nb_workers) {
+        worker_id = dcid[1];
+    }
+
+    return worker_id;
+}
+
+/* Copy the datagram to the queue of its worker, and wake it up. If the copy
+ * cannot be allocated, the datagram is processed locally, which fails the
+ * same way as a packet with an unknown connection id. */
+static int picoquic_shard_forward(picoquic_shard_worker_t* worker, picoquic_shard_worker_t* target, int i)
+{
+    picoquic_recv_datagram_t* datagram = &worker->loop->datagrams[i];
+    picoquic_shard_datagram_t* forwarded = (picoquic_shard_datagram_t*)malloc(
+        sizeof(picoquic_shard_datagram_t) + datagram->length);
+    int ret = 0;
+
+    if (forwarded == NULL) {
+        ret = picoquic_event_loop_incoming(worker->loop, i);
+    }
+    else {
+        forwarded->datagram = *datagram;
+        forwarded->datagram.buffer = (uint8_t*)(forwarded + 1);
+        forwarded->datagram.buffer_max = datagram->length;
+        memcpy(forwarded->datagram.buffer, datagram->buffer, datagram->length);
+
+        picoquic_mpsc_push(&target->forward_queue, &forwarded->node);
+        picoquic_event_loop_wakeup(target->loop);
+        picoquic_atomic_add(&worker->nb_forwarded, 1);
+    }
+
+    return ret;
+}
+
+/* Process the datagrams forwarded by the other workers */
+static void picoquic_shard_receive_forwarded(picoquic_shard_worker_t* worker, uint64_t current_time)
+{
+    picoquic_mpsc_node_t* node;
+
+    while ((node = picoquic_mpsc_pop(&worker->forward_queue)) != NULL) {
+        picoquic_recv_datagram_t* datagram = &((picoquic_shard_datagram_t*)node)->datagram;
+
+        (void)picoquic_incoming_datagrams(worker->quic, datagram->buffer, (size_t)datagram->length,
+            datagram->segment_size, (struct sockaddr*)&datagram->addr_from, (struct sockaddr*)&datagram->addr_dest,
+            datagram->dest_if, datagram->received_ecn, current_time);
+        picoquic_atomic_add(&worker->nb_received_forwarded, 1);
+        free(node);
+    }
+}
+
+/* Send the stateless packets, then prepare the packets of the connections that are due */
+static int picoquic_shard_send(picoquic_shard_worker_t* worker, uint64_t current_time)
+{
+    int ret = 0;
+    int nb_send = 0;
+    picoquic_stateless_packet_t* sp;
+    picoquic_cnx_t* cnx_next;
+
+    while ((sp = picoquic_dequeue_stateless_packet(worker->quic)) != NULL) {
+        picoquic_send_datagram_t datagram;
+
+        memset(&datagram, 0, sizeof(datagram));
+        datagram.bytes = sp->bytes;
+        datagram.length = sp->length;
+        datagram.addr_to = sp->addr_to;
+        datagram.addr_to_len = (sp->addr_to.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        datagram.addr_from = sp->addr_local;
+        datagram.addr_from_len = (sp->addr_local.ss_family == 0) ? 0 :
+            ((sp->addr_local.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+        datagram.if_index = sp->if_index_local;
+
+        (void)picoquic_event_loop_send_batch(worker->loop, &datagram, 1);
+        picoquic_recycle_stateless_packet(worker->quic, sp);
+    }
+
+    while (ret == 0 && (cnx_next = picoquic_event_loop_next_cnx(worker->loop)) != NULL) {
+        int nb_prepared = 0;
+
+        if (nb_send >= PICOQUIC_SHARD_SEND_BATCH) {
+            (void)picoquic_event_loop_send_batch(worker->loop, worker->send_datagrams, nb_send);
+            nb_send = 0;
+        }
+
+        ret = picoquic_prepare_packets(cnx_next, current_time,
+            worker->send_datagrams + nb_send, PICOQUIC_SHARD_SEND_BATCH - nb_send, &nb_prepared);
+        nb_send += nb_prepared;
+
+        if (ret == PICOQUIC_ERROR_DISCONNECTED) {
+            picoquic_delete_cnx(cnx_next);
+            ret = 0;
+        }
+    }
+
+    if (nb_send > 0) {
+        (void)picoquic_event_loop_send_batch(worker->loop, worker->send_datagrams, nb_send);
+    }
+
+    return ret;
+}
+
+static void picoquic_shard_worker_run(void* arg)
+{
+    picoquic_shard_worker_t* worker = (picoquic_shard_worker_t*)arg;
+    picoquic_shard_server_t* server = worker->server;
+    uint64_t current_time = picoquic_current_time();
+    int ret = 0;
+
+    /* The public random generator is per thread, and needs its own seed */
+    picoquic_public_random_seed(worker->quic);
+
+    /* The ring can only be used by the thread that creates it */
+    if (server->use_io_uring && picoquic_event_loop_set_io_uring(worker->loop) != 0) {
+        DBG_PRINTF("Worker %d cannot use io_uring, using the default socket loop\n", worker->worker_id);
+    }
+
+    while (ret == 0 && !picoquic_atomic_load(&server->stop_requested)) {
+        int nb_recv = picoquic_event_loop_wait(worker->loop, PICOQUIC_SHARD_MAX_DELAY, &current_time);
+
+        if (nb_recv < 0) {
+            ret = -1;
+        }
+        else {
+            for (int i = 0; i < nb_recv; i++) {
+                picoquic_recv_datagram_t* datagram = &worker->loop->datagrams[i];
+                int target = picoquic_shard_get_worker_id(server, datagram->buffer, (size_t)datagram->length);
+
+                if (target >= 0 && target != worker->worker_id) {
+                    (void)picoquic_shard_forward(worker, &server->workers[target], i);
+                }
+                else {
+                    (void)picoquic_event_loop_incoming(worker->loop, i);
+                    picoquic_atomic_add(&worker->nb_received, 1);
+                }
+            }
+
+            picoquic_shard_receive_forwarded(worker, current_time);
+
+            ret = picoquic_shard_send(worker, current_time);
+        }
+    }
+
+    if (ret != 0) {
+        /* Stop the other workers, which cannot forward to this one anymore */
+        DBG_PRINTF("Worker %d stops on error %d\n", worker->worker_id, ret);
+        picoquic_atomic_store(&server->stop_requested, 1);
+        for (int i = 0; i < server->nb_workers; i++) {
+            if (i != worker->worker_id) {
+                picoquic_event_loop_wakeup(server->workers[i].loop);
+            }
+        }
+    }
+
+    worker->ret = ret;
+}
+
+/* Create the context, loop and sockets of a worker. The workers after the first
+ * share its retry secret, so that any of them can check the retry tokens. */
+static int picoquic_shard_worker_init(picoquic_shard_server_t* server, int worker_id, int port,
+    picoquic_shard_create_quic_fn create_quic_fn, void* app_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_shard_worker_t* worker = &server->workers[worker_id];
+
+    worker->server = server;
+    worker->worker_id = worker_id;
+    picoquic_mpsc_init(&worker->forward_queue);
+
+    worker->cnx_id_ctx.cnx_id_select = picoquic_connection_id_random;
+    worker->cnx_id_ctx.cnx_id_val.id_len = PICOQUIC_SHARD_CID_LENGTH;
+    worker->cnx_id_ctx.cnx_id_val.id[0] = PICOQUIC_SHARD_CID_MAGIC;
+    worker->cnx_id_ctx.cnx_id_val.id[1] = (uint8_t)worker_id;
+    worker->cnx_id_ctx.cnx_id_mask.id_len = PICOQUIC_SHARD_CID_LENGTH;
+    memset(worker->cnx_id_ctx.cnx_id_mask.id + 2, 0xFF, PICOQUIC_SHARD_CID_LENGTH - 2);
+
+    worker->quic = create_quic_fn(worker_id, picoquic_connection_id_callback, &worker->cnx_id_ctx, current_time, app_ctx);
+
+    if (worker->quic == NULL ||
+        picoquic_set_default_connection_id_length(worker->quic, PICOQUIC_SHARD_CID_LENGTH) != 0) {
+        DBG_PRINTF("Cannot create the context of worker %d\n", worker_id);
+        ret = -1;
+    }
+    else {
+        if (worker_id > 0) {
+            memcpy(worker->quic->retry_seed, server->workers[0].quic->retry_seed, sizeof(worker->quic->retry_seed));
+        }
+
+        worker->send_datagrams = (picoquic_send_datagram_t*)malloc(PICOQUIC_SHARD_SEND_BATCH * sizeof(picoquic_send_datagram_t));
+        worker->send_buffers = (uint8_t*)malloc(PICOQUIC_SHARD_SEND_BATCH * PICOQUIC_MAX_PACKET_SIZE);
+        worker->loop = picoquic_event_loop_create(worker->quic, PICOQUIC_SHARD_RECEIVE_BATCH, PICOQUIC_MAX_PACKET_SIZE);
+
+        if (worker->send_datagrams == NULL || worker->send_buffers == NULL || worker->loop == NULL ||
+            picoquic_event_loop_enable_commands(worker->loop) != 0 ||
+            picoquic_event_loop_open_shared_server_sockets(worker->loop, port) != 0) {
+            DBG_PRINTF("Cannot create the loop of worker %d\n", worker_id);
+            ret = -1;
+        }
+        else {
+            for (int i = 0; i < PICOQUIC_SHARD_SEND_BATCH; i++) {
+                worker->send_datagrams[i].bytes = worker->send_buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+                worker->send_datagrams[i].bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+            }
+        }
+    }
+
+    return ret;
+}
+
+picoquic_shard_server_t* picoquic_shard_server_create(int nb_workers, int port,
+    picoquic_shard_create_quic_fn create_quic_fn, void* app_ctx, uint64_t current_time)
+{
+    picoquic_shard_server_t* server = NULL;
+    int ret = 0;
+
+    if (nb_workers < 1 || nb_workers > PICOQUIC_SHARD_MAX_WORKERS) {
+        DBG_PRINTF("Invalid number of workers: %d\n", nb_workers);
+    }
+    else if ((server = (picoquic_shard_server_t*)malloc(sizeof(picoquic_shard_server_t))) != NULL) {
+        memset(server, 0, sizeof(picoquic_shard_server_t));
+        server->workers = (picoquic_shard_worker_t*)malloc(nb_workers * sizeof(picoquic_shard_worker_t));
+
+        if (server->workers == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(server->workers, 0, nb_workers * sizeof(picoquic_shard_worker_t));
+
+            for (int i = 0; ret == 0 && i < nb_workers; i++) {
+                server->nb_workers = i + 1;
+                ret = picoquic_shard_worker_init(server, i, port, create_quic_fn, app_ctx, current_time);
+
+                if (ret == 0 && port == 0) {
+                    /* The first worker picked a port, the others share it */
+                    struct sockaddr_storage addr;
+
+                    if (picoquic_get_local_address(server->workers[0].loop->s_socket[0], &addr) == 0) {
+                        port = ntohs((addr.ss_family == AF_INET) ? ((struct sockaddr_in*)&addr)->sin_port :
+                            ((struct sockaddr_in6*)&addr)->sin6_port);
+                    }
+                    else {
+                        ret = -1;
+                    }
+                }
+            }
+        }
+
+        if (ret != 0) {
+            picoquic_shard_server_delete(server);
+            server = NULL;
+        }
+    }
+
+    return server;
+}
+
+void picoquic_shard_server_set_io_uring(picoquic_shard_server_t* server, int use_io_uring)
+{
+    server->use_io_uring = use_io_uring;
+}
+
+int picoquic_shard_server_start(picoquic_shard_server_t* server)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < server->nb_workers; i++) {
+        picoquic_shard_worker_t* worker = &server->workers[i];
+
+        if (!worker->thread_started) {
+            ret = picoquic_create_thread(&worker->thread, picoquic_shard_worker_run, worker);
+            worker->thread_started = (ret == 0);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_shard_server_wait(picoquic_shard_server_t* server)
+{
+    int ret = 0;
+
+    for (int i = 0; i < server->nb_workers; i++) {
+        picoquic_shard_worker_t* worker = &server->workers[i];
+
+        if (worker->thread_started) {
+            picoquic_join_thread(worker->thread);
+            worker->thread_started = 0;
+            if (ret == 0) {
+                ret = worker->ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_shard_server_stop(picoquic_shard_server_t* server)
+{
+    picoquic_atomic_store(&server->stop_requested, 1);
+
+    for (int i = 0; i < server->nb_workers; i++) {
+        if (server->workers[i].thread_started) {
+            picoquic_event_loop_wakeup(server->workers[i].loop);
+        }
+    }
+
+    return picoquic_shard_server_wait(server);
+}
+
+void picoquic_shard_server_delete(picoquic_shard_server_t* server)
+{
+    (void)picoquic_shard_server_stop(server);
+
+    for (int i = 0; i < server->nb_workers; i++) {
+        picoquic_shard_worker_t* worker = &server->workers[i];
+        picoquic_mpsc_node_t* node;
+
+        while ((node = picoquic_mpsc_pop(&worker->forward_queue)) != NULL) {
+            free(node);
+        }
+
+        if (worker->loop != NULL) {
+            picoquic_event_loop_delete(worker->loop);
+        }
+
+        if (worker->quic != NULL) {
+            picoquic_free(worker->quic);
+        }
+
+        if (worker->send_datagrams != NULL) {
+            free(worker->send_datagrams);
+        }
+
+        if (worker->send_buffers != NULL) {
+            free(worker->send_buffers);
+        }
+    }
+
+    if (server->workers != NULL) {
+        free(server->workers);
+    }
+
+    free(server);
+}
@@ -0,0 +1,125 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOSHARD_H
+#define PICOSHARD_H
+
+#include "picoquic.h"
+#include "picoloop.h"
+#include "picothread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sharded server, running one QUIC context per worker thread.
+ *
+ * Each worker opens its own sockets on the server port with SO_REUSEPORT,
+ * and the kernel spreads the incoming flows between the workers. The workers
+ * do not share connections: each connection is owned by the worker that
+ * created it, which encodes its id in the connection ids that it issues, using
+ * the value and mask of picoquic_connection_id_callback. The first byte of
+ * these ids is PICOQUIC_SHARD_CID_MAGIC, the second is the worker id, and the
+ * other bytes are random.
+ *
+ * The kernel only looks at addresses and ports, so packets may reach the wrong
+ * worker, for example after a NAT rebinding or a migration. Each worker checks
+ * the destination connection id of the packets it receives, and forwards those
+ * of other workers through a lock free queue. Packets without a sharded id,
+ * such as the first Initial packets of a connection, are processed by the
+ * worker that received them.
+ *
+ * Application threads act on the connections of a worker by queuing commands
+ * in its context, such as picoquic_queue_add_to_stream with cnx->quic and the
+ * serial number of the connection; the loop of the worker applies them.
+ */
+
+#define PICOQUIC_SHARD_MAX_WORKERS 255
+#define PICOQUIC_SHARD_CID_LENGTH 8
+#define PICOQUIC_SHARD_CID_MAGIC 0xA5
+#define PICOQUIC_SHARD_RECEIVE_BATCH 32
+#define PICOQUIC_SHARD_SEND_BATCH 32
+
+/* Create the QUIC context of a worker. The context shall use the connection id
+ * callback and context provided. The sessions can only be resumed by another
+ * worker if all use the same ticket encryption key. Called from the thread
+ * that creates the server. */
+typedef picoquic_quic_t* (*picoquic_shard_create_quic_fn)(int worker_id,
+    picoquic_connection_id_cb_fn cnx_id_callback, void* cnx_id_callback_ctx,
+    uint64_t current_time, void* app_ctx);
+
+typedef struct st_picoquic_shard_worker_t {
+    struct st_picoquic_shard_server_t* server;
+    int worker_id;
+    picoquic_thread_t thread;
+    int thread_started;
+    picoquic_quic_t* quic;
+    picoquic_event_loop_t* loop;
+    picoquic_connection_id_callback_ctx_t cnx_id_ctx;
+    picoquic_mpsc_queue_t forward_queue;
+    picoquic_send_datagram_t* send_datagrams;
+    uint8_t* send_buffers;
+    int ret;
+    /* Statistics, updated by the worker thread and read with picoquic_atomic_load */
+    volatile uint64_t nb_received;
+    volatile uint64_t nb_forwarded;
+    volatile uint64_t nb_received_forwarded;
+} picoquic_shard_worker_t;
+
+typedef struct st_picoquic_shard_server_t {
+    int nb_workers;
+    picoquic_shard_worker_t* workers;
+    int use_io_uring;
+    volatile int stop_requested;
+} picoquic_shard_server_t;
+
+/* Create the workers, with their contexts and sockets on the port, but do not
+ * start them yet. The contexts are created by create_quic_fn. */
+picoquic_shard_server_t* picoquic_shard_server_create(int nb_workers, int port,
+    picoquic_shard_create_quic_fn create_quic_fn, void* app_ctx, uint64_t current_time);
+
+/* Receive through io_uring in the workers that support it. Call before the start. */
+void picoquic_shard_server_set_io_uring(picoquic_shard_server_t* server, int use_io_uring);
+
+/* Start a thread per worker */
+int picoquic_shard_server_start(picoquic_shard_server_t* server);
+
+/* Wait until the threads of the workers return, which they only do on error or
+ * after picoquic_shard_server_stop. Returns 0, or the first error returned by
+ * a worker. */
+int picoquic_shard_server_wait(picoquic_shard_server_t* server);
+
+/* Ask the workers to stop, and wait until their threads return */
+int picoquic_shard_server_stop(picoquic_shard_server_t* server);
+
+/* Stop the workers if needed, then free their contexts and close the sockets */
+void picoquic_shard_server_delete(picoquic_shard_server_t* server);
+
+/* Return the worker that owns the destination connection id of the packet, or
+ * -1 if the id was not issued by one of the workers. */
+int picoquic_shard_get_worker_id(picoquic_shard_server_t* server, const uint8_t* bytes, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOSHARD_H */
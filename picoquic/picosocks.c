@@ -19,6 +19,11 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef _WINDOWS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg */
+#endif
+#endif
 #include "picosocks.h"
 #include "util.h"
 
@@ -281,6 +286,28 @@ int picoquic_socket_set_ecn_options(SOCKET_TYPE sd, int af, int * recv_set, int
     return ret;
 }
 
+/* Request that the kernel deliver consecutive datagrams of the same flow in a
+ * single buffer, with a UDP_GRO control message giving the segment size. The
+ * receive buffers of the socket shall then be large enough for the aggregate,
+ * up to 64KB. Returns 0 if the option is set, -1 if it is not supported. */
+int picoquic_socket_set_gro(SOCKET_TYPE sd)
+{
+    int ret = -1;
+#ifdef UDP_GRO
+    int val = 1;
+
+    ret = setsockopt(sd, IPPROTO_UDP, UDP_GRO, (const char*)&val, sizeof(val));
+    if (ret != 0) {
+        DBG_PRINTF("Cannot set UDP_GRO, error %d\n", errno);
+        ret = -1;
+    }
+#else
+    (void)sd;
+#endif
+
+    return ret;
+}
+
 SOCKET_TYPE picoquic_open_client_socket(int af)
 {
     SOCKET_TYPE sd = socket(af, SOCK_DGRAM, IPPROTO_UDP);
@@ -301,7 +328,11 @@ SOCKET_TYPE picoquic_open_client_socket(int af)
     return sd;
 }
 
-int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port)
+/* Open the server sockets. If reuse_port is set, the sockets are opened with
+ * SO_REUSEPORT, so that several threads or processes can each open their own
+ * sockets on the same port, and the kernel spreads the incoming flows between
+ * them based on the addresses and ports. */
+static int picoquic_open_server_sockets_ex(picoquic_server_sockets_t* sockets, int port, int reuse_port)
 {
     int ret = 0;
     const int sock_af[] = { AF_INET6, AF_INET };
@@ -318,6 +349,20 @@ int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port)
         }
         else {
             ret = picoquic_socket_set_pkt_info(sockets->s_socket[i], sock_af[i]);
+#ifdef SO_REUSEPORT
+            if (ret == 0 && reuse_port) {
+                int val = 1;
+                ret = setsockopt(sockets->s_socket[i], SOL_SOCKET, SO_REUSEPORT, (char*)&val, sizeof(int));
+                if (ret != 0) {
+                    DBG_PRINTF("Cannot set SO_REUSEPORT, error %d\n", errno);
+                }
+            }
+#else
+            if (reuse_port) {
+                DBG_PRINTF("%s", "SO_REUSEPORT is not supported on this system\n");
+                ret = -1;
+            }
+#endif
             if (ret == 0) {
                 ret = bind_to_port(sockets->s_socket[i], sock_af[i], port);
             }
@@ -327,6 +372,16 @@ int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port)
     return ret;
 }
 
+int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port)
+{
+    return picoquic_open_server_sockets_ex(sockets, port, 0);
+}
+
+int picoquic_open_shared_server_sockets(picoquic_server_sockets_t* sockets, int port)
+{
+    return picoquic_open_server_sockets_ex(sockets, port, 1);
+}
+
 void picoquic_close_server_sockets(picoquic_server_sockets_t* sockets)
 {
     for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
@@ -337,6 +392,89 @@ void picoquic_close_server_sockets(picoquic_server_sockets_t* sockets)
     }
 }
 
+#ifndef _WINDOWS
+/* Parse the control information of a received message */
+void picoquic_parse_recv_cmsg(struct msghdr* msg,
+    struct sockaddr_storage* addr_dest,
+    socklen_t* dest_length,
+    unsigned long* dest_if,
+    unsigned char* received_ecn,
+    size_t* recv_msg_size)
+{
+    struct cmsghdr* cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP) {
+#ifdef IP_PKTINFO
+            if (cmsg->cmsg_type == IP_PKTINFO) {
+                if (addr_dest != NULL && dest_length != NULL) {
+                    struct in_pktinfo* pPktInfo = (struct in_pktinfo*)CMSG_DATA(cmsg);
+                    ((struct sockaddr_in*)addr_dest)->sin_family = AF_INET;
+                    ((struct sockaddr_in*)addr_dest)->sin_port = 0;
+                    ((struct sockaddr_in*)addr_dest)->sin_addr.s_addr = pPktInfo->ipi_addr.s_addr;
+                    *dest_length = sizeof(struct sockaddr_in);
+
+                    if (dest_if != NULL) {
+                        *dest_if = pPktInfo->ipi_ifindex;
+                    }
+                }
+            }
+#else
+            /* The IP_PKTINFO structure is not defined on BSD */
+            if (cmsg->cmsg_type == IP_RECVDSTADDR) {
+                if (addr_dest != NULL && dest_length != NULL) {
+                    struct in_addr* pPktInfo = (struct in_addr*)CMSG_DATA(cmsg);
+                    ((struct sockaddr_in*)addr_dest)->sin_family = AF_INET;
+                    ((struct sockaddr_in*)addr_dest)->sin_port = 0;
+                    ((struct sockaddr_in*)addr_dest)->sin_addr.s_addr = pPktInfo->s_addr;
+                    *dest_length = sizeof(struct sockaddr_in);
+
+                    if (dest_if != NULL) {
+                        *dest_if = 0;
+                    }
+                }
+            }
+#endif
+            else if (cmsg->cmsg_type == IP_TOS && cmsg->cmsg_len > 0) {
+                if (received_ecn != NULL) {
+                    *received_ecn = *((unsigned char *)CMSG_DATA(cmsg));
+                }
+            }
+        }
+        else if (cmsg->cmsg_level == IPPROTO_IPV6) {
+            if (cmsg->cmsg_type == IPV6_PKTINFO) {
+                if (addr_dest != NULL && dest_length != NULL) {
+                    struct in6_pktinfo* pPktInfo6 = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+
+                    ((struct sockaddr_in6*)addr_dest)->sin6_family = AF_INET6;
+                    ((struct sockaddr_in6*)addr_dest)->sin6_port = 0;
+                    memcpy(&((struct sockaddr_in6*)addr_dest)->sin6_addr, &pPktInfo6->ipi6_addr, sizeof(struct in6_addr));
+                    *dest_length = sizeof(struct sockaddr_in6);
+
+                    if (dest_if != NULL) {
+                        *dest_if = pPktInfo6->ipi6_ifindex;
+                    }
+                }
+            }
+            else if (cmsg->cmsg_type == IPV6_TCLASS) {
+                if (cmsg->cmsg_len > 0 && received_ecn != NULL) {
+                    *received_ecn = *((unsigned char *)CMSG_DATA(cmsg));
+                }
+            }
+        }
+#ifdef UDP_GRO
+        else if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            if (recv_msg_size != NULL) {
+                int segment_size = 0;
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+                *recv_msg_size = (size_t)segment_size;
+            }
+        }
+#endif
+    }
+}
+#endif
+
 int picoquic_recvmsg(SOCKET_TYPE fd,
     struct sockaddr_storage* addr_from,
     socklen_t* from_length,
@@ -344,7 +482,8 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
     socklen_t* dest_length,
     unsigned long* dest_if,
     unsigned char* received_ecn,
-    uint8_t* buffer, int buffer_max)
+    uint8_t* buffer, int buffer_max,
+    size_t* recv_msg_size)
 #ifdef _WINDOWS
 {
     GUID WSARecvMsg_GUID = WSAID_WSARECVMSG;
@@ -362,6 +501,10 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
         *dest_length = 0;
     }
 
+    if (recv_msg_size != NULL) {
+        *recv_msg_size = 0;
+    }
+
     if (dest_if != NULL) {
         *dest_if = 0;
     }
@@ -475,6 +618,10 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
         *dest_if = 0;
     }
 
+    if (recv_msg_size != NULL) {
+        *recv_msg_size = 0;
+    }
+
     dataBuf.iov_base = (char*)buffer;
     dataBuf.iov_len = buffer_max;
 
@@ -492,82 +639,278 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
         *from_length = 0;
     } else {
         /* Get the control information */
-        struct cmsghdr* cmsg;
         *from_length = msg.msg_namelen;
+        picoquic_parse_recv_cmsg(&msg, addr_dest, dest_length, dest_if, received_ecn, recv_msg_size);
+    }
+
+    return bytes_recv;
+}
+#endif
+
+/* Receive up to nb_datagrams datagrams that are already queued on the socket.
+ * On Linux, a single call to recvmmsg drains the batch. Elsewhere, a single
+ * datagram is received. Returns the number of datagrams received, or -1 on error.
+ * The call does not wait, the socket should be known to be readable. */
+int picoquic_recvmsg_batch(SOCKET_TYPE fd, picoquic_recv_datagram_t* datagrams, int nb_datagrams)
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+{
+    struct mmsghdr msgs[PICOQUIC_RECV_BATCH_MAX];
+    struct iovec data_bufs[PICOQUIC_RECV_BATCH_MAX];
+    char cmsg_buffers[PICOQUIC_RECV_BATCH_MAX][PICOQUIC_RECV_CMSG_SIZE];
+    int nb_received;
+
+    if (nb_datagrams > PICOQUIC_RECV_BATCH_MAX) {
+        nb_datagrams = PICOQUIC_RECV_BATCH_MAX;
+    }
+
+    memset(msgs, 0, nb_datagrams * sizeof(struct mmsghdr));
+
+    for (int i = 0; i < nb_datagrams; i++) {
+        data_bufs[i].iov_base = (char*)datagrams[i].buffer;
+        data_bufs[i].iov_len = datagrams[i].buffer_max;
+
+        msgs[i].msg_hdr.msg_name = (struct sockaddr*)&datagrams[i].addr_from;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov = &data_bufs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = (void*)cmsg_buffers[i];
+        msgs[i].msg_hdr.msg_controllen = PICOQUIC_RECV_CMSG_SIZE;
+    }
+
+    nb_received = recvmmsg(fd, msgs, nb_datagrams, MSG_DONTWAIT, NULL);
+
+    if (nb_received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            nb_received = 0;
+        }
+    }
+    else {
+        for (int i = 0; i < nb_received; i++) {
+            datagrams[i].length = (int)msgs[i].msg_len;
+            datagrams[i].from_length = msgs[i].msg_hdr.msg_namelen;
+            datagrams[i].dest_length = 0;
+            datagrams[i].dest_if = 0;
+            datagrams[i].received_ecn = 0;
+            datagrams[i].segment_size = 0;
+
+            picoquic_parse_recv_cmsg(&msgs[i].msg_hdr, &datagrams[i].addr_dest, &datagrams[i].dest_length,
+                &datagrams[i].dest_if, &datagrams[i].received_ecn, &datagrams[i].segment_size);
+        }
+    }
+
+    return nb_received;
+}
+#else
+{
+    int nb_received = 0;
+
+    if (nb_datagrams > 0) {
+        datagrams[0].from_length = sizeof(struct sockaddr_storage);
+        datagrams[0].received_ecn = 0;
+        datagrams[0].length = picoquic_recvmsg(fd, &datagrams[0].addr_from, &datagrams[0].from_length,
+            &datagrams[0].addr_dest, &datagrams[0].dest_length, &datagrams[0].dest_if,
+            &datagrams[0].received_ecn, datagrams[0].buffer, datagrams[0].buffer_max, &datagrams[0].segment_size);
+
+        nb_received = (datagrams[0].length < 0) ? -1 : 1;
+    }
+
+    return nb_received;
+}
+#endif
 
-        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-            if (cmsg->cmsg_level == IPPROTO_IP) {
+#ifndef _WINDOWS
+/* Format the control information of a message, setting the source address and
+ * interface, the don't fragment option if applicable, and the segment size if
+ * the message shall be segmented by the kernel. The message control buffer
+ * shall be set and large enough. */
+void picoquic_set_send_cmsg(struct msghdr* msg,
+    struct sockaddr* addr_from,
+    socklen_t from_length,
+    unsigned long dest_if,
+    int length,
+    size_t send_msg_size)
+{
+    int control_length = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+
+    if (addr_from != NULL && from_length != 0) {
+        if (addr_from->sa_family == AF_INET) {
 #ifdef IP_PKTINFO
-                if (cmsg->cmsg_type == IP_PKTINFO) {
-                    if (addr_dest != NULL && dest_length != NULL) {
-                        struct in_pktinfo* pPktInfo = (struct in_pktinfo*)CMSG_DATA(cmsg);
-                        ((struct sockaddr_in*)addr_dest)->sin_family = AF_INET;
-                        ((struct sockaddr_in*)addr_dest)->sin_port = 0;
-                        ((struct sockaddr_in*)addr_dest)->sin_addr.s_addr = pPktInfo->ipi_addr.s_addr;
-                        *dest_length = sizeof(struct sockaddr_in);
-
-                        if (dest_if != NULL) {
-                            *dest_if = pPktInfo->ipi_ifindex;
-                        }
-                    }
-                }
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+            struct in_pktinfo* pktinfo = (struct in_pktinfo*)CMSG_DATA(cmsg);
+            pktinfo->ipi_addr.s_addr = ((struct sockaddr_in*)addr_from)->sin_addr.s_addr;
+            pktinfo->ipi_ifindex = dest_if;
+            control_length += CMSG_SPACE(sizeof(struct in_pktinfo));
 #else
-                /* The IP_PKTINFO structure is not defined on BSD */
-                if (cmsg->cmsg_type == IP_RECVDSTADDR) {
-                    if (addr_dest != NULL && dest_length != NULL) {
-                        struct in_addr* pPktInfo = (struct in_addr*)CMSG_DATA(cmsg);
-                        ((struct sockaddr_in*)addr_dest)->sin_family = AF_INET;
-                        ((struct sockaddr_in*)addr_dest)->sin_port = 0;
-                        ((struct sockaddr_in*)addr_dest)->sin_addr.s_addr = pPktInfo->s_addr;
-                        *dest_length = sizeof(struct sockaddr_in);
-
-                        if (dest_if != NULL) {
-                            *dest_if = 0;
-                        }
-                    }
-                }
+            /* The IP_PKTINFO structure is not defined on BSD */
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_SENDSRCADDR;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
+            struct in_addr* pktinfo = (struct in_addr*)CMSG_DATA(cmsg);
+            pktinfo->s_addr = ((struct sockaddr_in*)addr_from)->sin_addr.s_addr;
+            control_length += CMSG_SPACE(sizeof(struct in_addr));
 #endif
-                else if (cmsg->cmsg_type == IP_TOS && cmsg->cmsg_len > 0) {
-                    if (received_ecn != NULL) {
-                        *received_ecn = *((unsigned char *)CMSG_DATA(cmsg));
-                    }
-                }
-            }
-            else if (cmsg->cmsg_level == IPPROTO_IPV6) {
-                if (cmsg->cmsg_type == IPV6_PKTINFO) {
-                    if (addr_dest != NULL && dest_length != NULL) {
-                        struct in6_pktinfo* pPktInfo6 = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+        } else if (addr_from->sa_family == AF_INET6) {
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IPV6;
+            cmsg->cmsg_type = IPV6_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+            struct in6_pktinfo* pktinfo6 = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+            memcpy(&pktinfo6->ipi6_addr, &((struct sockaddr_in6*)addr_from)->sin6_addr, sizeof(struct in6_addr));
+            pktinfo6->ipi6_ifindex = dest_if;
 
-                        ((struct sockaddr_in6*)addr_dest)->sin6_family = AF_INET6;
-                        ((struct sockaddr_in6*)addr_dest)->sin6_port = 0;
-                        memcpy(&((struct sockaddr_in6*)addr_dest)->sin6_addr, &pPktInfo6->ipi6_addr, sizeof(struct in6_addr));
-                        *dest_length = sizeof(struct sockaddr_in6);
+            control_length += CMSG_SPACE(sizeof(struct in6_pktinfo));
+        } else {
+            DBG_PRINTF("Unexpected address family: %d\n", addr_from->sa_family);
+        }
+#ifdef IPV6_DONTFRAG
+        if (addr_from->sa_family == AF_INET6) {
+#ifdef CMSG_ALIGN
+            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
+            {
+#else
+            struct cmsghdr * cmsg_2 = CMSG_NXTHDR(msg, cmsg);
+            if (cmsg_2 == NULL) {
+                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
+            } else {
+#endif
+                int val = 1;
+                cmsg_2->cmsg_level = IPPROTO_IPV6;
+                cmsg_2->cmsg_type = IPV6_DONTFRAG;
+                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
+                control_length += CMSG_SPACE(sizeof(int));
+            }
+        }
+#endif
 
-                        if (dest_if != NULL) {
-                            *dest_if = pPktInfo6->ipi6_ifindex;
-                        }
-                    }
-                }
-                else if (cmsg->cmsg_type == IPV6_TCLASS) {
-                    if (cmsg->cmsg_len > 0 && received_ecn != NULL) {
-                        *received_ecn = *((unsigned char *)CMSG_DATA(cmsg));
-                    }
-                }
+#if 0
+#if defined(IP_PMTUDISC_DO) || defined(IP_DONTFRAG)
+        if (addr_from->sa_family == AF_INET && length > PICOQUIC_INITIAL_MTU_IPV4) {
+#ifdef CMSG_ALIGN
+            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
+            {
+#else
+            struct cmsghdr * cmsg_2 = CMSG_NXTHDR(msg, cmsg);
+            if (cmsg_2 == NULL) {
+                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
+            }
+            else {
+#endif
+#ifdef IP_PMTUDISC_DO
+                /* This sets the don't fragment bit on Linux */
+                int val = IP_PMTUDISC_DO;
+                cmsg_2->cmsg_level = IPPROTO_IP;
+                cmsg_2->cmsg_type = IP_MTU_DISCOVER;
+#else
+                /* On BSD systems, just use IP_DONTFRAG */
+                int val = 1;
+                cmsg_2->cmsg_level = IPPROTO_IP;
+                cmsg_2->cmsg_type = IP_DONTFRAG;
+#endif
+                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
+                control_length += CMSG_SPACE(sizeof(int));
             }
         }
+#endif
+#else
+#if defined(IP_DONTFRAG)
+        if (addr_from->sa_family == AF_INET6 && length > PICOQUIC_INITIAL_MTU_IPV6) {
+#ifdef CMSG_ALIGN
+            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
+            {
+#else
+            struct cmsghdr * cmsg_2 = CMSG_NXTHDR(msg, cmsg);
+            if (cmsg_2 == NULL) {
+                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
+            }
+            else {
+#endif
+                /* On BSD systems, just use IP_DONTFRAG */
+                int val = 1;
+                cmsg_2->cmsg_level = IPPROTO_IP;
+                cmsg_2->cmsg_type = IP_DONTFRAG;
+                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
+                control_length += CMSG_SPACE(sizeof(int));
+            }
+        }
+#endif
+
+
+#endif
+
     }
 
-    return bytes_recv;
+#ifdef UDP_SEGMENT
+    if (send_msg_size > 0 && (size_t)length > send_msg_size) {
+        struct cmsghdr* cmsg_gso = (struct cmsghdr*)((unsigned char*)msg->msg_control + control_length);
+        uint16_t segment_size = (uint16_t)send_msg_size;
+
+        memset(cmsg_gso, 0, CMSG_SPACE(sizeof(uint16_t)));
+        cmsg_gso->cmsg_level = IPPROTO_UDP;
+        cmsg_gso->cmsg_type = UDP_SEGMENT;
+        cmsg_gso->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg_gso), &segment_size, sizeof(uint16_t));
+        control_length += CMSG_SPACE(sizeof(uint16_t));
+    }
+#endif
+
+    msg->msg_controllen = control_length;
+    if (control_length == 0) {
+        msg->msg_control = NULL;
+    }
 }
 #endif
 
+/* Send a message as a series of segments of send_msg_size bytes, one call per segment.
+ * This is the fallback when the kernel cannot segment the message. */
+static int picoquic_sendmsg_segments(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    socklen_t dest_length,
+    struct sockaddr* addr_from,
+    socklen_t from_length,
+    unsigned long dest_if,
+    const char* bytes, int length, size_t send_msg_size)
+{
+    int bytes_sent = 0;
+
+    while (bytes_sent < length) {
+        int segment_length = length - bytes_sent;
+        int sent;
+
+        if ((size_t)segment_length > send_msg_size) {
+            segment_length = (int)send_msg_size;
+        }
+
+        sent = picoquic_sendmsg(fd, addr_dest, dest_length, addr_from, from_length, dest_if,
+            bytes + bytes_sent, segment_length, 0);
+
+        if (sent <= 0) {
+            if (bytes_sent == 0) {
+                bytes_sent = sent;
+            }
+            break;
+        }
+        bytes_sent += sent;
+    }
+
+    return bytes_sent;
+}
+
 int picoquic_sendmsg(SOCKET_TYPE fd,
     struct sockaddr* addr_dest,
     socklen_t dest_length,
     struct sockaddr* addr_from,
     socklen_t from_length,
     unsigned long dest_if,
-    const char* bytes, int length)
+    const char* bytes, int length,
+    size_t send_msg_size)
 #ifdef _WINDOWS
 {
     GUID WSASendMsg_GUID = WSAID_WSASENDMSG;
@@ -583,6 +926,12 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     int last_error;
     WSACMSGHDR* cmsg;
 
+    if (send_msg_size > 0 && (size_t)length > send_msg_size) {
+        /* Segmentation offload is not used on Windows */
+        return picoquic_sendmsg_segments(fd, addr_dest, dest_length, addr_from, from_length, dest_if,
+            bytes, length, send_msg_size);
+    }
+
     ret = WSAIoctl(fd, SIO_GET_EXTENSION_FUNCTION_POINTER,
         &WSASendMsg_GUID, sizeof WSASendMsg_GUID,
         &WSASendMsg, sizeof WSASendMsg,
@@ -686,9 +1035,7 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     struct msghdr msg;
     struct iovec dataBuf;
     char cmsg_buffer[1024];
-    int control_length = 0;
     int bytes_sent;
-    struct cmsghdr* cmsg;
 
     /* Format the message header */
 
@@ -704,162 +1051,118 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     msg.msg_controllen = sizeof(cmsg_buffer);
 
     /* Format the control message */
-    cmsg = CMSG_FIRSTHDR(&msg);
+    picoquic_set_send_cmsg(&msg, addr_from, from_length, dest_if, length, send_msg_size);
 
-    if (addr_from != NULL && from_length != 0) {
-        if (addr_from->sa_family == AF_INET) {
-#ifdef IP_PKTINFO
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
-            cmsg->cmsg_level = IPPROTO_IP;
-            cmsg->cmsg_type = IP_PKTINFO;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-            struct in_pktinfo* pktinfo = (struct in_pktinfo*)CMSG_DATA(cmsg);
-            pktinfo->ipi_addr.s_addr = ((struct sockaddr_in*)addr_from)->sin_addr.s_addr;
-            pktinfo->ipi_ifindex = dest_if;
-            control_length += CMSG_SPACE(sizeof(struct in_pktinfo));
-#else
-            /* The IP_PKTINFO structure is not defined on BSD */
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
-            cmsg->cmsg_level = IPPROTO_IP;
-            cmsg->cmsg_type = IP_SENDSRCADDR;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
-            struct in_addr* pktinfo = (struct in_addr*)CMSG_DATA(cmsg);
-            pktinfo->s_addr = ((struct sockaddr_in*)addr_from)->sin_addr.s_addr;
-            control_length += CMSG_SPACE(sizeof(struct in_addr));
-#endif
-        } else if (addr_from->sa_family == AF_INET6) {
-            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
-            cmsg->cmsg_level = IPPROTO_IPV6;
-            cmsg->cmsg_type = IPV6_PKTINFO;
-            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-            struct in6_pktinfo* pktinfo6 = (struct in6_pktinfo*)CMSG_DATA(cmsg);
-            memcpy(&pktinfo6->ipi6_addr, &((struct sockaddr_in6*)addr_from)->sin6_addr, sizeof(struct in6_addr));
-            pktinfo6->ipi6_ifindex = dest_if;
+    if (send_msg_size > 0 && (size_t)length > send_msg_size) {
+#ifdef UDP_SEGMENT
+        bytes_sent = sendmsg(fd, &msg, 0);
 
-            control_length += CMSG_SPACE(sizeof(struct in6_pktinfo));
-        } else {
-            DBG_PRINTF("Unexpected address family: %d\n", addr_from->sa_family);
+        if (bytes_sent < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+            /* The kernel or the interface does not support segmentation offload */
+            bytes_sent = picoquic_sendmsg_segments(fd, addr_dest, dest_length, addr_from, from_length, dest_if,
+                bytes, length, send_msg_size);
         }
-#ifdef IPV6_DONTFRAG
-        if (addr_from->sa_family == AF_INET6) {
-#ifdef CMSG_ALIGN
-            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
-            {
 #else
-            struct cmsghdr * cmsg_2 = CMSG_NXTHDR((&msg), cmsg);
-            if (cmsg_2 == NULL) {
-                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
-            } else {
-#endif
-                int val = 1;
-                cmsg_2->cmsg_level = IPPROTO_IPV6;
-                cmsg_2->cmsg_type = IPV6_DONTFRAG;
-                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
-                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
-                control_length += CMSG_SPACE(sizeof(int));
-            }
-        }
+        bytes_sent = picoquic_sendmsg_segments(fd, addr_dest, dest_length, addr_from, from_length, dest_if,
+            bytes, length, send_msg_size);
 #endif
+    }
+    else {
+        bytes_sent = sendmsg(fd, &msg, 0);
+    }
 
-#if 0
-#if defined(IP_PMTUDISC_DO) || defined(IP_DONTFRAG)
-        if (addr_from->sa_family == AF_INET && length > PICOQUIC_INITIAL_MTU_IPV4) {
-#ifdef CMSG_ALIGN
-            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
-            {
-#else
-            struct cmsghdr * cmsg_2 = CMSG_NXTHDR((&msg), cmsg);
-            if (cmsg_2 == NULL) {
-                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
-            }
-            else {
-#endif
-#ifdef IP_PMTUDISC_DO
-                /* This sets the don't fragment bit on Linux */
-                int val = IP_PMTUDISC_DO;
-                cmsg_2->cmsg_level = IPPROTO_IP;
-                cmsg_2->cmsg_type = IP_MTU_DISCOVER;
-#else
-                /* On BSD systems, just use IP_DONTFRAG */
-                int val = 1;
-                cmsg_2->cmsg_level = IPPROTO_IP;
-                cmsg_2->cmsg_type = IP_DONTFRAG;
-#endif
-                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
-                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
-                control_length += CMSG_SPACE(sizeof(int));
-            }
-        }
-#endif
-#else
-#if defined(IP_DONTFRAG)
-        if (addr_from->sa_family == AF_INET6 && length > PICOQUIC_INITIAL_MTU_IPV6) {
-#ifdef CMSG_ALIGN
-            struct cmsghdr * cmsg_2 = (struct cmsghdr *)((unsigned char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len));
-            {
-#else
-            struct cmsghdr * cmsg_2 = CMSG_NXTHDR((&msg), cmsg);
-            if (cmsg_2 == NULL) {
-                DBG_PRINTF("Cannot obtain second CMSG (control_length: %d)\n", control_length);
-            }
-            else {
+    return bytes_sent;
+}
 #endif
-                /* On BSD systems, just use IP_DONTFRAG */
-                int val = 1;
-                cmsg_2->cmsg_level = IPPROTO_IP;
-                cmsg_2->cmsg_type = IP_DONTFRAG;
-                cmsg_2->cmsg_len = CMSG_LEN(sizeof(int));
-                memcpy(CMSG_DATA(cmsg_2), &val, sizeof(int));
-                control_length += CMSG_SPACE(sizeof(int));
-            }
+
+/* Send a batch of datagrams through the same socket. On Linux, the batch is
+ * sent with a single call to sendmmsg. Elsewhere, the datagrams are sent one
+ * at a time. A datagram that the socket rejects, such as an MTU probe too
+ * large for the path, is skipped and the rest of the batch is still sent.
+ * Returns the number of datagrams sent, or -1 if none could be sent. */
+int picoquic_sendmsg_batch(SOCKET_TYPE fd, picoquic_send_datagram_t* datagrams, int nb_datagrams)
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+{
+    struct mmsghdr msgs[PICOQUIC_SEND_BATCH_MAX];
+    struct iovec data_bufs[PICOQUIC_SEND_BATCH_MAX];
+    char cmsg_buffers[PICOQUIC_SEND_BATCH_MAX][PICOQUIC_SEND_CMSG_SIZE];
+    int nb_sent = 0;
+    int nb_done = 0;
+
+    while (nb_done < nb_datagrams) {
+        int nb_batch = nb_datagrams - nb_done;
+        int ret_send;
+
+        if (nb_batch > PICOQUIC_SEND_BATCH_MAX) {
+            nb_batch = PICOQUIC_SEND_BATCH_MAX;
         }
-#endif
 
+        memset(msgs, 0, nb_batch * sizeof(struct mmsghdr));
 
-#endif
+        for (int i = 0; i < nb_batch; i++) {
+            picoquic_send_datagram_t* datagram = &datagrams[nb_done + i];
 
-    }
+            data_bufs[i].iov_base = (char*)datagram->bytes;
+            data_bufs[i].iov_len = datagram->length;
 
-    msg.msg_controllen = control_length;
-    if (control_length == 0) {
-        msg.msg_control = NULL;
+            msgs[i].msg_hdr.msg_name = (struct sockaddr*)&datagram->addr_to;
+            msgs[i].msg_hdr.msg_namelen = datagram->addr_to_len;
+            msgs[i].msg_hdr.msg_iov = &data_bufs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = (void*)cmsg_buffers[i];
+            msgs[i].msg_hdr.msg_controllen = PICOQUIC_SEND_CMSG_SIZE;
+
+            picoquic_set_send_cmsg(&msgs[i].msg_hdr, (struct sockaddr*)&datagram->addr_from,
+                datagram->addr_from_len, datagram->if_index, (int)datagram->length, 0);
+        }
+
+        ret_send = sendmmsg(fd, msgs, nb_batch, 0);
+
+        if (ret_send <= 0) {
+            /* sendmmsg stops at the first datagram that fails, skip it */
+            DBG_PRINTF("Could not send datagram %d of %d, error %d\n", nb_done, nb_datagrams, errno);
+            nb_done++;
+        }
+        else {
+            nb_sent += ret_send;
+            nb_done += ret_send;
+        }
     }
 
-    bytes_sent = sendmsg(fd, &msg, 0);
+    return (nb_sent == 0 && nb_datagrams > 0) ? -1 : nb_sent;
+}
+#else
+{
+    int nb_sent = 0;
 
-    return bytes_sent;
+    for (int i = 0; i < nb_datagrams; i++) {
+        if (picoquic_sendmsg(fd, (struct sockaddr*)&datagrams[i].addr_to, datagrams[i].addr_to_len,
+            (struct sockaddr*)&datagrams[i].addr_from, datagrams[i].addr_from_len, datagrams[i].if_index,
+            (const char*)datagrams[i].bytes, (int)datagrams[i].length, 0) <= 0) {
+            DBG_PRINTF("Could not send datagram %d of %d\n", i, nb_datagrams);
+        }
+        else {
+            nb_sent++;
+        }
+    }
+
+    return (nb_sent == 0 && nb_datagrams > 0) ? -1 : nb_sent;
 }
 #endif
 
-int picoquic_select(SOCKET_TYPE* sockets,
-    int nb_sockets,
-    struct sockaddr_storage* addr_from,
-    socklen_t* from_length,
-    struct sockaddr_storage* addr_dest,
-    socklen_t* dest_length,
-    unsigned long* dest_if,
-    unsigned char * received_ecn,
-    uint8_t* buffer, int buffer_max,
-    int64_t delta_t,
-    uint64_t* current_time)
+/* Wait until one of the sockets is readable, or the delay expires */
+static int picoquic_select_readable(SOCKET_TYPE* sockets, int nb_sockets, int64_t delta_t, fd_set* readfds)
 {
-    fd_set readfds;
     struct timeval tv;
-    int ret_select = 0;
-    int bytes_recv = 0;
     int sockmax = 0;
 
-    if (received_ecn != NULL) {
-        *received_ecn = 0;
-    }
-
-    FD_ZERO(&readfds);
+    FD_ZERO(readfds);
 
     for (int i = 0; i < nb_sockets; i++) {
         if (sockmax < (int)sockets[i]) {
             sockmax = (int)sockets[i];
         }
-        FD_SET(sockets[i], &readfds);
+        FD_SET(sockets[i], readfds);
     }
 
     if (delta_t <= 0) {
@@ -875,7 +1178,30 @@ int picoquic_select(SOCKET_TYPE* sockets,
         }
     }
 
-    ret_select = select(sockmax + 1, &readfds, NULL, NULL, &tv);
+    return select(sockmax + 1, readfds, NULL, NULL, &tv);
+}
+
+int picoquic_select(SOCKET_TYPE* sockets,
+    int nb_sockets,
+    struct sockaddr_storage* addr_from,
+    socklen_t* from_length,
+    struct sockaddr_storage* addr_dest,
+    socklen_t* dest_length,
+    unsigned long* dest_if,
+    unsigned char * received_ecn,
+    uint8_t* buffer, int buffer_max,
+    int64_t delta_t,
+    uint64_t* current_time)
+{
+    fd_set readfds;
+    int ret_select = 0;
+    int bytes_recv = 0;
+
+    if (received_ecn != NULL) {
+        *received_ecn = 0;
+    }
+
+    ret_select = picoquic_select_readable(sockets, nb_sockets, delta_t, &readfds);
 
     if (ret_select < 0) {
         bytes_recv = -1;
@@ -885,7 +1211,7 @@ int picoquic_select(SOCKET_TYPE* sockets,
             if (FD_ISSET(sockets[i], &readfds)) {
                 bytes_recv = picoquic_recvmsg(sockets[i], addr_from, from_length,
                     addr_dest, dest_length, dest_if, received_ecn,
-                    buffer, buffer_max);
+                    buffer, buffer_max, NULL);
 
                 if (bytes_recv <= 0) {
 #ifdef _WINDOWS
@@ -912,6 +1238,58 @@ int picoquic_select(SOCKET_TYPE* sockets,
     return bytes_recv;
 }
 
+/* Wait for the sockets to be readable, then receive up to nb_datagrams
+ * datagrams from the readable sockets. Returns the number of datagrams
+ * received, which is 0 if the delay expired, or -1 on error. */
+int picoquic_select_batch(SOCKET_TYPE* sockets,
+    int nb_sockets,
+    picoquic_recv_datagram_t* datagrams,
+    int nb_datagrams,
+    int64_t delta_t,
+    uint64_t* current_time)
+{
+    fd_set readfds;
+    int ret_select = 0;
+    int nb_received = 0;
+
+    ret_select = picoquic_select_readable(sockets, nb_sockets, delta_t, &readfds);
+
+    if (ret_select < 0) {
+        nb_received = -1;
+        DBG_PRINTF("Error: select returns %d\n", ret_select);
+    } else if (ret_select > 0) {
+        for (int i = 0; i < nb_sockets && nb_received < nb_datagrams; i++) {
+            if (FD_ISSET(sockets[i], &readfds)) {
+                int nb_batch = picoquic_recvmsg_batch(sockets[i], datagrams + nb_received,
+                    nb_datagrams - nb_received);
+
+                if (nb_batch < 0) {
+#ifdef _WINDOWS
+                    int last_error = WSAGetLastError();
+
+                    if (last_error == WSAECONNRESET || last_error == WSAEMSGSIZE) {
+                        continue;
+                    }
+#endif
+                    DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
+                        i, (int)sockets[i]);
+
+                    if (nb_received == 0) {
+                        nb_received = -1;
+                    }
+                    break;
+                } else {
+                    nb_received += nb_batch;
+                }
+            }
+        }
+    }
+
+    *current_time = picoquic_current_time();
+
+    return nb_received;
+}
+
 int picoquic_send_through_server_sockets(
     picoquic_server_sockets_t* sockets,
     struct sockaddr* addr_dest, socklen_t dest_length,
@@ -922,7 +1300,7 @@ int picoquic_send_through_server_sockets(
     int socket_index = (addr_dest->sa_family == AF_INET) ? 1 : 0;
 
     int sent = picoquic_sendmsg(sockets->s_socket[socket_index], addr_dest, dest_length,
-        addr_from, from_length, from_if, bytes, length);
+        addr_from, from_length, from_if, bytes, length, 0);
 
 #ifndef DISABLE_DEBUG_PRINTF
     if (sent <= 0) {
@@ -941,6 +1319,47 @@ int picoquic_send_through_server_sockets(
     return sent;
 }
 
+int picoquic_send_batch_through_server_sockets(
+    picoquic_server_sockets_t* sockets,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams)
+{
+    int nb_sent = 0;
+    int nb_done = 0;
+
+    /* Consecutive datagrams of the same address family share a system call.
+     * Datagrams that cannot be sent are dropped, and the next runs are
+     * still sent. */
+    while (nb_done < nb_datagrams) {
+        int socket_index = (datagrams[nb_done].addr_to.ss_family == AF_INET) ? 1 : 0;
+        int nb_batch = 1;
+        int sent;
+
+        while (nb_done + nb_batch < nb_datagrams &&
+            datagrams[nb_done + nb_batch].addr_to.ss_family == datagrams[nb_done].addr_to.ss_family) {
+            nb_batch++;
+        }
+
+        sent = picoquic_sendmsg_batch(sockets->s_socket[socket_index], datagrams + nb_done, nb_batch);
+
+        if (sent < nb_batch) {
+#ifndef DISABLE_DEBUG_PRINTF
+#ifdef _WINDOWS
+            int last_error = WSAGetLastError();
+#else
+            int last_error = errno;
+#endif
+            DBG_PRINTF("Could only send %d packets out of %d on UDP socket[%d]= %d!\n",
+                (sent < 0) ? 0 : sent, nb_batch, socket_index, last_error);
+#endif
+        }
+
+        nb_sent += (sent < 0) ? 0 : sent;
+        nb_done += nb_batch;
+    }
+
+    return nb_sent;
+}
+
 int picoquic_get_server_address(const char* ip_address_text, int server_port,
     struct sockaddr_storage* server_address,
     int* server_addr_length,
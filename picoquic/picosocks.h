@@ -85,6 +85,7 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/select.h>
 
 #ifndef SOCKET_TYPE
@@ -118,10 +119,75 @@ SOCKET_TYPE picoquic_open_client_socket(int af);
 
 int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port);
 
+/* Open server sockets that share the port with other sockets opened the same way,
+ * using SO_REUSEPORT. Fails on systems that do not support it. */
+int picoquic_open_shared_server_sockets(picoquic_server_sockets_t* sockets, int port);
+
 void picoquic_close_server_sockets(picoquic_server_sockets_t* sockets);
 
 int picoquic_socket_set_ecn_options(SOCKET_TYPE sd, int af, int * recv_set, int * send_set);
 
+int picoquic_socket_set_gro(SOCKET_TYPE sd);
+
+/* Receive a message. If UDP_GRO is set on the socket, the message may hold several
+ * datagrams, and recv_msg_size is set to the size of each except the last. Otherwise,
+ * recv_msg_size is set to 0. recv_msg_size can be NULL. */
+int picoquic_recvmsg(SOCKET_TYPE fd,
+    struct sockaddr_storage* addr_from,
+    socklen_t* from_length,
+    struct sockaddr_storage* addr_dest,
+    socklen_t* dest_length,
+    unsigned long* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max,
+    size_t* recv_msg_size);
+
+/* Batch receive. The caller sets the buffer and buffer size of each
+ * datagram, the other fields are filled when a datagram is received.
+ * If UDP_GRO is set on the socket, a buffer may hold several datagrams
+ * of segment_size bytes, the last one possibly shorter. Otherwise,
+ * segment_size is 0. */
+#define PICOQUIC_RECV_BATCH_MAX 64
+#define PICOQUIC_RECV_CMSG_SIZE 128
+
+typedef struct st_picoquic_recv_datagram_t {
+    uint8_t* buffer;
+    int buffer_max;
+    int length;
+    struct sockaddr_storage addr_from;
+    socklen_t from_length;
+    struct sockaddr_storage addr_dest;
+    socklen_t dest_length;
+    unsigned long dest_if;
+    unsigned char received_ecn;
+    size_t segment_size;
+} picoquic_recv_datagram_t;
+
+int picoquic_recvmsg_batch(SOCKET_TYPE fd, picoquic_recv_datagram_t* datagrams, int nb_datagrams);
+
+#ifndef _WINDOWS
+/* Control information of messages, shared with the I/O backends that
+ * post their own messages to the kernel. */
+void picoquic_parse_recv_cmsg(struct msghdr* msg,
+    struct sockaddr_storage* addr_dest,
+    socklen_t* dest_length,
+    unsigned long* dest_if,
+    unsigned char* received_ecn,
+    size_t* recv_msg_size);
+
+void picoquic_set_send_cmsg(struct msghdr* msg,
+    struct sockaddr* addr_from,
+    socklen_t from_length,
+    unsigned long dest_if,
+    int length,
+    size_t send_msg_size);
+#endif
+
+int picoquic_select_batch(SOCKET_TYPE* sockets, int nb_sockets,
+    picoquic_recv_datagram_t* datagrams, int nb_datagrams,
+    int64_t delta_t,
+    uint64_t* current_time);
+
 int picoquic_select(SOCKET_TYPE* sockets, int nb_sockets,
     struct sockaddr_storage* addr_from,
     socklen_t* from_length,
@@ -133,12 +199,35 @@ int picoquic_select(SOCKET_TYPE* sockets, int nb_sockets,
     int64_t delta_t,
     uint64_t* current_time);
 
+/* Send a message. If send_msg_size is not 0 and the message is longer, the message
+ * is sent as a series of datagrams of send_msg_size bytes, the last one possibly
+ * shorter. On Linux, the kernel segments the message (UDP_SEGMENT). Otherwise, or if
+ * the kernel does not support it, the segments are sent one at a time. */
+int picoquic_sendmsg(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    socklen_t dest_length,
+    struct sockaddr* addr_from,
+    socklen_t from_length,
+    unsigned long dest_if,
+    const char* bytes, int length,
+    size_t send_msg_size);
+
 int picoquic_send_through_server_sockets(
     picoquic_server_sockets_t* sockets,
     struct sockaddr* addr_dest, socklen_t addr_length,
     struct sockaddr* addr_from, socklen_t from_length, unsigned long from_if,
     const char* bytes, int length);
 
+/* Batch send, using the datagrams filled by picoquic_prepare_packets */
+#define PICOQUIC_SEND_BATCH_MAX 64
+#define PICOQUIC_SEND_CMSG_SIZE 128
+
+int picoquic_sendmsg_batch(SOCKET_TYPE fd, picoquic_send_datagram_t* datagrams, int nb_datagrams);
+
+int picoquic_send_batch_through_server_sockets(
+    picoquic_server_sockets_t* sockets,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams);
+
 int picoquic_get_server_address(const char* ip_address_text, int server_port,
     struct sockaddr_storage* server_address,
     int* server_addr_length,
@@ -97,6 +97,42 @@ picosplay_tree* picosplay_new_tree(picosplay_comparator comp) {
     return new;
 }
 
+/* Generic BST insertion of a node, followed by splaying the tree.
+ * Nodes with equal values are inserted after the existing ones, so
+ * that the in-order traversal is stable.
+ */
+static void picosplay_link_node(picosplay_tree *tree, picosplay_node *new) {
+    new->left = NULL;
+    new->right = NULL;
+    if (tree->root == NULL) {
+        tree->root = new;
+        new->parent = NULL;
+    }
+    else {
+        picosplay_node *curr = tree->root;
+        picosplay_node *parent = NULL;
+        int left = 0;
+        while (curr != NULL) {
+            parent = curr;
+            if (tree->comp(new->value, curr->value) < 0) {
+                left = 1;
+                curr = curr->left;
+            }
+            else {
+                left = 0;
+                curr = curr->right;
+            }
+        }
+        new->parent = parent;
+        if (left)
+            parent->left = new;
+        else
+            parent->right = new;
+    }
+    splay(tree, new);
+    tree->size++;
+}
+
 /* picosplay_insert and return a new node with the given value, splaying the tree. 
  * The insertion is essentially a generic BST insertion.
  */
@@ -105,46 +141,29 @@ picosplay_node* picosplay_insert(picosplay_tree *tree, void *value) {
 
     if (new != NULL) {
         new->value = value;
-        new->left = NULL;
-        new->right = NULL;
-        if (tree->root == NULL) {
-            tree->root = new;
-            new->parent = NULL;
-        }
-        else {
-            picosplay_node *curr = tree->root;
-            picosplay_node *parent = NULL;
-            int left = 0;
-            while (curr != NULL) {
-                parent = curr;
-                if (tree->comp(new->value, curr->value) < 0) {
-                    left = 1;
-                    curr = curr->left;
-                }
-                else {
-                    left = 0;
-                    curr = curr->right;
-                }
-            }
-            new->parent = parent;
-            if (left)
-                parent->left = new;
-            else
-                parent->right = new;
-        }
-        splay(tree, new);
-        tree->size++;
+        picosplay_link_node(tree, new);
     }
 
     return new;
 }
 
-/* Find a node with the given value, splaying the tree. */
+/* Insert a node provided by the caller, typically embedded in the value
+ * itself. No memory is allocated, so this cannot fail. */
+void picosplay_insert_node(picosplay_tree *tree, picosplay_node *node, void *value) {
+    node->value = value;
+    picosplay_link_node(tree, node);
+}
+
+/* Find a node with the given value, splaying the tree. If the value is
+ * not found, the last node visited is splayed instead, so that repeated
+ * misses do not keep paying the full depth of the tree. */
 picosplay_node* picosplay_find(picosplay_tree *tree, void *value) {
     picosplay_node *curr = tree->root;
+    picosplay_node *last = NULL;
     int found = 0;
     while(curr != NULL && !found) {
         int relation = tree->comp(value, curr->value);
+        last = curr;
         if(relation == 0) {
             found = 1;
         } else if(relation < 0) {
@@ -154,24 +173,43 @@ picosplay_node* picosplay_find(picosplay_tree *tree, void *value) {
         }
     }
 
-    /* TODO: there may or may not be a need to perform a splay on a find operation.
-     * The Wikipedia example omits it, but this code keeps it. We should
-     * perform measurements with and without it and keep the best alternative. */
-    if(curr != NULL)
-        splay(tree, curr);
+    if(last != NULL)
+        splay(tree, last);
     return curr;
 }
 
+/* Find the node with the largest value lower than or equal to the given
+ * value, splaying the tree. Returns NULL if all values are larger. */
+picosplay_node* picosplay_find_previous(picosplay_tree *tree, void *value) {
+    picosplay_node *curr = tree->root;
+    picosplay_node *previous = NULL;
+
+    while (curr != NULL) {
+        int relation = tree->comp(value, curr->value);
+        if (relation == 0) {
+            previous = curr;
+            break;
+        } else if (relation < 0) {
+            curr = curr->left;
+        } else {
+            previous = curr;
+            curr = curr->right;
+        }
+    }
+
+    if (previous != NULL)
+        splay(tree, previous);
+    return previous;
+}
+
 /* Remove a node with the given value, splaying the tree. */
 void picosplay_delete(picosplay_tree *tree, void *value) {
     picosplay_node *node = picosplay_find(tree, value);
     picosplay_delete_hint(tree, node);
 }
 
-/* Remove the node given by the pointer, splaying the tree. */
-void picosplay_delete_hint(picosplay_tree *tree, picosplay_node *node) {
-    if(node == NULL)
-        return;
+/* Detach the node from the tree, splaying the tree. The node is not freed. */
+static void picosplay_unlink_node(picosplay_tree *tree, picosplay_node *node) {
     splay(tree, node); /* Now node is tree's root. */
     if(node->left == NULL) {
         tree->root = node->right;
@@ -194,10 +232,28 @@ void picosplay_delete_hint(picosplay_tree *tree, picosplay_node *node) {
         x->left = node->left;
         x->left->parent = x;
     }
-    free(node);
+    node->parent = NULL;
+    node->left = NULL;
+    node->right = NULL;
     tree->size--;
 }
 
+/* Remove the node given by the pointer, splaying the tree. */
+void picosplay_delete_hint(picosplay_tree *tree, picosplay_node *node) {
+    if(node == NULL)
+        return;
+    picosplay_unlink_node(tree, node);
+    free(node);
+}
+
+/* Remove a node that was inserted with picosplay_insert_node. The node
+ * memory belongs to the caller and is not freed. */
+void picosplay_remove_node(picosplay_tree *tree, picosplay_node *node) {
+    if (node == NULL)
+        return;
+    picosplay_unlink_node(tree, node);
+}
+
 void picosplay_empty_tree(picosplay_tree * tree)
 {
     if (tree != NULL) {
@@ -207,8 +263,14 @@ void picosplay_empty_tree(picosplay_tree * tree)
     }
 }
 
+/* Return the smallest node, splaying it to the root. Without the splay,
+ * values inserted in increasing order would leave a left chain, and each
+ * call would walk the whole tree. */
 picosplay_node* picosplay_first(picosplay_tree *tree) {
-    return leftmost(tree->root);
+    picosplay_node *first = leftmost(tree->root);
+    if(first != NULL)
+        splay(tree, first);
+    return first;
 }
 
 /* Return the minimal node that is bigger than the given.
@@ -224,8 +286,12 @@ picosplay_node* picosplay_next(picosplay_node *node) {
     return node->parent;
 }
 
+/* Return the largest node, splaying it to the root. */
 picosplay_node* picosplay_last(picosplay_tree *tree) {
-    return rightmost(tree->root);
+    picosplay_node *last = rightmost(tree->root);
+    if(last != NULL)
+        splay(tree, last);
+    return last;
 }
 
 #if 0
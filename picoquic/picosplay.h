@@ -25,6 +25,10 @@
 #ifndef PICOSPLAY_H
 #define PICOSPLAY_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef int (*picosplay_comparator)(void *left, void *right);
 
 typedef struct picosplay_node {
@@ -41,7 +45,9 @@ typedef struct picosplay_tree {
 void picosplay_init_tree(picosplay_tree* tree, picosplay_comparator comp);
 picosplay_tree* picosplay_new_tree(picosplay_comparator comp);
 picosplay_node* picosplay_insert(picosplay_tree *tree, void *value);
+void picosplay_insert_node(picosplay_tree *tree, picosplay_node *node, void *value);
 picosplay_node* picosplay_find(picosplay_tree *tree, void *value);
+picosplay_node* picosplay_find_previous(picosplay_tree *tree, void *value);
 picosplay_node* picosplay_first(picosplay_tree *tree);
 picosplay_node* picosplay_next(picosplay_node *node);
 picosplay_node* picosplay_last(picosplay_tree *tree);
@@ -52,6 +58,11 @@ void* picosplay_contents(picosplay_tree *tree);
 #endif
 void picosplay_delete(picosplay_tree *tree, void *value);
 void picosplay_delete_hint(picosplay_tree *tree, picosplay_node *node);
+void picosplay_remove_node(picosplay_tree *tree, picosplay_node *node);
 void picosplay_empty_tree(picosplay_tree *tree);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PICOSPLAY_H */
@@ -0,0 +1,228 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _WINDOWS
+#include <pthread.h>
+#endif
+#include <stdlib.h>
+#include "picothread.h"
+
+/* The thread functions of the system have different signatures, so the
+ * thread starts with a wrapper, which finds the function and its argument
+ * in the thread structure */
+struct st_picoquic_thread_t {
+#ifdef _WINDOWS
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    picoquic_thread_fn thread_fn;
+    void* arg;
+};
+
+#ifdef _WINDOWS
+static DWORD WINAPI picoquic_thread_start(LPVOID param)
+#else
+static void* picoquic_thread_start(void* param)
+#endif
+{
+    picoquic_thread_t thread = (picoquic_thread_t)param;
+
+    thread->thread_fn(thread->arg);
+
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int picoquic_create_thread(picoquic_thread_t* thread, picoquic_thread_fn thread_fn, void* arg)
+{
+    int ret = 0;
+
+    *thread = (picoquic_thread_t)malloc(sizeof(struct st_picoquic_thread_t));
+
+    if (*thread == NULL) {
+        ret = -1;
+    }
+    else {
+        (*thread)->thread_fn = thread_fn;
+        (*thread)->arg = arg;
+#ifdef _WINDOWS
+        (*thread)->handle = CreateThread(NULL, 0, picoquic_thread_start, *thread, 0, NULL);
+        if ((*thread)->handle == NULL) {
+            ret = -1;
+        }
+#else
+        if (pthread_create(&(*thread)->handle, NULL, picoquic_thread_start, *thread) != 0) {
+            ret = -1;
+        }
+#endif
+        if (ret != 0) {
+            free(*thread);
+            *thread = NULL;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_join_thread(picoquic_thread_t thread)
+{
+#ifdef _WINDOWS
+    (void)WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    (void)pthread_join(thread->handle, NULL);
+#endif
+    free(thread);
+}
+
+struct st_picoquic_signal_t {
+#ifdef _WINDOWS
+    HANDLE event;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int is_set;
+#endif
+};
+
+int picoquic_create_signal(picoquic_signal_t* signal)
+{
+    int ret = 0;
+
+    *signal = (picoquic_signal_t)malloc(sizeof(struct st_picoquic_signal_t));
+
+    if (*signal == NULL) {
+        ret = -1;
+    }
+    else {
+#ifdef _WINDOWS
+        /* Auto reset event */
+        (*signal)->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if ((*signal)->event == NULL) {
+            ret = -1;
+        }
+#else
+        (*signal)->is_set = 0;
+        if (pthread_mutex_init(&(*signal)->mutex, NULL) != 0) {
+            ret = -1;
+        }
+        else if (pthread_cond_init(&(*signal)->cond, NULL) != 0) {
+            (void)pthread_mutex_destroy(&(*signal)->mutex);
+            ret = -1;
+        }
+#endif
+        if (ret != 0) {
+            free(*signal);
+            *signal = NULL;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_delete_signal(picoquic_signal_t signal)
+{
+#ifdef _WINDOWS
+    CloseHandle(signal->event);
+#else
+    (void)pthread_cond_destroy(&signal->cond);
+    (void)pthread_mutex_destroy(&signal->mutex);
+#endif
+    free(signal);
+}
+
+void picoquic_set_signal(picoquic_signal_t signal)
+{
+#ifdef _WINDOWS
+    (void)SetEvent(signal->event);
+#else
+    (void)pthread_mutex_lock(&signal->mutex);
+    signal->is_set = 1;
+    (void)pthread_cond_signal(&signal->cond);
+    (void)pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+void picoquic_wait_signal(picoquic_signal_t signal)
+{
+#ifdef _WINDOWS
+    (void)WaitForSingleObject(signal->event, INFINITE);
+#else
+    (void)pthread_mutex_lock(&signal->mutex);
+    while (!signal->is_set) {
+        (void)pthread_cond_wait(&signal->cond, &signal->mutex);
+    }
+    signal->is_set = 0;
+    (void)pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+void picoquic_mpsc_init(picoquic_mpsc_queue_t* queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void picoquic_mpsc_push(picoquic_mpsc_queue_t* queue, picoquic_mpsc_node_t* node)
+{
+    picoquic_mpsc_node_t* prev;
+
+    node->next = NULL;
+    prev = picoquic_atomic_exchange_ptr(&queue->head, node);
+    picoquic_atomic_store(&prev->next, node);
+}
+
+picoquic_mpsc_node_t* picoquic_mpsc_pop(picoquic_mpsc_queue_t* queue)
+{
+    picoquic_mpsc_node_t* tail = queue->tail;
+    picoquic_mpsc_node_t* next = picoquic_atomic_load(&tail->next);
+    picoquic_mpsc_node_t* node = NULL;
+
+    /* Skip the stub, which is only there to keep the queue linked when empty */
+    if (tail == &queue->stub) {
+        if (next != NULL) {
+            queue->tail = next;
+            tail = next;
+            next = picoquic_atomic_load(&tail->next);
+        }
+    }
+
+    if (tail != &queue->stub) {
+        if (next == NULL && tail == picoquic_atomic_load(&queue->head)) {
+            /* Last node: put the stub back behind it, so that it can be removed */
+            picoquic_mpsc_push(queue, &queue->stub);
+            next = picoquic_atomic_load(&tail->next);
+        }
+
+        /* If next is still NULL, a producer has not yet linked its node */
+        if (next != NULL) {
+            queue->tail = next;
+            node = tail;
+        }
+    }
+
+    return node;
+}
@@ -0,0 +1,119 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOTHREAD_H
+#define PICOTHREAD_H
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Threads and atomic operations, used by the servers that run one QUIC
+ * context per thread. A QUIC context is only ever used by one thread; the
+ * threads exchange data through lock free queues.
+ */
+
+#ifdef _WINDOWS
+#define PICOQUIC_THREAD_LOCAL __declspec(thread)
+#define picoquic_atomic_exchange_ptr(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (PVOID)(v))
+#define picoquic_atomic_exchange_int(p, v) InterlockedExchange((LONG volatile*)(p), (LONG)(v))
+/* Volatile accesses have acquire and release semantics with the Microsoft compilers */
+#define picoquic_atomic_load(p) (*(p))
+#define picoquic_atomic_store(p, v) (*(p) = (v))
+#define picoquic_atomic_add(p, v) InterlockedExchangeAdd64((LONG64 volatile*)(p), (LONG64)(v))
+#define picoquic_atomic_increment(p) InterlockedIncrement((LONG volatile*)(p))
+#define picoquic_atomic_decrement(p) InterlockedDecrement((LONG volatile*)(p))
+#else
+#define PICOQUIC_THREAD_LOCAL __thread
+#define picoquic_atomic_exchange_ptr(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define picoquic_atomic_exchange_int(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define picoquic_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define picoquic_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define picoquic_atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+/* Increment and decrement of an int, returning the new value */
+#define picoquic_atomic_increment(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define picoquic_atomic_decrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#endif
+
+typedef void (*picoquic_thread_fn)(void* arg);
+
+typedef struct st_picoquic_thread_t* picoquic_thread_t;
+
+/* Start a thread running thread_fn(arg). Returns 0 on success. */
+int picoquic_create_thread(picoquic_thread_t* thread, picoquic_thread_fn thread_fn, void* arg);
+
+/* Wait until the thread returns, and free it */
+void picoquic_join_thread(picoquic_thread_t thread);
+
+/*
+ * Signal on which one thread sleeps until another sets it. The signal resets
+ * when the waiting thread wakes up; setting it again before that has no
+ * further effect, and setting it while no thread waits makes the next wait
+ * return immediately.
+ */
+typedef struct st_picoquic_signal_t* picoquic_signal_t;
+
+int picoquic_create_signal(picoquic_signal_t* signal);
+void picoquic_delete_signal(picoquic_signal_t signal);
+void picoquic_set_signal(picoquic_signal_t signal);
+void picoquic_wait_signal(picoquic_signal_t signal);
+
+/*
+ * Intrusive multiple producers, single consumer queue, after the design of
+ * Dmitry Vyukov. Any thread can push without locking, with a single atomic
+ * exchange; only the thread that owns the queue pops. The nodes are embedded
+ * at the start of the structures that are queued.
+ *
+ * A push is only complete when it has linked the new node, which happens just
+ * after the exchange. A pop that runs between the two steps returns NULL even
+ * though the queue is not empty. Producers shall thus signal the consumer after
+ * the push returns, so that the consumer checks the queue again.
+ */
+
+typedef struct st_picoquic_mpsc_node_t {
+    struct st_picoquic_mpsc_node_t* volatile next;
+} picoquic_mpsc_node_t;
+
+typedef struct st_picoquic_mpsc_queue_t {
+    picoquic_mpsc_node_t* volatile head;
+    picoquic_mpsc_node_t* tail;
+    picoquic_mpsc_node_t stub;
+} picoquic_mpsc_queue_t;
+
+void picoquic_mpsc_init(picoquic_mpsc_queue_t* queue);
+
+/* Add a node to the queue. Can be called by any thread. */
+void picoquic_mpsc_push(picoquic_mpsc_queue_t* queue, picoquic_mpsc_node_t* node);
+
+/* Remove the oldest node from the queue, or return NULL if the queue is empty.
+ * Can only be called by the thread that owns the queue. */
+picoquic_mpsc_node_t* picoquic_mpsc_pop(picoquic_mpsc_queue_t* queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOTHREAD_H */
@@ -0,0 +1,758 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _WINDOWS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+#include "picouring.h"
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* Multishot recvmsg and single issuer rings both appeared in Linux 6.0 */
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SINGLE_ISSUER)
+#define PICOQUIC_WITH_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef PICOQUIC_WITH_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define PICOQUIC_URING_SQ_ENTRIES 256
+#define PICOQUIC_URING_SEND_SLOTS 128
+#define PICOQUIC_URING_MAX_SOCKETS 4
+#define PICOQUIC_URING_BUFFER_GROUP 0
+#define PICOQUIC_URING_MAX_BUFFERS 0x8000
+
+/* The user data of each request holds its type and an index */
+#define PICOQUIC_URING_TAG_RECV 1
+#define PICOQUIC_URING_TAG_SEND 2
+#define PICOQUIC_URING_TAG_TIMEOUT 3
+#define PICOQUIC_URING_TAG_OTHER 4
+#define PICOQUIC_URING_TAG_WAKEUP 5
+#define PICOQUIC_URING_USER_DATA(tag, index) (((uint64_t)(tag) << 32) | (uint32_t)(index))
+
+typedef enum {
+    picoquic_uring_recv_free = 0,
+    picoquic_uring_recv_armed,
+    picoquic_uring_recv_stopped,
+    picoquic_uring_recv_cancelled
+} picoquic_uring_recv_state_enum;
+
+typedef struct st_picoquic_uring_send_slot_t {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr_to;
+    char cmsg[PICOQUIC_SEND_CMSG_SIZE];
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_uring_send_slot_t;
+
+struct st_picoquic_uring_t {
+    int ring_fd;
+    /* Submission queue, shared with the kernel */
+    uint8_t* sq_map;
+    size_t sq_map_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail;
+    unsigned sq_nb_pending;
+    /* Completion queue, shared with the kernel */
+    uint8_t* cq_map;
+    size_t cq_map_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    /* Provided buffers, and the buffers received but not yet delivered or released */
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    uint8_t* buffers;
+    int nb_buffers;
+    int buffer_size;
+    uint16_t buf_tail;
+    uint16_t* stash;
+    int stash_first;
+    int stash_count;
+    uint16_t* delivered;
+    int nb_delivered;
+    /* Sockets, each with a multishot receive */
+    SOCKET_TYPE s_socket[PICOQUIC_URING_MAX_SOCKETS];
+    picoquic_uring_recv_state_enum recv_state[PICOQUIC_URING_MAX_SOCKETS];
+    struct msghdr recv_msg;
+    /* Send slots */
+    picoquic_uring_send_slot_t* slots;
+    int free_slots[PICOQUIC_URING_SEND_SLOTS];
+    int nb_free_slots;
+    /* Wake up timeout */
+    struct __kernel_timespec timeout;
+    uint64_t timer_wake_time;
+    int timer_pending;
+    /* Event fd polled to wake up the wait */
+    int wake_fd;
+    int wake_armed;
+};
+
+/* Submit the pending requests. If get_events is set, also process the
+ * completions, waiting for at least min_complete of them. */
+static int picoquic_uring_submit(picoquic_uring_t* ring, unsigned min_complete, int get_events)
+{
+    int ret = 0;
+    int nb_submitted;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    nb_submitted = (int)syscall(__NR_io_uring_enter, ring->ring_fd, ring->sq_nb_pending, min_complete,
+        (get_events) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (nb_submitted >= 0) {
+        ring->sq_nb_pending -= nb_submitted;
+    }
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        DBG_PRINTF("io_uring_enter fails, error %d\n", errno);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static struct io_uring_sqe* picoquic_uring_get_sqe(picoquic_uring_t* ring)
+{
+    struct io_uring_sqe* sqe = NULL;
+
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        (void)picoquic_uring_submit(ring, 0, 0);
+    }
+
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->sq_entries) {
+        unsigned index = ring->sq_local_tail & ring->sq_mask;
+
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ring->sq_array[index] = index;
+        ring->sq_local_tail++;
+        ring->sq_nb_pending++;
+    }
+
+    return sqe;
+}
+
+/* Add a buffer to the provided ring. The kernel sees it after picoquic_uring_publish_buffers */
+static void picoquic_uring_provide_buffer(picoquic_uring_t* ring, uint16_t bid)
+{
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->nb_buffers - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * ring->buffer_size);
+    buf->len = (uint32_t)ring->buffer_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static void picoquic_uring_publish_buffers(picoquic_uring_t* ring)
+{
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int picoquic_uring_post_recv(picoquic_uring_t* ring, int slot)
+{
+    int ret = 0;
+    struct io_uring_sqe* sqe = picoquic_uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        ret = -1;
+    }
+    else {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = ring->s_socket[slot];
+        sqe->addr = (uint64_t)(uintptr_t)&ring->recv_msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = PICOQUIC_URING_BUFFER_GROUP;
+        sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_RECV, slot);
+        ring->recv_state[slot] = picoquic_uring_recv_armed;
+    }
+
+    return ret;
+}
+
+/* Post a multishot poll of the wake up fd, so that the wait completes when it is signalled */
+static int picoquic_uring_post_wakeup(picoquic_uring_t* ring)
+{
+    int ret = 0;
+    struct io_uring_sqe* sqe = picoquic_uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        ret = -1;
+    }
+    else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = ring->wake_fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_WAKEUP, 0);
+        ring->wake_armed = 1;
+    }
+
+    return ret;
+}
+
+/* Process the completions. Received buffers are stashed until delivered, send
+ * slots are released, and receives that stopped are marked for reposting. */
+static void picoquic_uring_reap(picoquic_uring_t* ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int buffers_released = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        uint32_t tag = (uint32_t)(cqe->user_data >> 32);
+        uint32_t index = (uint32_t)cqe->user_data;
+
+        switch (tag) {
+        case PICOQUIC_URING_TAG_RECV:
+            if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+                uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+                if (cqe->res >= 0 && ring->stash_count < ring->nb_buffers) {
+                    ring->stash[(ring->stash_first + ring->stash_count) % ring->nb_buffers] = bid;
+                    ring->stash_count++;
+                }
+                else {
+                    picoquic_uring_provide_buffer(ring, bid);
+                    buffers_released = 1;
+                }
+            }
+            if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+                if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+                    DBG_PRINTF("Receive on socket %d stops, error %d\n", ring->s_socket[index], -cqe->res);
+                }
+                ring->recv_state[index] = (ring->recv_state[index] == picoquic_uring_recv_cancelled) ?
+                    picoquic_uring_recv_free : picoquic_uring_recv_stopped;
+            }
+            break;
+        case PICOQUIC_URING_TAG_SEND:
+            if (cqe->res < 0) {
+                DBG_PRINTF("Send fails, error %d\n", -cqe->res);
+            }
+            ring->free_slots[ring->nb_free_slots++] = (int)index;
+            break;
+        case PICOQUIC_URING_TAG_TIMEOUT:
+            ring->timer_pending = 0;
+            ring->timer_wake_time = 0;
+            break;
+        case PICOQUIC_URING_TAG_WAKEUP:
+            /* The poll only wakes the wait. The loop reads the fd. */
+            if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+                ring->wake_armed = 0;
+            }
+            break;
+        default:
+            break;
+        }
+        head++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (buffers_released) {
+        picoquic_uring_publish_buffers(ring);
+    }
+}
+
+/* Post the timeout at the wake time, or move the pending one there */
+static void picoquic_uring_set_timer(picoquic_uring_t* ring, int64_t delta_t, uint64_t current_time)
+{
+    uint64_t wake_time = current_time + delta_t;
+
+    if (!ring->timer_pending || wake_time != ring->timer_wake_time) {
+        struct io_uring_sqe* sqe = picoquic_uring_get_sqe(ring);
+
+        if (sqe != NULL) {
+            ring->timeout.tv_sec = delta_t / 1000000;
+            ring->timeout.tv_nsec = (delta_t % 1000000) * 1000;
+
+            if (ring->timer_pending) {
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_TIMEOUT, 0);
+                sqe->off = (uint64_t)(uintptr_t)&ring->timeout;
+                sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+                sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_OTHER, 0);
+            }
+            else {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+                sqe->len = 1;
+                sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_TIMEOUT, 0);
+                ring->timer_pending = 1;
+            }
+            ring->timer_wake_time = wake_time;
+        }
+    }
+}
+
+/* Fill a datagram from a received buffer, laid out as a recvmsg_out header
+ * followed by the name, the control data and the payload. */
+static void picoquic_uring_get_datagram(picoquic_uring_t* ring, uint16_t bid, picoquic_recv_datagram_t* datagram)
+{
+    uint8_t* buf = ring->buffers + (size_t)bid * ring->buffer_size;
+    struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+    uint8_t* name = buf + sizeof(struct io_uring_recvmsg_out);
+    uint8_t* control = name + ring->recv_msg.msg_namelen;
+    uint8_t* payload = control + ring->recv_msg.msg_controllen;
+    struct msghdr msg;
+
+    datagram->from_length = (out->namelen < ring->recv_msg.msg_namelen) ? out->namelen : ring->recv_msg.msg_namelen;
+    memcpy(&datagram->addr_from, name, datagram->from_length);
+    datagram->buffer = payload;
+    datagram->buffer_max = (int)(ring->buffer_size - (payload - buf));
+    datagram->length = ((int)out->payloadlen < datagram->buffer_max) ? (int)out->payloadlen : datagram->buffer_max;
+    datagram->dest_length = 0;
+    datagram->dest_if = 0;
+    datagram->received_ecn = 0;
+    datagram->segment_size = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = (out->controllen < ring->recv_msg.msg_controllen) ? out->controllen : ring->recv_msg.msg_controllen;
+    picoquic_parse_recv_cmsg(&msg, &datagram->addr_dest, &datagram->dest_length,
+        &datagram->dest_if, &datagram->received_ecn, &datagram->segment_size);
+}
+
+picoquic_uring_t* picoquic_uring_create(int nb_buffers, int buffer_size)
+{
+    picoquic_uring_t* ring = (picoquic_uring_t*)malloc(sizeof(picoquic_uring_t));
+    struct io_uring_params params;
+    int ret = 0;
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(picoquic_uring_t));
+    ring->ring_fd = -1;
+    ring->wake_fd = -1;
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->buf_ring = MAP_FAILED;
+
+    /* The buffer ring size is a power of 2, and buffer ids are 16 bits */
+    ring->nb_buffers = 16;
+    while (ring->nb_buffers < nb_buffers && ring->nb_buffers < PICOQUIC_URING_MAX_BUFFERS) {
+        ring->nb_buffers *= 2;
+    }
+    ring->buffer_size = (int)(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +
+        PICOQUIC_RECV_CMSG_SIZE) + buffer_size;
+    ring->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    ring->recv_msg.msg_controllen = PICOQUIC_RECV_CMSG_SIZE;
+
+    /* Size the completion queue for all the receive, send and timeout requests in flight */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * (ring->nb_buffers + PICOQUIC_URING_SEND_SLOTS + PICOQUIC_URING_SQ_ENTRIES);
+
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, PICOQUIC_URING_SQ_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        DBG_PRINTF("Cannot create io_uring, error %d\n", errno);
+        ret = -1;
+    }
+    else {
+        ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 && ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+
+        ring->sq_map = (uint8_t*)mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->ring_fd, IORING_OFF_SQ_RING);
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+            ring->cq_map = ring->sq_map;
+        }
+        else {
+            ring->cq_map = (uint8_t*)mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->ring_fd, IORING_OFF_CQ_RING);
+        }
+        ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->ring_fd, IORING_OFF_SQES);
+
+        if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+            DBG_PRINTF("Cannot map io_uring, error %d\n", errno);
+            ret = -1;
+        }
+        else {
+            ring->sq_head = (unsigned*)(ring->sq_map + params.sq_off.head);
+            ring->sq_tail = (unsigned*)(ring->sq_map + params.sq_off.tail);
+            ring->sq_mask = *(unsigned*)(ring->sq_map + params.sq_off.ring_mask);
+            ring->sq_entries = *(unsigned*)(ring->sq_map + params.sq_off.ring_entries);
+            ring->sq_array = (unsigned*)(ring->sq_map + params.sq_off.array);
+            ring->sq_local_tail = *ring->sq_tail;
+            ring->cq_head = (unsigned*)(ring->cq_map + params.cq_off.head);
+            ring->cq_tail = (unsigned*)(ring->cq_map + params.cq_off.tail);
+            ring->cq_mask = *(unsigned*)(ring->cq_map + params.cq_off.ring_mask);
+            ring->cqes = (struct io_uring_cqe*)(ring->cq_map + params.cq_off.cqes);
+        }
+    }
+
+    /* Register the ring of provided buffers */
+    if (ret == 0) {
+        struct io_uring_buf_reg reg;
+
+        ring->buf_ring_size = ring->nb_buffers * sizeof(struct io_uring_buf);
+        ring->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ring->buffers = (uint8_t*)malloc((size_t)ring->nb_buffers * ring->buffer_size);
+        ring->stash = (uint16_t*)malloc(ring->nb_buffers * sizeof(uint16_t));
+        ring->delivered = (uint16_t*)malloc(ring->nb_buffers * sizeof(uint16_t));
+        ring->slots = (picoquic_uring_send_slot_t*)malloc(PICOQUIC_URING_SEND_SLOTS * sizeof(picoquic_uring_send_slot_t));
+
+        if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL || ring->stash == NULL ||
+            ring->delivered == NULL || ring->slots == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+            reg.ring_entries = (uint32_t)ring->nb_buffers;
+            reg.bgid = PICOQUIC_URING_BUFFER_GROUP;
+
+            if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+                DBG_PRINTF("Cannot register the io_uring buffers, error %d\n", errno);
+                ret = -1;
+            }
+            else {
+                for (int i = 0; i < ring->nb_buffers; i++) {
+                    picoquic_uring_provide_buffer(ring, (uint16_t)i);
+                }
+                picoquic_uring_publish_buffers(ring);
+
+                for (int i = 0; i < PICOQUIC_URING_SEND_SLOTS; i++) {
+                    ring->free_slots[i] = PICOQUIC_URING_SEND_SLOTS - 1 - i;
+                }
+                ring->nb_free_slots = PICOQUIC_URING_SEND_SLOTS;
+            }
+        }
+    }
+
+    if (ret != 0) {
+        picoquic_uring_delete(ring);
+        ring = NULL;
+    }
+
+    return ring;
+}
+
+void picoquic_uring_delete(picoquic_uring_t* ring)
+{
+    /* Closing the ring cancels the requests in flight */
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    if (ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+
+    if (ring->buf_ring != MAP_FAILED) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+
+    if (ring->buffers != NULL) {
+        free(ring->buffers);
+    }
+
+    if (ring->stash != NULL) {
+        free(ring->stash);
+    }
+
+    if (ring->delivered != NULL) {
+        free(ring->delivered);
+    }
+
+    if (ring->slots != NULL) {
+        free(ring->slots);
+    }
+
+    free(ring);
+}
+
+int picoquic_uring_add_socket(picoquic_uring_t* ring, SOCKET_TYPE fd)
+{
+    int ret = -1;
+
+    for (int i = 0; i < PICOQUIC_URING_MAX_SOCKETS; i++) {
+        if (ring->recv_state[i] == picoquic_uring_recv_free) {
+            ring->s_socket[i] = fd;
+            ret = picoquic_uring_post_recv(ring, i);
+            if (ret == 0) {
+                ret = picoquic_uring_submit(ring, 0, 0);
+            }
+            break;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_uring_add_wakeup(picoquic_uring_t* ring, int fd)
+{
+    int ret = 0;
+
+    ring->wake_fd = fd;
+    ret = picoquic_uring_post_wakeup(ring);
+    if (ret == 0) {
+        ret = picoquic_uring_submit(ring, 0, 0);
+    }
+
+    return ret;
+}
+
+void picoquic_uring_remove_socket(picoquic_uring_t* ring, SOCKET_TYPE fd)
+{
+    for (int i = 0; i < PICOQUIC_URING_MAX_SOCKETS; i++) {
+        if (ring->recv_state[i] != picoquic_uring_recv_free && ring->recv_state[i] != picoquic_uring_recv_cancelled &&
+            ring->s_socket[i] == fd) {
+            if (ring->recv_state[i] == picoquic_uring_recv_armed) {
+                /* Cancel by user data, which works even if the socket is already closed */
+                struct io_uring_sqe* sqe = picoquic_uring_get_sqe(ring);
+
+                if (sqe != NULL) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->fd = -1;
+                    sqe->addr = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_RECV, i);
+                    sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_OTHER, 0);
+                    (void)picoquic_uring_submit(ring, 0, 0);
+                }
+                ring->recv_state[i] = picoquic_uring_recv_cancelled;
+            }
+            else {
+                ring->recv_state[i] = picoquic_uring_recv_free;
+            }
+            ring->s_socket[i] = INVALID_SOCKET;
+            break;
+        }
+    }
+}
+
+int picoquic_uring_wait(picoquic_uring_t* ring, picoquic_recv_datagram_t* datagrams, int nb_datagrams,
+    int64_t delta_t, uint64_t current_time)
+{
+    int ret = 0;
+    int nb_received = 0;
+
+    /* The buffers delivered by the previous wait can be reused */
+    if (ring->nb_delivered > 0) {
+        for (int i = 0; i < ring->nb_delivered; i++) {
+            picoquic_uring_provide_buffer(ring, ring->delivered[i]);
+        }
+        ring->nb_delivered = 0;
+        picoquic_uring_publish_buffers(ring);
+    }
+
+    /* Repost the receives that stopped, for example when the buffers ran out */
+    for (int i = 0; ret == 0 && i < PICOQUIC_URING_MAX_SOCKETS; i++) {
+        if (ring->recv_state[i] == picoquic_uring_recv_stopped) {
+            ret = picoquic_uring_post_recv(ring, i);
+        }
+    }
+
+    if (ret == 0 && ring->wake_fd >= 0 && !ring->wake_armed) {
+        ret = picoquic_uring_post_wakeup(ring);
+    }
+
+    if (ret == 0) {
+        if (ring->stash_count == 0) {
+            unsigned min_complete = 0;
+
+            if (delta_t > 0) {
+                picoquic_uring_set_timer(ring, delta_t, current_time);
+                min_complete = 1;
+            }
+            ret = picoquic_uring_submit(ring, min_complete, 1);
+        }
+        else if (ring->sq_nb_pending > 0) {
+            ret = picoquic_uring_submit(ring, 0, 0);
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_uring_reap(ring);
+
+        while (nb_received < nb_datagrams && ring->stash_count > 0) {
+            uint16_t bid = ring->stash[ring->stash_first];
+
+            ring->stash_first = (ring->stash_first + 1) % ring->nb_buffers;
+            ring->stash_count--;
+            ring->delivered[ring->nb_delivered++] = bid;
+            picoquic_uring_get_datagram(ring, bid, &datagrams[nb_received++]);
+        }
+    }
+
+    return (ret == 0) ? nb_received : -1;
+}
+
+int picoquic_uring_send_batch(picoquic_uring_t* ring, SOCKET_TYPE fd,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams)
+{
+    int ret = 0;
+    int nb_queued = 0;
+
+    for (int i = 0; ret == 0 && i < nb_datagrams; i++) {
+        picoquic_send_datagram_t* datagram = &datagrams[i];
+        picoquic_uring_send_slot_t* slot;
+        struct io_uring_sqe* sqe;
+        int slot_index;
+
+        if (datagram->length > PICOQUIC_MAX_PACKET_SIZE) {
+            /* Too large for a slot, send it directly */
+            if (picoquic_sendmsg(fd, (struct sockaddr*)&datagram->addr_to, datagram->addr_to_len,
+                (struct sockaddr*)&datagram->addr_from, datagram->addr_from_len, datagram->if_index,
+                (const char*)datagram->bytes, (int)datagram->length, 0) <= 0) {
+                /* Drop the datagram, but keep queuing the rest of the batch */
+                DBG_PRINTF("Could not send datagram %d of %d\n", i, nb_datagrams);
+            }
+            else {
+                nb_queued++;
+            }
+            continue;
+        }
+
+        /* Wait for sends to complete if all the slots are in flight */
+        while (ret == 0 && ring->nb_free_slots == 0) {
+            if ((ret = picoquic_uring_submit(ring, 1, 1)) == 0) {
+                picoquic_uring_reap(ring);
+            }
+        }
+
+        if (ret != 0 || (sqe = picoquic_uring_get_sqe(ring)) == NULL) {
+            ret = -1;
+            break;
+        }
+
+        slot_index = ring->free_slots[--ring->nb_free_slots];
+        slot = &ring->slots[slot_index];
+        memcpy(slot->bytes, datagram->bytes, datagram->length);
+        memcpy(&slot->addr_to, &datagram->addr_to, datagram->addr_to_len);
+        slot->iov.iov_base = slot->bytes;
+        slot->iov.iov_len = datagram->length;
+        memset(&slot->msg, 0, sizeof(slot->msg));
+        slot->msg.msg_name = &slot->addr_to;
+        slot->msg.msg_namelen = datagram->addr_to_len;
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        slot->msg.msg_control = slot->cmsg;
+        slot->msg.msg_controllen = PICOQUIC_SEND_CMSG_SIZE;
+        picoquic_set_send_cmsg(&slot->msg, (struct sockaddr*)&datagram->addr_from, datagram->addr_from_len,
+            datagram->if_index, (int)datagram->length, 0);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+        sqe->len = 1;
+        sqe->user_data = PICOQUIC_URING_USER_DATA(PICOQUIC_URING_TAG_SEND, slot_index);
+        nb_queued++;
+    }
+
+    if (ring->sq_nb_pending > 0 && picoquic_uring_submit(ring, 0, 0) != 0) {
+        nb_queued = 0;
+    }
+
+    return (nb_queued == 0 && nb_datagrams > 0) ? -1 : nb_queued;
+}
+
+#else
+
+picoquic_uring_t* picoquic_uring_create(int nb_buffers, int buffer_size)
+{
+    (void)nb_buffers;
+    (void)buffer_size;
+    DBG_PRINTF("%s", "io_uring is not supported on this system\n");
+    return NULL;
+}
+
+void picoquic_uring_delete(picoquic_uring_t* ring)
+{
+    (void)ring;
+}
+
+int picoquic_uring_add_socket(picoquic_uring_t* ring, SOCKET_TYPE fd)
+{
+    (void)ring;
+    (void)fd;
+    return -1;
+}
+
+int picoquic_uring_add_wakeup(picoquic_uring_t* ring, int fd)
+{
+    (void)ring;
+    (void)fd;
+    return -1;
+}
+
+void picoquic_uring_remove_socket(picoquic_uring_t* ring, SOCKET_TYPE fd)
+{
+    (void)ring;
+    (void)fd;
+}
+
+int picoquic_uring_wait(picoquic_uring_t* ring, picoquic_recv_datagram_t* datagrams, int nb_datagrams,
+    int64_t delta_t, uint64_t current_time)
+{
+    (void)ring;
+    (void)datagrams;
+    (void)nb_datagrams;
+    (void)delta_t;
+    (void)current_time;
+    return -1;
+}
+
+int picoquic_uring_send_batch(picoquic_uring_t* ring, SOCKET_TYPE fd,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams)
+{
+    (void)ring;
+    (void)fd;
+    (void)datagrams;
+    (void)nb_datagrams;
+    return -1;
+}
+#endif
@@ -0,0 +1,75 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2019, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOURING_H
+#define PICOURING_H
+
+#include "picosocks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * io_uring backend of the event loop.
+ *
+ * Each socket has a multishot recvmsg request posted, which takes its buffers
+ * from a ring of provided buffers, so that one request keeps receiving until
+ * it is cancelled. The datagrams to send are copied to slots owned by the
+ * ring and submitted in batches, and the wake time is set with a timeout
+ * request that is only updated when the time changes. The backend requires
+ * Linux 6.0 or later; on other systems, or if the kernel does not support it,
+ * picoquic_uring_create returns NULL and the loop keeps using epoll.
+ */
+
+typedef struct st_picoquic_uring_t picoquic_uring_t;
+
+picoquic_uring_t* picoquic_uring_create(int nb_buffers, int buffer_size);
+
+void picoquic_uring_delete(picoquic_uring_t* ring);
+
+/* Post the multishot receive of a socket */
+int picoquic_uring_add_socket(picoquic_uring_t* ring, SOCKET_TYPE fd);
+
+/* Poll the event fd, so that the wait completes when it becomes readable. The
+ * caller reads the fd. */
+int picoquic_uring_add_wakeup(picoquic_uring_t* ring, int fd);
+
+/* Cancel the receive of a socket. This is needed even if the socket is closed,
+ * because the pending request holds a reference to it. */
+void picoquic_uring_remove_socket(picoquic_uring_t* ring, SOCKET_TYPE fd);
+
+/* Wait until datagrams are received or the delay expires. The buffers of the
+ * datagrams point to the ring, and remain valid until the next wait. Returns
+ * the number of datagrams, 0 if the delay expired, or -1 on error. */
+int picoquic_uring_wait(picoquic_uring_t* ring, picoquic_recv_datagram_t* datagrams, int nb_datagrams,
+    int64_t delta_t, uint64_t current_time);
+
+/* Queue the datagrams for sending on the socket, and submit them with a
+ * single system call. Returns the number of datagrams queued. */
+int picoquic_uring_send_batch(picoquic_uring_t* ring, SOCKET_TYPE fd,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOURING_H */
@@ -48,12 +48,11 @@ typedef struct st_picoquic_net_id_key_t {
 } picoquic_net_id_key_t;
 
 /* Hash and compare for CNX hash tables */
-static uint64_t picoquic_cnx_id_hash(void* key)
+static uint64_t picoquic_cnx_id_hash(void* key, const uint8_t* hash_seed)
 {
     picoquic_cnx_id_key_t* cid = (picoquic_cnx_id_key_t*)key;
 
-    /* TODO: should scramble the value for security and DOS protection */
-    return picoquic_val64_connection_id(cid->cnx_id);
+    return picohash_siphash(cid->cnx_id.id, cid->cnx_id.id_len, hash_seed);
 }
 
 static int picoquic_cnx_id_compare(void* key1, void* key2)
@@ -64,11 +63,13 @@ static int picoquic_cnx_id_compare(void* key1, void* key2)
     return picoquic_compare_connection_id(&cid1->cnx_id, &cid2->cnx_id);
 }
 
-static uint64_t picoquic_net_id_hash(void* key)
+static uint64_t picoquic_net_id_hash(void* key, const uint8_t* hash_seed)
 {
     picoquic_net_id_key_t* net = (picoquic_net_id_key_t*)key;
+    /* The rest of the storage is always zero, see picoquic_set_hash_key_by_address */
+    size_t length = (net->saddr.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
 
-    return picohash_bytes((uint8_t*)&net->saddr, sizeof(net->saddr));
+    return picohash_siphash((uint8_t*)&net->saddr, length, hash_seed);
 }
 
 static int picoquic_net_id_compare(void* key1, void* key2)
@@ -79,33 +80,42 @@ static int picoquic_net_id_compare(void* key1, void* key2)
     return memcmp(&net1->saddr, &net2->saddr, sizeof(net1->saddr));
 }
 
-#if 0
-/* Not used yet, should be used in ordering connections by wake time. */
-static int picoquic_compare_cnx_waketime(void * v_cnxleft, void * v_cnxright) {
-    /* Example:  return *((int*)l) - *((int*)r); */
+static uint64_t picoquic_cnx_serial_hash(void* key, const uint8_t* hash_seed)
+{
+    picoquic_cnx_serial_key_t* serial_key = (picoquic_cnx_serial_key_t*)key;
+    uint8_t serial_bytes[8];
+
+    picoformat_64(serial_bytes, serial_key->serial);
+
+    return picohash_siphash(serial_bytes, sizeof(serial_bytes), hash_seed);
+}
+
+static int picoquic_cnx_serial_compare(void* key1, void* key2)
+{
+    picoquic_cnx_serial_key_t* serial_key1 = (picoquic_cnx_serial_key_t*)key1;
+    picoquic_cnx_serial_key_t* serial_key2 = (picoquic_cnx_serial_key_t*)key2;
+
+    return (serial_key1->serial == serial_key2->serial) ? 0 : -1;
+}
+
+/* Order connections by wake time. Connections with the same wake time
+ * compare equal, and the splay insertion places the newest after the
+ * older ones, so they are polled in the order in which they were queued. */
+static int picoquic_compare_cnx_waketime(void * v_cnxleft, void * v_cnxright)
+{
+    picoquic_cnx_t * cnx_l = (picoquic_cnx_t *)v_cnxleft;
+    picoquic_cnx_t * cnx_r = (picoquic_cnx_t *)v_cnxright;
     int ret = 0;
-    if (v_cnxleft != v_cnxright) {
-        picoquic_cnx_t * cnx_l = (picoquic_cnx_t *)v_cnxleft;
-        picoquic_cnx_t * cnx_r = (picoquic_cnx_t *)v_cnxright;
 
-        if (cnx_l->next_wake_time > cnx_r->next_wake_time) {
-            ret = 1;
-        }
-        else if (cnx_l->next_wake_time < cnx_r->next_wake_time) {
-            ret = -1;
-        }
-        else {
-            if (((intptr_t)v_cnxleft) > ((intptr_t)v_cnxright)) {
-                ret = 1;
-            }
-            else {
-                ret = -1;
-            }
-        }
+    if (cnx_l->next_wake_time > cnx_r->next_wake_time) {
+        ret = 1;
+    }
+    else if (cnx_l->next_wake_time < cnx_r->next_wake_time) {
+        ret = -1;
     }
+
     return ret;
 }
-#endif
 
 picoquic_packet_context_enum picoquic_context_from_epoch(int epoch)
 {
@@ -196,6 +206,11 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
         quic->local_cnxid_length = 8; /* TODO: should be lower on clients-only implementation */
         quic->padding_multiple_default = 0; /* TODO: consider default = 128 */
         quic->padding_minsize_default = PICOQUIC_RESET_PACKET_MIN_SIZE;
+        quic->packet_pool_max = PICOQUIC_PACKET_POOL_MAX_DEFAULT;
+        quic->nb_connections = nb_connections;
+
+        picosplay_init_tree(&quic->cnx_wake_tree, picoquic_compare_cnx_waketime);
+        picoquic_mpsc_init(&quic->command_queue);
 
         if (cnx_id_callback != NULL) {
             quic->flags |= picoquic_context_unconditional_cnx_id;
@@ -215,29 +230,40 @@ picoquic_quic_t* picoquic_create(uint32_t nb_connections,
         }
 
         if (ret == 0) {
-            quic->table_cnx_by_id = picohash_create(nb_connections * 4,
-                picoquic_cnx_id_hash, picoquic_cnx_id_compare);
-
-            quic->table_cnx_by_net = picohash_create(nb_connections * 4,
-                picoquic_net_id_hash, picoquic_net_id_compare);
-
-            if (quic->table_cnx_by_id == NULL || quic->table_cnx_by_net == NULL) {
-                ret = -1;
-                DBG_PRINTF("%s", "Cannot initialize hash tables\n");
-            }
-            else if (picoquic_master_tlscontext(quic, cert_file_name, key_file_name, cert_root_file_name, ticket_encryption_key, ticket_encryption_key_length) != 0) {
+            if (picoquic_master_tlscontext(quic, cert_file_name, key_file_name, cert_root_file_name, ticket_encryption_key, ticket_encryption_key_length) != 0) {
                 ret = -1;
                 DBG_PRINTF("%s", "Cannot create TLS context \n");
             }
             else {
+                uint8_t hash_seed[PICOHASH_SEED_SIZE];
+
                 /* the random generator was initialized as part of the TLS context.
                  * Use it to create the seed for generating the per context stateless
-                 * resets. */
+                 * resets, and the secret seed of the connection hash tables. The
+                 * hash seed is drawn separately, so that it reveals nothing about
+                 * the reset seed. */
 
                 if (!reset_seed)
                     picoquic_crypto_random(quic, quic->reset_seed, sizeof(quic->reset_seed));
                 else
                     memcpy(quic->reset_seed, reset_seed, sizeof(quic->reset_seed));
+
+                picoquic_crypto_random(quic, hash_seed, sizeof(hash_seed));
+
+                quic->table_cnx_by_id = picohash_oa_create(nb_connections * 4,
+                    picoquic_cnx_id_hash, picoquic_cnx_id_compare, hash_seed);
+
+                quic->table_cnx_by_net = picohash_oa_create(nb_connections * 4,
+                    picoquic_net_id_hash, picoquic_net_id_compare, hash_seed);
+
+                quic->table_cnx_by_serial = picohash_oa_create(nb_connections * 2,
+                    picoquic_cnx_serial_hash, picoquic_cnx_serial_compare, hash_seed);
+
+                if (quic->table_cnx_by_id == NULL || quic->table_cnx_by_net == NULL ||
+                    quic->table_cnx_by_serial == NULL) {
+                    ret = -1;
+                    DBG_PRINTF("%s", "Cannot initialize hash tables\n");
+                }
             }
         }
         
@@ -327,17 +353,37 @@ void picoquic_free(picoquic_quic_t* quic)
             free(to_delete);
         }
 
+        /* delete the commands that were never processed */
+        picoquic_free_commands(quic);
+
         /* delete all the connection contexts */
         while (quic->cnx_list != NULL) {
             picoquic_delete_cnx(quic->cnx_list);
         }
 
+        /* delete the packet pools, after the connections returned their packets */
+        picoquic_set_packet_pool_max(quic, 0);
+
+        /* delete the connection slab, after the connections returned their objects */
+        if (quic->cnx_slab != NULL) {
+            free(quic->cnx_slab->cnx_array);
+            free(quic->cnx_slab->path_array);
+            free(quic->cnx_slab->path_table);
+            free(quic->cnx_slab);
+            quic->cnx_slab = NULL;
+        }
+
         if (quic->table_cnx_by_id != NULL) {
-            picohash_delete(quic->table_cnx_by_id, 1);
+            picohash_oa_delete(quic->table_cnx_by_id, 1);
         }
 
         if (quic->table_cnx_by_net != NULL) {
-            picohash_delete(quic->table_cnx_by_net, 1);
+            picohash_oa_delete(quic->table_cnx_by_net, 1);
+        }
+
+        /* The serial keys are part of the connection contexts */
+        if (quic->table_cnx_by_serial != NULL) {
+            picohash_oa_delete(quic->table_cnx_by_serial, 0);
         }
 
         if (quic->verify_certificate_ctx != NULL &&
@@ -381,12 +427,210 @@ void picoquic_set_cookie_mode(picoquic_quic_t* quic, int cookie_mode)
     }
 }
 
+void picoquic_set_packet_pool_max(picoquic_quic_t* quic, size_t max_packets)
+{
+    quic->packet_pool_max = max_packets;
+
+    while (quic->packet_pool_stats.nb_packets_in_pool > max_packets) {
+        picoquic_packet_t* packet = quic->packet_pool;
+        quic->packet_pool = packet->next_packet;
+        quic->packet_pool_stats.nb_packets_in_pool--;
+        if (packet->bytes != NULL) {
+            free(packet->bytes);
+        }
+        free(packet);
+    }
+
+    while (quic->packet_pool_stats.nb_buffers_in_pool > max_packets) {
+        picoquic_packet_buffer_t* buffer = quic->packet_buffer_pool;
+        quic->packet_buffer_pool = buffer->next_buffer;
+        quic->packet_pool_stats.nb_buffers_in_pool--;
+        free(buffer);
+    }
+
+    while (quic->packet_pool_stats.nb_small_buffers_in_pool > max_packets) {
+        picoquic_packet_buffer_t* buffer = quic->small_buffer_pool;
+        quic->small_buffer_pool = buffer->next_buffer;
+        quic->packet_pool_stats.nb_small_buffers_in_pool--;
+        free(buffer);
+    }
+
+    while (quic->packet_pool_stats.nb_stateless_in_pool > max_packets) {
+        picoquic_stateless_packet_t* sp = quic->stateless_packet_pool;
+        quic->stateless_packet_pool = sp->next_packet;
+        quic->packet_pool_stats.nb_stateless_in_pool--;
+        free(sp);
+    }
+}
+
+void picoquic_get_packet_pool_stats(picoquic_quic_t* quic, picoquic_packet_pool_stats_t* stats)
+{
+    *stats = quic->packet_pool_stats;
+}
+
+void picoquic_get_arena_stats(picoquic_cnx_t* cnx, picoquic_arena_stats_t* stats)
+{
+    *stats = cnx->arena.stats;
+}
+
+/*
+ * Connection slab. The objects of the slab are recognized by their address,
+ * so objects that were allocated before the slab was enabled are still
+ * freed with the system allocator.
+ */
+int picoquic_enable_cnx_slab(picoquic_quic_t* quic)
+{
+    int ret = 0;
+
+    if (quic->cnx_slab == NULL) {
+        size_t nb_cnx = (quic->nb_connections == 0) ? 1 : quic->nb_connections;
+        size_t nb_paths = nb_cnx * PICOQUIC_CNX_SLAB_PATHS_PER_CNX;
+        picoquic_cnx_slab_t* slab = (picoquic_cnx_slab_t*)malloc(sizeof(picoquic_cnx_slab_t));
+
+        if (slab == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(slab, 0, sizeof(picoquic_cnx_slab_t));
+            slab->cnx_array = (picoquic_cnx_t*)malloc(nb_cnx * sizeof(picoquic_cnx_t));
+            slab->path_array = (picoquic_path_t*)malloc(nb_paths * sizeof(picoquic_path_t));
+            slab->path_table = (picoquic_path_t**)malloc(nb_paths * sizeof(picoquic_path_t*));
+
+            if (slab->cnx_array == NULL || slab->path_array == NULL || slab->path_table == NULL) {
+                free(slab->cnx_array);
+                free(slab->path_array);
+                free(slab->path_table);
+                free(slab);
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                /* Link the free objects, so they are used in order of address */
+                for (size_t i = nb_cnx; i > 0; i--) {
+                    picoquic_slab_item_t* item = (picoquic_slab_item_t*)&slab->cnx_array[i - 1];
+                    item->next_item = slab->cnx_free;
+                    slab->cnx_free = item;
+                }
+                for (size_t i = nb_paths; i > 0; i--) {
+                    picoquic_slab_item_t* item = (picoquic_slab_item_t*)&slab->path_array[i - 1];
+                    item->next_item = slab->path_free;
+                    slab->path_free = item;
+                }
+                slab->stats.nb_cnx = nb_cnx;
+                slab->stats.nb_cnx_free = nb_cnx;
+                slab->stats.nb_paths = nb_paths;
+                slab->stats.nb_paths_free = nb_paths;
+                quic->cnx_slab = slab;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_get_cnx_slab_stats(picoquic_quic_t* quic, picoquic_cnx_slab_stats_t* stats)
+{
+    if (quic->cnx_slab == NULL) {
+        memset(stats, 0, sizeof(picoquic_cnx_slab_stats_t));
+    }
+    else {
+        *stats = quic->cnx_slab->stats;
+    }
+}
+
+static int picoquic_is_slab_cnx(picoquic_quic_t* quic, picoquic_cnx_t* cnx)
+{
+    return quic->cnx_slab != NULL && cnx >= quic->cnx_slab->cnx_array &&
+        cnx < quic->cnx_slab->cnx_array + quic->cnx_slab->stats.nb_cnx;
+}
+
+static picoquic_cnx_t* picoquic_alloc_cnx(picoquic_quic_t* quic)
+{
+    picoquic_cnx_t* cnx = NULL;
+
+    if (quic->cnx_slab == NULL) {
+        cnx = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    }
+    else if (quic->cnx_slab->cnx_free == NULL || quic->cnx_slab->path_free == NULL) {
+        quic->cnx_slab->stats.nb_refused++;
+    }
+    else {
+        cnx = (picoquic_cnx_t*)quic->cnx_slab->cnx_free;
+        quic->cnx_slab->cnx_free = quic->cnx_slab->cnx_free->next_item;
+        quic->cnx_slab->stats.nb_cnx_free--;
+    }
+
+    return cnx;
+}
+
+static void picoquic_free_cnx_memory(picoquic_quic_t* quic, picoquic_cnx_t* cnx)
+{
+    if (picoquic_is_slab_cnx(quic, cnx)) {
+        picoquic_slab_item_t* item = (picoquic_slab_item_t*)cnx;
+        item->next_item = quic->cnx_slab->cnx_free;
+        quic->cnx_slab->cnx_free = item;
+        quic->cnx_slab->stats.nb_cnx_free++;
+    }
+    else {
+        free(cnx);
+    }
+}
+
+static picoquic_path_t* picoquic_alloc_path(picoquic_quic_t* quic)
+{
+    picoquic_path_t* path_x = NULL;
+
+    if (quic->cnx_slab == NULL) {
+        path_x = (picoquic_path_t*)malloc(sizeof(picoquic_path_t));
+    }
+    else if (quic->cnx_slab->path_free != NULL) {
+        path_x = (picoquic_path_t*)quic->cnx_slab->path_free;
+        quic->cnx_slab->path_free = quic->cnx_slab->path_free->next_item;
+        quic->cnx_slab->stats.nb_paths_free--;
+    }
+
+    return path_x;
+}
+
+static void picoquic_free_path_memory(picoquic_quic_t* quic, picoquic_path_t* path_x)
+{
+    if (quic->cnx_slab != NULL && path_x >= quic->cnx_slab->path_array &&
+        path_x < quic->cnx_slab->path_array + quic->cnx_slab->stats.nb_paths) {
+        picoquic_slab_item_t* item = (picoquic_slab_item_t*)path_x;
+        item->next_item = quic->cnx_slab->path_free;
+        quic->cnx_slab->path_free = item;
+        quic->cnx_slab->stats.nb_paths_free++;
+    }
+    else {
+        free(path_x);
+    }
+}
+
+/* The table of path pointers of a slab connection is part of the slab */
+static void picoquic_free_path_table(picoquic_cnx_t* cnx)
+{
+    picoquic_quic_t* quic = cnx->quic;
+
+    if (quic->cnx_slab == NULL || cnx->path < quic->cnx_slab->path_table ||
+        cnx->path >= quic->cnx_slab->path_table + quic->cnx_slab->stats.nb_paths) {
+        free(cnx->path);
+    }
+    cnx->path = NULL;
+}
+
 picoquic_stateless_packet_t* picoquic_create_stateless_packet(picoquic_quic_t* quic)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(quic);
-#endif
-    return (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+    picoquic_stateless_packet_t* sp = quic->stateless_packet_pool;
+
+    if (sp != NULL) {
+        quic->stateless_packet_pool = sp->next_packet;
+        quic->packet_pool_stats.nb_stateless_in_pool--;
+        quic->packet_pool_stats.nb_stateless_hits++;
+    } else {
+        sp = (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+        quic->packet_pool_stats.nb_stateless_misses++;
+    }
+
+    return sp;
 }
 
 void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp)
@@ -394,6 +638,17 @@ void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp)
     free(sp);
 }
 
+void picoquic_recycle_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
+{
+    if (quic->packet_pool_stats.nb_stateless_in_pool < quic->packet_pool_max) {
+        sp->next_packet = quic->stateless_packet_pool;
+        quic->stateless_packet_pool = sp;
+        quic->packet_pool_stats.nb_stateless_in_pool++;
+    } else {
+        free(sp);
+    }
+}
+
 void picoquic_queue_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
 {
     picoquic_stateless_packet_t** pnext = &quic->pending_stateless_packet;
@@ -427,7 +682,6 @@ picoquic_stateless_packet_t* picoquic_dequeue_stateless_packet(picoquic_quic_t*
 int picoquic_register_cnx_id(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picoquic_path_t * path_x, picoquic_connection_id_t cnx_id)
 {
     int ret = 0;
-    picohash_item* item;
     picoquic_cnx_id_key_t* key = (picoquic_cnx_id_key_t*)malloc(sizeof(picoquic_cnx_id_key_t));
 
     if (key == NULL) {
@@ -438,12 +692,10 @@ int picoquic_register_cnx_id(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picoqui
         key->path = path_x;
         key->next_cnx_id = NULL;
 
-        item = picohash_retrieve(quic->table_cnx_by_id, key);
-
-        if (item != NULL) {
+        if (picohash_oa_retrieve(quic->table_cnx_by_id, key) != NULL) {
             ret = -1;
         } else {
-            ret = picohash_insert(quic->table_cnx_by_id, key);
+            ret = picohash_oa_insert(quic->table_cnx_by_id, key);
 
             if (ret == 0) {
                 key->next_cnx_id = path_x->first_cnx_id;
@@ -452,6 +704,10 @@ int picoquic_register_cnx_id(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picoqui
         }
     }
 
+    if (key != NULL && ret != 0) {
+        free(key);
+    }
+
     return ret;
 }
 
@@ -484,7 +740,6 @@ static void picoquic_set_hash_key_by_address(picoquic_net_id_key_t * key, struct
 int picoquic_register_net_id(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picoquic_path_t * path_x, struct sockaddr* addr)
 {
     int ret = 0;
-    picohash_item* item;
     picoquic_net_id_key_t* key = (picoquic_net_id_key_t*)malloc(sizeof(picoquic_net_id_key_t));
 
     if (key == NULL) {
@@ -495,12 +750,10 @@ int picoquic_register_net_id(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picoqui
         key->cnx = cnx;
         key->path = path_x;
 
-        item = picohash_retrieve(quic->table_cnx_by_net, key);
-
-        if (item != NULL) {
+        if (picohash_oa_retrieve(quic->table_cnx_by_net, key) != NULL) {
             ret = -1;
         } else {
-            ret = picohash_insert(quic->table_cnx_by_net, key);
+            ret = picohash_oa_insert(quic->table_cnx_by_net, key);
 
             if (ret == 0) {
                 key->next_net_id = path_x->first_net_id;
@@ -576,47 +829,19 @@ static void picoquic_remove_cnx_from_list(picoquic_cnx_t* cnx)
     }
 }
 
-/* Management of the list of connections, sorted by wake time */
+/* Management of the list of connections, sorted by wake time.
+ * The connections are kept in a splay tree, using a node embedded in
+ * the connection context, so that the reinsertion at each packet does
+ * not require walking the list of connections or allocating memory. */
 
 static void picoquic_remove_cnx_from_wake_list(picoquic_cnx_t* cnx)
 {
-    if (cnx->next_by_wake_time == NULL) {
-        cnx->quic->cnx_wake_last = cnx->previous_by_wake_time;
-    } else {
-        cnx->next_by_wake_time->previous_by_wake_time = cnx->previous_by_wake_time;
-    }
-    
-    if (cnx->previous_by_wake_time == NULL) {
-        cnx->quic->cnx_wake_first = cnx->next_by_wake_time;
-    } else {
-        cnx->previous_by_wake_time->next_by_wake_time = cnx->next_by_wake_time;
-    }
+    picosplay_remove_node(&cnx->quic->cnx_wake_tree, &cnx->cnx_wake_node);
 }
 
 static void picoquic_insert_cnx_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx)
 {
-    picoquic_cnx_t * cnx_next = quic->cnx_wake_first;
-    picoquic_cnx_t * previous = NULL;
-    while (cnx_next != NULL && cnx_next->next_wake_time <= cnx->next_wake_time) {
-        previous = cnx_next;
-        cnx_next = cnx_next->next_by_wake_time;
-    }
-    
-    cnx->previous_by_wake_time = previous;
-    if (previous == NULL) {
-        quic->cnx_wake_first = cnx;
-
-    } else {
-        previous->next_by_wake_time = cnx;
-    }
-    
-    cnx->next_by_wake_time = cnx_next;
-
-    if (cnx_next == NULL) {
-        quic->cnx_wake_last = cnx;
-    } else { 
-        cnx_next->previous_by_wake_time = cnx;
-    }
+    picosplay_insert_node(&quic->cnx_wake_tree, &cnx->cnx_wake_node, cnx);
 }
 
 void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx, uint64_t next_time)
@@ -628,10 +853,15 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
 
 picoquic_cnx_t* picoquic_get_earliest_cnx_to_wake(picoquic_quic_t* quic, uint64_t max_wake_time)
 {
-    picoquic_cnx_t * cnx = quic->cnx_wake_first;
-    if (cnx != NULL && max_wake_time != 0 && cnx->next_wake_time > max_wake_time)
-    {
-        cnx = NULL;
+    picoquic_cnx_t * cnx = NULL;
+    picosplay_node * first = picosplay_first(&quic->cnx_wake_tree);
+
+    if (first != NULL) {
+        cnx = (picoquic_cnx_t *)first->value;
+        if (max_wake_time != 0 && cnx->next_wake_time > max_wake_time)
+        {
+            cnx = NULL;
+        }
     }
 
     return cnx;
@@ -642,10 +872,11 @@ int64_t picoquic_get_next_wake_delay(picoquic_quic_t* quic,
     uint64_t current_time, int64_t delay_max)
 {
     int64_t wake_delay = delay_max;
+    picoquic_cnx_t * cnx_first = picoquic_get_earliest_cnx_to_wake(quic, 0);
 
-    if (quic->cnx_wake_first != NULL) {
-        if (quic->cnx_wake_first->next_wake_time > current_time) {
-            wake_delay = quic->cnx_wake_first->next_wake_time - current_time;
+    if (cnx_first != NULL) {
+        if (cnx_first->next_wake_time > current_time) {
+            wake_delay = cnx_first->next_wake_time - current_time;
             
             if (wake_delay > delay_max) {
                 wake_delay = delay_max;
@@ -695,6 +926,14 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, struct sockad
 {
     int ret = -1;
 
+    if (cnx->nb_path_alloc == 0 && picoquic_is_slab_cnx(cnx->quic, cnx))
+    {
+        /* Use the table of path pointers that the slab reserved for this connection */
+        cnx->path = cnx->quic->cnx_slab->path_table +
+            (cnx - cnx->quic->cnx_slab->cnx_array) * PICOQUIC_CNX_SLAB_PATHS_PER_CNX;
+        cnx->nb_path_alloc = PICOQUIC_CNX_SLAB_PATHS_PER_CNX;
+    }
+
     if (cnx->nb_paths >= cnx->nb_path_alloc)
     {
         int new_alloc = (cnx->nb_path_alloc == 0) ? 1 : 2 * cnx->nb_path_alloc;
@@ -708,7 +947,7 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, struct sockad
                 {
                     memcpy(new_path, cnx->path, cnx->nb_paths * sizeof(picoquic_path_t *));
                 }
-                free(cnx->path);
+                picoquic_free_path_table(cnx);
             }
             cnx->path = new_path;
             cnx->nb_path_alloc = new_alloc;
@@ -717,7 +956,7 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, struct sockad
 
     if (cnx->nb_paths < cnx->nb_path_alloc)
     {
-        picoquic_path_t * path_x = (picoquic_path_t *)malloc(sizeof(picoquic_path_t));
+        picoquic_path_t * path_x = picoquic_alloc_path(cnx->quic);
 
         if (path_x != NULL)
         {
@@ -801,27 +1040,21 @@ static void picoquic_clear_path_data(picoquic_cnx_t* cnx, picoquic_path_t * path
 {
     /* Remove the registration in hash tables */
     while (path_x->first_cnx_id != NULL) {
-        picohash_item* item;
         picoquic_cnx_id_key_t* cnx_id_key = path_x->first_cnx_id;
         path_x->first_cnx_id = cnx_id_key->next_cnx_id;
         cnx_id_key->next_cnx_id = NULL;
 
-        item = picohash_retrieve(cnx->quic->table_cnx_by_id, cnx_id_key);
-        if (item != NULL) {
-            picohash_item_delete(cnx->quic->table_cnx_by_id, item, 1);
-        }
+        (void)picohash_oa_remove(cnx->quic->table_cnx_by_id, cnx_id_key);
+        free(cnx_id_key);
     }
 
     while (path_x->first_net_id != NULL) {
-        picohash_item* item;
         picoquic_net_id_key_t* net_id_key = path_x->first_net_id;
         path_x->first_net_id = net_id_key->next_net_id;
         net_id_key->next_net_id = NULL;
 
-        item = picohash_retrieve(cnx->quic->table_cnx_by_net, net_id_key);
-        if (item != NULL) {
-            picohash_item_delete(cnx->quic->table_cnx_by_net, item, 1);
-        }
+        (void)picohash_oa_remove(cnx->quic->table_cnx_by_net, net_id_key);
+        free(net_id_key);
     }
     /* Remove the congestion data */
     if (cnx->congestion_alg != NULL) {
@@ -829,7 +1062,7 @@ static void picoquic_clear_path_data(picoquic_cnx_t* cnx, picoquic_path_t * path
     }
 
     /* Free the record */
-    free(path_x);
+    picoquic_free_path_memory(cnx->quic, path_x);
 }
 
 void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
@@ -978,6 +1211,12 @@ picoquic_cnxid_stash_t * picoquic_dequeue_cnxid_stash(picoquic_cnx_t * cnx)
     return stashed;
 }
 
+/* Free a stashed connection ID, after it was dequeued */
+void picoquic_delete_cnxid_stash(picoquic_cnx_t* cnx, picoquic_cnxid_stash_t* stashed)
+{
+    picoquic_arena_free(&cnx->arena, stashed, sizeof(picoquic_cnxid_stash_t));
+}
+
 int picoquic_enqueue_cnxid_stash(picoquic_cnx_t * cnx,
     const uint64_t sequence, const uint8_t cid_length, const uint8_t * cnxid_bytes, 
     const uint8_t * secret_bytes, picoquic_cnxid_stash_t ** pstashed)
@@ -1089,7 +1328,7 @@ int picoquic_enqueue_cnxid_stash(picoquic_cnx_t * cnx,
     }
 
     if (ret == 0 && is_duplicate == 0) {
-        stashed = (picoquic_cnxid_stash_t *)malloc(sizeof(picoquic_cnxid_stash_t));
+        stashed = (picoquic_cnxid_stash_t *)picoquic_arena_alloc(&cnx->arena, sizeof(picoquic_cnxid_stash_t));
 
         if (stashed == NULL) {
             ret = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
@@ -1142,7 +1381,7 @@ int picoquic_renew_connection_id(picoquic_cnx_t* cnx)
             cnx->path[0]->remote_cnxid_sequence = stashed->sequence;
             memcpy(cnx->path[0]->reset_secret, stashed->reset_secret,
                 PICOQUIC_RESET_SECRET_SIZE);
-            free(stashed);
+            picoquic_delete_cnxid_stash(cnx, stashed);
         }
     }
 
@@ -1216,7 +1455,7 @@ void picoquic_delete_probe(picoquic_cnx_t* cnx, picoquic_probe_t * probe)
         }
     }
 
-    free(probe);
+    picoquic_arena_free(&cnx->arena, probe, sizeof(picoquic_probe_t));
 }
 
 /*
@@ -1243,7 +1482,7 @@ void picoquic_delete_failed_probes(picoquic_cnx_t* cnx)
             /* Before deleting, post a notification to the peer */
             (void)picoquic_queue_retire_connection_id_frame(cnx, abandoned->sequence);
 
-            free(abandoned);
+            picoquic_arena_free(&cnx->arena, abandoned, sizeof(picoquic_probe_t));
         }
         else {
             previous = probe;
@@ -1267,7 +1506,7 @@ int picoquic_create_probe(picoquic_cnx_t* cnx, const struct sockaddr* addr_to, c
     }
     else {
         /* Create the probe */
-        probe = (picoquic_probe_t *)malloc(sizeof(picoquic_probe_t));
+        probe = (picoquic_probe_t *)picoquic_arena_alloc(&cnx->arena, sizeof(picoquic_probe_t));
 
         if (probe == NULL) {
             ret = PICOQUIC_ERROR_MEMORY;
@@ -1277,7 +1516,7 @@ int picoquic_create_probe(picoquic_cnx_t* cnx, const struct sockaddr* addr_to, c
 
             if (stashed == NULL) {
                 ret = PICOQUIC_ERROR_CNXID_NOT_AVAILABLE;
-                free(probe);
+                picoquic_arena_free(&cnx->arena, probe, sizeof(picoquic_probe_t));
                 probe = NULL;
             }
             else {
@@ -1286,7 +1525,7 @@ int picoquic_create_probe(picoquic_cnx_t* cnx, const struct sockaddr* addr_to, c
                 probe->sequence = stashed->sequence;
                 probe->remote_cnxid = stashed->cnx_id;
                 memcpy(probe->reset_secret, stashed->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
-                free(stashed);
+                picoquic_delete_cnxid_stash(cnx, stashed);
 
                 probe->peer_addr_len = picoquic_store_addr(&probe->peer_addr, addr_to);
                 probe->local_addr_len = picoquic_store_addr(&probe->local_addr, addr_from);
@@ -1311,26 +1550,38 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
     struct sockaddr* addr_to, uint64_t start_time, uint32_t preferred_version,
     char const* sni, char const* alpn, char client_mode)
 {
-    picoquic_cnx_t* cnx = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    picoquic_cnx_t* cnx = picoquic_alloc_cnx(quic);
 
     if (cnx != NULL) {
         int ret;
 
         memset(cnx, 0, sizeof(picoquic_cnx_t));
+        cnx->quic = quic;
         /* Should return 0, since this is the first path */
         ret = picoquic_create_path(cnx, start_time, NULL, addr_to);
 
+        if (ret == 0) {
+            cnx->serial_key.serial = ++quic->cnx_serial_last;
+            cnx->serial_key.cnx = cnx;
+            ret = picohash_oa_insert(quic->table_cnx_by_serial, &cnx->serial_key);
+        }
+
         if (ret != 0) {
-            free(cnx);
+            /* Return the first path to the slab or the heap before dropping the table */
+            while (cnx->nb_paths > 0) {
+                picoquic_delete_path(cnx, cnx->nb_paths - 1);
+            }
+            picoquic_free_path_table(cnx);
+            picoquic_free_cnx_memory(quic, cnx);
             cnx = NULL;
         } else {
             cnx->next_wake_time = start_time;
             cnx->start_time = start_time;
             cnx->client_mode = client_mode;
 
-            cnx->quic = quic;
             picoquic_insert_cnx_in_list(quic, cnx);
             picoquic_insert_cnx_by_wake_time(quic, cnx);
+            picoquic_init_stream_tree(cnx);
             /* Do not require verification for default path */
             cnx->path[0]->challenge_verified = 1;
 
@@ -1433,6 +1684,7 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
         } else {
             for (int epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS; epoch++) {
                 cnx->tls_stream[epoch].send_queue = NULL;
+                cnx->tls_stream[epoch].send_queue_last = NULL;
             }
             cnx->cnx_state = picoquic_state_server_init;
             cnx->initial_cnxid = initial_cnx_id;
@@ -1450,9 +1702,7 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
 
         for (picoquic_packet_context_enum pc = 0;
             pc < picoquic_nb_packet_context; pc++) {
-            cnx->pkt_ctx[pc].first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
-            cnx->pkt_ctx[pc].first_sack_item.end_of_sack_range = 0;
-            cnx->pkt_ctx[pc].first_sack_item.next_sack = NULL;
+            picoquic_init_sack_list(&cnx->pkt_ctx[pc].sack_list, PICOQUIC_MAX_SACK_RANGES);
             cnx->pkt_ctx[pc].highest_ack_sent = 0;
             cnx->pkt_ctx[pc].highest_ack_sent_time = start_time;
             cnx->pkt_ctx[pc].time_stamp_largest_received = (uint64_t)((int64_t)-1);
@@ -1474,8 +1724,8 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
             cnx->tls_stream[epoch].stream_id = 0;
             cnx->tls_stream[epoch].consumed_offset = 0;
             cnx->tls_stream[epoch].fin_offset = 0;
-            cnx->tls_stream[epoch].next_stream = NULL;
-            cnx->tls_stream[epoch].stream_data = NULL;
+            cnx->tls_stream[epoch].receive_buffer = NULL;
+            cnx->tls_stream[epoch].receive_buffer_size = 0;
             cnx->tls_stream[epoch].sent_offset = 0;
             cnx->tls_stream[epoch].local_error = 0;
             cnx->tls_stream[epoch].remote_error = 0;
@@ -1625,6 +1875,11 @@ picoquic_state_enum picoquic_get_cnx_state(picoquic_cnx_t* cnx)
     return cnx->cnx_state;
 }
 
+uint64_t picoquic_get_cnx_serial(picoquic_cnx_t* cnx)
+{
+    return cnx->serial_key.serial;
+}
+
 uint64_t picoquic_is_0rtt_available(picoquic_cnx_t* cnx)
 {
     return (cnx->crypto_context[1].aead_encrypt == NULL) ? 0 : 1;
@@ -1769,7 +2024,7 @@ picoquic_connection_id_callback_ctx_t * picoquic_connection_id_callback_create_c
         ctx->cnx_id_select = atoi(select_type);
         /* TODO: find an alternative to parsing a 64 bit integer */
         lv = picoquic_parse_connection_id_hexa(default_value_hex, strlen(default_value_hex), &ctx->cnx_id_val);
-        lm = picoquic_parse_connection_id_hexa(mask_hex, strlen(mask_hex), &ctx->cnx_id_val);
+        lm = picoquic_parse_connection_id_hexa(mask_hex, strlen(mask_hex), &ctx->cnx_id_mask);
 
         if (lm == 0 || lv == 0 || lm != lv) {
             free(ctx);
@@ -1868,8 +2123,8 @@ void * picoquic_get_callback_context(picoquic_cnx_t * cnx)
     return cnx->callback_ctx;
 }
 
-picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, size_t length) {
-    uint8_t* misc_frame = (uint8_t*)malloc(sizeof(picoquic_misc_frame_header_t) + length);
+picoquic_misc_frame_header_t* picoquic_create_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length) {
+    uint8_t* misc_frame = (uint8_t*)picoquic_arena_alloc(&cnx->arena, sizeof(picoquic_misc_frame_header_t) + length);
 
     if (misc_frame == NULL) {
         return NULL;
@@ -1882,10 +2137,15 @@ picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, s
     }
 }
 
+void picoquic_delete_misc_frame(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t* misc_frame)
+{
+    picoquic_arena_free(&cnx->arena, misc_frame, sizeof(picoquic_misc_frame_header_t) + misc_frame->length);
+}
+
 int picoquic_queue_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length)
 {
     int ret = 0;
-    picoquic_misc_frame_header_t* misc_frame = picoquic_create_misc_frame(bytes, length);
+    picoquic_misc_frame_header_t* misc_frame = picoquic_create_misc_frame(cnx, bytes, length);
 
     if (misc_frame == NULL) {
         ret = PICOQUIC_ERROR_MEMORY;
@@ -1901,22 +2161,19 @@ int picoquic_queue_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t
 
 void picoquic_clear_stream(picoquic_stream_head* stream)
 {
-    picoquic_stream_data** pdata[2];
-    pdata[0] = &stream->stream_data;
-    pdata[1] = &stream->send_queue;
-
-    for (int i = 0; i < 2; i++) {
-        picoquic_stream_data* next;
-
-        while ((next = *pdata[i]) != NULL) {
-            *pdata[i] = next->next_stream_data;
+    while (stream->send_queue != NULL) {
+        picoquic_dequeue_stream_data(stream);
+    }
+    picoquic_release_retained_stream_data(stream);
 
-            if (next->bytes != NULL) {
-                free(next->bytes);
-            }
-            free(next);
-        }
+    if (stream->receive_buffer != NULL) {
+        free(stream->receive_buffer);
+        stream->receive_buffer = NULL;
     }
+    stream->receive_buffer_size = 0;
+
+    picoquic_clear_sack_list(&stream->receive_ranges);
+    picoquic_clear_sack_list(&stream->sack_list);
 }
 
 void picoquic_reset_packet_context(picoquic_cnx_t* cnx,
@@ -1928,6 +2185,8 @@ void picoquic_reset_packet_context(picoquic_cnx_t* cnx,
     while (pkt_ctx->retransmit_newest != NULL) {
         (void)picoquic_dequeue_retransmit_packet(cnx, pkt_ctx->retransmit_newest, 1);
     }
+
+    picoquic_clear_retransmit_index(pkt_ctx);
     
     while (pkt_ctx->retransmitted_newest != NULL) {
         picoquic_dequeue_retransmitted_packet(cnx, pkt_ctx->retransmitted_newest);
@@ -1935,14 +2194,7 @@ void picoquic_reset_packet_context(picoquic_cnx_t* cnx,
 
     pkt_ctx->retransmitted_oldest = NULL;
 
-    while (pkt_ctx->first_sack_item.next_sack != NULL) {
-        picoquic_sack_item_t * next = pkt_ctx->first_sack_item.next_sack;
-        pkt_ctx->first_sack_item.next_sack = next->next_sack;
-        free(next);
-    }
-
-    pkt_ctx->first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
-    pkt_ctx->first_sack_item.end_of_sack_range = 0;
+    picoquic_clear_sack_list(&pkt_ctx->sack_list);
 }
 
 /*
@@ -2091,8 +2343,6 @@ int picoquic_start_key_rotation(picoquic_cnx_t* cnx)
 void picoquic_delete_cnx(picoquic_cnx_t* cnx)
 {
     picoquic_stream_head* stream;
-    picoquic_misc_frame_header_t* misc_frame;
-    picoquic_cnxid_stash_t* stashed_cnxid;
 
     if (cnx != NULL) {
         if (cnx->cnx_state < picoquic_state_disconnected) {
@@ -2115,6 +2365,7 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
         
         picoquic_remove_cnx_from_list(cnx);
         picoquic_remove_cnx_from_wake_list(cnx);
+        (void)picohash_oa_remove(cnx->quic->table_cnx_by_serial, &cnx->serial_key);
 
         for (int i = 0; i < 4; i++) {
             picoquic_crypto_context_free(&cnx->crypto_context[i]);
@@ -2127,18 +2378,17 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
             picoquic_reset_packet_context(cnx, pc);
         }
 
-        while ((misc_frame = cnx->first_misc_frame) != NULL) {
-            cnx->first_misc_frame = misc_frame->next_misc_frame;
-            free(misc_frame);
-        }
         for (int epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS; epoch++) {
             picoquic_clear_stream(&cnx->tls_stream[epoch]);
         }
 
-        while ((stream = cnx->first_stream) != NULL) {
-            cnx->first_stream = stream->next_stream;
+        /* The stream heads are freed with the arena, only their data is freed here */
+        for (stream = picoquic_first_stream(cnx); stream != NULL; stream = picoquic_next_stream(stream)) {
             picoquic_clear_stream(stream);
-            free(stream);
+        }
+
+        for (int i = 0; i < 4; i++) {
+            picoquic_clear_sack_list(&cnx->closed_stream_ranks[i]);
         }
 
         if (cnx->tls_ctx != NULL) {
@@ -2152,21 +2402,15 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
                 picoquic_delete_path(cnx, cnx->nb_paths - 1);
             }
 
-            free(cnx->path);
-            cnx->path = NULL;
-        }
-
-        while ((stashed_cnxid = picoquic_dequeue_cnxid_stash(cnx)) != NULL) {
-            free(stashed_cnxid);
-        }
-
-        while (cnx->probe_first != NULL) {
-            picoquic_delete_probe(cnx, cnx->probe_first);
+            picoquic_free_path_table(cnx);
         }
 
         picoquic_close_cc_dump(cnx);
 
-        free(cnx);
+        /* Misc frames, stashed connection IDs, probes and streams are all freed at once */
+        picoquic_arena_release(&cnx->arena);
+
+        picoquic_free_cnx_memory(cnx->quic, cnx);
     }
     
     qlog_close();
@@ -2182,16 +2426,33 @@ int picoquic_is_handshake_error(uint16_t error_code)
 picoquic_cnx_t* picoquic_cnx_by_id(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id)
 {
     picoquic_cnx_t* ret = NULL;
-    picohash_item* item;
+    picoquic_cnx_id_key_t* found;
     picoquic_cnx_id_key_t key;
 
     memset(&key, 0, sizeof(key));
     key.cnx_id = cnx_id;
 
-    item = picohash_retrieve(quic->table_cnx_by_id, &key);
+    found = (picoquic_cnx_id_key_t*)picohash_oa_retrieve(quic->table_cnx_by_id, &key);
+
+    if (found != NULL) {
+        ret = found->cnx;
+    }
+    return ret;
+}
+
+picoquic_cnx_t* picoquic_cnx_by_serial(picoquic_quic_t* quic, uint64_t serial)
+{
+    picoquic_cnx_t* ret = NULL;
+    picoquic_cnx_serial_key_t* found;
+    picoquic_cnx_serial_key_t key;
+
+    key.serial = serial;
+    key.cnx = NULL;
+
+    found = (picoquic_cnx_serial_key_t*)picohash_oa_retrieve(quic->table_cnx_by_serial, &key);
 
-    if (item != NULL) {
-        ret = ((picoquic_cnx_id_key_t*)item->key)->cnx;
+    if (found != NULL) {
+        ret = found->cnx;
     }
     return ret;
 }
@@ -2199,15 +2460,15 @@ picoquic_cnx_t* picoquic_cnx_by_id(picoquic_quic_t* quic, picoquic_connection_id
 picoquic_cnx_t* picoquic_cnx_by_net(picoquic_quic_t* quic, struct sockaddr* addr)
 {
     picoquic_cnx_t* ret = NULL;
-    picohash_item* item;
+    picoquic_net_id_key_t* found;
     picoquic_net_id_key_t key;
 
     picoquic_set_hash_key_by_address(&key, addr);
 
-    item = picohash_retrieve(quic->table_cnx_by_net, &key);
+    found = (picoquic_net_id_key_t*)picohash_oa_retrieve(quic->table_cnx_by_net, &key);
 
-    if (item != NULL) {
-        ret = ((picoquic_net_id_key_t*)item->key)->cnx;
+    if (found != NULL) {
+        ret = found->cnx;
     }
     return ret;
 }
@@ -21,6 +21,7 @@
 
 #include "picoquic_internal.h"
 #include <stdlib.h>
+#include <string.h>
 
 /*
 * Packet sequence recording prepares the next ACK:
@@ -32,166 +33,162 @@
 */
 
 /*
- * Check whether the packet was already received.
+ * Initialize a SACK list. If max_ranges is not zero, the list will never
+ * hold more than that number of ranges.
  */
-int picoquic_is_pn_already_received(picoquic_cnx_t* cnx, 
-    picoquic_packet_context_enum pc, uint64_t pn64)
+void picoquic_init_sack_list(picoquic_sack_list_t* sack_list, size_t max_ranges)
 {
-    int is_received = 0;
-    picoquic_sack_item_t* sack = &cnx->pkt_ctx[pc].first_sack_item;
-
-    if (sack->start_of_sack_range != (uint64_t)((int64_t)-1)) {
-        do {
-            if (pn64 > sack->end_of_sack_range)
-                break;
-            else if (pn64 >= sack->start_of_sack_range) {
-                is_received = 1;
-                break;
-            }
-            else {
-                sack = sack->next_sack;
-            }
-        } while (sack != NULL);
+    memset(sack_list, 0, sizeof(picoquic_sack_list_t));
+    sack_list->max_ranges = max_ranges;
+}
+
+/*
+ * Free the range array of a SACK list, and reset it to the empty state.
+ * The limit on the number of ranges is kept.
+ */
+
+void picoquic_clear_sack_list(picoquic_sack_list_t* sack_list)
+{
+    if (sack_list->ranges != NULL) {
+        free(sack_list->ranges);
+        sack_list->ranges = NULL;
     }
+    sack_list->nb_ranges = 0;
+    sack_list->nb_ranges_allocated = 0;
+    sack_list->horizon = 0;
+}
+
+int picoquic_sack_list_is_empty(const picoquic_sack_list_t* sack_list)
+{
+    return sack_list->nb_ranges == 0;
+}
 
-    return is_received;
+uint64_t picoquic_sack_list_last(const picoquic_sack_list_t* sack_list)
+{
+    return (sack_list->nb_ranges == 0) ? 0 : sack_list->ranges[0].end_of_sack_range;
 }
 
 /*
- * Packet was already received and checksum, etc. was properly verified.
- * Record it in the chain.
+ * Return the index of the highest range that starts at or below the
+ * specified number, i.e. the only range that could contain it, or
+ * nb_ranges if all ranges start above that number.
  */
+static size_t picoquic_sack_list_find(const picoquic_sack_list_t* sack_list, uint64_t pn64)
+{
+    size_t low = 0;
+    size_t high = sack_list->nb_ranges;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if (sack_list->ranges[middle].start_of_sack_range <= pn64) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return low;
+}
 
-int picoquic_update_sack_list(picoquic_sack_item_t* sack,
+/*
+ * Insert a new range at the specified position. If the list is full,
+ * the lowest range is forgotten and the horizon moves above it.
+ */
+static int picoquic_sack_list_insert(picoquic_sack_list_t* sack_list, size_t index,
     uint64_t pn64_min, uint64_t pn64_max)
 {
-    int ret = 1; /* duplicate by default, reset to 0 if update found */
-    picoquic_sack_item_t* previous = NULL;
-
-    if (sack->start_of_sack_range == (uint64_t)((int64_t)-1)) {
-        /* This is the first packet ever received.. */
-        sack->start_of_sack_range = pn64_min;
-        sack->end_of_sack_range = pn64_max;
-        ret = 0;
-    } else {
-        do {
-            if (pn64_max > sack->end_of_sack_range) {
-                ret = 0;
-
-                if (pn64_min <= sack->end_of_sack_range + 1) {
-                    /* if this actually fills the hole, merge with previous item */
-                    if (previous != NULL && pn64_max + 1 >= previous->start_of_sack_range) {
-                        previous->start_of_sack_range = sack->start_of_sack_range;
-                        previous->next_sack = sack->next_sack;
-                        free(sack);
-                        sack = previous;
-                    } else {
-                        /* add at end of range */
-                        sack->end_of_sack_range = pn64_max;
-                    }
-
-                    /* Check whether there is a need to continue */
-                    if (pn64_min >= sack->start_of_sack_range) {
-                        break;
-                    } else if (sack->next_sack == NULL) {
-                        /* Last in range. Just expand. */
-                        sack->start_of_sack_range = pn64_min;
-                        break;
-                    } else {
-                        /* Continue with reminder of range */
-                        pn64_max = sack->start_of_sack_range - 1;
-                        previous = sack;
-                        sack = sack->next_sack;
-                    }
-                } else if (previous != NULL && pn64_max + 1 >= previous->start_of_sack_range) {
-                    /* Extend the previous range */
-                    previous->start_of_sack_range = pn64_min;
-                    break;
-                } else {
-                    /* Found a new hole */
-                    picoquic_sack_item_t* new_hole = (picoquic_sack_item_t*)malloc(sizeof(picoquic_sack_item_t));
-                    if (new_hole == NULL) {
-                        /* memory error. That's infortunate */
-                        ret = -1;
-                    } else {
-                        /* swap old and new, so it works even if previous == NULL */
-                        new_hole->start_of_sack_range = sack->start_of_sack_range;
-                        new_hole->end_of_sack_range = sack->end_of_sack_range;
-                        new_hole->next_sack = sack->next_sack;
-                        sack->start_of_sack_range = pn64_min;
-                        sack->end_of_sack_range = pn64_max;
-                        sack->next_sack = new_hole;
-                    }
-                    /* No need to continue, everything is consumed. */
-                    break;
-                }
-            } else if (pn64_max >= sack->start_of_sack_range) {
-                if (pn64_min < sack->start_of_sack_range) {
-                    ret = 0;
-
-                    if (sack->next_sack == NULL) {
-                        /* Just extend the last range */
-                        sack->start_of_sack_range = pn64_min;
-                        break;
-                    } else {
-                        /* continue with reminder. */
-                        pn64_max = sack->start_of_sack_range - 1;
-                        previous = sack;
-                        sack = sack->next_sack;
-                    }
-                } else {
-                    /*comple overlap */
-                    break;
-                }
-            } else if (sack->next_sack == NULL) {
-                ret = 0;
-                if (pn64_max + 1 == sack->start_of_sack_range) {
-                    sack->start_of_sack_range = pn64_min;
-                } else {
-                    /* this is an old packet, beyond the current range of SACK */
-                    /* Found a new hole */
-                    picoquic_sack_item_t* new_hole = (picoquic_sack_item_t*)malloc(sizeof(picoquic_sack_item_t));
-                    if (new_hole == NULL) {
-                        /* memory error. That's infortunate */
-                        ret = -1;
-                    } else {
-                        /* Create new hole at the tail. */
-                        new_hole->start_of_sack_range = pn64_min;
-                        new_hole->end_of_sack_range = pn64_max;
-                        new_hole->next_sack = NULL;
-                        sack->next_sack = new_hole;
-                    }
-                }
-                break;
-            } else {
-                previous = sack;
-                sack = sack->next_sack;
-            }
-        } while (sack != NULL);
+    int ret = 0;
+
+    if (sack_list->max_ranges > 0 && sack_list->nb_ranges >= sack_list->max_ranges) {
+        if (index >= sack_list->nb_ranges) {
+            /* The new range would be the lowest one: forget it instead */
+            sack_list->horizon = pn64_max + 1;
+            return 0;
+        }
+        sack_list->nb_ranges--;
+        sack_list->horizon = sack_list->ranges[sack_list->nb_ranges].end_of_sack_range + 1;
+    }
+
+    if (sack_list->nb_ranges >= sack_list->nb_ranges_allocated) {
+        size_t new_size = (sack_list->nb_ranges_allocated == 0) ? 4 : 2 * sack_list->nb_ranges_allocated;
+        picoquic_sack_item_t* new_ranges;
+
+        if (sack_list->max_ranges > 0 && new_size > sack_list->max_ranges) {
+            new_size = sack_list->max_ranges;
+        }
+
+        new_ranges = (picoquic_sack_item_t*)realloc(sack_list->ranges, new_size * sizeof(picoquic_sack_item_t));
+        if (new_ranges == NULL) {
+            /* memory error. That's infortunate */
+            ret = -1;
+        } else {
+            sack_list->ranges = new_ranges;
+            sack_list->nb_ranges_allocated = new_size;
+        }
+    }
+
+    if (ret == 0) {
+        if (index < sack_list->nb_ranges) {
+            memmove(&sack_list->ranges[index + 1], &sack_list->ranges[index],
+                (sack_list->nb_ranges - index) * sizeof(picoquic_sack_item_t));
+        }
+        sack_list->ranges[index].start_of_sack_range = pn64_min;
+        sack_list->ranges[index].end_of_sack_range = pn64_max;
+        sack_list->nb_ranges++;
     }
 
     return ret;
 }
 
-int picoquic_record_pn_received(picoquic_cnx_t* cnx,
-    picoquic_packet_context_enum pc, uint64_t pn64,
-    uint64_t current_microsec)
+/*
+ * Packet was already received and checksum, etc. was properly verified.
+ * Record it in the list. Returns 1 if the range was already fully recorded,
+ * 0 if it was added, -1 in case of memory error.
+ */
+
+int picoquic_update_sack_list(picoquic_sack_list_t* sack_list,
+    uint64_t pn64_min, uint64_t pn64_max)
 {
     int ret = 0;
-    picoquic_sack_item_t* sack = &cnx->pkt_ctx[pc].first_sack_item;
+    size_t first;
+    size_t last;
 
-    if (sack->start_of_sack_range == (uint64_t)((int64_t)-1)) {
-        /* This is the first packet ever received.. */
-        sack->start_of_sack_range = pn64;
-        sack->end_of_sack_range = pn64;
-        cnx->pkt_ctx[pc].time_stamp_largest_received = current_microsec;
-    } 
-    else {
-        if (pn64 > sack->end_of_sack_range) {
-            cnx->pkt_ctx[pc].time_stamp_largest_received = current_microsec;
+    if (pn64_max < sack_list->horizon) {
+        return 1;
+    } else if (pn64_min < sack_list->horizon) {
+        pn64_min = sack_list->horizon;
+    }
+
+    /* Ranges [first, last[ overlap or touch the new range, and will be merged with it */
+    first = picoquic_sack_list_find(sack_list, pn64_max + 1);
+    last = first;
+    while (last < sack_list->nb_ranges && sack_list->ranges[last].end_of_sack_range + 1 >= pn64_min) {
+        last++;
+    }
+
+    if (last == first) {
+        /* Found a new hole */
+        ret = picoquic_sack_list_insert(sack_list, first, pn64_min, pn64_max);
+    } else if (last == first + 1 && sack_list->ranges[first].start_of_sack_range <= pn64_min &&
+        sack_list->ranges[first].end_of_sack_range >= pn64_max) {
+        /* complete overlap */
+        ret = 1;
+    } else {
+        if (sack_list->ranges[first].end_of_sack_range < pn64_max) {
+            sack_list->ranges[first].end_of_sack_range = pn64_max;
+        }
+        if (sack_list->ranges[last - 1].start_of_sack_range < pn64_min) {
+            pn64_min = sack_list->ranges[last - 1].start_of_sack_range;
         }
+        sack_list->ranges[first].start_of_sack_range = pn64_min;
 
-        ret = picoquic_update_sack_list(sack, pn64, pn64);
+        if (last > first + 1) {
+            /* The new range filled holes, remove the merged ranges */
+            memmove(&sack_list->ranges[first + 1], &sack_list->ranges[last],
+                (sack_list->nb_ranges - last) * sizeof(picoquic_sack_item_t));
+            sack_list->nb_ranges -= last - first - 1;
+        }
     }
 
     return ret;
@@ -200,38 +197,83 @@ int picoquic_record_pn_received(picoquic_cnx_t* cnx,
 /*
  * Check whether the data fills a hole. returns 0 if it does, -1 otherwise.
  */
-int picoquic_check_sack_list(picoquic_sack_item_t* sack,
+int picoquic_check_sack_list(picoquic_sack_list_t* sack_list,
     uint64_t pn64_min, uint64_t pn64_max)
 {
-    int ret = -1; /* duplicate by default, reset to 0 if update found */
+    int ret = 0;
 
-    if (sack->start_of_sack_range == (uint64_t)((int64_t)-1)) {
-        ret = 0;
+    if (pn64_max < sack_list->horizon) {
+        ret = -1;
     } else {
-        for(;;) {
-            if (pn64_max > sack->end_of_sack_range) {
-                ret = 0;
-                break;
-            } else if (pn64_max >= sack->start_of_sack_range) {
-                if (pn64_min < sack->start_of_sack_range) {
-                    ret = 0;
-                } else {
-                    /*complete overlap */
-                    ret = -1;
-                }
-                break;
-            } else if (sack->next_sack == NULL) {
-                ret = 0;
-                break;
-            } else {
-                sack = sack->next_sack;
-            }
-        };
+        size_t index;
+
+        if (pn64_min < sack_list->horizon) {
+            pn64_min = sack_list->horizon;
+        }
+
+        index = picoquic_sack_list_find(sack_list, pn64_min);
+
+        if (index < sack_list->nb_ranges && sack_list->ranges[index].end_of_sack_range >= pn64_max) {
+            /* complete overlap */
+            ret = -1;
+        }
     }
 
     return ret;
 }
 
+/*
+ * Check whether the packet was already received.
+ */
+int picoquic_is_pn_already_received(picoquic_cnx_t* cnx, 
+    picoquic_packet_context_enum pc, uint64_t pn64)
+{
+    return picoquic_check_sack_list(&cnx->pkt_ctx[pc].sack_list, pn64, pn64) != 0;
+}
+
+int picoquic_record_pn_received(picoquic_cnx_t* cnx,
+    picoquic_packet_context_enum pc, uint64_t pn64,
+    uint64_t current_microsec)
+{
+    picoquic_sack_list_t* sack_list = &cnx->pkt_ctx[pc].sack_list;
+
+    if (picoquic_sack_list_is_empty(sack_list) || pn64 > picoquic_sack_list_last(sack_list)) {
+        cnx->pkt_ctx[pc].time_stamp_largest_received = current_microsec;
+    }
+
+    return picoquic_update_sack_list(sack_list, pn64, pn64);
+}
+
+/*
+ * Process a range acknowledged in an ACK of ACK. The oldest part of the
+ * highest range is trimmed, keeping at least the largest number received.
+ * Lower ranges are removed if they exactly match.
+ */
+void picoquic_process_ack_of_ack_range(picoquic_sack_list_t* sack_list,
+    uint64_t start_of_range, uint64_t end_of_range)
+{
+    if (sack_list->nb_ranges == 0) {
+        return;
+    } else if (sack_list->ranges[0].start_of_sack_range == start_of_range) {
+        if (end_of_range < sack_list->ranges[0].end_of_sack_range) {
+            sack_list->ranges[0].start_of_sack_range = end_of_range + 1;
+        } else {
+            sack_list->ranges[0].start_of_sack_range = sack_list->ranges[0].end_of_sack_range;
+        }
+    } else {
+        size_t index = picoquic_sack_list_find(sack_list, start_of_range);
+
+        if (index < sack_list->nb_ranges &&
+            sack_list->ranges[index].start_of_sack_range == start_of_range &&
+            sack_list->ranges[index].end_of_sack_range == end_of_range) {
+            /* Matching range should be removed */
+            memmove(&sack_list->ranges[index], &sack_list->ranges[index + 1],
+                (sack_list->nb_ranges - index - 1) * sizeof(picoquic_sack_item_t));
+            sack_list->nb_ranges--;
+        }
+    }
+}
+
 /*
  * Float16 format required for encoding the time deltas in current QUIC draft.
  *
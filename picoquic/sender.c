@@ -20,6 +20,7 @@
 */
 
 #include "fnv1a.h"
+#include "picocrypto.h"
 #include "picoquic_internal.h"
 #include "tls_api.h"
 #include <stdlib.h>
@@ -56,6 +57,10 @@ static picoquic_stream_head* picoquic_find_stream_for_writing(picoquic_cnx_t* cn
         if (IS_CLIENT_STREAM_ID(stream_id) != cnx->client_mode) {
             *ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
         }
+        else if (picoquic_is_stream_closed(cnx, stream_id)) {
+            /* The stream was closed in both directions and deleted */
+            *ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+        }
 
         if (*ret == 0) {
             stream = picoquic_create_stream(cnx, stream_id);
@@ -95,6 +100,8 @@ int picoquic_mark_active_stream(picoquic_cnx_t* cnx,
         else {
             stream->is_active = 0;
         }
+
+        picoquic_update_ready_stream(cnx, stream, 0);
     }
 
     return ret;
@@ -112,21 +119,167 @@ int picoquic_mark_high_priority_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
     return 0;
 }
 
-int picoquic_add_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
-    const uint8_t* data, size_t length, int set_fin)
+int picoquic_set_stream_priority(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t priority)
 {
     int ret = 0;
-    picoquic_stream_head* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
+    picoquic_stream_head* stream = NULL;
 
-    if (ret == 0 && set_fin) {
-        if (stream->fin_requested) {
-            /* app error, notified the fin twice*/
-            if (length > 0) {
-                ret = -1;
-            }
+    if (priority >= PICOQUIC_STREAM_PRIORITY_LEVELS) {
+        ret = -1;
+    }
+    else if ((stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL) {
+        ret = (picoquic_is_stream_closed(cnx, stream_id)) ? PICOQUIC_ERROR_STREAM_ALREADY_CLOSED : PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else {
+        picoquic_update_stream_priority(cnx, stream, priority);
+    }
+
+    return ret;
+}
+
+/*
+ * Append data at the end of the send queue of a stream. If a release function
+ * is provided, the queue references the application buffer. If not, the data
+ * is copied in the same allocation as the queue item.
+ */
+int picoquic_queue_stream_data(picoquic_stream_head* stream, const uint8_t* data, size_t length,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret = 0;
+    picoquic_stream_data* stream_data = (picoquic_stream_data*)malloc(
+        sizeof(picoquic_stream_data) + ((release_fn == NULL) ? length : 0));
+
+    if (stream_data == NULL) {
+        ret = -1;
+    } else {
+        if (release_fn == NULL) {
+            stream_data->bytes = (uint8_t*)(stream_data + 1);
+            memcpy(stream_data->bytes, data, length);
         } else {
-            stream->fin_requested = 1;
+            stream_data->bytes = (uint8_t*)data;
         }
+        stream_data->length = length;
+        stream_data->offset = 0;
+        stream_data->release_fn = release_fn;
+        stream_data->release_ctx = release_ctx;
+        stream_data->next_stream_data = NULL;
+
+        if (stream->send_queue == NULL) {
+            stream->send_queue = stream_data;
+        } else {
+            stream->send_queue_last->next_stream_data = stream_data;
+        }
+        stream->send_queue_last = stream_data;
+    }
+
+    return ret;
+}
+
+static void picoquic_free_stream_data(picoquic_stream_data* stream_data)
+{
+    if (stream_data->release_fn != NULL) {
+        stream_data->release_fn(stream_data->bytes, stream_data->length, stream_data->release_ctx);
+    }
+    free(stream_data);
+}
+
+/*
+ * Remove the first item of the send queue, and release the application
+ * buffer if there was one.
+ */
+void picoquic_dequeue_stream_data(picoquic_stream_head* stream)
+{
+    picoquic_stream_data* stream_data = stream->send_queue;
+
+    if (stream_data != NULL) {
+        stream->send_queue = stream_data->next_stream_data;
+        if (stream->send_queue == NULL) {
+            stream->send_queue_last = NULL;
+        }
+        picoquic_free_stream_data(stream_data);
+    }
+}
+
+/*
+ * Move the first item of the send queue, after all its bytes were sent, to
+ * the list of data retained until acknowledged. Lost stream frames are
+ * rebuilt from that list. The retained items are contiguous, and follow each
+ * other in the order of the stream offsets.
+ */
+void picoquic_retain_stream_data(picoquic_stream_head* stream)
+{
+    picoquic_stream_data* stream_data = stream->send_queue;
+
+    if (stream_data != NULL) {
+        stream->send_queue = stream_data->next_stream_data;
+        if (stream->send_queue == NULL) {
+            stream->send_queue_last = NULL;
+        }
+        stream_data->next_stream_data = NULL;
+
+        if (stream->send_retained == NULL) {
+            stream->send_retained = stream_data;
+            stream->retained_offset = stream->sent_offset - stream_data->length;
+        } else {
+            stream->send_retained_last->next_stream_data = stream_data;
+        }
+        stream->send_retained_last = stream_data;
+    }
+}
+
+/*
+ * Release the retained items, in order, once all their bytes are acknowledged.
+ */
+void picoquic_release_acked_stream_data(picoquic_stream_head* stream)
+{
+    while (stream->send_retained != NULL && (stream->send_retained->length == 0 ||
+        picoquic_check_sack_list(&stream->sack_list, stream->retained_offset,
+            stream->retained_offset + stream->send_retained->length - 1) != 0)) {
+        picoquic_stream_data* stream_data = stream->send_retained;
+
+        stream->retained_offset += stream_data->length;
+        stream->send_retained = stream_data->next_stream_data;
+        if (stream->send_retained == NULL) {
+            stream->send_retained_last = NULL;
+        }
+        if (stream->send_retained_hint == stream_data) {
+            stream->send_retained_hint = NULL;
+        }
+        picoquic_free_stream_data(stream_data);
+    }
+}
+
+/*
+ * Release all the retained items, e.g. after the stream was reset.
+ */
+void picoquic_release_retained_stream_data(picoquic_stream_head* stream)
+{
+    while (stream->send_retained != NULL) {
+        picoquic_stream_data* stream_data = stream->send_retained;
+
+        stream->retained_offset += stream_data->length;
+        stream->send_retained = stream_data->next_stream_data;
+        picoquic_free_stream_data(stream_data);
+    }
+    stream->send_retained_last = NULL;
+    stream->send_retained_hint = NULL;
+}
+
+static int picoquic_add_iovec_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const picoquic_iovec_t* iov, size_t iov_count, int set_fin,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret = 0;
+    picoquic_stream_head* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
+    size_t length = 0;
+
+    for (size_t i = 0; i < iov_count; i++) {
+        length += iov[i].len;
+    }
+
+    if (ret == 0 && set_fin && stream->fin_requested && length > 0) {
+        /* app error, notified the fin twice*/
+        ret = -1;
     }
 
     /* If our side has sent RST_STREAM or received STOP_SENDING, we should not send anymore data. */
@@ -135,41 +288,69 @@ int picoquic_add_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
     }
 
     if (ret == 0 && length > 0) {
-        picoquic_stream_data* stream_data = (picoquic_stream_data*)malloc(sizeof(picoquic_stream_data));
+        picoquic_stream_data* queue_last = stream->send_queue_last;
 
-        if (stream_data == 0) {
-            ret = -1;
-        } else {
-            stream_data->bytes = (uint8_t*)malloc(length);
-
-            if (stream_data->bytes == NULL) {
-                free(stream_data);
-                stream_data = NULL;
-                ret = -1;
-            } else {
-                picoquic_stream_data** pprevious = &stream->send_queue;
-                picoquic_stream_data* next = stream->send_queue;
+        for (size_t i = 0; ret == 0 && i < iov_count; i++) {
+            if (iov[i].len > 0) {
+                ret = picoquic_queue_stream_data(stream, iov[i].base, iov[i].len, release_fn, release_ctx);
+            }
+        }
 
-                memcpy(stream_data->bytes, data, length);
-                stream_data->length = length;
-                stream_data->offset = 0;
-                stream_data->next_stream_data = NULL;
+        if (ret != 0) {
+            /* Nothing is queued if an allocation fails, and the application keeps its buffers */
+            picoquic_stream_data* next = (queue_last == NULL) ? stream->send_queue : queue_last->next_stream_data;
 
-                while (next != NULL) {
-                    pprevious = &next->next_stream_data;
-                    next = next->next_stream_data;
-                }
+            while (next != NULL) {
+                picoquic_stream_data* stream_data = next;
+                next = next->next_stream_data;
+                free(stream_data);
+            }
 
-                *pprevious = stream_data;
+            if (queue_last == NULL) {
+                stream->send_queue = NULL;
+            } else {
+                queue_last->next_stream_data = NULL;
             }
+            stream->send_queue_last = queue_last;
         }
 
         picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
     }
 
     if (ret == 0) {
+        /* The fin is only requested once all the data is queued */
+        if (set_fin) {
+            stream->fin_requested = 1;
+        }
         cnx->nb_bytes_queued += length;
         stream->is_active = 0;
+        picoquic_update_ready_stream(cnx, stream, 0);
+    }
+
+    return ret;
+}
+
+int picoquic_add_to_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin)
+{
+    picoquic_iovec_t iov;
+
+    iov.base = (uint8_t*)data;
+    iov.len = length;
+
+    return picoquic_add_iovec_to_stream(cnx, stream_id, &iov, 1, set_fin, NULL, NULL);
+}
+
+int picoquic_add_to_stream_zero_copy(picoquic_cnx_t* cnx,
+    uint64_t stream_id, const picoquic_iovec_t* iov, size_t iov_count, int set_fin,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret = 0;
+
+    if (release_fn == NULL || (iov == NULL && iov_count > 0)) {
+        ret = -1;
+    } else {
+        ret = picoquic_add_iovec_to_stream(cnx, stream_id, iov, iov_count, set_fin, release_fn, release_ctx);
     }
 
     return ret;
@@ -181,9 +362,10 @@ int picoquic_reset_stream(picoquic_cnx_t* cnx,
     int ret = 0;
     picoquic_stream_head* stream = NULL;
 
-    stream = picoquic_find_stream(cnx, stream_id, 1);
-
-    if (stream == NULL) {
+    if (picoquic_is_stream_closed(cnx, stream_id)) {
+        ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+    }
+    else if ((stream = picoquic_find_stream(cnx, stream_id, 1)) == NULL) {
         ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
     }
     else if (stream->fin_sent) {
@@ -192,6 +374,7 @@ int picoquic_reset_stream(picoquic_cnx_t* cnx,
     else if (!stream->reset_requested) {
         stream->local_error = local_stream_error;
         stream->reset_requested = 1;
+        picoquic_update_ready_stream(cnx, stream, 0);
     }
 
     picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
@@ -205,9 +388,10 @@ int picoquic_stop_sending(picoquic_cnx_t* cnx,
     int ret = 0;
     picoquic_stream_head* stream = NULL;
 
-    stream = picoquic_find_stream(cnx, stream_id, 1);
-
-    if (stream == NULL) {
+    if (picoquic_is_stream_closed(cnx, stream_id)) {
+        ret = PICOQUIC_ERROR_STREAM_ALREADY_CLOSED;
+    }
+    else if ((stream = picoquic_find_stream(cnx, stream_id, 1)) == NULL) {
         ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
     }
     else if (stream->reset_received) {
@@ -216,6 +400,7 @@ int picoquic_stop_sending(picoquic_cnx_t* cnx,
     else if (!stream->stop_sending_requested) {
         stream->local_stop_error = local_stream_error;
         stream->stop_sending_requested = 1;
+        picoquic_update_ready_stream(cnx, stream, 0);
     }
 
     picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
@@ -264,17 +449,186 @@ uint32_t picoquic_pad_to_policy(picoquic_cnx_t * cnx, uint8_t * bytes, uint32_t
  * Packet management
  */
 
-picoquic_packet_t* picoquic_create_packet()
+static uint8_t* picoquic_create_packet_buffer(picoquic_quic_t* quic)
+{
+    uint8_t* buffer = (uint8_t*)quic->packet_buffer_pool;
+
+    if (buffer != NULL) {
+        quic->packet_buffer_pool = quic->packet_buffer_pool->next_buffer;
+        quic->packet_pool_stats.nb_buffers_in_pool--;
+    } else {
+        buffer = (uint8_t*)malloc(PICOQUIC_MAX_PACKET_SIZE);
+    }
+
+    return buffer;
+}
+
+static void picoquic_recycle_packet_buffer(picoquic_quic_t* quic, uint8_t* buffer)
+{
+    if (quic->packet_pool_stats.nb_buffers_in_pool < quic->packet_pool_max) {
+        picoquic_packet_buffer_t* pooled = (picoquic_packet_buffer_t*)buffer;
+
+        pooled->next_buffer = quic->packet_buffer_pool;
+        quic->packet_buffer_pool = pooled;
+        quic->packet_pool_stats.nb_buffers_in_pool++;
+    } else {
+        free(buffer);
+    }
+}
+
+static uint8_t* picoquic_create_small_buffer(picoquic_quic_t* quic)
+{
+    uint8_t* buffer = (uint8_t*)quic->small_buffer_pool;
+
+    if (buffer != NULL) {
+        quic->small_buffer_pool = quic->small_buffer_pool->next_buffer;
+        quic->packet_pool_stats.nb_small_buffers_in_pool--;
+    } else {
+        buffer = (uint8_t*)malloc(PICOQUIC_SMALL_PACKET_BUFFER_SIZE);
+    }
+
+    return buffer;
+}
+
+static void picoquic_recycle_small_buffer(picoquic_quic_t* quic, uint8_t* buffer)
 {
-    picoquic_packet_t* packet = (picoquic_packet_t*)malloc(sizeof(picoquic_packet_t));
+    if (quic->packet_pool_stats.nb_small_buffers_in_pool < quic->packet_pool_max) {
+        picoquic_packet_buffer_t* pooled = (picoquic_packet_buffer_t*)buffer;
+
+        pooled->next_buffer = quic->small_buffer_pool;
+        quic->small_buffer_pool = pooled;
+        quic->packet_pool_stats.nb_small_buffers_in_pool++;
+    } else {
+        free(buffer);
+    }
+}
+
+picoquic_packet_t* picoquic_create_packet(picoquic_quic_t* quic)
+{
+    picoquic_packet_t* packet = quic->packet_pool;
+    uint8_t* bytes = NULL;
 
     if (packet != NULL) {
-        memset(packet, 0, sizeof(picoquic_packet_t));
+        quic->packet_pool = packet->next_packet;
+        quic->packet_pool_stats.nb_packets_in_pool--;
+        quic->packet_pool_stats.nb_packet_hits++;
+        bytes = packet->bytes;
+    } else {
+        packet = (picoquic_packet_t*)malloc(sizeof(picoquic_packet_t));
+        quic->packet_pool_stats.nb_packet_misses++;
+    }
+
+    if (packet != NULL) {
+        /* Packets in the pool may have lost their buffer when they were compacted */
+        if (bytes == NULL && (bytes = picoquic_create_packet_buffer(quic)) == NULL) {
+            free(packet);
+            packet = NULL;
+        } else {
+            memset(packet, 0, sizeof(picoquic_packet_t));
+            memset(bytes, 0, PICOQUIC_MAX_PACKET_SIZE);
+            packet->bytes = bytes;
+        }
     }
 
     return packet;
 }
 
+void picoquic_recycle_packet(picoquic_quic_t* quic, picoquic_packet_t* packet)
+{
+    if (packet->is_compacted) {
+        if (packet->bytes != NULL) {
+            if (packet->is_small_buffer) {
+                picoquic_recycle_small_buffer(quic, packet->bytes);
+            }
+            else {
+                free(packet->bytes);
+            }
+        }
+        packet->bytes = NULL;
+        packet->is_compacted = 0;
+        packet->is_small_buffer = 0;
+    }
+
+    if (quic->packet_pool_stats.nb_packets_in_pool < quic->packet_pool_max) {
+        packet->next_packet = quic->packet_pool;
+        quic->packet_pool = packet;
+        quic->packet_pool_stats.nb_packets_in_pool++;
+    } else {
+        if (packet->bytes != NULL) {
+            picoquic_recycle_packet_buffer(quic, packet->bytes);
+        }
+        free(packet);
+    }
+}
+
+/*
+ * Once a described packet is queued for retransmission, only keep the frames
+ * that may have to be repeated as they are, and return the full size buffer
+ * to the pool. Stream frames are rebuilt from the data that the stream retains
+ * until it is acknowledged. Frames that are never repeated, such as padding,
+ * are dropped, except for the ACK frames that are needed when the packet is
+ * acknowledged. The frames that are kept usually fit in a small buffer from
+ * the pool of the context.
+ */
+static void picoquic_compact_packet(picoquic_cnx_t* cnx, picoquic_packet_t* packet)
+{
+    size_t stored_length = 0;
+    uint8_t* stored = NULL;
+
+    for (uint16_t i = 0; i < packet->nb_frame_desc; i++) {
+        picoquic_frame_desc_t* desc = &packet->frame_desc[i];
+        int is_stored = 1;
+
+        if (PICOQUIC_IN_RANGE(desc->frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+            picoquic_stream_head* stream = picoquic_find_stream(cnx, desc->stream_id, 0);
+            is_stored = (stream != NULL && stream->send_not_retained);
+        } else if ((desc->flags & PICOQUIC_FRAME_DESC_PURE_ACK) != 0) {
+            is_stored = (desc->frame_type == picoquic_frame_type_ack || desc->frame_type == picoquic_frame_type_ack_ecn);
+        }
+
+        if (is_stored) {
+            stored_length += desc->frame_length;
+        } else {
+            desc->flags |= PICOQUIC_FRAME_DESC_NOT_STORED;
+        }
+    }
+
+    if (stored_length > 0) {
+        if (stored_length <= PICOQUIC_SMALL_PACKET_BUFFER_SIZE) {
+            stored = picoquic_create_small_buffer(cnx->quic);
+            packet->is_small_buffer = (stored != NULL);
+        }
+        else {
+            stored = (uint8_t*)malloc(stored_length);
+        }
+    }
+
+    if (stored_length > 0 && stored == NULL) {
+        /* Keep the full packet */
+        for (uint16_t i = 0; i < packet->nb_frame_desc; i++) {
+            packet->frame_desc[i].flags &= ~PICOQUIC_FRAME_DESC_NOT_STORED;
+        }
+    } else {
+        size_t byte_index = 0;
+
+        for (uint16_t i = 0; i < packet->nb_frame_desc; i++) {
+            picoquic_frame_desc_t* desc = &packet->frame_desc[i];
+
+            if ((desc->flags & PICOQUIC_FRAME_DESC_NOT_STORED) == 0) {
+                memcpy(stored + byte_index, packet->bytes + desc->frame_index, desc->frame_length);
+                desc->frame_index = (uint16_t)byte_index;
+                byte_index += desc->frame_length;
+            } else {
+                desc->frame_index = 0;
+            }
+        }
+
+        picoquic_recycle_packet_buffer(cnx->quic, packet->bytes);
+        packet->bytes = stored;
+        packet->is_compacted = 1;
+    }
+}
+
 void picoquic_update_payload_length(
     uint8_t* bytes, size_t pnum_index, size_t header_length, uint32_t packet_length)
 {
@@ -443,6 +797,49 @@ uint32_t picoquic_get_checksum_length(picoquic_cnx_t* cnx, int is_cleartext_mode
     return ret;
 }
 
+void picoquic_protect_packet_header(uint8_t* send_buffer, size_t pn_offset, void* pn_enc)
+{
+    /* The sample is located after the pn_offset, as if the PN was 4 bytes long */
+    size_t sample_offset = pn_offset + 4;
+    uint8_t first_byte = send_buffer[0];
+    uint8_t first_mask = ((first_byte & 0x80) == 0x80) ? 0x0F : 0x1F;
+    uint8_t mask_bytes[5] = { 0, 0, 0, 0, 0 };
+
+    picoquic_pn_encrypt(pn_enc, send_buffer + sample_offset, mask_bytes, mask_bytes, 5);
+    /* Encode the first byte */
+    send_buffer[0] ^= (mask_bytes[0] & first_mask);
+
+    /* Packet encoding is 1 to 4 bytes */
+    for (uint8_t i = 0; i < 4; i++) {
+        send_buffer[pn_offset + i] ^= mask_bytes[i + 1];
+    }
+}
+
+/* Leave the encryption of a 1-RTT packet to a crypto worker. The payload
+ * is copied after the header, so that the packet can be retransmitted or
+ * freed before the worker runs. */
+static uint32_t picoquic_defer_packet_protection(picoquic_quic_t* quic, uint8_t* bytes, uint64_t sequence_number,
+    uint32_t length, uint32_t header_length, uint8_t* send_buffer, uint32_t h_length, uint32_t pn_offset,
+    uint32_t aead_checksum_length, void* aead_context, void* pn_enc)
+{
+    picoquic_crypto_job_t* job = &quic->crypto_jobs[quic->nb_crypto_jobs++];
+
+    memcpy(send_buffer + h_length, bytes + header_length, length - header_length);
+
+    job->aead_context = aead_context;
+    job->pn_enc = pn_enc;
+    job->header = send_buffer;
+    job->header_length = h_length;
+    job->pn_offset = pn_offset;
+    job->input = send_buffer + h_length;
+    job->input_length = length - header_length;
+    job->output = send_buffer + h_length;
+    job->sequence_number = sequence_number;
+    job->result = 0;
+
+    return h_length + length - header_length + aead_checksum_length;
+}
+
 uint32_t picoquic_protect_packet(picoquic_cnx_t* cnx, 
     picoquic_packet_type_enum ptype,
     uint8_t * bytes, 
@@ -456,7 +853,6 @@ uint32_t picoquic_protect_packet(picoquic_cnx_t* cnx,
     uint32_t send_length;
     uint32_t h_length;
     uint32_t pn_offset = 0;
-    uint32_t sample_offset = 0;
     uint32_t pn_length = 0;
     uint32_t aead_checksum_length = (uint32_t)picoquic_aead_get_checksum_length(aead_context);
 
@@ -486,38 +882,28 @@ uint32_t picoquic_protect_packet(picoquic_cnx_t* cnx,
         }
     }
 
-    /* Encrypt the packet */
-    send_length = (uint32_t)picoquic_aead_encrypt_generic(send_buffer + /* header_length */ h_length,
-        bytes + header_length, length - header_length,
-        sequence_number, send_buffer, /* header_length */ h_length, aead_context);
-
-    send_length += /* header_length */ h_length;
-
-    /* if needed, log the segment before header protection is applied */
-    if (cnx->quic->F_log != NULL) {
-        picoquic_log_outgoing_segment(cnx->quic->F_log, 1, cnx,
-            bytes, sequence_number, length,
-            send_buffer, send_length);
+    if (ptype == picoquic_packet_1rtt_protected && cnx->quic->nb_crypto_jobs < cnx->quic->nb_crypto_jobs_max &&
+        cnx->quic->F_log == NULL) {
+        send_length = picoquic_defer_packet_protection(cnx->quic, bytes, sequence_number, length, header_length,
+            send_buffer, h_length, pn_offset, aead_checksum_length, aead_context, pn_enc);
     }
+    else {
+        /* Encrypt the packet */
+        send_length = (uint32_t)picoquic_aead_encrypt_generic(send_buffer + /* header_length */ h_length,
+            bytes + header_length, length - header_length,
+            sequence_number, send_buffer, /* header_length */ h_length, aead_context);
 
-    /* Next, encrypt the PN -- The sample is located after the pn_offset */
-    sample_offset = /* header_length */ pn_offset + 4;
-
-    if (pn_offset < sample_offset)
-    {
-        /* This is always true, as use pn_length = 4 */
-        uint8_t first_byte = send_buffer[0];
-        uint8_t first_mask = ((first_byte & 0x80) == 0x80) ? 0x0F : 0x1F;
-        uint8_t mask_bytes[5] = { 0, 0, 0, 0, 0 };
-
-        picoquic_pn_encrypt(pn_enc, send_buffer + sample_offset, mask_bytes, mask_bytes, 5);
-        /* Decode the first byte */
-        send_buffer[0] ^= (mask_bytes[0] & first_mask);
+        send_length += /* header_length */ h_length;
 
-        /* Packet encoding is 1 to 4 bytes */
-        for (uint8_t i = 0; i < 4; i++) {
-            send_buffer[pn_offset+i] ^= mask_bytes[i+1];
+        /* if needed, log the segment before header protection is applied */
+        if (cnx->quic->F_log != NULL) {
+            picoquic_log_outgoing_segment(cnx->quic->F_log, 1, cnx,
+                bytes, sequence_number, length,
+                send_buffer, send_length);
         }
+
+        /* Next, encrypt the PN */
+        picoquic_protect_packet_header(send_buffer, pn_offset, pn_enc);
     }
 
     return send_length;
@@ -607,6 +993,121 @@ void picoquic_update_pacing_after_send(picoquic_path_t * path_x, uint64_t curren
     }
 }
 
+/*
+ * Index of the retransmit queue by sequence number.
+ *
+ * Packets are queued in sequence number order, so the queued packets span
+ * the numbers from retransmit_oldest to retransmit_newest. The index is a
+ * ring of pointers covering that span. It grows when the span no longer fits,
+ * and is rebuilt from the queue at that point. If the allocation fails, the
+ * index is dropped and the lookups fall back to walking the queue, until the
+ * queue is empty again.
+ */
+
+#define PICOQUIC_RETRANSMIT_INDEX_MIN 64
+
+void picoquic_clear_retransmit_index(picoquic_packet_context_t* pkt_ctx)
+{
+    if (pkt_ctx->retransmit_index != NULL) {
+        free(pkt_ctx->retransmit_index);
+        pkt_ctx->retransmit_index = NULL;
+    }
+    pkt_ctx->retransmit_index_base = 0;
+    pkt_ctx->retransmit_index_size = 0;
+}
+
+static void picoquic_retransmit_index_grow(picoquic_packet_context_t* pkt_ctx, uint64_t span)
+{
+    size_t new_size = (pkt_ctx->retransmit_index_size == 0) ? PICOQUIC_RETRANSMIT_INDEX_MIN : pkt_ctx->retransmit_index_size;
+    picoquic_packet_t** new_index;
+
+    while (new_size < 2 * span) {
+        new_size *= 2;
+    }
+
+    new_index = (picoquic_packet_t**)malloc(new_size * sizeof(picoquic_packet_t*));
+
+    picoquic_clear_retransmit_index(pkt_ctx);
+
+    if (new_index != NULL) {
+        memset(new_index, 0, new_size * sizeof(picoquic_packet_t*));
+        pkt_ctx->retransmit_index = new_index;
+        pkt_ctx->retransmit_index_size = new_size;
+        pkt_ctx->retransmit_index_base = pkt_ctx->retransmit_oldest->sequence_number;
+
+        for (picoquic_packet_t* p = pkt_ctx->retransmit_oldest; p != NULL; p = p->previous_packet) {
+            new_index[p->sequence_number & (new_size - 1)] = p;
+        }
+    }
+}
+
+/* Called after the packet was added at the head of the queue */
+static void picoquic_retransmit_index_add(picoquic_packet_context_t* pkt_ctx, picoquic_packet_t* packet)
+{
+    uint64_t oldest = pkt_ctx->retransmit_oldest->sequence_number;
+
+    if (pkt_ctx->retransmit_index == NULL) {
+        if (packet->next_packet == NULL) {
+            picoquic_retransmit_index_grow(pkt_ctx, 1);
+        }
+    } else if (packet->next_packet != NULL && packet->next_packet->sequence_number >= packet->sequence_number) {
+        /* Not in sequence order, the ring cannot be used */
+        picoquic_clear_retransmit_index(pkt_ctx);
+    } else if (packet->sequence_number - pkt_ctx->retransmit_index_base >= pkt_ctx->retransmit_index_size) {
+        if (2 * (packet->sequence_number - oldest + 1) <= pkt_ctx->retransmit_index_size) {
+            /* The slots of the numbers below the oldest packet are empty, and
+             * can be reused for the new numbers. */
+            pkt_ctx->retransmit_index_base = oldest;
+        } else {
+            picoquic_retransmit_index_grow(pkt_ctx, packet->sequence_number - oldest + 1);
+        }
+    }
+
+    if (pkt_ctx->retransmit_index != NULL) {
+        pkt_ctx->retransmit_index[packet->sequence_number & (pkt_ctx->retransmit_index_size - 1)] = packet;
+    }
+}
+
+static void picoquic_retransmit_index_remove(picoquic_packet_context_t* pkt_ctx, picoquic_packet_t* packet)
+{
+    if (pkt_ctx->retransmit_index != NULL) {
+        picoquic_packet_t** slot = &pkt_ctx->retransmit_index[packet->sequence_number & (pkt_ctx->retransmit_index_size - 1)];
+
+        if (*slot == packet) {
+            *slot = NULL;
+        }
+    }
+}
+
+/* Find the queued packet with the highest sequence number lower or equal to
+ * the specified number. The queue is ordered from newest to oldest, so the
+ * caller can continue from the returned packet through next_packet. */
+picoquic_packet_t* picoquic_find_retransmit_packet_at_or_below(picoquic_packet_context_t* pkt_ctx, uint64_t sequence_number)
+{
+    picoquic_packet_t* p = pkt_ctx->retransmit_newest;
+
+    if (p != NULL && p->sequence_number > sequence_number) {
+        if (sequence_number < pkt_ctx->retransmit_oldest->sequence_number) {
+            p = NULL;
+        } else if (pkt_ctx->retransmit_index != NULL) {
+            uint64_t oldest = pkt_ctx->retransmit_oldest->sequence_number;
+            size_t mask = pkt_ctx->retransmit_index_size - 1;
+
+            /* The oldest packet is in the index, so the search always ends */
+            p = NULL;
+            for (uint64_t s = sequence_number; p == NULL && s >= oldest; s--) {
+                p = pkt_ctx->retransmit_index[s & mask];
+            }
+        } else {
+            while (p != NULL && p->sequence_number > sequence_number) {
+                p = p->next_packet;
+            }
+        }
+    }
+
+    return p;
+}
+
 /*
  * Final steps in packet transmission: queue for retransmission, etc
  */
@@ -627,6 +1128,13 @@ void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t * path_x
         packet->next_packet->previous_packet = packet;
     }
     cnx->pkt_ctx[pc].retransmit_newest = packet;
+    picoquic_retransmit_index_add(&cnx->pkt_ctx[pc], packet);
+
+    /* Summarize the frames, so acks and losses are processed without parsing the packet */
+    picoquic_describe_packet_frames(packet);
+    if (packet->is_described) {
+        picoquic_compact_packet(cnx, packet);
+    }
 
     if (!packet->is_ack_trap) {
         /* Account for bytes in transit, for congestion control */
@@ -641,6 +1149,8 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx, picoq
     uint32_t dequeued_length = p->length + p->checksum_overhead;
     picoquic_packet_context_enum pc = p->pc;
 
+    picoquic_retransmit_index_remove(&cnx->pkt_ctx[pc], p);
+
     if (p->previous_packet == NULL) {
         cnx->pkt_ctx[pc].retransmit_newest = p->next_packet;
     }
@@ -676,7 +1186,7 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx, picoq
     }
 
     if (should_free) {
-        free(p);
+        picoquic_recycle_packet(cnx->quic, p);
         p = NULL;
     }
     else {
@@ -725,7 +1235,7 @@ void picoquic_dequeue_retransmitted_packet(picoquic_cnx_t* cnx, picoquic_packet_
         p->next_packet->previous_packet = p->previous_packet;
     }
 
-    free(p);
+    picoquic_recycle_packet(cnx->quic, p);
 }
 
 /*
@@ -739,7 +1249,7 @@ void picoquic_insert_hole_in_send_sequence_if_needed(picoquic_cnx_t* cnx, uint64
         cnx->quic->sequence_hole_pseudo_period > 0 &&
         !cnx->pkt_ctx[0].retransmit_newest->is_ack_trap &&
         picoquic_public_uniform_random(cnx->quic->sequence_hole_pseudo_period) == 0) {
-        picoquic_packet_t* packet = picoquic_create_packet();
+        picoquic_packet_t* packet = picoquic_create_packet(cnx->quic);
 
         if (packet != NULL) {
             packet->is_ack_trap = 1;
@@ -930,9 +1440,9 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
             int packet_is_pure_ack = 1;
             int do_not_detect_spurious = 1;
             int frame_is_pure_ack = 0;
-            uint8_t* old_bytes = p->bytes;
-            size_t frame_length = 0;
-            size_t byte_index = 0; /* Used when parsing the old packet */
+            size_t cursor = 0; /* Used when iterating over the old packet frames */
+            picoquic_frame_desc_t scratch;
+            picoquic_frame_desc_t* desc;
             size_t checksum_length = 0;
 
 	        /* we'll report it where it got lost */
@@ -945,18 +1455,14 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
             if (p->ptype == picoquic_packet_0rtt_protected) {
                 /* Only retransmit as 0-RTT if contains crypto data */
                 int contains_crypto = 0;
-                byte_index = p->offset;
 
                 if (p->is_evaluated == 0) {
-                    while (ret == 0 && byte_index < p->length) {
-                        if (old_bytes[byte_index] == picoquic_frame_type_crypto_hs) {
+                    while ((desc = picoquic_next_frame_desc(p, &cursor, &scratch)) != NULL) {
+                        if (desc->frame_type == picoquic_frame_type_crypto_hs) {
                             contains_crypto = 1;
                             packet_is_pure_ack = 0;
                             break;
                         }
-                        ret = picoquic_skip_frame(&p->bytes[byte_index],
-                            p->length - byte_index, &frame_length, &frame_is_pure_ack);
-                        byte_index += frame_length;
                     }
                     p->contains_crypto = contains_crypto;
                     p->is_pure_ack = packet_is_pure_ack;
@@ -1013,28 +1519,43 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
                     checksum_length = picoquic_get_checksum_length(cnx, *is_cleartext_mode);
 
                     /* Copy the relevant bytes from one packet to the next */
-                    byte_index = p->offset;
+                    while (ret == 0 && (desc = picoquic_next_frame_desc(p, &cursor, &scratch)) != NULL) {
+                        uint8_t rebuilt[PICOQUIC_MAX_PACKET_SIZE];
+                        uint8_t* frame_bytes = rebuilt;
+                        size_t frame_length = 0;
 
-                    while (ret == 0 && byte_index < p->length) {
-                        ret = picoquic_skip_frame(&p->bytes[byte_index],
-                            p->length - byte_index, &frame_length, &frame_is_pure_ack);
+                        frame_is_pure_ack = (desc->flags & PICOQUIC_FRAME_DESC_PURE_ACK) != 0;
 
                         /* Check whether the data was already acked, which may happen in 
                          * case of spurious retransmissions */
-                        if (ret == 0 && frame_is_pure_ack == 0) {
-                            ret = picoquic_check_frame_needs_repeat(cnx, &p->bytes[byte_index],
-                                frame_length, &frame_is_pure_ack);
+                        if (frame_is_pure_ack == 0) {
+                            ret = picoquic_check_frame_needs_repeat(cnx, desc, &frame_is_pure_ack);
+                        }
+
+                        if (ret == 0 && !frame_is_pure_ack) {
+                            if ((desc->flags & PICOQUIC_FRAME_DESC_NOT_STORED) == 0) {
+                                frame_bytes = &p->bytes[desc->frame_index];
+                                frame_length = desc->frame_length;
+                            } else {
+                                /* Stream frame, rebuilt from the data retained by the stream */
+                                ret = picoquic_rebuild_stream_frame(picoquic_find_stream(cnx, desc->stream_id, 0),
+                                    desc, rebuilt, sizeof(rebuilt), &frame_length);
+                                if (ret == 0 && frame_length == 0) {
+                                    /* All the data was acknowledged in the mean time */
+                                    frame_is_pure_ack = 1;
+                                }
+                            }
                         }
 
                         /* Prepare retransmission if needed */
                         if (ret == 0 && !frame_is_pure_ack) {
-                            if (PICOQUIC_IN_RANGE(p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+                            if (PICOQUIC_IN_RANGE(desc->frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
                                 uint8_t overflow[PICOQUIC_MAX_PACKET_SIZE];
                                 size_t copied_length = 0;
                                 size_t overflow_length = 0;
 
                                 /* By default, copy to new frame, but if that does not fit also create overflow frame */
-                                ret = picoquic_split_stream_frame(&p->bytes[byte_index], frame_length,
+                                ret = picoquic_split_stream_frame(frame_bytes, frame_length,
                                     &new_bytes[length], path_x->send_mtu - length - checksum_length, &copied_length,
                                     overflow, sizeof(overflow), &overflow_length);
 
@@ -1046,12 +1567,11 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
                                 }
                             }
                             else {
-                                memcpy(&new_bytes[length], &p->bytes[byte_index], frame_length);
+                                memcpy(&new_bytes[length], frame_bytes, frame_length);
                                 length += (uint32_t)frame_length;
                             }
                             packet_is_pure_ack = 0;
                         }
-                        byte_index += frame_length;
                     }
                 }
 
@@ -1135,23 +1655,15 @@ int picoquic_is_cnx_backlog_empty(picoquic_cnx_t* cnx)
 
         while (p != NULL && backlog_empty == 1) {
             /* check if this is an ACK only packet */
-            int ret = 0;
-            int frame_is_pure_ack = 0;
-            size_t frame_length = 0;
-            size_t byte_index = 0; /* Used when parsing the old packet */
-
-            byte_index = p->offset;
-
+            size_t cursor = 0;
+            picoquic_frame_desc_t scratch;
+            picoquic_frame_desc_t* desc;
 
-            while (ret == 0 && byte_index < p->length) {
-                ret = picoquic_skip_frame(&p->bytes[byte_index],
-                    p->length - p->offset, &frame_length, &frame_is_pure_ack);
-
-                if (!frame_is_pure_ack) {
+            while ((desc = picoquic_next_frame_desc(p, &cursor, &scratch)) != NULL) {
+                if ((desc->flags & PICOQUIC_FRAME_DESC_PURE_ACK) == 0) {
                     backlog_empty = 0;
                     break;
                 }
-                byte_index += frame_length;
             }
 
             p = p->previous_packet;
@@ -1989,7 +2501,7 @@ int picoquic_prepare_packet_closing(picoquic_cnx_t* cnx, picoquic_path_t * path_
     case picoquic_state_handshake_failure:
         /* TODO: check whether closing can be requested in "initial" mode */
         if (cnx->crypto_context[2].aead_encrypt != NULL &&
-            cnx->pkt_ctx[picoquic_packet_context_handshake].first_sack_item.start_of_sack_range != (uint64_t)((int64_t)-1)) {
+            !picoquic_sack_list_is_empty(&cnx->pkt_ctx[picoquic_packet_context_handshake].sack_list)) {
             pc = picoquic_packet_context_handshake;
             packet_type = picoquic_packet_handshake;
         }
@@ -2700,7 +3212,7 @@ int picoquic_prepare_probe(picoquic_cnx_t* cnx,
         if (probe != NULL)
         {
             
-            packet = picoquic_create_packet();
+            packet = picoquic_create_packet(cnx->quic);
 
             if (packet == NULL) {
                 ret = PICOQUIC_ERROR_MEMORY;
@@ -2822,7 +3334,7 @@ static int picoquic_prepare_alt_challenge(picoquic_cnx_t* cnx,
                     current_time >= cnx->path[i]->alt_challenge_timeout))
                 || cnx->path[i]->alt_response_required)
                 && !cnx->path[i]->path_is_demoted) {
-                packet = picoquic_create_packet();
+                packet = picoquic_create_packet(cnx->quic);
 
                 if (packet == NULL) {
                     ret = PICOQUIC_ERROR_MEMORY;
@@ -2999,7 +3511,7 @@ int picoquic_prepare_packet(picoquic_cnx_t* cnx,
                 }
             }
 
-            packet = picoquic_create_packet();
+            packet = picoquic_create_packet(cnx->quic);
 
             if (packet == NULL) {
                 ret = PICOQUIC_ERROR_MEMORY;
@@ -3014,14 +3526,14 @@ int picoquic_prepare_packet(picoquic_cnx_t* cnx,
                     if (packet->length == 0 ||
                         packet->ptype == picoquic_packet_1rtt_protected) {
                         if (packet->length == 0) {
-                            free(packet);
+                            picoquic_recycle_packet(cnx->quic, packet);
                             packet = NULL;
                         }
                         break;
                     }
                 }
                 else {
-                    free(packet);
+                    picoquic_recycle_packet(cnx->quic, packet);
                     packet = NULL;
 
                     if (*send_length != 0) {
@@ -3050,6 +3562,79 @@ int picoquic_prepare_packet(picoquic_cnx_t* cnx,
     return ret;
 }
 
+int picoquic_prepare_packets(picoquic_cnx_t* cnx, uint64_t current_time,
+    picoquic_send_datagram_t* datagrams, int nb_datagrams, int* nb_prepared)
+{
+    int ret = 0;
+
+    *nb_prepared = 0;
+
+    while (ret == 0 && *nb_prepared < nb_datagrams) {
+        picoquic_send_datagram_t* datagram = &datagrams[*nb_prepared];
+
+        ret = picoquic_prepare_packet(cnx, current_time, datagram->bytes, datagram->bytes_max, &datagram->length,
+            &datagram->addr_to, &datagram->addr_to_len, &datagram->addr_from, &datagram->addr_from_len);
+
+        if (datagram->length == 0) {
+            break;
+        }
+
+        datagram->if_index = picoquic_get_local_if_index(cnx);
+        *nb_prepared += 1;
+    }
+
+    return ret;
+}
+
+/* The next packet can be added to a series of segments if it will be sent on the
+ * default path, to the same address as the previous ones */
+static int picoquic_is_next_segment_possible(picoquic_cnx_t* cnx)
+{
+    return cnx->nb_paths == 1 && cnx->probe_first == NULL &&
+        !cnx->path[0]->alt_challenge_required && !cnx->path[0]->alt_response_required;
+}
+
+int picoquic_prepare_segments(picoquic_cnx_t* cnx, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length, size_t* segment_size,
+    struct sockaddr_storage* p_addr_to, int* to_len, struct sockaddr_storage* p_addr_from, int* from_len)
+{
+    int ret = 0;
+    int nb_segments = 0;
+    size_t segment_length = 0;
+
+    *send_length = 0;
+    *segment_size = 0;
+
+    ret = picoquic_prepare_packet(cnx, current_time, send_buffer,
+        (send_buffer_max > PICOQUIC_MAX_PACKET_SIZE) ? PICOQUIC_MAX_PACKET_SIZE : send_buffer_max,
+        &segment_length, p_addr_to, to_len, p_addr_from, from_len);
+
+    if (segment_length > 0) {
+        *send_length = segment_length;
+        *segment_size = segment_length;
+        nb_segments = 1;
+
+        /* Add full size 1-RTT packets, until a shorter one ends the series */
+        while (ret == 0 && segment_length == *segment_size && *segment_size >= cnx->path[0]->send_mtu &&
+            nb_segments < PICOQUIC_MAX_SEGMENTS_PER_SEND &&
+            *send_length + *segment_size <= send_buffer_max &&
+            (send_buffer[*send_length - segment_length] & 0x80) == 0 &&
+            picoquic_is_next_segment_possible(cnx)) {
+            ret = picoquic_prepare_packet(cnx, current_time, send_buffer + *send_length, *segment_size,
+                &segment_length, NULL, NULL, NULL, NULL);
+
+            if (segment_length == 0) {
+                break;
+            }
+
+            *send_length += segment_length;
+            nb_segments++;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_close(picoquic_cnx_t* cnx, uint16_t reason_code)
 {
     int ret = 0;
@@ -29,6 +29,7 @@
 #include "picotls/minicrypto.h"
 #include "picotls/ffx.h"
 #include "tls_api.h"
+#include "picothread.h"
 #include <openssl/pem.h>
 #include <openssl/err.h>
 #include <openssl/engine.h>
@@ -203,8 +204,11 @@ uint64_t picoquic_crypto_uniform_random(picoquic_quic_t* quic, uint64_t rnd_max)
  * that it cannot be broken.
  */
 
-static uint64_t public_random_seed[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
-static int public_random_index = 0;
+/* The generator state is per thread, so that the threads that each run their own
+ * QUIC context do not race on it. Each of these threads shall call
+ * picoquic_public_random_seed before using its context. */
+static PICOQUIC_THREAD_LOCAL uint64_t public_random_seed[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+static PICOQUIC_THREAD_LOCAL int public_random_index = 0;
 static const uint64_t public_random_multiplier = 1181783497276652981ull;
 
 uint64_t picoquic_public_random_64(void)
@@ -1457,36 +1461,8 @@ static int picoquic_add_to_tls_stream(picoquic_cnx_t* cnx, const uint8_t* data,
     picoquic_stream_head* stream = &cnx->tls_stream[epoch];
 
     if (length > 0) {
-        picoquic_stream_data* stream_data = (picoquic_stream_data*)malloc(sizeof(picoquic_stream_data));
+        ret = picoquic_queue_stream_data(stream, data, length, NULL, NULL);
 
-        if (stream_data == 0) {
-            ret = -1;
-        }
-        else {
-            stream_data->bytes = (uint8_t*)malloc(length);
-
-            if (stream_data->bytes == NULL) {
-                free(stream_data);
-                stream_data = NULL;
-                ret = -1;
-            }
-            else {
-                picoquic_stream_data** pprevious = &stream->send_queue;
-                picoquic_stream_data* next = stream->send_queue;
-
-                memcpy(stream_data->bytes, data, length);
-                stream_data->length = length;
-                stream_data->offset = 0;
-                stream_data->next_stream_data = NULL;
-
-                while (next != NULL) {
-                    pprevious = &next->next_stream_data;
-                    next = next->next_stream_data;
-                }
-
-                *pprevious = stream_data;
-            }
-        }
 #if 0
         picoquic_cnx_set_next_wake_time(cnx, picoquic_get_quic_time(cnx->quic));
 #else
@@ -1715,7 +1691,8 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx)
 
     for (size_t epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS && ret == 0; epoch++) {
         picoquic_stream_head* stream = &cnx->tls_stream[epoch];
-        picoquic_stream_data* data = stream->stream_data;
+        uint8_t* data;
+        size_t data_length = 0;
         size_t processed = 0;
         int data_pushed = 0;
 
@@ -1725,7 +1702,9 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx)
             if (epoch > next_epoch) {
                 break;
             } else {
-                if (data != NULL && data->offset > stream->consumed_offset) {
+                if (!picoquic_sack_list_is_empty(&stream->receive_ranges) &&
+                    picoquic_sack_list_last(&stream->receive_ranges) >= stream->consumed_offset &&
+                    picoquic_get_stream_data_span(stream, stream->consumed_offset, &data_length) == NULL) {
                     /* Protocol error: data received that could not be read */
 #ifdef _DEBUG
                     DBG_PRINTF("Connection error - TLS data at epoch %d, expected %d.\n",
@@ -1739,16 +1718,15 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx)
         }
 
         while ((ret == 0 || ret == PTLS_ERROR_IN_PROGRESS) &&
-            data != NULL && data->offset <= stream->consumed_offset) {
+            (data = picoquic_get_stream_data_span(stream, stream->consumed_offset, &data_length)) != NULL) {
             struct st_ptls_buffer_t sendbuf;
-            size_t start = (size_t)(stream->consumed_offset - data->offset);
-            size_t epoch_data = data->length - start;
+            size_t epoch_data = data_length;
             size_t send_offset[PICOQUIC_NUMBER_OF_EPOCH_OFFSETS] = { 0, 0, 0, 0, 0 };
 
             ptls_buffer_init(&sendbuf, "", 0);
 
             ret = ptls_handle_message(ctx->tls, &sendbuf, send_offset, epoch,
-                data->bytes + start, epoch_data, &ctx->handshake_properties);
+                data, epoch_data, &ctx->handshake_properties);
 
 #ifdef _DEBUG
             if (cnx->cnx_state < picoquic_state_ready) {
@@ -1770,13 +1748,6 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx)
             stream->consumed_offset += epoch_data;
             processed += epoch_data;
 
-            if (start + epoch_data >= data->length) {
-                free(data->bytes);
-                cnx->tls_stream[epoch].stream_data = data->next_stream_data;
-                free(data);
-                data = cnx->tls_stream[epoch].stream_data;
-            }
-
             ptls_buffer_dispose(&sendbuf);
         }
 
@@ -586,6 +586,7 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
 
                                 cnx->max_stream_id_bidir_remote =
                                     (cnx->remote_parameters.initial_max_stream_id_bidir == 0xFFFFFFFF) ? 0 : cnx->remote_parameters.initial_max_stream_id_bidir;
+                                picoquic_update_ready_stream_list(cnx);
 
                                 break;
                             case picoquic_tp_idle_timeout:
@@ -620,6 +621,7 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
 
                                 cnx->max_stream_id_unidir_remote =
                                     (cnx->remote_parameters.initial_max_stream_id_unidir == 0xFFFFFFFF) ? 0 : cnx->remote_parameters.initial_max_stream_id_unidir;
+                                picoquic_update_ready_stream_list(cnx);
 
                                 break;
                             case picoquic_tp_server_preferred_address:
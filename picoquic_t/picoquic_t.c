@@ -42,8 +42,17 @@ typedef enum {
 
 static const picoquic_test_def_t test_table[] = {
     { "picohash", picohash_test },
+    { "picohash_oa", picohash_oa_test },
+    { "picohash_bench", picohash_bench_test },
+    { "picohash_siphash", picohash_siphash_test },
     { "splay", splay_test },
     { "cnxcreation", cnxcreation_test },
+    { "wake_list", wake_list_test },
+    { "packet_pool", packet_pool_test },
+    { "arena", arena_test },
+    { "cnx_slab", cnx_slab_test },
+    { "cnx_layout", cnx_layout_test },
+    { "frame_desc", frame_desc_test },
     { "parseheader", parseheadertest },
     { "pn2pn64", pn2pn64test },
     { "intformat", intformattest },
@@ -56,9 +65,17 @@ static const picoquic_test_def_t test_table[] = {
     { "logger", logger_test },
     { "TlsStreamFrame", TlsStreamFrameTest },
     { "StreamZeroFrame", StreamZeroFrameTest },
+    { "stream_tree", stream_tree_test },
+    { "ready_stream", ready_stream_test },
+    { "stream_gc", stream_gc_test },
+    { "stream_reassembly", stream_reassembly_test },
+    { "zero_copy_send", zero_copy_send_test },
+    { "stream_retransmit", stream_retransmit_test },
     { "split_stream_frame", split_stream_frame_test },
     { "sendack", sendacktest },
     { "ackrange", ackrange_test },
+    { "retransmit_index", retransmit_index_test },
+    { "sack_bound", sack_bound_test },
     { "ack_of_ack", ack_of_ack_test },
     { "sim_link", sim_link_test },
     { "clear_text_aead", cleartext_aead_test },
@@ -103,6 +120,15 @@ static const picoquic_test_def_t test_table[] = {
     { "keep_alive", keep_alive_test },
     { "sockets", socket_test },
     { "socket_ecn", socket_ecn_test },
+    { "socket_batch", socket_batch_test },
+    { "socket_send_batch", socket_send_batch_test },
+    { "socket_gso", socket_gso_test },
+    { "socket_gro", socket_gro_test },
+    { "socket_loop", socket_loop_test },
+    { "socket_uring", socket_uring_test },
+    { "socket_shard", socket_shard_test },
+    { "socket_command", socket_command_test },
+    { "crypto_pool", crypto_pool_test },
     { "ticket_store", ticket_store_test },
     { "token_store", token_store_test },
     { "session_resume", session_resume_test },
@@ -111,6 +137,7 @@ static const picoquic_test_def_t test_table[] = {
     { "stop_sending", stop_sending_test },
     { "unidir", unidir_test },
     { "mtu_discovery", mtu_discovery_test },
+    { "gso_prepare", gso_prepare_test },
     { "spurious_retransmit", spurious_retransmit_test },
     { "tls_zero_share", tls_zero_share_test },
     { "transport_param_log", transport_param_log_test },
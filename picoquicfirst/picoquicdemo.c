@@ -101,6 +101,8 @@ static const char* token_store_filename = "demo_token_store.bin";
 #include "picoquic.h"
 #include "picoquic_internal.h"
 #include "picosocks.h"
+#include "picoloop.h"
+#include "picoshard.h"
 #include "util.h"
 #include "h3zero.c"
 #include "democlient.h"
@@ -160,34 +162,45 @@ static void picoquic_set_key_log_file_from_env(picoquic_quic_t* quic)
     picoquic_set_key_log_file(quic, F);
 }
 
+#define PICOQUIC_DEMO_SERVER_RECEIVE_BATCH 32
+#define PICOQUIC_DEMO_SERVER_SEND_BATCH 32
+
 int quic_server(const char* server_name, int server_port,
     const char* pem_cert, const char* pem_key,
     int just_once, int do_hrr, picoquic_connection_id_cb_fn cnx_id_callback,
     void* cnx_id_callback_ctx, uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE],
-    int dest_if, int mtu_max, uint32_t proposed_version)
+    int dest_if, int mtu_max, uint32_t proposed_version, int use_io_uring)
 {
     /* Start: start the QUIC process with cert and key files */
     int ret = 0;
     picoquic_quic_t* qserver = NULL;
     picoquic_cnx_t* cnx_server = NULL;
     picoquic_cnx_t* cnx_next = NULL;
+    picoquic_event_loop_t* loop = NULL;
     picoquic_server_sockets_t server_sockets;
-    struct sockaddr_storage addr_from;
-    struct sockaddr_storage addr_to;
-    unsigned long if_index_to;
+    picoquic_recv_datagram_t* datagrams = NULL;
     struct sockaddr_storage client_from;
-    socklen_t from_length;
-    socklen_t to_length;
-    uint8_t buffer[1536];
-    uint8_t send_buffer[1536];
-    size_t send_length = 0;
-    int bytes_recv;
+    picoquic_send_datagram_t* send_datagrams = NULL;
+    uint8_t* send_buffers = NULL;
+    int nb_send = 0;
+    int nb_recv;
     uint64_t current_time = 0;
     picoquic_stateless_packet_t* sp;
     int64_t delay_max = 10000000;
 
-    /* Open a UDP socket */
-    ret = picoquic_open_server_sockets(&server_sockets, server_port);
+    /* Allocate the buffers of the send batch */
+    send_datagrams = (picoquic_send_datagram_t*)malloc(PICOQUIC_DEMO_SERVER_SEND_BATCH * sizeof(picoquic_send_datagram_t));
+    send_buffers = (uint8_t*)malloc(PICOQUIC_DEMO_SERVER_SEND_BATCH * PICOQUIC_MAX_PACKET_SIZE);
+
+    if (send_datagrams == NULL || send_buffers == NULL) {
+        printf("Could not allocate the send buffers\n");
+        ret = -1;
+    } else {
+        for (int i = 0; i < PICOQUIC_DEMO_SERVER_SEND_BATCH; i++) {
+            send_datagrams[i].bytes = send_buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+            send_datagrams[i].bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+        }
+    }
 
     /* Wait for packets and process them */
     if (ret == 0) {
@@ -214,47 +227,61 @@ int quic_server(const char* server_name, int server_port,
         }
     }
 
+    /* Open the UDP sockets in an event loop, which receives the packets in batches */
+    if (ret == 0) {
+        loop = picoquic_event_loop_create(qserver, PICOQUIC_DEMO_SERVER_RECEIVE_BATCH, PICOQUIC_MAX_PACKET_SIZE);
+
+        if (loop == NULL) {
+            printf("Could not create the event loop\n");
+            ret = -1;
+        } else if ((ret = picoquic_event_loop_open_server_sockets(loop, server_port)) != 0) {
+            printf("Could not open the server sockets\n");
+        } else {
+            if (use_io_uring) {
+                if (picoquic_event_loop_set_io_uring(loop) == 0) {
+                    printf("Using io_uring for the server sockets\n");
+                } else {
+                    printf("io_uring is not supported, using the default socket loop\n");
+                }
+            }
+            /* The loop holds the IPv6 and IPv4 sockets in the order of the server sockets */
+            for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
+                server_sockets.s_socket[i] = loop->s_socket[i];
+            }
+            datagrams = loop->datagrams;
+        }
+    }
+
     /* Wait for packets */
     while (ret == 0 && (just_once == 0 || cnx_server == NULL || picoquic_get_cnx_state(cnx_server) != picoquic_state_disconnected)) {
         int64_t delta_t = picoquic_get_next_wake_delay(qserver, current_time, delay_max);
         uint64_t time_before = current_time;
-        unsigned char received_ecn;
-
-        from_length = to_length = sizeof(struct sockaddr_storage);
-        if_index_to = 0;
 
         if (just_once != 0 && delta_t > 10000 && cnx_server != NULL) {
             picoquic_log_congestion_state(stdout, cnx_server, current_time);
         }
 
-        bytes_recv = picoquic_select(server_sockets.s_socket, PICOQUIC_NB_SERVER_SOCKETS,
-            &addr_from, &from_length,
-            &addr_to, &to_length, &if_index_to, &received_ecn,
-            buffer, sizeof(buffer),
-            delta_t, &current_time);
+        nb_recv = picoquic_event_loop_wait(loop, delay_max, &current_time);
 
         if (just_once != 0) {
-            if (bytes_recv > 0) {
-                printf("Select returns %d, from length %d after %d us (wait for %d us)\n",
-                    bytes_recv, from_length, (int)(current_time - time_before), (int)delta_t);
-                print_address((struct sockaddr*)&addr_from, "recv from:", picoquic_null_connection_id);
+            if (nb_recv > 0) {
+                for (int i = 0; i < nb_recv; i++) {
+                    printf("Select returns %d, from length %d after %d us (wait for %d us)\n",
+                        datagrams[i].length, datagrams[i].from_length, (int)(current_time - time_before), (int)delta_t);
+                    print_address((struct sockaddr*)&datagrams[i].addr_from, "recv from:", picoquic_null_connection_id);
+                }
             } else {
-                printf("Select return %d, after %d us (wait for %d us)\n", bytes_recv,
+                printf("Select return %d, after %d us (wait for %d us)\n", nb_recv,
                     (int)(current_time - time_before), (int)delta_t);
             }
         }
 
-        if (bytes_recv < 0) {
+        if (nb_recv < 0) {
             ret = -1;
         } else {
-            uint64_t loop_time;
-
-            if (bytes_recv > 0) {
+            for (int i = 0; i < nb_recv; i++) {
                 /* Submit the packet to the server */
-                ret = picoquic_incoming_packet(qserver, buffer,
-                    (size_t)bytes_recv, (struct sockaddr*)&addr_from,
-                    (struct sockaddr*)&addr_to, if_index_to, received_ecn,
-                    current_time);
+                ret = picoquic_event_loop_incoming(loop, i);
 
                 if (ret != 0) {
                     ret = 0;
@@ -265,17 +292,15 @@ int quic_server(const char* server_name, int server_port,
                     printf("%" PRIx64 ": ", picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx_server)));
                     picoquic_log_time(stdout, cnx_server, picoquic_current_time(), "", " : ");
                     printf("Connection established, state = %d, from length: %d\n",
-                        picoquic_get_cnx_state(picoquic_get_first_cnx(qserver)), from_length);
+                        picoquic_get_cnx_state(picoquic_get_first_cnx(qserver)), datagrams[i].from_length);
                     memset(&client_from, 0, sizeof(client_from));
-                    memcpy(&client_from, &addr_from, from_length);
+                    memcpy(&client_from, &datagrams[i].addr_from, datagrams[i].from_length);
 
                     print_address((struct sockaddr*)&client_from, "Client address:",
                         picoquic_get_logging_cnxid(cnx_server));
                     picoquic_log_transport_extension(stdout, cnx_server, 1);
                 }
             }
-            loop_time = current_time;
-
             while ((sp = picoquic_dequeue_stateless_packet(qserver)) != NULL) {
                 (void)picoquic_send_through_server_sockets(&server_sockets,
                     (struct sockaddr*)&sp->addr_to,
@@ -289,18 +314,38 @@ int quic_server(const char* server_name, int server_port,
 
                 fflush(stdout);
 
-                picoquic_delete_stateless_packet(sp);
+                picoquic_recycle_stateless_packet(qserver, sp);
             }
 
-            while (ret == 0 && (cnx_next = picoquic_get_earliest_cnx_to_wake(qserver, loop_time)) != NULL) {
-                int peer_addr_len = 0;
-                struct sockaddr_storage peer_addr;
-                int local_addr_len = 0;
-                struct sockaddr_storage local_addr;
+            /* Prepare the packets of the connections that are due, and send them in batches */
+            while (ret == 0 && (cnx_next = picoquic_event_loop_next_cnx(loop)) != NULL) {
+                int nb_prepared = 0;
+
+                if (nb_send >= PICOQUIC_DEMO_SERVER_SEND_BATCH) {
+                    (void)picoquic_event_loop_send_batch(loop, send_datagrams, nb_send);
+                    nb_send = 0;
+                }
+
+                ret = picoquic_prepare_packets(cnx_next, current_time,
+                    send_datagrams + nb_send, PICOQUIC_DEMO_SERVER_SEND_BATCH - nb_send, &nb_prepared);
 
-                ret = picoquic_prepare_packet(cnx_next, current_time,
-                    send_buffer, sizeof(send_buffer), &send_length,
-                    &peer_addr, &peer_addr_len, &local_addr, &local_addr_len);
+                if (nb_prepared > 0) {
+                    if (just_once != 0 ||
+                        cnx_next->cnx_state < picoquic_state_server_false_start ||
+                        cnx_next->cnx_state >= picoquic_state_disconnecting) {
+                        printf("%" PRIx64 ": ", picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx_next)));
+                        printf("Connection state = %d\n",
+                            picoquic_get_cnx_state(cnx_next));
+                    }
+
+                    if (dest_if != -1) {
+                        for (int i = 0; i < nb_prepared; i++) {
+                            send_datagrams[nb_send + i].if_index = dest_if;
+                        }
+                    }
+
+                    nb_send += nb_prepared;
+                }
 
                 if (ret == PICOQUIC_ERROR_DISCONNECTED) {
                     ret = 0;
@@ -321,27 +366,14 @@ int quic_server(const char* server_name, int server_port,
 
                     break;
                 }
-                else if (ret == 0) {
-
-                    if (send_length > 0) {
-                        if (just_once != 0 ||
-                            cnx_next->cnx_state < picoquic_state_server_false_start ||
-                            cnx_next->cnx_state >= picoquic_state_disconnecting) {
-                            printf("%" PRIx64 ": ", picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx_next)));
-                            printf("Connection state = %d\n",
-                                picoquic_get_cnx_state(cnx_next));
-                        }
-
-                        (void)picoquic_send_through_server_sockets(&server_sockets,
-                            (struct sockaddr *)&peer_addr, peer_addr_len, (struct sockaddr *)&local_addr, local_addr_len,
-                            dest_if == -1 ? picoquic_get_local_if_index(cnx_next) : dest_if,
-                            (const char*)send_buffer, (int)send_length);
-                    }
-                }
-                else {
+                else if (ret != 0) {
                     break;
                 }
+            }
 
+            if (nb_send > 0) {
+                (void)picoquic_event_loop_send_batch(loop, send_datagrams, nb_send);
+                nb_send = 0;
             }
         }
     }
@@ -353,7 +385,92 @@ int quic_server(const char* server_name, int server_port,
         picoquic_free(qserver);
     }
 
-    picoquic_close_server_sockets(&server_sockets);
+    if (loop != NULL) {
+        picoquic_event_loop_delete(loop);
+    }
+
+    if (send_datagrams != NULL) {
+        free(send_datagrams);
+    }
+
+    if (send_buffers != NULL) {
+        free(send_buffers);
+    }
+
+    return ret;
+}
+
+/* Parameters of the QUIC contexts of the sharded server */
+typedef struct st_picoquic_demo_shard_ctx_t {
+    const char* pem_cert;
+    const char* pem_key;
+    int do_hrr;
+    int mtu_max;
+    uint8_t* reset_seed;
+} picoquic_demo_shard_ctx_t;
+
+static picoquic_quic_t* picoquic_demo_shard_create_quic(int worker_id,
+    picoquic_connection_id_cb_fn cnx_id_callback, void* cnx_id_callback_ctx,
+    uint64_t current_time, void* app_ctx)
+{
+    picoquic_demo_shard_ctx_t* ctx = (picoquic_demo_shard_ctx_t*)app_ctx;
+    picoquic_quic_t* qserver = picoquic_create(8, ctx->pem_cert, ctx->pem_key, NULL, NULL,
+        picoquic_demo_server_callback, NULL, cnx_id_callback, cnx_id_callback_ctx, ctx->reset_seed,
+        current_time, NULL, NULL, NULL, 0);
+
+    if (qserver == NULL) {
+        printf("Could not create the context of worker %d\n", worker_id);
+    } else {
+        if (ctx->do_hrr != 0) {
+            picoquic_set_cookie_mode(qserver, 1);
+        }
+        qserver->mtu_max = ctx->mtu_max;
+
+        picoquic_set_default_congestion_algorithm(qserver, picoquic_cubic_algorithm);
+    }
+
+    return qserver;
+}
+
+/* Run the server with one context per worker thread. The workers do not log
+ * the packets, as their logs would be mixed. */
+int quic_sharded_server(int server_port, const char* pem_cert, const char* pem_key,
+    int do_hrr, uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE], int mtu_max,
+    int nb_workers, int use_io_uring)
+{
+    int ret = 0;
+    picoquic_demo_shard_ctx_t ctx;
+    picoquic_shard_server_t* server;
+
+    ctx.pem_cert = pem_cert;
+    ctx.pem_key = pem_key;
+    ctx.do_hrr = do_hrr;
+    ctx.mtu_max = mtu_max;
+    ctx.reset_seed = reset_seed;
+
+    server = picoquic_shard_server_create(nb_workers, server_port, picoquic_demo_shard_create_quic, &ctx,
+        picoquic_current_time());
+
+    if (server == NULL) {
+        printf("Could not create the sharded server\n");
+        ret = -1;
+    } else {
+        picoquic_shard_server_set_io_uring(server, use_io_uring);
+
+        if ((ret = picoquic_shard_server_start(server)) != 0) {
+            printf("Could not start the workers\n");
+        } else {
+            printf("Started %d workers\n", nb_workers);
+        }
+
+        if (picoquic_shard_server_wait(server) != 0 && ret == 0) {
+            ret = -1;
+        }
+
+        picoquic_shard_server_delete(server);
+    }
+
+    printf("Server exit, ret = %d\n", ret);
 
     return ret;
 }
@@ -380,6 +497,7 @@ static const picoquic_demo_stream_desc_t test_scenario[] = {
 static const size_t test_scenario_nb = sizeof(test_scenario) / sizeof(picoquic_demo_stream_desc_t);
 
 #define PICOQUIC_DEMO_CLIENT_MAX_RECEIVE_BATCH 4
+#define PICOQUIC_DEMO_CLIENT_RECEIVE_BUFFER_SIZE 0x10000
 
 /* Client client migration to a new port number: 
  *  - close the current socket.
@@ -409,6 +527,7 @@ int quic_client_migrate(picoquic_cnx_t * cnx, SOCKET_TYPE * fd, struct sockaddr
         else {
             SOCKET_CLOSE(*fd);
             *fd = fd_m;
+            (void)picoquic_socket_set_gro(*fd);
         }
     }
 
@@ -500,7 +619,9 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
     socklen_t from_length;
     socklen_t to_length;
     int server_addr_length = 0;
-    uint8_t buffer[1536];
+    picoquic_event_loop_t* loop = NULL;
+    picoquic_recv_datagram_t* datagram = NULL;
+    uint8_t* buffer = NULL;
     uint8_t send_buffer[1536];
     size_t send_length = 0;
     uint64_t key_update_done = 0;
@@ -552,6 +673,10 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
         if (fd == INVALID_SOCKET) {
             ret = -1;
         }
+        else {
+            /* Receive series of datagrams in a single call if the kernel supports it */
+            (void)picoquic_socket_set_gro(fd);
+        }
     }
 
     /* Create QUIC context */
@@ -601,6 +726,24 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
         }
     }
 
+    /* Wait for the socket in an event loop, which owns it from then on */
+    if (ret == 0) {
+        loop = picoquic_event_loop_create(qclient, 1, PICOQUIC_DEMO_CLIENT_RECEIVE_BUFFER_SIZE);
+
+        if (loop == NULL) {
+            ret = -1;
+        }
+        else if (picoquic_event_loop_add_socket(loop, fd) != 0) {
+            picoquic_event_loop_delete(loop);
+            loop = NULL;
+            ret = -1;
+        }
+        else {
+            datagram = &loop->datagrams[0];
+            buffer = datagram->buffer;
+        }
+    }
+
     /* Create the client connection */
     if (ret == 0) {
         /* Create a client connection */
@@ -655,15 +798,26 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
 
     /* Wait for packets */
     while (ret == 0 && picoquic_get_cnx_state(cnx_client) != picoquic_state_disconnected) {
-        unsigned char received_ecn;
+        unsigned char received_ecn = 0;
+        int nb_datagrams = 0;
 
-        from_length = to_length = sizeof(struct sockaddr_storage);
+        from_length = to_length = 0;
+        if_index_to = 0;
 
-        bytes_recv = picoquic_select(&fd, 1, &packet_from, &from_length,
-            &packet_to, &to_length, &if_index_to, &received_ecn,
-            buffer, sizeof(buffer),
-            delta_t,
-            &current_time);
+        bytes_recv = picoquic_event_loop_wait(loop, delta_t, &current_time);
+
+        if (bytes_recv > 0) {
+            buffer = datagram->buffer;
+            bytes_recv = datagram->length;
+            from_length = datagram->from_length;
+            to_length = datagram->dest_length;
+            if_index_to = datagram->dest_if;
+            received_ecn = datagram->received_ecn;
+            memcpy(&packet_from, &datagram->addr_from, sizeof(struct sockaddr_storage));
+            memcpy(&packet_to, &datagram->addr_dest, sizeof(struct sockaddr_storage));
+            nb_datagrams = (datagram->segment_size == 0) ? 1 :
+                (int)((datagram->length + datagram->segment_size - 1) / datagram->segment_size);
+        }
 
         if (bytes_recv != 0) {
             fprintf(F_log, "Select returns %d, from length %d\n", bytes_recv, from_length);
@@ -706,12 +860,12 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
             ret = -1;
         } else {
             if (bytes_recv > 0) {
-                /* Submit the packet to the client */
-                ret = picoquic_incoming_packet(qclient, buffer,
-                    (size_t)bytes_recv, (struct sockaddr*)&packet_from,
+                /* Submit the packets to the client, splitting the series received with UDP GRO */
+                ret = picoquic_incoming_datagrams(qclient, buffer,
+                    (size_t)bytes_recv, datagram->segment_size, (struct sockaddr*)&packet_from,
                     (struct sockaddr*)&packet_to, if_index_to, received_ecn,
                     current_time);
-                client_receive_loop++;
+                client_receive_loop += nb_datagrams;
 
                 picoquic_log_processing(F_log, cnx_client, bytes_recv, ret);
 
@@ -768,9 +922,19 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
                     if (force_migration && migration_started == 0 && 
                         (cnx_client->cnxid_stash_first != NULL || force_migration == 1)
                         && picoquic_get_cnx_state(cnx_client) == picoquic_state_ready) {
+                        SOCKET_TYPE fd_old = fd;
                         int mig_ret = quic_client_migrate(cnx_client, &fd,
                             (struct sockaddr *)&server_address, force_migration, F_log);
 
+                        if (fd != fd_old) {
+                            picoquic_event_loop_remove_socket(loop, fd_old);
+                            if (picoquic_event_loop_add_socket(loop, fd) != 0) {
+                                SOCKET_CLOSE(fd);
+                                fd = INVALID_SOCKET;
+                                ret = -1;
+                            }
+                        }
+
                         migration_started = 1;
                         address_updated = 0;
 
@@ -782,7 +946,7 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
 
                     if (nb_packets_before_key_update > 0 &&
                         !key_update_done &&
-                        cnx_client->pkt_ctx[picoquic_packet_context_application].first_sack_item.end_of_sack_range > (uint64_t)nb_packets_before_key_update) {
+                        picoquic_sack_list_last(&cnx_client->pkt_ctx[picoquic_packet_context_application].sack_list) > (uint64_t)nb_packets_before_key_update) {
                         int key_rot_ret = picoquic_start_key_rotation(cnx_client);
                         if (key_rot_ret != 0) {
                             fprintf(stdout, "Will not test key rotation.\n");
@@ -910,11 +1074,13 @@ int quic_client(const char* ip_address_text, int server_port, const char * sni,
         picoquic_free(qclient);
     }
 
-    if (fd != INVALID_SOCKET) {
+    if (loop != NULL) {
+        picoquic_event_loop_delete(loop);
+    }
+    else if (fd != INVALID_SOCKET) {
         SOCKET_CLOSE(fd);
     }
 
-
     if (client_scenario_text != NULL && client_sc != NULL) {
         demo_client_delete_scenario_desc(client_sc_nb, client_sc);
         client_sc = NULL;
@@ -992,6 +1158,8 @@ void usage()
     fprintf(stderr, "  -1                    Once\n");
     fprintf(stderr, "  -S solution_dir       Set the path to the source files to find the default files\n");
     fprintf(stderr, "  -I length             Length of CNX_ID used by the client, default=8\n");
+    fprintf(stderr, "  -U                    Use io_uring for the server sockets, if supported\n");
+    fprintf(stderr, "  -W nb_workers         Run the server with one thread per worker, sharing the port\n");
     fprintf(stderr, "\nThe scenario argument specifies the set of files that should be retrieved,\n");
     fprintf(stderr, "and their order. The syntax is:\n");
     fprintf(stderr, "  *{[<stream_id>':'[<previous_stream>':'[<format>:]]]path;}\n");
@@ -1033,6 +1201,8 @@ int main(int argc, char** argv)
     uint64_t reset_seed_x[2];
     int dest_if = -1;
     int mtu_max = 0;
+    int use_io_uring = 0;
+    int nb_workers = 0;
     char default_server_cert_file[512];
     char default_server_key_file[512];
     char * client_scenario = NULL;
@@ -1046,7 +1216,7 @@ int main(int argc, char** argv)
 
     /* Get the parameters */
     int opt;
-    while ((opt = getopt(argc, argv, "c:k:p:u:v:1rhzf:i:s:e:l:m:n:a:t:S:I:")) != -1) {
+    while ((opt = getopt(argc, argv, "c:k:p:u:v:1rhzf:i:s:e:l:m:n:a:t:S:I:UW:")) != -1) {
         switch (opt) {
         case 'c':
             server_cert_file = optarg;
@@ -1142,6 +1312,16 @@ int main(int argc, char** argv)
                 usage();
             }
             break;
+        case 'U':
+            use_io_uring = 1;
+            break;
+        case 'W':
+            nb_workers = atoi(optarg);
+            if (nb_workers <= 0 || nb_workers > PICOQUIC_SHARD_MAX_WORKERS) {
+                fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                usage();
+            }
+            break;
         case 'h':
             usage();
             break;
@@ -1192,13 +1372,24 @@ int main(int argc, char** argv)
         }
 
         /* Run as server */
-        printf("Starting PicoQUIC server on port %d, server name = %s, just_once = %d, hrr= %d\n",
-            server_port, server_name, just_once, do_hrr);
-        ret = quic_server(server_name, server_port,
-            server_cert_file, server_key_file, just_once, do_hrr,
-            (cnx_id_cbdata == NULL) ? NULL : picoquic_connection_id_callback,
-            (cnx_id_cbdata == NULL) ? NULL : (void*)cnx_id_cbdata,
-            (uint8_t*)reset_seed, dest_if, mtu_max, proposed_version);
+        if (nb_workers > 0) {
+            if (just_once != 0 || cnx_id_cbdata != NULL) {
+                fprintf(stderr, "The options -1 and -i cannot be used with -W\n");
+                usage();
+            }
+            printf("Starting PicoQUIC server on port %d, %d workers, hrr= %d\n",
+                server_port, nb_workers, do_hrr);
+            ret = quic_sharded_server(server_port, server_cert_file, server_key_file, do_hrr,
+                (uint8_t*)reset_seed, mtu_max, nb_workers, use_io_uring);
+        } else {
+            printf("Starting PicoQUIC server on port %d, server name = %s, just_once = %d, hrr= %d\n",
+                server_port, server_name, just_once, do_hrr);
+            ret = quic_server(server_name, server_port,
+                server_cert_file, server_key_file, just_once, do_hrr,
+                (cnx_id_cbdata == NULL) ? NULL : picoquic_connection_id_callback,
+                (cnx_id_cbdata == NULL) ? NULL : (void*)cnx_id_cbdata,
+                (uint8_t*)reset_seed, dest_if, mtu_max, proposed_version, use_io_uring);
+        }
         printf("Server exit with code = %d\n", ret);
     } else {
         FILE* F_log = NULL;
@@ -115,67 +115,36 @@ static const test_ack_of_ack_t test_ack_of_ack_list[] = {
  * Fill a structured SACK list from a test range 
  */
 
-static void fill_test_sack_list(picoquic_sack_item_t* sack_head,
+static void fill_test_sack_list(picoquic_sack_list_t* sack_list,
     test_ack_range_t const* ranges, size_t nb_ranges)
 {
-    picoquic_sack_item_t** previous;
+    picoquic_init_sack_list(sack_list, 0);
 
-    sack_head->start_of_sack_range = ranges[0].start_of_sack_range;
-    sack_head->end_of_sack_range = ranges[0].end_of_sack_range;
-    sack_head->next_sack = NULL;
-    previous = &sack_head->next_sack;
-
-    for (size_t i = 1; i < nb_ranges; i++) {
-        picoquic_sack_item_t* range = (picoquic_sack_item_t*)malloc(sizeof(picoquic_sack_item_t));
-
-        if (range == NULL) {
+    for (size_t i = 0; i < nb_ranges; i++) {
+        if (picoquic_update_sack_list(sack_list, ranges[i].start_of_sack_range,
+            ranges[i].end_of_sack_range) != 0) {
             break;
-        } else {
-            *previous = range;
-            range->start_of_sack_range = ranges[i].start_of_sack_range;
-            range->end_of_sack_range = ranges[i].end_of_sack_range;
-            range->next_sack = NULL;
-            previous = &range->next_sack;
         }
     }
 }
 
-/*
- * Release the memory still allocated in a sack list
- */
-static void free_test_sack_list(picoquic_sack_item_t* sack_head)
-{
-    picoquic_sack_item_t* next;
-    while ((next = sack_head->next_sack) != NULL) {
-        sack_head->next_sack = next->next_sack;
-        free(next);
-    }
-}
 /*
  * Compare a structured list to a test range
  */
 
-static int cmp_test_sack_list(picoquic_sack_item_t* sack_head,
+static int cmp_test_sack_list(picoquic_sack_list_t* sack_list,
     test_ack_range_t const* ranges, size_t nb_ranges)
 {
-    size_t nb_compared = 0;
-    picoquic_sack_item_t* next = sack_head;
+    int ret = (sack_list->nb_ranges == nb_ranges) ? 0 : -1;
 
-    for (size_t i = 0; i < nb_ranges; i++) {
-        if (next->start_of_sack_range != ranges[i].start_of_sack_range || next->end_of_sack_range != ranges[i].end_of_sack_range) {
-            break;
-        }
-
-        nb_compared++;
-
-        next = next->next_sack;
-
-        if (next == NULL) {
-            break;
+    for (size_t i = 0; ret == 0 && i < nb_ranges; i++) {
+        if (sack_list->ranges[i].start_of_sack_range != ranges[i].start_of_sack_range ||
+            sack_list->ranges[i].end_of_sack_range != ranges[i].end_of_sack_range) {
+            ret = -1;
         }
     }
 
-    return (next == NULL && nb_compared == nb_ranges) ? 0 : -1;
+    return ret;
 }
 
 static size_t build_test_ack(test_ack_range_t const* ranges, size_t nb_ranges,
@@ -211,22 +180,22 @@ static size_t build_test_ack(test_ack_range_t const* ranges, size_t nb_ranges,
 static int ack_of_ack_do_one_test(test_ack_of_ack_t const* sample)
 {
     int ret = 0;
-    picoquic_sack_item_t sack_head;
+    picoquic_sack_list_t sack_list;
     uint8_t ack[1024];
     size_t ack_length;
     size_t consumed;
 
-    fill_test_sack_list(&sack_head, sample->initial, sample->nb_initial);
+    fill_test_sack_list(&sack_list, sample->initial, sample->nb_initial);
     ack_length = build_test_ack(sample->ack, sample->nb_ack, ack, sizeof(ack),
         sample->version_flags);
 
-    ret = picoquic_process_ack_of_ack_frame(&sack_head, ack, ack_length, &consumed, 0);
+    ret = picoquic_process_ack_of_ack_frame(&sack_list, ack, ack_length, &consumed, 0);
 
     if (ret == 0) {
-        ret = cmp_test_sack_list(&sack_head, sample->result, sample->nb_result);
+        ret = cmp_test_sack_list(&sack_list, sample->result, sample->nb_result);
     }
 
-    free_test_sack_list(&sack_head);
+    picoquic_clear_sack_list(&sack_list);
 
     return ret;
 }
@@ -19,12 +19,24 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef _WINDOWS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* syscall */
+#endif
+#endif
 #include "picoquic_internal.h"
 #include <stdlib.h>
 #ifdef _WINDOWS
 #include <malloc.h>
 #endif
 #include <string.h>
+#include <stddef.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /* 
  * Cnx creation unit test
@@ -203,3 +215,808 @@ int cnxcreation_test()
 
     return ret;
 }
+
+/*
+ * Wake list unit test
+ * - Create a QUIC context and a set of connections.
+ * - Reinsert the connections with pseudo random wake times.
+ * - Verify that the wake tree stays ordered, that the earliest connection
+ *   is the one with the lowest wake time, and that the next wake delay
+ *   matches that connection.
+ * - Verify that connections with the same wake time are polled in the
+ *   order in which they were queued.
+ * - Measure the cost of a reinsertion, and of polling the earliest
+ *   connection and rescheduling it after all others, as the number of
+ *   connections grows to the size of a large server.
+ */
+
+#define WAKE_TEST_CNX_MAX 65536
+#define WAKE_TEST_REINSERT_COUNT 10000
+#define WAKE_TEST_POLL_COUNT 100000
+
+static int wake_list_check(picoquic_quic_t* quic, int nb_cnx)
+{
+    int ret = 0;
+    int count = 0;
+    uint64_t previous_time = 0;
+    uint64_t min_time = UINT64_MAX;
+    picoquic_cnx_t* earliest = picoquic_get_earliest_cnx_to_wake(quic, 0);
+
+    for (picosplay_node* node = picosplay_first(&quic->cnx_wake_tree);
+        ret == 0 && node != NULL; node = picosplay_next(node)) {
+        picoquic_cnx_t* cnx = (picoquic_cnx_t*)node->value;
+
+        if (cnx->next_wake_time < previous_time) {
+            DBG_PRINTF("Wake tree out of order at rank %d\n", count);
+            ret = -1;
+        }
+        previous_time = cnx->next_wake_time;
+        count++;
+    }
+
+    for (picoquic_cnx_t* cnx = picoquic_get_first_cnx(quic); cnx != NULL; cnx = picoquic_get_next_cnx(cnx)) {
+        if (cnx->next_wake_time < min_time) {
+            min_time = cnx->next_wake_time;
+        }
+    }
+
+    if (ret == 0 && count != nb_cnx) {
+        DBG_PRINTF("Expected %d connections in wake tree, got %d\n", nb_cnx, count);
+        ret = -1;
+    }
+
+    if (ret == 0 && (earliest == NULL || earliest->next_wake_time != min_time)) {
+        DBG_PRINTF("%s", "Earliest connection does not have the lowest wake time\n");
+        ret = -1;
+    }
+
+    if (ret == 0 && picoquic_get_earliest_cnx_to_wake(quic, min_time - 1) != NULL) {
+        DBG_PRINTF("%s", "Earliest connection returned before max wake time\n");
+        ret = -1;
+    }
+
+    if (ret == 0 && (picoquic_get_next_wake_delay(quic, min_time - 100, 1000) != 100 ||
+        picoquic_get_next_wake_delay(quic, min_time + 1, 1000) != 0)) {
+        DBG_PRINTF("%s", "Unexpected next wake delay\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int wake_list_test()
+{
+    int ret = 0;
+    int nb_cnx = 0;
+    int nb_cnx_target = 16;
+    uint64_t random_state = 0xDEADBEEFCAFEBABEull;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t** test_cnx = (picoquic_cnx_t**)malloc(WAKE_TEST_CNX_MAX * sizeof(picoquic_cnx_t*));
+
+    quic = picoquic_create(WAKE_TEST_CNX_MAX, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL || test_cnx == NULL) {
+        ret = -1;
+    }
+
+    while (ret == 0 && nb_cnx_target <= WAKE_TEST_CNX_MAX) {
+        uint64_t start_time;
+        uint64_t duration;
+
+        /* Create the connections up to the target */
+        while (ret == 0 && nb_cnx < nb_cnx_target) {
+            struct sockaddr_in addr;
+
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(0xC0000200 + (nb_cnx >> 16));
+            addr.sin_port = htons((uint16_t)nb_cnx);
+            test_cnx[nb_cnx] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1);
+            if (test_cnx[nb_cnx] == NULL) {
+                ret = -1;
+            }
+            else {
+                nb_cnx++;
+            }
+        }
+
+        /* Reinsert connections at random times, and verify the order */
+        start_time = picoquic_current_time();
+        for (int i = 0; ret == 0 && i < WAKE_TEST_REINSERT_COUNT; i++) {
+            random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+            picoquic_reinsert_by_wake_time(quic, test_cnx[(random_state >> 33) % nb_cnx],
+                1000 + ((random_state >> 11) % 1000000));
+        }
+        duration = picoquic_current_time() - start_time;
+
+        DBG_PRINTF("%d connections, %d reinsertions in %llu microseconds\n",
+            nb_cnx, WAKE_TEST_REINSERT_COUNT, (unsigned long long)duration);
+
+        /* Poll the earliest connection and wake it again after all others,
+         * as a server does. Wake times then grow in insertion order. */
+        if (ret == 0) {
+            uint64_t wake_time = picosplay_last(&quic->cnx_wake_tree) != NULL ?
+                ((picoquic_cnx_t*)picosplay_last(&quic->cnx_wake_tree)->value)->next_wake_time : 0;
+
+            start_time = picoquic_current_time();
+            for (int i = 0; ret == 0 && i < WAKE_TEST_POLL_COUNT; i++) {
+                picoquic_cnx_t* cnx = picoquic_get_earliest_cnx_to_wake(quic, 0);
+
+                if (cnx == NULL || picoquic_get_next_wake_delay(quic, wake_time, 1000000) != 0) {
+                    ret = -1;
+                }
+                else {
+                    picoquic_reinsert_by_wake_time(quic, cnx, ++wake_time);
+                }
+            }
+            duration = picoquic_current_time() - start_time;
+
+            DBG_PRINTF("%d connections, %d polls in %llu microseconds\n",
+                nb_cnx, WAKE_TEST_POLL_COUNT, (unsigned long long)duration);
+        }
+
+        if (ret == 0) {
+            ret = wake_list_check(quic, nb_cnx);
+        }
+
+        nb_cnx_target *= 4;
+    }
+
+    /* Connections with the same wake time are polled in order of insertion */
+    for (int i = 0; ret == 0 && i < nb_cnx; i++) {
+        picoquic_reinsert_by_wake_time(quic, test_cnx[(i * 7) % nb_cnx], 500);
+        if (picoquic_get_earliest_cnx_to_wake(quic, 0) != test_cnx[0]) {
+            DBG_PRINTF("Wrong earliest connection after %d reinsertions with the same time\n", i + 1);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        int rank = 0;
+        for (picosplay_node* node = picosplay_first(&quic->cnx_wake_tree);
+            ret == 0 && node != NULL && rank < nb_cnx; node = picosplay_next(node), rank++) {
+            if (node->value != (void*)test_cnx[(rank * 7) % nb_cnx]) {
+                DBG_PRINTF("Connection at rank %d not polled in insertion order\n", rank);
+                ret = -1;
+            }
+        }
+    }
+
+    /* Delete half of the connections, and verify the tree again */
+    for (int i = 0; ret == 0 && i < nb_cnx; i += 2) {
+        picoquic_delete_cnx(test_cnx[i]);
+        test_cnx[i] = NULL;
+    }
+
+    if (ret == 0) {
+        ret = wake_list_check(quic, nb_cnx / 2);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (test_cnx != NULL) {
+        free(test_cnx);
+    }
+
+    return ret;
+}
+
+/* Check that freed packets are kept for reuse up to the high water mark,
+ * and that the hits and misses are counted. */
+#define PACKET_POOL_TEST_NB 16
+
+static int packet_pool_check(picoquic_quic_t* quic, uint64_t hits, uint64_t misses, size_t in_pool,
+    uint64_t stateless_hits, uint64_t stateless_misses, size_t stateless_in_pool)
+{
+    int ret = 0;
+    picoquic_packet_pool_stats_t stats;
+
+    picoquic_get_packet_pool_stats(quic, &stats);
+
+    if (stats.nb_packet_hits != hits || stats.nb_packet_misses != misses || stats.nb_packets_in_pool != in_pool ||
+        stats.nb_stateless_hits != stateless_hits || stats.nb_stateless_misses != stateless_misses ||
+        stats.nb_stateless_in_pool != stateless_in_pool) {
+        DBG_PRINTF("Pool stats: %d/%d/%d, stateless %d/%d/%d, expected %d/%d/%d, %d/%d/%d",
+            (int)stats.nb_packet_hits, (int)stats.nb_packet_misses, (int)stats.nb_packets_in_pool,
+            (int)stats.nb_stateless_hits, (int)stats.nb_stateless_misses, (int)stats.nb_stateless_in_pool,
+            (int)hits, (int)misses, (int)in_pool, (int)stateless_hits, (int)stateless_misses, (int)stateless_in_pool);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int packet_pool_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_t* packets[PACKET_POOL_TEST_NB];
+    picoquic_stateless_packet_t* sp[PACKET_POOL_TEST_NB];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if (quic == NULL) {
+        ret = -1;
+    } else if (quic->packet_pool_max != PICOQUIC_PACKET_POOL_MAX_DEFAULT) {
+        ret = -1;
+    }
+
+    /* Empty pool: every allocation is a miss, and every free goes to the pool */
+    for (int i = 0; ret == 0 && i < PACKET_POOL_TEST_NB; i++) {
+        packets[i] = picoquic_create_packet(quic);
+        sp[i] = picoquic_create_stateless_packet(quic);
+        if (packets[i] == NULL || sp[i] == NULL) {
+            ret = -1;
+        } else {
+            packets[i]->sequence_number = i + 1;
+            packets[i]->length = 1000;
+            packets[i]->bytes[0] = 0xFF;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < PACKET_POOL_TEST_NB; i++) {
+        picoquic_recycle_packet(quic, packets[i]);
+        picoquic_recycle_stateless_packet(quic, sp[i]);
+    }
+
+    if (ret == 0) {
+        ret = packet_pool_check(quic, 0, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, 0, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB);
+    }
+
+    /* Reused packets are served from the pool, and come back cleared */
+    for (int i = 0; ret == 0 && i < PACKET_POOL_TEST_NB; i++) {
+        packets[i] = picoquic_create_packet(quic);
+        sp[i] = picoquic_create_stateless_packet(quic);
+        if (packets[i] == NULL || sp[i] == NULL) {
+            ret = -1;
+        } else if (packets[i]->sequence_number != 0 || packets[i]->length != 0 || packets[i]->bytes[0] != 0) {
+            DBG_PRINTF("%s", "Packet from pool not cleared");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = packet_pool_check(quic, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, 0, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, 0);
+    }
+
+    /* The high water mark limits the packets kept in the pools */
+    if (ret == 0) {
+        picoquic_set_packet_pool_max(quic, PACKET_POOL_TEST_NB / 4);
+
+        for (int i = 0; i < PACKET_POOL_TEST_NB; i++) {
+            picoquic_recycle_packet(quic, packets[i]);
+            picoquic_recycle_stateless_packet(quic, sp[i]);
+        }
+
+        ret = packet_pool_check(quic, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB / 4,
+            PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB / 4);
+    }
+
+    /* Stateless packets deleted without the context are freed, and do not change the pool */
+    if (ret == 0) {
+        picoquic_stateless_packet_t* deleted = picoquic_create_stateless_packet(quic);
+
+        if (deleted == NULL) {
+            ret = -1;
+        } else {
+            picoquic_delete_stateless_packet(deleted);
+            ret = packet_pool_check(quic, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB / 4,
+                PACKET_POOL_TEST_NB + 1, PACKET_POOL_TEST_NB, PACKET_POOL_TEST_NB / 4 - 1);
+        }
+    }
+
+    /* Packets acknowledged by the peer are returned to the pool */
+    if (ret == 0 && (cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        picoquic_packet_pool_stats_t stats;
+
+        picoquic_set_packet_pool_max(quic, PICOQUIC_PACKET_POOL_MAX_DEFAULT);
+        picoquic_get_packet_pool_stats(quic, &stats);
+
+        for (int i = 0; ret == 0 && i < PACKET_POOL_TEST_NB; i++) {
+            picoquic_packet_t* packet = picoquic_create_packet(quic);
+
+            if (packet == NULL) {
+                ret = -1;
+            } else {
+                packet->pc = picoquic_packet_context_application;
+                packet->sequence_number = cnx->pkt_ctx[picoquic_packet_context_application].send_sequence++;
+                packet->send_path = cnx->path[0];
+                picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, 0, 0);
+            }
+        }
+
+        while (cnx->pkt_ctx[picoquic_packet_context_application].retransmit_oldest != NULL) {
+            (void)picoquic_dequeue_retransmit_packet(cnx, cnx->pkt_ctx[picoquic_packet_context_application].retransmit_oldest, 1);
+        }
+
+        if (ret == 0) {
+            ret = packet_pool_check(quic, stats.nb_packet_hits + stats.nb_packets_in_pool,
+                stats.nb_packet_misses + PACKET_POOL_TEST_NB - stats.nb_packets_in_pool, PACKET_POOL_TEST_NB,
+                stats.nb_stateless_hits, stats.nb_stateless_misses, stats.nb_stateless_in_pool);
+        }
+    }
+
+    /* Setting the mark to zero releases the pools */
+    if (ret == 0) {
+        picoquic_set_packet_pool_max(quic, 0);
+
+        if (quic->packet_pool != NULL || quic->stateless_packet_pool != NULL) {
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the connection arena. Objects are served from a few chunks, freed
+ * objects are reused for the next allocation of the same size class, large
+ * objects get a chunk of their own, and the accounting follows the objects
+ * that are in use.
+ */
+
+#define ARENA_TEST_NB_STREAMS 64
+#define ARENA_TEST_NB_FRAMES 32
+
+int arena_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_arena_stats_t initial;
+    picoquic_arena_stats_t stats;
+    uint8_t frame[2048];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    memset(frame, picoquic_frame_type_ping, sizeof(frame));
+
+    if (quic == NULL || (cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_get_arena_stats(cnx, &initial);
+    }
+
+    /* Streams and small frames are carved from shared chunks */
+    for (int i = 0; ret == 0 && i < ARENA_TEST_NB_STREAMS; i++) {
+        if (picoquic_create_stream(cnx, STREAM_ID_FROM_RANK(i, 1, 0)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    /* Stream heads are rounded to a close size class, and the chunks are densely used */
+    if (ret == 0) {
+        picoquic_get_arena_stats(cnx, &stats);
+
+        if (stats.bytes_in_use - initial.bytes_in_use > ARENA_TEST_NB_STREAMS * (sizeof(picoquic_stream_head) + 16) ||
+            8 * (stats.bytes_reserved - initial.bytes_reserved) >
+            9 * ARENA_TEST_NB_STREAMS * sizeof(picoquic_stream_head) + 8 * PICOQUIC_ARENA_CHUNK_SIZE) {
+            DBG_PRINTF("%d stream heads of %d bytes use %d bytes, in %d reserved bytes", ARENA_TEST_NB_STREAMS,
+                (int)sizeof(picoquic_stream_head), (int)(stats.bytes_in_use - initial.bytes_in_use),
+                (int)(stats.bytes_reserved - initial.bytes_reserved));
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < ARENA_TEST_NB_FRAMES; i++) {
+        ret = picoquic_queue_misc_frame(cnx, frame, 1 + i);
+    }
+
+    if (ret == 0) {
+        picoquic_get_arena_stats(cnx, &stats);
+
+        if (stats.nb_allocs - initial.nb_allocs != ARENA_TEST_NB_STREAMS + ARENA_TEST_NB_FRAMES ||
+            stats.bytes_in_use < initial.bytes_in_use + ARENA_TEST_NB_STREAMS * sizeof(picoquic_stream_head) ||
+            stats.bytes_in_use > stats.bytes_reserved ||
+            stats.nb_chunks * PICOQUIC_ARENA_CHUNK_SIZE > 2 * stats.bytes_reserved) {
+            DBG_PRINTF("Unexpected arena stats, %d allocs, %d bytes in use, %d reserved in %d chunks",
+                (int)stats.nb_allocs, (int)stats.bytes_in_use, (int)stats.bytes_reserved, (int)stats.nb_chunks);
+            ret = -1;
+        }
+        else {
+            DBG_PRINTF("%d objects allocated from %d chunks", (int)(stats.nb_allocs - initial.nb_allocs),
+                (int)(stats.nb_chunks - initial.nb_chunks));
+        }
+    }
+
+    /* Deleted objects are reused, no new chunk is needed */
+    if (ret == 0) {
+        picoquic_stream_head* stream;
+
+        while ((stream = picoquic_first_stream(cnx)) != NULL) {
+            picoquic_delete_stream(cnx, stream);
+        }
+
+        for (int i = 0; ret == 0 && i < ARENA_TEST_NB_STREAMS; i++) {
+            if (picoquic_create_stream(cnx, STREAM_ID_FROM_RANK(i, 1, 0)) == NULL) {
+                ret = -1;
+            }
+        }
+
+        if (ret == 0) {
+            picoquic_arena_stats_t reused;
+
+            picoquic_get_arena_stats(cnx, &reused);
+            if (reused.nb_chunks != stats.nb_chunks || reused.bytes_in_use != stats.bytes_in_use) {
+                DBG_PRINTF("%s", "Deleted streams were not reused");
+                ret = -1;
+            }
+        }
+    }
+
+    /* A large frame gets its own chunk, freed when the frame is sent */
+    if (ret == 0) {
+        uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+        size_t consumed = 0;
+
+        picoquic_get_arena_stats(cnx, &stats);
+
+        if (picoquic_queue_misc_frame(cnx, frame, sizeof(frame)) != 0) {
+            ret = -1;
+        }
+        else {
+            picoquic_arena_stats_t large;
+
+            picoquic_get_arena_stats(cnx, &large);
+            if (large.nb_chunks != stats.nb_chunks + 1 ||
+                large.bytes_in_use != stats.bytes_in_use + sizeof(picoquic_misc_frame_header_t) + sizeof(frame)) {
+                DBG_PRINTF("%s", "Large frame not allocated in its own chunk");
+                ret = -1;
+            }
+        }
+
+        /* The large frame is queued first, but it does not fit in a packet */
+        while (ret == 0 && cnx->first_misc_frame != NULL) {
+            if (cnx->first_misc_frame->length > sizeof(bytes)) {
+                picoquic_misc_frame_header_t* misc_frame = cnx->first_misc_frame;
+                cnx->first_misc_frame = misc_frame->next_misc_frame;
+                picoquic_delete_misc_frame(cnx, misc_frame);
+            }
+            else {
+                ret = picoquic_prepare_first_misc_frame(cnx, bytes, sizeof(bytes), &consumed);
+            }
+        }
+
+        if (ret == 0) {
+            picoquic_arena_stats_t sent;
+
+            picoquic_get_arena_stats(cnx, &sent);
+            if (sent.nb_chunks != stats.nb_chunks ||
+                sent.bytes_in_use >= stats.bytes_in_use) {
+                DBG_PRINTF("%s", "Frames not freed after they were sent");
+                ret = -1;
+            }
+        }
+    }
+
+    /* Deleting the connection releases all the chunks at once */
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the connection slab. Connections and paths are taken from the slab
+ * until it is exhausted, further connections are refused, and deleted
+ * connections return their objects for reuse.
+ */
+
+#define CNX_SLAB_TEST_NB 4
+
+int cnx_slab_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(CNX_SLAB_TEST_NB, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    picoquic_cnx_t* cnx[CNX_SLAB_TEST_NB + 1];
+    picoquic_cnx_slab_stats_t stats;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    memset(cnx, 0, sizeof(cnx));
+
+    if (quic == NULL || picoquic_enable_cnx_slab(quic) != 0) {
+        ret = -1;
+    }
+
+    /* Fill the slab */
+    for (int i = 0; ret == 0 && i < CNX_SLAB_TEST_NB; i++) {
+        cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1);
+        if (cnx[i] == NULL) {
+            DBG_PRINTF("Cannot create connection %d from the slab", i);
+            ret = -1;
+        }
+    }
+
+    /* A second path comes from the slab, in the table of the connection */
+    if (ret == 0 && picoquic_create_path(cnx[0], 0, NULL, (struct sockaddr*)&addr) != 1) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        picoquic_get_cnx_slab_stats(quic, &stats);
+
+        if (stats.nb_cnx != CNX_SLAB_TEST_NB || stats.nb_cnx_free != 0 ||
+            stats.nb_paths != CNX_SLAB_TEST_NB * PICOQUIC_CNX_SLAB_PATHS_PER_CNX ||
+            stats.nb_paths_free != stats.nb_paths - CNX_SLAB_TEST_NB - 1 || stats.nb_refused != 0) {
+            DBG_PRINTF("Unexpected slab stats, %d/%d connections, %d/%d paths, %d refused",
+                (int)stats.nb_cnx_free, (int)stats.nb_cnx, (int)stats.nb_paths_free, (int)stats.nb_paths,
+                (int)stats.nb_refused);
+            ret = -1;
+        }
+    }
+
+    /* The slab is exhausted, the next connection is refused */
+    if (ret == 0) {
+        cnx[CNX_SLAB_TEST_NB] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1);
+        picoquic_get_cnx_slab_stats(quic, &stats);
+
+        if (cnx[CNX_SLAB_TEST_NB] != NULL || stats.nb_refused != 1) {
+            DBG_PRINTF("%s", "Connection not refused when the slab is exhausted");
+            ret = -1;
+        }
+    }
+
+    /* A deleted connection returns its objects, which are reused */
+    if (ret == 0) {
+        picoquic_cnx_t* deleted = cnx[0];
+
+        picoquic_delete_cnx(cnx[0]);
+        cnx[0] = NULL;
+        picoquic_get_cnx_slab_stats(quic, &stats);
+
+        if (stats.nb_cnx_free != 1 || stats.nb_paths_free != stats.nb_paths - CNX_SLAB_TEST_NB + 1) {
+            DBG_PRINTF("%s", "Objects not returned to the slab");
+            ret = -1;
+        }
+        else if ((cnx[0] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) != deleted) {
+            DBG_PRINTF("%s", "Deleted connection not reused");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Layout of the connection and path contexts.
+ *
+ * The fields read or updated when preparing or receiving most packets are
+ * grouped at the start of the structures, ahead of the cold state. The test
+ * verifies that these fields are placed before the first cold field, and
+ * counts the cache lines that they span.
+ *
+ * The test then walks the hot fields of a large set of connections, as the
+ * sender would, and reports the number of L1 data cache misses per visit if
+ * the hardware counters can be read, or the time per visit otherwise.
+ */
+
+#define CNX_LAYOUT_CACHE_LINE 64
+#define CNX_LAYOUT_NB_CNX 1024
+#define CNX_LAYOUT_NB_PASSES 64
+
+typedef struct st_cnx_layout_field_t {
+    char const* name;
+    size_t offset;
+    size_t size;
+} cnx_layout_field_t;
+
+#define CNX_LAYOUT_FIELD(t, f) { #f, offsetof(t, f), sizeof(((t*)0)->f) }
+
+static const cnx_layout_field_t cnx_layout_hot_cnx[] = {
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, quic),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, cnx_state),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, spin_policy),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, next_wake_time),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, latest_progress_time),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, callback_fn),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, congestion_alg),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, path),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, nb_paths),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, data_sent),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, data_received),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, maxdata_local),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, maxdata_remote),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, first_misc_frame),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, first_ready_stream),
+    CNX_LAYOUT_FIELD(picoquic_cnx_t, keep_alive_interval)
+};
+
+static const cnx_layout_field_t cnx_layout_hot_path[] = {
+    CNX_LAYOUT_FIELD(picoquic_path_t, local_cnxid),
+    CNX_LAYOUT_FIELD(picoquic_path_t, remote_cnxid),
+    CNX_LAYOUT_FIELD(picoquic_path_t, send_mtu),
+    CNX_LAYOUT_FIELD(picoquic_path_t, smoothed_rtt),
+    CNX_LAYOUT_FIELD(picoquic_path_t, retransmit_timer),
+    CNX_LAYOUT_FIELD(picoquic_path_t, rtt_min),
+    CNX_LAYOUT_FIELD(picoquic_path_t, cwin),
+    CNX_LAYOUT_FIELD(picoquic_path_t, bytes_in_transit),
+    CNX_LAYOUT_FIELD(picoquic_path_t, congestion_alg_state),
+    CNX_LAYOUT_FIELD(picoquic_path_t, pacing_evaluation_time),
+    CNX_LAYOUT_FIELD(picoquic_path_t, pacing_bucket_nanosec),
+    CNX_LAYOUT_FIELD(picoquic_path_t, pacing_packet_time_microsec)
+};
+
+static int cnx_layout_check(char const* name, const cnx_layout_field_t* fields, size_t nb_fields, size_t cold_offset)
+{
+    int ret = 0;
+    uint8_t lines[64];
+    size_t nb_lines = 0;
+
+    memset(lines, 0, sizeof(lines));
+
+    for (size_t i = 0; i < nb_fields; i++) {
+        size_t first_line = fields[i].offset / CNX_LAYOUT_CACHE_LINE;
+        size_t last_line = (fields[i].offset + fields[i].size - 1) / CNX_LAYOUT_CACHE_LINE;
+
+        if (fields[i].offset + fields[i].size > cold_offset) {
+            DBG_PRINTF("Hot field %s.%s at offset %d, after the cold state at %d",
+                name, fields[i].name, (int)fields[i].offset, (int)cold_offset);
+            ret = -1;
+        }
+
+        for (size_t line = first_line; line <= last_line && line < sizeof(lines); line++) {
+            if (lines[line] == 0) {
+                lines[line] = 1;
+                nb_lines++;
+            }
+        }
+    }
+
+    DBG_PRINTF("Hot fields of %s span %d cache lines", name, (int)nb_lines);
+
+    return ret;
+}
+
+#if defined(__linux__)
+static int cnx_layout_open_counter()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Read the hot fields that the sender reads for each packet */
+static uint64_t cnx_layout_visit(picoquic_cnx_t* cnx)
+{
+    picoquic_path_t* path_x = cnx->path[0];
+    uint64_t x = cnx->next_wake_time + cnx->cnx_state + cnx->data_sent + cnx->maxdata_remote +
+        (uint64_t)(cnx->first_misc_frame != NULL) + (uint64_t)(cnx->first_ready_stream[0] != NULL) +
+        cnx->pkt_ctx[picoquic_packet_context_application].send_sequence;
+
+    x += path_x->send_mtu + path_x->cwin + path_x->bytes_in_transit + path_x->smoothed_rtt +
+        path_x->retransmit_timer + path_x->pacing_bucket_nanosec + path_x->pacing_packet_time_microsec;
+
+    return x;
+}
+
+int cnx_layout_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t** cnx = NULL;
+    struct sockaddr_in addr;
+
+    ret = cnx_layout_check("picoquic_cnx_t", cnx_layout_hot_cnx,
+        sizeof(cnx_layout_hot_cnx) / sizeof(cnx_layout_field_t), offsetof(picoquic_cnx_t, next_in_table));
+
+    if (cnx_layout_check("picoquic_path_t", cnx_layout_hot_path,
+        sizeof(cnx_layout_hot_path) / sizeof(cnx_layout_field_t), offsetof(picoquic_path_t, first_cnx_id)) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+
+        quic = picoquic_create(CNX_LAYOUT_NB_CNX, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        cnx = (picoquic_cnx_t**)malloc(CNX_LAYOUT_NB_CNX * sizeof(picoquic_cnx_t*));
+
+        if (quic == NULL || cnx == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(cnx, 0, CNX_LAYOUT_NB_CNX * sizeof(picoquic_cnx_t*));
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < CNX_LAYOUT_NB_CNX; i++) {
+        addr.sin_port = (uint16_t)(i + 1);
+        if ((cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        volatile uint64_t sum = 0;
+        uint64_t nb_visits = ((uint64_t)CNX_LAYOUT_NB_CNX) * CNX_LAYOUT_NB_PASSES;
+        uint64_t nb_misses = 0;
+        uint64_t start_time;
+        uint64_t duration;
+        int counter_fd = -1;
+
+#if defined(__linux__)
+        counter_fd = cnx_layout_open_counter();
+        if (counter_fd >= 0) {
+            ioctl(counter_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+        start_time = picoquic_current_time();
+
+        for (int pass = 0; pass < CNX_LAYOUT_NB_PASSES; pass++) {
+            for (int i = 0; i < CNX_LAYOUT_NB_CNX; i++) {
+                sum += cnx_layout_visit(cnx[i]);
+            }
+        }
+
+        duration = picoquic_current_time() - start_time;
+
+#if defined(__linux__)
+        if (counter_fd >= 0) {
+            ioctl(counter_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter_fd, &nb_misses, sizeof(nb_misses)) != sizeof(nb_misses)) {
+                nb_misses = 0;
+            }
+            close(counter_fd);
+            DBG_PRINTF("L1D read misses per visit: %f", ((double)nb_misses) / ((double)nb_visits));
+        }
+#endif
+        if (counter_fd < 0) {
+            DBG_PRINTF("Cache counters not available, %f ns per visit", (1000.0 * (double)duration) / ((double)nb_visits));
+        }
+    }
+
+    if (cnx != NULL) {
+        for (int i = 0; i < CNX_LAYOUT_NB_CNX; i++) {
+            if (cnx[i] != NULL) {
+                picoquic_delete_cnx(cnx[i]);
+            }
+        }
+        free(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
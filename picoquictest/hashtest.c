@@ -20,10 +20,12 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #ifdef _WINDOWS
 #include <malloc.h>
 #endif
 #include "picohash.h"
+#include "picoquic_internal.h"
 
 struct hashtestkey {
     uint64_t x;
@@ -36,6 +38,12 @@ static uint64_t hashtest_hash(void* v)
     return hash;
 }
 
+static uint64_t hashtest_oa_hash(void* v, const uint8_t* hash_seed)
+{
+    (void)hash_seed;
+    return hashtest_hash(v);
+}
+
 static int hashtest_compare(void* v1, void* v2)
 {
     struct hashtestkey* k1 = (struct hashtestkey*)v1;
@@ -135,3 +143,327 @@ int picohash_test()
 
     return ret;
 }
+
+int picohash_oa_test()
+{
+    int ret = 0;
+    picohash_oa_table* t = picohash_oa_create(8, hashtest_oa_hash, hashtest_compare, NULL);
+
+    if (t == NULL) {
+        ret = -1;
+    } else {
+        struct hashtestkey hk;
+        const uint64_t nb_keys = 4096;
+        int nb_partial_clear = 0;
+
+        /* Enter a bunch of values, all different */
+        for (uint64_t i = 1; ret == 0 && i < 10; i += 2) {
+            ret = picohash_oa_insert(t, hashtest_item(i));
+        }
+
+        /* Test whether each value can be retrieved */
+        for (uint64_t i = 1; ret == 0 && i < 10; i += 2) {
+            hk.x = i;
+            if (picohash_oa_retrieve(t, &hk) == NULL) {
+                ret = -1;
+            }
+        }
+
+        /* Create keys with the same hash, which share the same probe sequence */
+        for (uint64_t k = 1; ret == 0 && k < 6; k += 4) {
+            for (uint64_t j = 1; ret == 0 && j <= k; j++) {
+                ret = picohash_oa_insert(t, hashtest_item(k + (j << 32)));
+            }
+        }
+
+        /* Test whether different values cannot be retrieved */
+        for (uint64_t i = 0; ret == 0 && i <= 10; i += 2) {
+            hk.x = i;
+            ret = (picohash_oa_retrieve(t, &hk) == NULL) ? 0 : -1;
+        }
+
+        /* Delete first, last and middle, and check that the collisions survive */
+        for (uint64_t i = 1; ret == 0 && i < 10; i += 4) {
+            void* removed;
+            hk.x = i;
+            removed = picohash_oa_remove(t, &hk);
+            if (removed == NULL) {
+                ret = -1;
+            } else {
+                free(removed);
+                ret = (picohash_oa_retrieve(t, &hk) == NULL) ? 0 : -1;
+            }
+        }
+
+        for (uint64_t k = 1; ret == 0 && k < 6; k += 4) {
+            for (uint64_t j = 1; ret == 0 && j <= k; j++) {
+                hk.x = k + (j << 32);
+                ret = (picohash_oa_retrieve(t, &hk) != NULL) ? 0 : -1;
+            }
+        }
+
+        if (ret == 0 && picohash_oa_count(t) != 8) {
+            ret = -1;
+        }
+
+        /* Grow through several resizes, removing every other key on the way.
+         * The new slots of the larger tables are cleared over several calls. */
+        for (uint64_t i = 0; ret == 0 && i < nb_keys; i++) {
+            ret = picohash_oa_insert(t, hashtest_item(0x1000000 + i));
+
+            if (t->next_slots != NULL && t->clear_index > 0 && t->clear_index < t->next_nb_slots) {
+                nb_partial_clear++;
+            }
+
+            if (ret == 0 && (i & 1) == 1) {
+                void* removed;
+                hk.x = 0x1000000 + i - 1;
+                removed = picohash_oa_remove(t, &hk);
+                if (removed == NULL) {
+                    DBG_PRINTF("Cannot remove key %d", (int)(i - 1));
+                    ret = -1;
+                } else {
+                    free(removed);
+                }
+            }
+        }
+
+        for (uint64_t i = 0; ret == 0 && i < nb_keys; i++) {
+            hk.x = 0x1000000 + i;
+            if ((picohash_oa_retrieve(t, &hk) == NULL) != ((i & 1) == 0)) {
+                DBG_PRINTF("Unexpected lookup result for key %d", (int)i);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && picohash_oa_count(t) != 8 + nb_keys / 2) {
+            ret = -1;
+        }
+
+        if (ret == 0 && nb_partial_clear == 0) {
+            DBG_PRINTF("%s", "New slots cleared in a single call");
+            ret = -1;
+        }
+
+        /* Delete the table */
+        picohash_oa_delete(t, 1);
+    }
+
+    return ret;
+}
+
+/* Compare the lookup rate of the open addressing table and the chained
+ * table, with one million random keys. The chained table is sized with
+ * one bin per key, which is its best case. */
+#define PICOHASH_BENCH_NB_KEYS 1000000
+
+static uint64_t picohash_bench_random(uint64_t* state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+int picohash_bench_test()
+{
+    int ret = 0;
+    struct hashtestkey* keys = (struct hashtestkey*)malloc(sizeof(struct hashtestkey) * PICOHASH_BENCH_NB_KEYS);
+    picohash_oa_table* oa = picohash_oa_create(PICOHASH_BENCH_NB_KEYS, hashtest_oa_hash, hashtest_compare, NULL);
+    picohash_table* chained = picohash_create(PICOHASH_BENCH_NB_KEYS, hashtest_hash, hashtest_compare);
+
+    if (keys == NULL || oa == NULL || chained == NULL) {
+        ret = -1;
+    } else {
+        uint64_t random_state = 0xBADC0FFEEull;
+        uint64_t start_time;
+        uint64_t oa_time;
+        uint64_t chained_time;
+        size_t nb_found = 0;
+
+        for (size_t i = 0; ret == 0 && i < PICOHASH_BENCH_NB_KEYS; i++) {
+            keys[i].x = picohash_bench_random(&random_state);
+            ret = picohash_oa_insert(oa, &keys[i]);
+            if (ret == 0) {
+                ret = picohash_insert(chained, &keys[i]);
+            }
+        }
+
+        if (ret == 0) {
+            start_time = picoquic_current_time();
+            for (size_t i = 0; i < PICOHASH_BENCH_NB_KEYS; i++) {
+                nb_found += (picohash_oa_retrieve(oa, &keys[(i * 7919) % PICOHASH_BENCH_NB_KEYS]) != NULL);
+            }
+            oa_time = picoquic_current_time() - start_time;
+
+            start_time = picoquic_current_time();
+            for (size_t i = 0; i < PICOHASH_BENCH_NB_KEYS; i++) {
+                nb_found += (picohash_retrieve(chained, &keys[(i * 7919) % PICOHASH_BENCH_NB_KEYS]) != NULL);
+            }
+            chained_time = picoquic_current_time() - start_time;
+
+            if (nb_found != 2 * PICOHASH_BENCH_NB_KEYS) {
+                DBG_PRINTF("Found %d keys instead of %d", (int)nb_found, 2 * PICOHASH_BENCH_NB_KEYS);
+                ret = -1;
+            } else {
+                DBG_PRINTF("Lookups per second, open addressing: %.0f, chained: %.0f",
+                    ((double)PICOHASH_BENCH_NB_KEYS) * 1000000.0 / (double)((oa_time == 0) ? 1 : oa_time),
+                    ((double)PICOHASH_BENCH_NB_KEYS) * 1000000.0 / (double)((chained_time == 0) ? 1 : chained_time));
+            }
+        }
+    }
+
+    if (oa != NULL) {
+        picohash_oa_delete(oa, 0);
+    }
+
+    if (chained != NULL) {
+        picohash_delete(chained, 0);
+    }
+
+    if (keys != NULL) {
+        free(keys);
+    }
+
+    return ret;
+}
+
+/* Check that the keyed hash spreads connection IDs chosen by an attacker.
+ * The adversarial set uses 16 bytes connection IDs that only differ after
+ * the 8th byte: they all collide with the former hash, which only used the
+ * first 64 bits of the ID. */
+#define PICOHASH_SIPHASH_NB_KEYS 4096
+#define PICOHASH_SIPHASH_NB_BINS 1024
+
+static const uint8_t siphash_test_seed[PICOHASH_SEED_SIZE] = {
+    0x0f, 0x1e, 0x2d, 0x3c, 0x4b, 0x5a, 0x69, 0x78, 0x87, 0x96, 0xa5, 0xb4, 0xc3, 0xd2, 0xe1, 0xf0
+};
+
+static uint64_t siphash_test_legacy_hash(void* v)
+{
+    return picoquic_val64_connection_id(*(picoquic_connection_id_t*)v);
+}
+
+static uint64_t siphash_test_keyed_hash(void* v)
+{
+    picoquic_connection_id_t* cid = (picoquic_connection_id_t*)v;
+
+    return picohash_siphash(cid->id, cid->id_len, siphash_test_seed);
+}
+
+static int siphash_test_compare(void* v1, void* v2)
+{
+    return picoquic_compare_connection_id((picoquic_connection_id_t*)v1, (picoquic_connection_id_t*)v2);
+}
+
+static int siphash_test_table(picoquic_connection_id_t* cids, uint64_t (*hash_fn)(void*),
+    size_t* max_bin_length, uint64_t* lookup_time)
+{
+    int ret = 0;
+    picohash_table* t = picohash_create(PICOHASH_SIPHASH_NB_BINS, hash_fn, siphash_test_compare);
+
+    *max_bin_length = 0;
+    *lookup_time = 0;
+
+    if (t == NULL) {
+        ret = -1;
+    } else {
+        uint64_t start_time;
+
+        for (size_t i = 0; ret == 0 && i < PICOHASH_SIPHASH_NB_KEYS; i++) {
+            ret = picohash_insert(t, &cids[i]);
+        }
+
+        for (size_t i = 0; ret == 0 && i < PICOHASH_SIPHASH_NB_BINS; i++) {
+            size_t bin_length = 0;
+
+            for (picohash_item* item = t->hash_bin[i]; item != NULL; item = item->next_in_bin) {
+                bin_length++;
+            }
+
+            if (bin_length > *max_bin_length) {
+                *max_bin_length = bin_length;
+            }
+        }
+
+        start_time = picoquic_current_time();
+        for (size_t i = 0; ret == 0 && i < PICOHASH_SIPHASH_NB_KEYS; i++) {
+            if (picohash_retrieve(t, &cids[i]) == NULL) {
+                ret = -1;
+            }
+        }
+        *lookup_time = picoquic_current_time() - start_time;
+
+        picohash_delete(t, 0);
+    }
+
+    return ret;
+}
+
+int picohash_siphash_test()
+{
+    int ret = 0;
+    uint8_t message[32];
+    uint8_t other_seed[PICOHASH_SEED_SIZE];
+    picoquic_connection_id_t* cids = (picoquic_connection_id_t*)malloc(sizeof(picoquic_connection_id_t) * PICOHASH_SIPHASH_NB_KEYS);
+
+    memset(message, 0, sizeof(message));
+    memcpy(other_seed, siphash_test_seed, sizeof(other_seed));
+    other_seed[PICOHASH_SEED_SIZE - 1] ^= 1;
+
+    /* The hash depends on the seed and on the length, not just the content */
+    if (picohash_siphash(message, 8, siphash_test_seed) != picohash_siphash(message, 8, siphash_test_seed)) {
+        DBG_PRINTF("%s", "Hash is not deterministic");
+        ret = -1;
+    } else if (picohash_siphash(message, 8, siphash_test_seed) == picohash_siphash(message, 8, other_seed)) {
+        DBG_PRINTF("%s", "Hash does not depend on the seed");
+        ret = -1;
+    }
+
+    for (size_t length = 1; ret == 0 && length < sizeof(message); length++) {
+        if (picohash_siphash(message, length, siphash_test_seed) == picohash_siphash(message, length - 1, siphash_test_seed)) {
+            DBG_PRINTF("Hash does not depend on the length %d", (int)length);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && cids == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        size_t legacy_max;
+        size_t keyed_max;
+        uint64_t legacy_time;
+        uint64_t keyed_time;
+
+        for (size_t i = 0; i < PICOHASH_SIPHASH_NB_KEYS; i++) {
+            memset(&cids[i], 0, sizeof(picoquic_connection_id_t));
+            cids[i].id_len = 16;
+            memset(cids[i].id, 0xA5, 8);
+            picoformat_64(&cids[i].id[8], (uint64_t)i);
+        }
+
+        ret = siphash_test_table(cids, siphash_test_legacy_hash, &legacy_max, &legacy_time);
+        if (ret == 0) {
+            ret = siphash_test_table(cids, siphash_test_keyed_hash, &keyed_max, &keyed_time);
+        }
+
+        if (ret == 0) {
+            DBG_PRINTF("Adversarial keys, longest bin: legacy %d, keyed %d, lookup time: legacy %dus, keyed %dus",
+                (int)legacy_max, (int)keyed_max, (int)legacy_time, (int)keyed_time);
+
+            /* With 4 keys per bin on average, a fair hash should not exceed 32 */
+            if (legacy_max != PICOHASH_SIPHASH_NB_KEYS || keyed_max > 32) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (cids != NULL) {
+        free(cids);
+    }
+
+    return ret;
+}
@@ -38,7 +38,16 @@ extern uint64_t picoquic_stress_test_duration; /* In microseconds; defaults to 2
 
 /* List of test functions */
 int picohash_test();
+int picohash_oa_test();
+int picohash_bench_test();
+int picohash_siphash_test();
 int cnxcreation_test();
+int wake_list_test();
+int packet_pool_test();
+int arena_test();
+int cnx_slab_test();
+int cnx_layout_test();
+int frame_desc_test();
 int parseheadertest();
 int pn2pn64test();
 int intformattest();
@@ -46,6 +55,12 @@ int fnv1atest();
 int sacktest();
 int float16test();
 int StreamZeroFrameTest();
+int stream_tree_test();
+int ready_stream_test();
+int stream_gc_test();
+int stream_reassembly_test();
+int zero_copy_send_test();
+int stream_retransmit_test();
 int sendacktest();
 int tls_api_test();
 int tls_api_silence_test();
@@ -72,6 +87,8 @@ int tls_api_very_long_congestion_test();
 int http0dot9_test();
 int tls_api_retry_test();
 int ackrange_test();
+int retransmit_index_test();
+int sack_bound_test();
 int ack_of_ack_test();
 int tls_api_two_connections_test();
 int cleartext_aead_test();
@@ -91,6 +108,7 @@ int zero_rtt_loss_test();
 int stop_sending_test();
 int unidir_test();
 int mtu_discovery_test();
+int gso_prepare_test();
 int spurious_retransmit_test();
 int pn_ctr_test();
 int cleartext_pn_enc_test();
@@ -165,6 +183,15 @@ int tls_retry_token_test();
 int optimistic_ack_test();
 int document_addresses_test();
 int socket_ecn_test();
+int socket_batch_test();
+int socket_send_batch_test();
+int socket_gso_test();
+int socket_gro_test();
+int socket_loop_test();
+int socket_uring_test();
+int socket_shard_test();
+int socket_command_test();
+int crypto_pool_test();
 int zero_rtt_vnego_test();
 int null_sni_test();
 int preferred_address_test();
@@ -74,7 +74,7 @@ int sacktest()
     picoquic_packet_context_enum pc = 0;
 
     memset(&cnx, 0, sizeof(cnx));
-    cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
+    picoquic_init_sack_list(&cnx.pkt_ctx[pc].sack_list, PICOQUIC_MAX_SACK_RANGES);
 
     /* Do a basic test with packet zero */
 
@@ -90,15 +90,14 @@ int sacktest()
         ret = -1;
     }
 
-    if (cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range != 0 ||
-        cnx.pkt_ctx[pc].first_sack_item.end_of_sack_range != 0 ||
-        cnx.pkt_ctx[pc].first_sack_item.next_sack != NULL) {
+    if (cnx.pkt_ctx[pc].sack_list.nb_ranges != 1 ||
+        cnx.pkt_ctx[pc].sack_list.ranges[0].start_of_sack_range != 0 ||
+        cnx.pkt_ctx[pc].sack_list.ranges[0].end_of_sack_range != 0) {
         ret = -1;
     }
     else {
         /* reset for the next test */
-        memset(&cnx, 0, sizeof(cnx));
-        cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
+        picoquic_clear_sack_list(&cnx.pkt_ctx[pc].sack_list);
     }
 
     for (size_t i = 0; ret == 0 && i < nb_test_pn64; i++) {
@@ -131,20 +130,16 @@ int sacktest()
     }
 
     if (ret == 0) {
-        if (cnx.pkt_ctx[pc].first_sack_item.end_of_sack_range != 21 || 
-            cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range != 0 || 
-            cnx.pkt_ctx[pc].time_stamp_largest_received != highest_seen_time ||
-            cnx.pkt_ctx[pc].first_sack_item.next_sack != NULL) {
+        if (cnx.pkt_ctx[pc].sack_list.nb_ranges != 1 ||
+            cnx.pkt_ctx[pc].sack_list.ranges[0].end_of_sack_range != 21 ||
+            cnx.pkt_ctx[pc].sack_list.ranges[0].start_of_sack_range != 0 ||
+            cnx.pkt_ctx[pc].time_stamp_largest_received != highest_seen_time) {
             ret = -1;
         }
     }
 
     /* Reset the sack lists*/
-    while (cnx.pkt_ctx[pc].first_sack_item.next_sack != NULL) {
-        picoquic_sack_item_t * next = cnx.pkt_ctx[pc].first_sack_item.next_sack;
-        cnx.pkt_ctx[pc].first_sack_item.next_sack = next->next_sack;
-        free(next);
-    }
+    picoquic_clear_sack_list(&cnx.pkt_ctx[pc].sack_list);
 
     return ret;
 }
@@ -280,7 +275,7 @@ int sendacktest()
     picoquic_packet_context_enum pc = 0;
 
     memset(&cnx, 0, sizeof(cnx));
-    cnx.pkt_ctx[pc].first_sack_item.start_of_sack_range = (uint64_t)((int64_t)-1);
+    picoquic_init_sack_list(&cnx.pkt_ctx[pc].sack_list, PICOQUIC_MAX_SACK_RANGES);
 
     for (size_t i = 0; ret == 0 && i < nb_test_pn64; i++) {
         current_time = i * 100;
@@ -305,6 +300,8 @@ int sendacktest()
         }
     }
 
+    picoquic_clear_sack_list(&cnx.pkt_ctx[pc].sack_list);
+
     return ret;
 }
 
@@ -330,10 +327,9 @@ static const size_t nb_ack_range = sizeof(ack_range) / sizeof(test_ack_range_t);
 int ackrange_test()
 {
     int ret = 0;
-    picoquic_sack_item_t sack0;
+    picoquic_sack_list_t sack0;
 
-    memset(&sack0, 0, sizeof(picoquic_sack_item_t));
-    sack0.start_of_sack_range = (uint64_t)((int64_t)-1);
+    picoquic_init_sack_list(&sack0, 0);
 
     for (size_t i = 0; i < nb_ack_range; i++) {
         ret = picoquic_check_sack_list(&sack0,
@@ -358,16 +354,588 @@ int ackrange_test()
         }
     }
 
-    if (ret == 0 && sack0.start_of_sack_range != 0) {
+    if (ret == 0 && sack0.nb_ranges != 1) {
+        ret = -1;
+    }
+
+    if (ret == 0 && sack0.ranges[0].start_of_sack_range != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0 && sack0.ranges[0].end_of_sack_range != 7500) {
+        ret = -1;
+    }
+
+    picoquic_clear_sack_list(&sack0);
+
+    return ret;
+}
+
+/*
+ * Acknowledge a large window of packets with a random loss pattern. The
+ * sender keeps a window of packets in flight, the receiver loses 5% of them
+ * and acknowledges every other packet, and the sender declares lost the
+ * packets that fall too far behind. The test checks that every received
+ * packet is removed from the retransmit queue by the ACKs, and compares
+ * the time spent decoding ACKs with and without the sequence number index.
+ */
+#define RETRANSMIT_INDEX_WINDOW 10000
+#define RETRANSMIT_INDEX_NB_PACKETS 20000
+#define RETRANSMIT_INDEX_LOSS_PER_1000 50
+
+static uint64_t retransmit_index_random(uint64_t* state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static int retransmit_index_queue(picoquic_cnx_t* cnx, int use_index, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+    picoquic_packet_t* packet = picoquic_create_packet(cnx->quic);
+
+    if (packet == NULL) {
+        ret = -1;
+    } else {
+        packet->sequence_number = pkt_ctx->send_sequence++;
+        packet->pc = picoquic_packet_context_application;
+        packet->ptype = picoquic_packet_1rtt_protected;
+        packet->send_path = cnx->path[0];
+        packet->send_time = current_time;
+        picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, 0, current_time);
+
+        if (!use_index) {
+            picoquic_clear_retransmit_index(pkt_ctx);
+        }
+    }
+
+    return ret;
+}
+
+static int retransmit_index_one_test(picoquic_cnx_t* cnx, uint8_t* received, int use_index,
+    uint64_t* decode_time, uint64_t* nb_lost)
+{
+    int ret = 0;
+    picoquic_cnx_t* receiver = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+    uint64_t current_time = 0;
+    uint8_t bytes[1024];
+
+    *decode_time = 0;
+    *nb_lost = 0;
+
+    if (receiver == NULL) {
+        ret = -1;
+    } else {
+        memset(receiver, 0, sizeof(picoquic_cnx_t));
+    }
+
+    for (uint64_t pn = 0; ret == 0 && pn < RETRANSMIT_INDEX_WINDOW; pn++) {
+        ret = retransmit_index_queue(cnx, use_index, current_time);
+    }
+
+    for (uint64_t pn = 0; ret == 0 && pn < RETRANSMIT_INDEX_NB_PACKETS; pn++) {
+        current_time += 10;
+
+        if (received[pn]) {
+            ret = picoquic_record_pn_received(receiver, picoquic_packet_context_application, pn, current_time);
+        }
+
+        if (ret == 0 && (pn & 1) == 1) {
+            size_t consumed = 0;
+            uint64_t start_time;
+
+            ret = picoquic_prepare_ack_frame_basic(receiver, current_time, picoquic_packet_context_application,
+                bytes, sizeof(bytes), &consumed);
+
+            if (ret == 0 && consumed > 0) {
+                start_time = picoquic_current_time();
+                ret = picoquic_decode_frames(cnx, cnx->path[0], bytes, consumed, 3, NULL, NULL, current_time);
+                *decode_time += picoquic_current_time() - start_time;
+            }
+
+            /* Declare lost the packets that are a full window behind */
+            while (ret == 0 && pkt_ctx->retransmit_oldest != NULL &&
+                pkt_ctx->retransmit_oldest->sequence_number + RETRANSMIT_INDEX_WINDOW < pn) {
+                if (received[pkt_ctx->retransmit_oldest->sequence_number]) {
+                    DBG_PRINTF("Packet %d was received but not acknowledged", (int)pkt_ctx->retransmit_oldest->sequence_number);
+                    ret = -1;
+                } else {
+                    (void)picoquic_dequeue_retransmit_packet(cnx, pkt_ctx->retransmit_oldest, 1);
+                    *nb_lost += 1;
+                }
+            }
+        }
+
+        if (ret == 0 && pkt_ctx->send_sequence < RETRANSMIT_INDEX_NB_PACKETS) {
+            ret = retransmit_index_queue(cnx, use_index, current_time);
+        }
+    }
+
+    /* The packets still in the queue must not have been received */
+    for (picoquic_packet_t* p = pkt_ctx->retransmit_newest; ret == 0 && p != NULL; p = p->next_packet) {
+        if (received[p->sequence_number]) {
+            DBG_PRINTF("Packet %d was received but is still queued", (int)p->sequence_number);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (pkt_ctx->retransmit_index != NULL) != use_index) {
+        DBG_PRINTF("Unexpected index state, use index = %d", use_index);
         ret = -1;
     }
 
-    if (ret == 0 && sack0.end_of_sack_range != 7500) {
+    picoquic_reset_packet_context(cnx, picoquic_packet_context_application);
+    pkt_ctx->send_sequence = 0;
+    pkt_ctx->highest_acknowledged = 0;
+
+    if (receiver != NULL) {
+        picoquic_clear_sack_list(&receiver->pkt_ctx[picoquic_packet_context_application].sack_list);
+        free(receiver);
+    }
+
+    return ret;
+}
+
+int retransmit_index_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    uint8_t* received = (uint8_t*)malloc(RETRANSMIT_INDEX_NB_PACKETS);
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if (quic == NULL || received == NULL) {
+        ret = -1;
+    } else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
         ret = -1;
+    } else {
+        uint64_t random_state = 0xFEEDFACEull;
+        uint64_t decode_time[2];
+        uint64_t nb_lost[2];
+
+        for (size_t i = 0; i < RETRANSMIT_INDEX_NB_PACKETS; i++) {
+            received[i] = (retransmit_index_random(&random_state) % 1000) >= RETRANSMIT_INDEX_LOSS_PER_1000;
+        }
+
+        for (int use_index = 1; ret == 0 && use_index >= 0; use_index--) {
+            ret = retransmit_index_one_test(cnx, received, use_index, &decode_time[use_index], &nb_lost[use_index]);
+        }
+
+        if (ret == 0) {
+            DBG_PRINTF("ACK decoding time, %d packets window: with index %dus, without %dus, %d lost",
+                RETRANSMIT_INDEX_WINDOW, (int)decode_time[1], (int)decode_time[0], (int)nb_lost[1]);
+
+            if (nb_lost[0] != nb_lost[1] || nb_lost[1] == 0) {
+                ret = -1;
+            }
+        }
     }
 
-    if (ret == 0 && sack0.next_sack != NULL) {
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (received != NULL) {
+        free(received);
+    }
+
+    return ret;
+}
+
+/*
+ * Send a bulk transfer over four streams with a random loss pattern, each
+ * packet carrying an ACK and two stream frames. The receiver loses 5% of
+ * the packets and acknowledges every other packet, and the sender repeats
+ * the lost stream frames. The test compares the time spent processing ACKs
+ * and losses when the frames are described at send time and when the
+ * packets are parsed again, and checks that both produce the same result.
+ */
+#define FRAME_DESC_NB_PACKETS 20000
+#define FRAME_DESC_NB_STREAMS 4
+#define FRAME_DESC_PACKET_SIZE 1200
+#define FRAME_DESC_BUFFER_SIZE 500
+#define FRAME_DESC_NB_BUFFERS (FRAME_DESC_NB_PACKETS / 2)
+
+typedef struct st_frame_desc_test_result_t {
+    uint64_t ack_time;
+    uint64_t loss_time;
+    uint64_t nb_retransmit;
+    uint64_t retransmit_bytes;
+    uint64_t acked_bytes;
+} frame_desc_test_result_t;
+
+static void frame_desc_test_release(uint8_t* bytes, size_t length, void* release_ctx)
+{
+    /* The buffer is shared by all the streams, and freed at the end of the test */
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(release_ctx);
+#endif
+}
+
+static int frame_desc_test_send(picoquic_cnx_t* cnx, picoquic_stream_head** streams, int use_desc,
+    uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+    picoquic_packet_t* packet = picoquic_create_packet(cnx->quic);
+    size_t length = 0;
+    size_t consumed = 0;
+
+    if (packet == NULL) {
         ret = -1;
+    } else {
+        packet->sequence_number = pkt_ctx->send_sequence++;
+        packet->pc = picoquic_packet_context_application;
+        packet->ptype = picoquic_packet_1rtt_protected;
+        packet->send_path = cnx->path[0];
+        packet->send_time = current_time;
+
+        /* Acknowledge the peer packets, assuming the peer sends one per packet received */
+        ret = picoquic_record_pn_received(cnx, picoquic_packet_context_application, packet->sequence_number, current_time);
+        if (ret == 0) {
+            ret = picoquic_prepare_ack_frame_basic(cnx, current_time, picoquic_packet_context_application,
+                packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &consumed);
+            length += consumed;
+        }
+
+        for (int i = 0; ret == 0 && i < 2; i++) {
+            picoquic_stream_head* stream = streams[(2 * packet->sequence_number + i) % FRAME_DESC_NB_STREAMS];
+
+            /* Each frame carries one of the queued buffers */
+            ret = picoquic_prepare_stream_frame(cnx, stream, &packet->bytes[length], FRAME_DESC_PACKET_SIZE - length, &consumed, NULL);
+            length += consumed;
+        }
+
+        packet->length = (uint32_t)length;
+
+        if (use_desc) {
+            picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, length, current_time);
+        } else {
+            /* Keep a verbatim copy of the packet, as before the frames were described */
+            uint8_t* verbatim = (uint8_t*)malloc(PICOQUIC_MAX_PACKET_SIZE);
+
+            if (verbatim == NULL) {
+                ret = -1;
+            } else {
+                memcpy(verbatim, packet->bytes, length);
+            }
+            picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, length, current_time);
+            if (verbatim != NULL) {
+                if (packet->bytes != NULL) {
+                    free(packet->bytes);
+                }
+                packet->bytes = verbatim;
+                packet->is_compacted = 1;
+                packet->is_described = 0;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int frame_desc_one_test(uint8_t* received, uint8_t* data, int use_desc, frame_desc_test_result_t* result)
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_cnx_t* receiver = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    picoquic_stream_head* streams[FRAME_DESC_NB_STREAMS];
+    picoquic_iovec_t* iov = (picoquic_iovec_t*)malloc(FRAME_DESC_NB_BUFFERS * sizeof(picoquic_iovec_t));
+    uint64_t current_time = 0;
+    uint8_t bytes[1024];
+    struct sockaddr_in addr;
+
+    memset(result, 0, sizeof(frame_desc_test_result_t));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if (quic == NULL || receiver == NULL || iov == NULL) {
+        ret = -1;
+    } else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    } else {
+        memset(receiver, 0, sizeof(picoquic_cnx_t));
+        for (int i = 0; i < FRAME_DESC_NB_BUFFERS; i++) {
+            iov[i].base = data;
+            iov[i].len = FRAME_DESC_BUFFER_SIZE;
+        }
+        cnx->maxdata_remote = (uint64_t)((int64_t)-1);
+        cnx->remote_parameters.initial_max_stream_data_bidi_local = 0x40000000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = 0x40000000;
+        cnx->remote_parameters.max_ack_delay = 0;
+        cnx->max_stream_id_bidir_local = STREAM_ID_FROM_RANK(FRAME_DESC_NB_STREAMS, 1, 0);
+        cnx->max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(FRAME_DESC_NB_STREAMS, 0, 0);
+        /* Declare packets lost soon after the next ones are acknowledged */
+        cnx->path[0]->smoothed_rtt = 100;
+        /* Peer packets are acknowledged before the first ACK is received */
+        cnx->pkt_ctx[picoquic_packet_context_application].highest_acknowledged = 0;
+
+        for (int i = 0; ret == 0 && i < FRAME_DESC_NB_STREAMS; i++) {
+            uint64_t stream_id = STREAM_ID_FROM_RANK(i, 0, 0);
+
+            if (picoquic_add_to_stream_zero_copy(cnx, stream_id, iov, FRAME_DESC_NB_BUFFERS, 0,
+                frame_desc_test_release, NULL) != 0 ||
+                (streams[i] = picoquic_find_stream(cnx, stream_id, 0)) == NULL) {
+                ret = -1;
+            }
+        }
+    }
+
+    for (uint64_t pn = 0; ret == 0 && pn < FRAME_DESC_NB_PACKETS; pn++) {
+        current_time += 10;
+
+        ret = frame_desc_test_send(cnx, streams, use_desc, current_time);
+
+        if (ret == 0 && received[pn]) {
+            ret = picoquic_record_pn_received(receiver, picoquic_packet_context_application, pn, current_time);
+        }
+
+        if (ret == 0 && (pn & 1) == 1) {
+            size_t consumed = 0;
+            uint64_t start_time;
+
+            ret = picoquic_prepare_ack_frame_basic(receiver, current_time, picoquic_packet_context_application,
+                bytes, sizeof(bytes), &consumed);
+
+            if (ret == 0 && consumed > 0) {
+                start_time = picoquic_current_time();
+                ret = picoquic_decode_frames(cnx, cnx->path[0], bytes, consumed, 3, NULL, NULL, current_time);
+                result->ack_time += picoquic_current_time() - start_time;
+            }
+        }
+
+        /* Repeat the lost frames. The repeated packets are not sent again */
+        while (ret == 0) {
+            picoquic_packet_t* packet = picoquic_create_packet(quic);
+            uint64_t next_wake_time = UINT64_MAX;
+            int is_cleartext_mode = 0;
+            uint32_t header_length = 0;
+            uint64_t start_time = picoquic_current_time();
+            int length;
+
+            if (packet == NULL) {
+                ret = -1;
+                break;
+            }
+
+            length = picoquic_retransmit_needed(cnx, picoquic_packet_context_application, cnx->path[0],
+                current_time, &next_wake_time, packet, PICOQUIC_MAX_PACKET_SIZE, &is_cleartext_mode, &header_length);
+            result->loss_time += picoquic_current_time() - start_time;
+            picoquic_recycle_packet(quic, packet);
+
+            if (length <= 0) {
+                break;
+            }
+            result->nb_retransmit++;
+            result->retransmit_bytes += (uint64_t)length - header_length;
+        }
+
+        /* Spurious retransmissions are not tested here, forget the repeated packets */
+        while (ret == 0 && cnx->pkt_ctx[picoquic_packet_context_application].retransmitted_newest != NULL) {
+            picoquic_dequeue_retransmitted_packet(cnx, cnx->pkt_ctx[picoquic_packet_context_application].retransmitted_newest);
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < FRAME_DESC_NB_STREAMS; i++) {
+        for (size_t j = 0; j < streams[i]->sack_list.nb_ranges; j++) {
+            result->acked_bytes += streams[i]->sack_list.ranges[j].end_of_sack_range + 1 -
+                streams[i]->sack_list.ranges[j].start_of_sack_range;
+        }
+    }
+
+    if (ret == 0 && cnx->cnx_state == picoquic_state_disconnected) {
+        DBG_PRINTF("%s", "Connection disconnected during the transfer");
+        ret = -1;
+    }
+
+    if (receiver != NULL) {
+        picoquic_clear_sack_list(&receiver->pkt_ctx[picoquic_packet_context_application].sack_list);
+        free(receiver);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (iov != NULL) {
+        free(iov);
+    }
+
+    return ret;
+}
+
+int frame_desc_test()
+{
+    int ret = 0;
+    uint8_t* received = (uint8_t*)malloc(FRAME_DESC_NB_PACKETS);
+    uint8_t* data = (uint8_t*)malloc(FRAME_DESC_BUFFER_SIZE);
+    frame_desc_test_result_t result[2];
+
+    if (received == NULL || data == NULL) {
+        ret = -1;
+    } else {
+        uint64_t random_state = 0xDEADBEEFull;
+
+        for (size_t i = 0; i < FRAME_DESC_NB_PACKETS; i++) {
+            received[i] = (retransmit_index_random(&random_state) % 1000) >= RETRANSMIT_INDEX_LOSS_PER_1000;
+        }
+        for (size_t i = 0; i < FRAME_DESC_BUFFER_SIZE; i++) {
+            data[i] = (uint8_t)i;
+        }
+
+        for (int use_desc = 1; ret == 0 && use_desc >= 0; use_desc--) {
+            ret = frame_desc_one_test(received, data, use_desc, &result[use_desc]);
+        }
+
+        if (ret == 0) {
+            DBG_PRINTF("ACK processing with frame descriptors %dus, without %dus",
+                (int)result[1].ack_time, (int)result[0].ack_time);
+            DBG_PRINTF("Loss processing with frame descriptors %dus, without %dus, %d packets repeated",
+                (int)result[1].loss_time, (int)result[0].loss_time, (int)result[1].nb_retransmit);
+
+            if (result[0].nb_retransmit != result[1].nb_retransmit || result[1].nb_retransmit == 0 ||
+                result[0].retransmit_bytes != result[1].retransmit_bytes ||
+                result[0].acked_bytes != result[1].acked_bytes || result[1].acked_bytes == 0) {
+                DBG_PRINTF("%s", "Results differ with and without frame descriptors");
+                ret = -1;
+            }
+        }
+    }
+
+    if (received != NULL) {
+        free(received);
+    }
+
+    if (data != NULL) {
+        free(data);
+    }
+
+    return ret;
+}
+
+/*
+ * Receive packets in a lossy and reordered pattern, with the SACK list
+ * bounded to its default number of ranges. Check that the list never grows
+ * beyond the bound, that the ranges stay sorted and separated by holes,
+ * that duplicates are detected above the horizon, and that packets that
+ * were lost are never reported as received above the horizon.
+ */
+
+#define SACK_BOUND_NB_PACKETS 20000
+#define SACK_BOUND_REORDER 16
+
+static int sack_bound_check_ranges(picoquic_sack_list_t* sack_list)
+{
+    int ret = 0;
+
+    if (sack_list->nb_ranges > sack_list->max_ranges) {
+        DBG_PRINTF("Too many ranges: %d", (int)sack_list->nb_ranges);
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < sack_list->nb_ranges; i++) {
+        if (sack_list->ranges[i].start_of_sack_range > sack_list->ranges[i].end_of_sack_range ||
+            sack_list->ranges[i].start_of_sack_range < sack_list->horizon ||
+            (i > 0 && sack_list->ranges[i].end_of_sack_range + 1 >= sack_list->ranges[i - 1].start_of_sack_range)) {
+            DBG_PRINTF("Range %d is not well formed", (int)i);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int sack_bound_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    uint8_t* received = (uint8_t*)malloc(SACK_BOUND_NB_PACKETS);
+    uint64_t order[SACK_BOUND_REORDER];
+    uint64_t random_state = 0xDEADBEEFull;
+    picoquic_packet_context_enum pc = picoquic_packet_context_application;
+
+    if (cnx == NULL || received == NULL) {
+        ret = -1;
+    } else {
+        memset(cnx, 0, sizeof(picoquic_cnx_t));
+        picoquic_init_sack_list(&cnx->pkt_ctx[pc].sack_list, PICOQUIC_MAX_SACK_RANGES);
+        memset(received, 0, SACK_BOUND_NB_PACKETS);
+    }
+
+    for (uint64_t base = 0; ret == 0 && base < SACK_BOUND_NB_PACKETS; base += SACK_BOUND_REORDER) {
+        /* Shuffle the next block of packets, and drop 5% of them */
+        for (size_t i = 0; i < SACK_BOUND_REORDER; i++) {
+            order[i] = base + i;
+        }
+        for (size_t i = SACK_BOUND_REORDER - 1; i > 0; i--) {
+            size_t j = (size_t)(retransmit_index_random(&random_state) % (i + 1));
+            uint64_t x = order[i];
+            order[i] = order[j];
+            order[j] = x;
+        }
+
+        for (size_t i = 0; ret == 0 && i < SACK_BOUND_REORDER; i++) {
+            if ((retransmit_index_random(&random_state) % 1000) < 50) {
+                continue;
+            }
+            if (picoquic_is_pn_already_received(cnx, pc, order[i])) {
+                DBG_PRINTF("Packet %d reported as duplicate", (int)order[i]);
+                ret = -1;
+            } else if (picoquic_record_pn_received(cnx, pc, order[i], base) != 0) {
+                ret = -1;
+            } else if (!picoquic_is_pn_already_received(cnx, pc, order[i]) ||
+                picoquic_record_pn_received(cnx, pc, order[i], base) != 1) {
+                DBG_PRINTF("Packet %d not recorded", (int)order[i]);
+                ret = -1;
+            } else {
+                received[order[i]] = 1;
+            }
+        }
+
+        if (ret == 0) {
+            ret = sack_bound_check_ranges(&cnx->pkt_ctx[pc].sack_list);
+        }
+    }
+
+    if (ret == 0 && cnx->pkt_ctx[pc].sack_list.horizon == 0) {
+        DBG_PRINTF("%s", "The oldest ranges were never forgotten");
+        ret = -1;
+    }
+
+    for (uint64_t pn = 0; ret == 0 && pn < SACK_BOUND_NB_PACKETS; pn++) {
+        int is_received = picoquic_is_pn_already_received(cnx, pc, pn);
+
+        if (pn < cnx->pkt_ctx[pc].sack_list.horizon) {
+            if (!is_received) {
+                DBG_PRINTF("Packet %d below horizon not treated as duplicate", (int)pn);
+                ret = -1;
+            }
+        } else if (is_received != received[pn]) {
+            DBG_PRINTF("Packet %d, received %d, reported %d", (int)pn, received[pn], is_received);
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_clear_sack_list(&cnx->pkt_ctx[pc].sack_list);
+        free(cnx);
+    }
+
+    if (received != NULL) {
+        free(received);
     }
 
     return ret;
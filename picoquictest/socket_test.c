@@ -19,7 +19,12 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include "picocrypto.h"
+#include "picoloop.h"
+#include "picoquic_internal.h"
+#include "picoshard.h"
 #include "picosocks.h"
+#include "tls_api.h"
 #include "util.h"
 
 static int socket_ping_pong(SOCKET_TYPE fd, struct sockaddr* server_addr, int server_address_length,
@@ -223,4 +228,1753 @@ int socket_ecn_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+/*
+ * Test the batch receive API. A client sends a series of datagrams to the
+ * server sockets, which are then received with picoquic_select_batch.
+ * Verify that all the datagrams are received, in order, with their source
+ * and destination addresses.
+ *
+ * The test then compares the rate at which datagrams are received on the
+ * loopback interface with picoquic_select and with picoquic_select_batch.
+ */
+
+#define SOCKET_BATCH_TEST_NB 32
+#define SOCKET_BATCH_TEST_LENGTH 1200
+#define SOCKET_BATCH_TEST_ROUNDS 200
+
+static int socket_batch_send(SOCKET_TYPE fd, struct sockaddr* server_addr, int server_address_length,
+    uint8_t* message, int round)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+        message[0] = (uint8_t)round;
+        message[1] = (uint8_t)i;
+
+        if (sendto(fd, (const char*)message, SOCKET_BATCH_TEST_LENGTH, 0, server_addr, server_address_length)
+            != SOCKET_BATCH_TEST_LENGTH) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int socket_batch_receive(picoquic_server_sockets_t* server_sockets, picoquic_recv_datagram_t* datagrams,
+    int use_batch, int round, int check)
+{
+    int ret = 0;
+    int nb_received = 0;
+    uint64_t current_time;
+
+    while (ret == 0 && nb_received < SOCKET_BATCH_TEST_NB) {
+        int nb_recv;
+
+        if (use_batch) {
+            nb_recv = picoquic_select_batch(server_sockets->s_socket, PICOQUIC_NB_SERVER_SOCKETS,
+                datagrams + nb_received, SOCKET_BATCH_TEST_NB - nb_received, 1000000, &current_time);
+        }
+        else {
+            picoquic_recv_datagram_t* d = &datagrams[nb_received];
+
+            d->from_length = sizeof(struct sockaddr_storage);
+            d->length = picoquic_select(server_sockets->s_socket, PICOQUIC_NB_SERVER_SOCKETS,
+                &d->addr_from, &d->from_length, &d->addr_dest, &d->dest_length, &d->dest_if, &d->received_ecn,
+                d->buffer, d->buffer_max, 1000000, &current_time);
+            nb_recv = (d->length > 0) ? 1 : -1;
+        }
+
+        if (nb_recv <= 0) {
+            DBG_PRINTF("Received %d datagrams, then %d", nb_received, nb_recv);
+            ret = -1;
+        }
+        else {
+            nb_received += nb_recv;
+        }
+    }
+
+    for (int i = 0; ret == 0 && check && i < SOCKET_BATCH_TEST_NB; i++) {
+        if (datagrams[i].length != SOCKET_BATCH_TEST_LENGTH ||
+            datagrams[i].buffer[0] != (uint8_t)round || datagrams[i].buffer[1] != (uint8_t)i) {
+            DBG_PRINTF("Unexpected datagram %d, length %d", i, datagrams[i].length);
+            ret = -1;
+        }
+        else if (datagrams[i].from_length != sizeof(struct sockaddr_in) ||
+            datagrams[i].addr_from.ss_family != AF_INET ||
+            datagrams[i].dest_length != sizeof(struct sockaddr_in) ||
+            datagrams[i].addr_dest.ss_family != AF_INET) {
+            DBG_PRINTF("Unexpected addresses for datagram %d", i);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int socket_batch_test()
+{
+    int ret = 0;
+    int test_port = 12346;
+    picoquic_server_sockets_t server_sockets;
+    picoquic_recv_datagram_t datagrams[SOCKET_BATCH_TEST_NB];
+    uint8_t* buffers = NULL;
+    uint8_t message[SOCKET_BATCH_TEST_LENGTH];
+    struct sockaddr_storage server_address;
+    int server_address_length;
+    int is_name;
+    SOCKET_TYPE fd = INVALID_SOCKET;
+    uint64_t duration[2] = { 0, 0 };
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    memset(message, 0x5A, sizeof(message));
+
+    if ((buffers = (uint8_t*)malloc(SOCKET_BATCH_TEST_NB * PICOQUIC_MAX_PACKET_SIZE)) == NULL) {
+        ret = -1;
+    }
+    else {
+        for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+            datagrams[i].buffer = buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+            datagrams[i].buffer_max = PICOQUIC_MAX_PACKET_SIZE;
+        }
+        ret = picoquic_open_server_sockets(&server_sockets, test_port);
+    }
+
+    if (ret == 0) {
+        ret = picoquic_get_server_address("127.0.0.1", test_port, &server_address, &server_address_length, &is_name);
+
+        if (ret == 0 && (fd = socket(server_address.ss_family, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+            ret = -1;
+        }
+
+        /* Check that a batch is received completely and correctly */
+        if (ret == 0) {
+            ret = socket_batch_send(fd, (struct sockaddr*)&server_address, server_address_length, message, 0);
+        }
+
+        if (ret == 0) {
+            ret = socket_batch_receive(&server_sockets, datagrams, 1, 0, 1);
+        }
+
+        /* Compare the receive rates of the single and batch APIs */
+        for (int use_batch = 0; ret == 0 && use_batch < 2; use_batch++) {
+            for (int round = 1; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+                uint64_t start_time;
+
+                ret = socket_batch_send(fd, (struct sockaddr*)&server_address, server_address_length, message, round);
+
+                start_time = picoquic_current_time();
+                if (ret == 0) {
+                    ret = socket_batch_receive(&server_sockets, datagrams, use_batch, round, 0);
+                }
+                duration[use_batch] += picoquic_current_time() - start_time;
+            }
+        }
+
+        if (ret == 0) {
+            for (int use_batch = 0; use_batch < 2; use_batch++) {
+                DBG_PRINTF("%s: %d packets per second", (use_batch) ? "picoquic_select_batch" : "picoquic_select",
+                    (int)((1000000.0 * SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_ROUNDS) / (double)(duration[use_batch] + 1)));
+            }
+        }
+
+        if (fd != INVALID_SOCKET) {
+            SOCKET_CLOSE(fd);
+        }
+
+        picoquic_close_server_sockets(&server_sockets);
+    }
+
+    if (buffers != NULL) {
+        free(buffers);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the batch send API. The server sockets send a series of datagrams to
+ * a client socket with picoquic_send_batch_through_server_sockets, and the
+ * client verifies that they arrive complete and in order.
+ *
+ * The test then compares the rate at which datagrams are sent on the
+ * loopback interface one at a time and in batches, and verifies that a
+ * datagram rejected by the socket does not stop the rest of the batch.
+ */
+
+#define SOCKET_BATCH_REJECTED 3
+
+static int socket_send_batch_drain(SOCKET_TYPE fd, uint8_t* buffer, int round, int check)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+        struct sockaddr_storage addr_from;
+        socklen_t from_length = sizeof(addr_from);
+        int bytes_recv = (int)recvfrom(fd, (char*)buffer, PICOQUIC_MAX_PACKET_SIZE, 0,
+            (struct sockaddr*)&addr_from, &from_length);
+
+        if (bytes_recv != SOCKET_BATCH_TEST_LENGTH) {
+            DBG_PRINTF("Datagram %d, received %d bytes", i, bytes_recv);
+            ret = -1;
+        }
+        else if (check && (buffer[0] != (uint8_t)round || buffer[1] != (uint8_t)i)) {
+            DBG_PRINTF("Unexpected datagram %d", i);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int socket_send_batch_test()
+{
+    int ret = 0;
+    int test_port = 12347;
+    picoquic_server_sockets_t server_sockets;
+    picoquic_send_datagram_t datagrams[SOCKET_BATCH_TEST_NB];
+    uint8_t* buffers = NULL;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+    struct sockaddr_storage client_address;
+    int client_address_length;
+    SOCKET_TYPE fd = INVALID_SOCKET;
+    uint64_t duration[2] = { 0, 0 };
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    if ((buffers = (uint8_t*)malloc(SOCKET_BATCH_TEST_NB * PICOQUIC_MAX_PACKET_SIZE)) == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = picoquic_open_server_sockets(&server_sockets, test_port);
+    }
+
+    if (ret == 0) {
+        /* Open a client socket, and find its port on the loopback address */
+        struct sockaddr_in* client_v4 = (struct sockaddr_in*)&client_address;
+
+        if ((fd = picoquic_open_client_socket(AF_INET)) == INVALID_SOCKET) {
+            ret = -1;
+        }
+        else {
+            struct sockaddr_in bind_addr;
+
+            memset(&bind_addr, 0, sizeof(bind_addr));
+            bind_addr.sin_family = AF_INET;
+            if (bind(fd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0 ||
+                picoquic_get_local_address(fd, &client_address) != 0) {
+                ret = -1;
+            }
+            else {
+                client_v4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                client_address_length = sizeof(struct sockaddr_in);
+            }
+        }
+
+        for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+            datagrams[i].bytes = buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+            datagrams[i].bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+            datagrams[i].length = SOCKET_BATCH_TEST_LENGTH;
+            memset(datagrams[i].bytes, 0x5A, SOCKET_BATCH_TEST_LENGTH);
+            datagrams[i].bytes[1] = (uint8_t)i;
+            memcpy(&datagrams[i].addr_to, &client_address, sizeof(client_address));
+            datagrams[i].addr_to_len = client_address_length;
+            memset(&datagrams[i].addr_from, 0, sizeof(datagrams[i].addr_from));
+            datagrams[i].addr_from_len = 0;
+            datagrams[i].if_index = 0;
+        }
+
+        /* Compare the send rates of the single and batch APIs, and check what is received */
+        for (int use_batch = 0; ret == 0 && use_batch < 2; use_batch++) {
+            for (int round = 0; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+                uint64_t start_time;
+
+                for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+                    datagrams[i].bytes[0] = (uint8_t)round;
+                }
+
+                start_time = picoquic_current_time();
+                if (use_batch) {
+                    if (picoquic_send_batch_through_server_sockets(&server_sockets, datagrams, SOCKET_BATCH_TEST_NB)
+                        != SOCKET_BATCH_TEST_NB) {
+                        ret = -1;
+                    }
+                }
+                else {
+                    for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+                        if (picoquic_send_through_server_sockets(&server_sockets,
+                            (struct sockaddr*)&datagrams[i].addr_to, datagrams[i].addr_to_len, NULL, 0, 0,
+                            (const char*)datagrams[i].bytes, (int)datagrams[i].length) != (int)datagrams[i].length) {
+                            ret = -1;
+                        }
+                    }
+                }
+                duration[use_batch] += picoquic_current_time() - start_time;
+
+                if (ret == 0) {
+                    ret = socket_send_batch_drain(fd, buffer, round, round == 0);
+                }
+            }
+        }
+
+        /* A datagram that the socket rejects does not stop the rest of the batch */
+        if (ret == 0) {
+            uint16_t client_port = ((struct sockaddr_in*)&datagrams[SOCKET_BATCH_REJECTED].addr_to)->sin_port;
+
+            ((struct sockaddr_in*)&datagrams[SOCKET_BATCH_REJECTED].addr_to)->sin_port = 0;
+            if (picoquic_send_batch_through_server_sockets(&server_sockets, datagrams, SOCKET_BATCH_TEST_NB)
+                != SOCKET_BATCH_TEST_NB - 1) {
+                DBG_PRINTF("%s", "Batch not sent after a rejected datagram");
+                ret = -1;
+            }
+            ((struct sockaddr_in*)&datagrams[SOCKET_BATCH_REJECTED].addr_to)->sin_port = client_port;
+
+            for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+                struct sockaddr_storage addr_from;
+                socklen_t from_length = sizeof(addr_from);
+                int bytes_recv;
+
+                if (i == SOCKET_BATCH_REJECTED) {
+                    continue;
+                }
+                bytes_recv = (int)recvfrom(fd, (char*)buffer, PICOQUIC_MAX_PACKET_SIZE, 0,
+                    (struct sockaddr*)&addr_from, &from_length);
+                if (bytes_recv != SOCKET_BATCH_TEST_LENGTH || buffer[1] != (uint8_t)i) {
+                    DBG_PRINTF("Expected datagram %d after the rejected one, got %d bytes", i, bytes_recv);
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            for (int use_batch = 0; use_batch < 2; use_batch++) {
+                DBG_PRINTF("%s: %d packets per second",
+                    (use_batch) ? "picoquic_send_batch_through_server_sockets" : "picoquic_send_through_server_sockets",
+                    (int)((1000000.0 * SOCKET_BATCH_TEST_NB * (SOCKET_BATCH_TEST_ROUNDS + 1)) / (double)(duration[use_batch] + 1)));
+            }
+        }
+
+        if (fd != INVALID_SOCKET) {
+            SOCKET_CLOSE(fd);
+        }
+
+        picoquic_close_server_sockets(&server_sockets);
+    }
+
+    if (buffers != NULL) {
+        free(buffers);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the segmented send. A buffer holding a series of equal size packets
+ * is sent with picoquic_sendmsg and a segment size, which uses UDP segmentation
+ * offload if available. Verify that the client receives the expected series of
+ * datagrams, then compare the send rate on loopback with that of sending each
+ * packet with its own call.
+ */
+
+int socket_gso_test()
+{
+    int ret = 0;
+    uint8_t* send_buffer = NULL;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+    struct sockaddr_storage client_address;
+    int client_address_length = 0;
+    SOCKET_TYPE fd = INVALID_SOCKET;
+    SOCKET_TYPE fd_send = INVALID_SOCKET;
+    uint64_t duration[2] = { 0, 0 };
+    int length = SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_LENGTH;
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    if ((send_buffer = (uint8_t*)malloc(length)) == NULL) {
+        ret = -1;
+    }
+    else if ((fd = picoquic_open_client_socket(AF_INET)) == INVALID_SOCKET ||
+        (fd_send = picoquic_open_client_socket(AF_INET)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+    else {
+        struct sockaddr_in bind_addr;
+
+        memset(&bind_addr, 0, sizeof(bind_addr));
+        bind_addr.sin_family = AF_INET;
+        if (bind(fd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0 ||
+            picoquic_get_local_address(fd, &client_address) != 0) {
+            ret = -1;
+        }
+        else {
+            ((struct sockaddr_in*)&client_address)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            client_address_length = sizeof(struct sockaddr_in);
+        }
+    }
+
+    if (ret == 0) {
+        memset(send_buffer, 0x5A, length);
+        for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+            send_buffer[i * SOCKET_BATCH_TEST_LENGTH + 1] = (uint8_t)i;
+        }
+    }
+
+    /* Compare the per packet and segmented sends, and check what is received */
+    for (int use_gso = 0; ret == 0 && use_gso < 2; use_gso++) {
+        for (int round = 0; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+            uint64_t start_time;
+
+            for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+                send_buffer[i * SOCKET_BATCH_TEST_LENGTH] = (uint8_t)round;
+            }
+
+            start_time = picoquic_current_time();
+            if (use_gso) {
+                if (picoquic_sendmsg(fd_send, (struct sockaddr*)&client_address, client_address_length, NULL, 0, 0,
+                    (const char*)send_buffer, length, SOCKET_BATCH_TEST_LENGTH) != length) {
+                    ret = -1;
+                }
+            }
+            else {
+                for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+                    if (picoquic_sendmsg(fd_send, (struct sockaddr*)&client_address, client_address_length, NULL, 0, 0,
+                        (const char*)send_buffer + i * SOCKET_BATCH_TEST_LENGTH, SOCKET_BATCH_TEST_LENGTH, 0)
+                        != SOCKET_BATCH_TEST_LENGTH) {
+                        ret = -1;
+                    }
+                }
+            }
+            duration[use_gso] += picoquic_current_time() - start_time;
+
+            if (ret == 0) {
+                ret = socket_send_batch_drain(fd, buffer, round, round == 0);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (int use_gso = 0; use_gso < 2; use_gso++) {
+            DBG_PRINTF("%s: %d packets per second", (use_gso) ? "segmented send" : "per packet send",
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * (SOCKET_BATCH_TEST_ROUNDS + 1)) / (double)(duration[use_gso] + 1)));
+        }
+    }
+
+    if (fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd);
+    }
+
+    if (fd_send != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd_send);
+    }
+
+    if (send_buffer != NULL) {
+        free(send_buffer);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the coalesced receive. A series of equal size datagrams is sent with
+ * a segmented send to a socket on which UDP generic receive offload is
+ * enabled if available. The receiver splits what it gets using the segment
+ * size reported by picoquic_select_batch, and verifies that each datagram
+ * arrives complete and in order. The test then compares the number of receive
+ * calls and the receive rate with those of a socket without GRO.
+ */
+
+#define SOCKET_GRO_TEST_BUFFER_SIZE 0x10000
+
+static SOCKET_TYPE socket_gro_open_receiver(struct sockaddr_storage* addr, int* addr_length)
+{
+    SOCKET_TYPE fd = picoquic_open_client_socket(AF_INET);
+
+    if (fd != INVALID_SOCKET) {
+        struct sockaddr_in bind_addr;
+
+        memset(&bind_addr, 0, sizeof(bind_addr));
+        bind_addr.sin_family = AF_INET;
+        if (bind(fd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0 ||
+            picoquic_get_local_address(fd, addr) != 0) {
+            SOCKET_CLOSE(fd);
+            fd = INVALID_SOCKET;
+        }
+        else {
+            ((struct sockaddr_in*)addr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            *addr_length = sizeof(struct sockaddr_in);
+        }
+    }
+
+    return fd;
+}
+
+static int socket_gro_receive(SOCKET_TYPE fd, picoquic_recv_datagram_t* datagram, int round, int check, int* nb_calls)
+{
+    int ret = 0;
+    int nb_received = 0;
+    uint64_t current_time;
+
+    while (ret == 0 && nb_received < SOCKET_BATCH_TEST_NB) {
+        if (picoquic_select_batch(&fd, 1, datagram, 1, 1000000, &current_time) <= 0) {
+            DBG_PRINTF("Received %d datagrams, then nothing", nb_received);
+            ret = -1;
+        }
+        else {
+            size_t segment_size = (datagram->segment_size == 0) ? datagram->length : datagram->segment_size;
+            size_t offset = 0;
+
+            *nb_calls += 1;
+            while (ret == 0 && offset < datagram->length) {
+                size_t length = datagram->length - offset;
+
+                if (length > segment_size) {
+                    length = segment_size;
+                }
+
+                if (length != SOCKET_BATCH_TEST_LENGTH || nb_received >= SOCKET_BATCH_TEST_NB) {
+                    DBG_PRINTF("Datagram %d, received %d bytes", nb_received, (int)length);
+                    ret = -1;
+                }
+                else if (check && (datagram->buffer[offset] != (uint8_t)round ||
+                    datagram->buffer[offset + 1] != (uint8_t)nb_received)) {
+                    DBG_PRINTF("Unexpected datagram %d", nb_received);
+                    ret = -1;
+                }
+                offset += length;
+                nb_received++;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int socket_gro_test()
+{
+    int ret = 0;
+    uint8_t* send_buffer = NULL;
+    uint8_t* recv_buffer = NULL;
+    picoquic_recv_datagram_t datagram;
+    struct sockaddr_storage receiver_address[2];
+    int receiver_address_length[2] = { 0, 0 };
+    SOCKET_TYPE fd[2] = { INVALID_SOCKET, INVALID_SOCKET };
+    SOCKET_TYPE fd_send = INVALID_SOCKET;
+    uint64_t duration[2] = { 0, 0 };
+    int nb_calls[2] = { 0, 0 };
+    int gro_enabled = 0;
+    int length = SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_LENGTH;
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    if ((send_buffer = (uint8_t*)malloc(length)) == NULL ||
+        (recv_buffer = (uint8_t*)malloc(SOCKET_GRO_TEST_BUFFER_SIZE)) == NULL) {
+        ret = -1;
+    }
+    else if ((fd_send = picoquic_open_client_socket(AF_INET)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+    else {
+        for (int use_gro = 0; ret == 0 && use_gro < 2; use_gro++) {
+            if ((fd[use_gro] = socket_gro_open_receiver(&receiver_address[use_gro], &receiver_address_length[use_gro]))
+                == INVALID_SOCKET) {
+                ret = -1;
+            }
+        }
+
+        if (ret == 0) {
+            /* GRO is an optimization: the test still checks the receive path if it is not supported */
+            gro_enabled = (picoquic_socket_set_gro(fd[1]) == 0);
+            if (!gro_enabled) {
+                DBG_PRINTF("%s", "UDP GRO is not supported on this system");
+            }
+        }
+    }
+
+    if (ret == 0) {
+        memset(send_buffer, 0x5A, length);
+        for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+            send_buffer[i * SOCKET_BATCH_TEST_LENGTH + 1] = (uint8_t)i;
+        }
+        datagram.buffer = recv_buffer;
+        datagram.buffer_max = SOCKET_GRO_TEST_BUFFER_SIZE;
+    }
+
+    /* Compare the receive with and without GRO, and check what is received */
+    for (int use_gro = 0; ret == 0 && use_gro < 2; use_gro++) {
+        for (int round = 0; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+            uint64_t start_time;
+
+            for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+                send_buffer[i * SOCKET_BATCH_TEST_LENGTH] = (uint8_t)round;
+            }
+
+            if (picoquic_sendmsg(fd_send, (struct sockaddr*)&receiver_address[use_gro], receiver_address_length[use_gro],
+                NULL, 0, 0, (const char*)send_buffer, length, SOCKET_BATCH_TEST_LENGTH) != length) {
+                ret = -1;
+            }
+            else {
+                start_time = picoquic_current_time();
+                ret = socket_gro_receive(fd[use_gro], &datagram, round, round == 0, &nb_calls[use_gro]);
+                duration[use_gro] += picoquic_current_time() - start_time;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (int use_gro = 0; use_gro < 2; use_gro++) {
+            DBG_PRINTF("%s: %d packets per second, %d receive calls per %d packets",
+                (use_gro) ? "GRO receive" : "per packet receive",
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * (SOCKET_BATCH_TEST_ROUNDS + 1)) / (double)(duration[use_gro] + 1)),
+                nb_calls[use_gro] / (SOCKET_BATCH_TEST_ROUNDS + 1), SOCKET_BATCH_TEST_NB);
+        }
+    }
+
+    for (int use_gro = 0; use_gro < 2; use_gro++) {
+        if (fd[use_gro] != INVALID_SOCKET) {
+            SOCKET_CLOSE(fd[use_gro]);
+        }
+    }
+
+    if (fd_send != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd_send);
+    }
+
+    if (send_buffer != NULL) {
+        free(send_buffer);
+    }
+
+    if (recv_buffer != NULL) {
+        free(recv_buffer);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the event loop. The loop opens the server sockets, and a client sends
+ * a series of datagrams that the loop shall receive in order. The test then
+ * verifies that a wait without traffic expires at the requested delay, and
+ * compares the receive rate of the loop with that of picoquic_select_batch.
+ */
+
+#define SOCKET_LOOP_TEST_DELAY 20000
+
+static int socket_loop_receive(picoquic_event_loop_t* loop, int round, int check)
+{
+    int ret = 0;
+    int nb_received = 0;
+    uint64_t current_time = picoquic_current_time();
+
+    while (ret == 0 && nb_received < SOCKET_BATCH_TEST_NB) {
+        int nb_recv = picoquic_event_loop_wait(loop, 1000000, &current_time);
+
+        if (nb_recv <= 0) {
+            DBG_PRINTF("Received %d datagrams, then %d", nb_received, nb_recv);
+            ret = -1;
+        }
+        else {
+            for (int i = 0; ret == 0 && i < nb_recv; i++) {
+                picoquic_recv_datagram_t* d = &loop->datagrams[i];
+
+                if (check && (d->length != SOCKET_BATCH_TEST_LENGTH || d->buffer[0] != (uint8_t)round ||
+                    d->buffer[1] != (uint8_t)(nb_received + i) || d->addr_dest.ss_family != AF_INET)) {
+                    DBG_PRINTF("Unexpected datagram %d, length %d", nb_received + i, d->length);
+                    ret = -1;
+                }
+            }
+            nb_received += nb_recv;
+        }
+    }
+
+    return ret;
+}
+
+int socket_loop_test()
+{
+    int ret = 0;
+    int test_port = 12348;
+    picoquic_event_loop_t* loop = NULL;
+    picoquic_recv_datagram_t* datagrams = NULL;
+    uint8_t message[SOCKET_BATCH_TEST_LENGTH];
+    struct sockaddr_storage server_address;
+    int server_address_length;
+    int is_name;
+    SOCKET_TYPE fd = INVALID_SOCKET;
+    uint64_t duration[2] = { 0, 0 };
+    uint64_t current_time;
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    memset(message, 0x5A, sizeof(message));
+
+    if ((loop = picoquic_event_loop_create(NULL, SOCKET_BATCH_TEST_NB, PICOQUIC_MAX_PACKET_SIZE)) == NULL) {
+        ret = -1;
+    }
+    else if ((ret = picoquic_event_loop_open_server_sockets(loop, test_port)) == 0) {
+        datagrams = loop->datagrams;
+        ret = picoquic_get_server_address("127.0.0.1", test_port, &server_address, &server_address_length, &is_name);
+    }
+
+    if (ret == 0 && (fd = socket(server_address.ss_family, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+
+    /* Check that a batch is received completely and correctly */
+    if (ret == 0) {
+        ret = socket_batch_send(fd, (struct sockaddr*)&server_address, server_address_length, message, 0);
+    }
+
+    if (ret == 0) {
+        ret = socket_loop_receive(loop, 0, 1);
+    }
+
+    /* Check that the wait expires at the requested delay, twice in a row with the same timer */
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        uint64_t start_time = picoquic_current_time();
+        int64_t elapsed;
+
+        current_time = start_time;
+        if (picoquic_event_loop_wait(loop, SOCKET_LOOP_TEST_DELAY, &current_time) != 0) {
+            DBG_PRINTF("%s", "Unexpected datagram or error during the timed wait");
+            ret = -1;
+        }
+        else if ((elapsed = (int64_t)(current_time - start_time)) < SOCKET_LOOP_TEST_DELAY ||
+            elapsed > 50 * SOCKET_LOOP_TEST_DELAY) {
+            DBG_PRINTF("Wait for %d us, expired after %d us", SOCKET_LOOP_TEST_DELAY, (int)elapsed);
+            ret = -1;
+        }
+    }
+
+    /* Compare the receive rates of picoquic_select_batch and of the loop */
+    for (int use_loop = 0; ret == 0 && use_loop < 2; use_loop++) {
+        for (int round = 1; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+            uint64_t start_time;
+
+            ret = socket_batch_send(fd, (struct sockaddr*)&server_address, server_address_length, message, round);
+
+            start_time = picoquic_current_time();
+            if (ret == 0) {
+                if (use_loop) {
+                    ret = socket_loop_receive(loop, round, 0);
+                }
+                else {
+                    int nb_received = 0;
+
+                    while (ret == 0 && nb_received < SOCKET_BATCH_TEST_NB) {
+                        int nb_recv = picoquic_select_batch(loop->s_socket, loop->nb_sockets,
+                            datagrams, SOCKET_BATCH_TEST_NB - nb_received, 1000000, &current_time);
+
+                        if (nb_recv <= 0) {
+                            ret = -1;
+                        }
+                        else {
+                            nb_received += nb_recv;
+                        }
+                    }
+                }
+            }
+            duration[use_loop] += picoquic_current_time() - start_time;
+        }
+    }
+
+    if (ret == 0) {
+        for (int use_loop = 0; use_loop < 2; use_loop++) {
+            DBG_PRINTF("%s: %d packets per second", (use_loop) ? "picoquic_event_loop_wait" : "picoquic_select_batch",
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_ROUNDS) / (double)(duration[use_loop] + 1)));
+        }
+    }
+
+    if (fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd);
+    }
+
+    if (loop != NULL) {
+        picoquic_event_loop_delete(loop);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the io_uring backend of the event loop. Verify that a batch of
+ * datagrams is received and sent correctly through the ring, then compare
+ * the receive rates of picoquic_select_batch, of the epoll loop and of the
+ * io_uring loop, and the send rates of the two loops. If the kernel does
+ * not support io_uring, the loop keeps using epoll and the test checks that.
+ */
+
+static int socket_uring_send(picoquic_event_loop_t* loop, picoquic_send_datagram_t* datagrams, int round)
+{
+    for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+        datagrams[i].bytes[0] = (uint8_t)round;
+    }
+
+    return (picoquic_event_loop_send_batch(loop, datagrams, SOCKET_BATCH_TEST_NB) == SOCKET_BATCH_TEST_NB) ? 0 : -1;
+}
+
+int socket_uring_test()
+{
+    int ret = 0;
+    int test_port[2] = { 12349, 12350 };
+    picoquic_event_loop_t* loop[2] = { NULL, NULL };
+    picoquic_send_datagram_t send_datagrams[SOCKET_BATCH_TEST_NB];
+    uint8_t* send_buffers = NULL;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t message[SOCKET_BATCH_TEST_LENGTH];
+    struct sockaddr_storage server_address[2];
+    int server_address_length[2];
+    struct sockaddr_storage client_address;
+    int client_address_length = 0;
+    int is_name;
+    int is_uring = 0;
+    SOCKET_TYPE fd = INVALID_SOCKET;
+    SOCKET_TYPE fd_recv = INVALID_SOCKET;
+    uint64_t recv_duration[3] = { 0, 0, 0 };
+    uint64_t send_duration[2] = { 0, 0 };
+    uint64_t current_time;
+    const char* recv_name[3] = { "picoquic_select_batch", "epoll loop", "io_uring loop" };
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    memset(message, 0x5A, sizeof(message));
+
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        if ((loop[i] = picoquic_event_loop_create(NULL, SOCKET_BATCH_TEST_NB, PICOQUIC_MAX_PACKET_SIZE)) == NULL ||
+            picoquic_event_loop_open_server_sockets(loop[i], test_port[i]) != 0 ||
+            picoquic_get_server_address("127.0.0.1", test_port[i], &server_address[i], &server_address_length[i], &is_name) != 0) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        is_uring = (picoquic_event_loop_set_io_uring(loop[1]) == 0);
+        if (!is_uring) {
+            DBG_PRINTF("%s", "io_uring is not supported, the loop keeps using epoll");
+            recv_name[2] = "fallback loop";
+        }
+
+        if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET ||
+            (fd_recv = socket_gro_open_receiver(&client_address, &client_address_length)) == INVALID_SOCKET ||
+            (send_buffers = (uint8_t*)malloc(SOCKET_BATCH_TEST_NB * PICOQUIC_MAX_PACKET_SIZE)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        for (int i = 0; i < SOCKET_BATCH_TEST_NB; i++) {
+            send_datagrams[i].bytes = send_buffers + i * PICOQUIC_MAX_PACKET_SIZE;
+            send_datagrams[i].bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+            send_datagrams[i].length = SOCKET_BATCH_TEST_LENGTH;
+            memset(send_datagrams[i].bytes, 0x5A, SOCKET_BATCH_TEST_LENGTH);
+            send_datagrams[i].bytes[1] = (uint8_t)i;
+            memcpy(&send_datagrams[i].addr_to, &client_address, sizeof(client_address));
+            send_datagrams[i].addr_to_len = client_address_length;
+            memset(&send_datagrams[i].addr_from, 0, sizeof(send_datagrams[i].addr_from));
+            send_datagrams[i].addr_from_len = 0;
+            send_datagrams[i].if_index = 0;
+        }
+
+        /* Check that a batch is received and sent completely and correctly */
+        ret = socket_batch_send(fd, (struct sockaddr*)&server_address[1], server_address_length[1], message, 0);
+        if (ret == 0) {
+            ret = socket_loop_receive(loop[1], 0, 1);
+        }
+        if (ret == 0) {
+            ret = socket_uring_send(loop[1], send_datagrams, 0);
+        }
+        if (ret == 0) {
+            ret = socket_send_batch_drain(fd_recv, buffer, 0, 1);
+        }
+    }
+
+    /* Compare the receive rates */
+    for (int backend = 0; ret == 0 && backend < 3; backend++) {
+        picoquic_event_loop_t* recv_loop = loop[(backend == 2) ? 1 : 0];
+        int target = (backend == 2) ? 1 : 0;
+
+        for (int round = 1; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+            uint64_t start_time;
+
+            ret = socket_batch_send(fd, (struct sockaddr*)&server_address[target], server_address_length[target], message, round);
+
+            start_time = picoquic_current_time();
+            if (ret == 0) {
+                if (backend == 0) {
+                    int nb_received = 0;
+
+                    while (ret == 0 && nb_received < SOCKET_BATCH_TEST_NB) {
+                        int nb_recv = picoquic_select_batch(recv_loop->s_socket, recv_loop->nb_sockets,
+                            recv_loop->datagrams, SOCKET_BATCH_TEST_NB - nb_received, 1000000, &current_time);
+
+                        if (nb_recv <= 0) {
+                            ret = -1;
+                        }
+                        else {
+                            nb_received += nb_recv;
+                        }
+                    }
+                }
+                else {
+                    ret = socket_loop_receive(recv_loop, round, 0);
+                }
+            }
+            recv_duration[backend] += picoquic_current_time() - start_time;
+        }
+    }
+
+    /* Compare the send rates */
+    for (int backend = 0; ret == 0 && backend < 2; backend++) {
+        for (int round = 1; ret == 0 && round <= SOCKET_BATCH_TEST_ROUNDS; round++) {
+            uint64_t start_time = picoquic_current_time();
+
+            ret = socket_uring_send(loop[backend], send_datagrams, round);
+            send_duration[backend] += picoquic_current_time() - start_time;
+
+            if (ret == 0) {
+                ret = socket_send_batch_drain(fd_recv, buffer, round, 0);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (int backend = 0; backend < 3; backend++) {
+            DBG_PRINTF("Receive with %s: %d packets per second", recv_name[backend],
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_ROUNDS) / (double)(recv_duration[backend] + 1)));
+        }
+        for (int backend = 0; backend < 2; backend++) {
+            DBG_PRINTF("Send with %s: %d packets per second", recv_name[backend + 1],
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * SOCKET_BATCH_TEST_ROUNDS) / (double)(send_duration[backend] + 1)));
+        }
+    }
+
+    if (fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd);
+    }
+
+    if (fd_recv != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd_recv);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (loop[i] != NULL) {
+            picoquic_event_loop_delete(loop[i]);
+        }
+    }
+
+    if (send_buffers != NULL) {
+        free(send_buffers);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the sharded server. Check that the worker ids are found in the sharded
+ * connection ids, then send packets for each worker from several client
+ * sockets, so that the kernel spreads them between the workers. Verify that
+ * each packet reaches the worker that owns its id, directly or through the
+ * forwarding queues, and compare the dispatch rates with 1, 2 and 4 workers.
+ * The packets are short header packets with unknown connection ids, so the
+ * workers only drop them or answer with stateless resets.
+ */
+
+#define SOCKET_SHARD_TEST_CLIENTS PICOQUIC_LOOP_MAX_SOCKETS
+#define SOCKET_SHARD_TEST_ROUNDS 50
+
+static picoquic_quic_t* socket_shard_create_quic(int worker_id,
+    picoquic_connection_id_cb_fn cnx_id_callback, void* cnx_id_callback_ctx,
+    uint64_t current_time, void* app_ctx)
+{
+    (void)worker_id;
+
+    return picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, cnx_id_callback, cnx_id_callback_ctx,
+        (uint8_t*)app_ctx, current_time, NULL, NULL, NULL, 0);
+}
+
+static void socket_shard_format_packet(uint8_t* bytes, int worker_id, int round, int i)
+{
+    memset(bytes, 0, SOCKET_BATCH_TEST_LENGTH);
+    bytes[0] = 0x40;
+    bytes[1] = PICOQUIC_SHARD_CID_MAGIC;
+    bytes[2] = (uint8_t)worker_id;
+    bytes[3] = (uint8_t)round;
+    bytes[4] = (uint8_t)i;
+}
+
+static int socket_shard_routing_test(picoquic_shard_server_t* server)
+{
+    int ret = 0;
+    uint8_t bytes[SOCKET_BATCH_TEST_LENGTH];
+    const uint8_t long_header[6] = { 0xC0, 0xFF, 0, 0, 18, 0x55 };
+
+    /* Short header with a sharded id, or with an id of another server */
+    socket_shard_format_packet(bytes, server->nb_workers - 1, 0, 0);
+    if (picoquic_shard_get_worker_id(server, bytes, sizeof(bytes)) != server->nb_workers - 1) {
+        ret = -1;
+    }
+    bytes[2] = (uint8_t)server->nb_workers;
+    if (ret == 0 && picoquic_shard_get_worker_id(server, bytes, sizeof(bytes)) != -1) {
+        ret = -1;
+    }
+    bytes[1] = 0;
+    bytes[2] = 0;
+    if (ret == 0 && picoquic_shard_get_worker_id(server, bytes, sizeof(bytes)) != -1) {
+        ret = -1;
+    }
+
+    /* Long header with an 8 bytes sharded id, or with an id of another length */
+    memcpy(bytes, long_header, sizeof(long_header));
+    bytes[6] = PICOQUIC_SHARD_CID_MAGIC;
+    bytes[7] = 0;
+    if (ret == 0 && picoquic_shard_get_worker_id(server, bytes, sizeof(bytes)) != 0) {
+        ret = -1;
+    }
+    bytes[5] = 0x15;
+    if (ret == 0 && picoquic_shard_get_worker_id(server, bytes, sizeof(bytes)) != -1) {
+        ret = -1;
+    }
+
+    /* Truncated packet */
+    bytes[5] = 0x55;
+    if (ret == 0 && picoquic_shard_get_worker_id(server, bytes, 10) != -1) {
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Worker id not found as expected");
+    }
+
+    return ret;
+}
+
+/* Count the packets received by each worker, directly or forwarded */
+static int socket_shard_count(picoquic_shard_server_t* server, uint64_t* nb_forwarded)
+{
+    int nb_received = 0;
+
+    *nb_forwarded = 0;
+    for (int i = 0; i < server->nb_workers; i++) {
+        picoquic_shard_worker_t* worker = &server->workers[i];
+
+        nb_received += (int)(picoquic_atomic_load(&worker->nb_received) +
+            picoquic_atomic_load(&worker->nb_received_forwarded));
+        *nb_forwarded += picoquic_atomic_load(&worker->nb_forwarded);
+    }
+
+    return nb_received;
+}
+
+static int socket_shard_test_one(int nb_workers, int test_port, uint64_t* duration, uint64_t* nb_forwarded)
+{
+    int ret = 0;
+    uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE];
+    picoquic_shard_server_t* server = NULL;
+    picoquic_event_loop_t* client_loop = NULL;
+    struct sockaddr_storage server_address;
+    int server_address_length;
+    int is_name;
+    uint8_t bytes[SOCKET_BATCH_TEST_LENGTH];
+    int nb_sent = 0;
+    int nb_expected[4] = { 0, 0, 0, 0 };
+    uint64_t start_time;
+
+    memset(reset_seed, 0x5A, sizeof(reset_seed));
+
+    if ((server = picoquic_shard_server_create(nb_workers, test_port, socket_shard_create_quic, reset_seed,
+        picoquic_current_time())) == NULL ||
+        (client_loop = picoquic_event_loop_create(NULL, SOCKET_BATCH_TEST_NB, PICOQUIC_MAX_PACKET_SIZE)) == NULL ||
+        picoquic_get_server_address("127.0.0.1", test_port, &server_address, &server_address_length, &is_name) != 0) {
+        DBG_PRINTF("Cannot create the server with %d workers", nb_workers);
+        ret = -1;
+    }
+    else {
+        ret = socket_shard_routing_test(server);
+    }
+
+    for (int i = 0; ret == 0 && i < SOCKET_SHARD_TEST_CLIENTS; i++) {
+        ret = picoquic_event_loop_add_socket(client_loop, picoquic_open_client_socket(AF_INET));
+    }
+
+    /* The workers log each dropped packet, which would dominate the measurement */
+    debug_printf_suspend();
+
+    if (ret == 0) {
+        ret = picoquic_shard_server_start(server);
+    }
+
+    /* Each client socket sends packets for all the workers, and the clients
+     * wait until all of them are received before the next round */
+    start_time = picoquic_current_time();
+    for (int round = 0; ret == 0 && round < SOCKET_SHARD_TEST_ROUNDS; round++) {
+        uint64_t current_time = picoquic_current_time();
+        int nb_waits = 0;
+
+        for (int i = 0; ret == 0 && i < SOCKET_BATCH_TEST_NB; i++) {
+            int worker_id = (i + round) % nb_workers;
+            SOCKET_TYPE fd = client_loop->s_socket[i % SOCKET_SHARD_TEST_CLIENTS];
+
+            socket_shard_format_packet(bytes, worker_id, round, i);
+            if (sendto(fd, (const char*)bytes, sizeof(bytes), 0, (struct sockaddr*)&server_address, server_address_length)
+                != (int)sizeof(bytes)) {
+                ret = -1;
+            }
+            else {
+                nb_sent++;
+                nb_expected[worker_id]++;
+            }
+        }
+
+        while (ret == 0 && socket_shard_count(server, nb_forwarded) < nb_sent) {
+            /* Drain the stateless resets, if any, while waiting */
+            if (picoquic_event_loop_wait(client_loop, 100, &current_time) < 0 || ++nb_waits > 20000) {
+                ret = -1;
+            }
+        }
+    }
+    *duration = picoquic_current_time() - start_time;
+
+    if (server != NULL && picoquic_shard_server_stop(server) != 0) {
+        ret = -1;
+    }
+
+    debug_printf_resume();
+
+    /* Each packet shall be received by the worker that owns its id */
+    for (int i = 0; ret == 0 && i < nb_workers; i++) {
+        picoquic_shard_worker_t* worker = &server->workers[i];
+
+        if ((int)(worker->nb_received + worker->nb_received_forwarded) != nb_expected[i]) {
+            DBG_PRINTF("Worker %d received %d + %d packets instead of %d", i, (int)worker->nb_received,
+                (int)worker->nb_received_forwarded, nb_expected[i]);
+            ret = -1;
+        }
+    }
+
+    if (client_loop != NULL) {
+        picoquic_event_loop_delete(client_loop);
+    }
+
+    if (server != NULL) {
+        picoquic_shard_server_delete(server);
+    }
+
+    return ret;
+}
+
+int socket_shard_test()
+{
+    int ret = 0;
+    int nb_workers[3] = { 1, 2, 4 };
+    uint64_t duration[3] = { 0, 0, 0 };
+    uint64_t nb_forwarded[3] = { 0, 0, 0 };
+#ifdef _WINDOWS
+    WSADATA wsaData;
+
+    if (WSA_START(MAKEWORD(2, 2), &wsaData)) {
+        DBG_PRINTF("Cannot init WSA\n");
+        ret = -1;
+    }
+#endif
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        ret = socket_shard_test_one(nb_workers[i], 12351 + i, &duration[i], &nb_forwarded[i]);
+    }
+
+    if (ret == 0) {
+        for (int i = 0; i < 3; i++) {
+            DBG_PRINTF("%d workers: %d packets per second, %d forwarded", nb_workers[i],
+                (int)((1000000.0 * SOCKET_BATCH_TEST_NB * SOCKET_SHARD_TEST_ROUNDS) / (double)(duration[i] + 1)),
+                (int)nb_forwarded[i]);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Test of the commands queued by other threads. The first part checks each
+ * command type and the commands for a deleted connection, processing the
+ * queue directly. The second part runs an event loop with the commands
+ * enabled, while an application thread queues data in bursts and waits
+ * for each burst to be applied, and measures the delay between the queuing
+ * of a command and its application by the loop.
+ */
+
+#define SOCKET_COMMAND_TEST_NB 4096
+#define SOCKET_COMMAND_TEST_BURST 16
+#define SOCKET_COMMAND_TEST_LENGTH 64
+/* A lost wake up would leave the loop waiting for its full delay */
+#define SOCKET_COMMAND_TEST_WAIT_MAX 10000000
+#define SOCKET_COMMAND_TEST_LATENCY_MAX 1000000
+
+typedef struct st_socket_command_test_ctx_t {
+    picoquic_quic_t* quic;
+    uint64_t cnx_serial;
+    uint64_t stream_id;
+    picoquic_event_loop_t* app_loop;
+    uint64_t push_time[SOCKET_COMMAND_TEST_NB];
+    volatile int nb_applied;
+    int ret;
+} socket_command_test_ctx_t;
+
+static int socket_command_callback(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx)
+{
+    (void)cnx;
+    (void)stream_id;
+    (void)bytes;
+    (void)length;
+    (void)fin_or_event;
+    (void)callback_ctx;
+
+    return 0;
+}
+
+static picoquic_cnx_t* socket_command_create_cnx(picoquic_quic_t* quic)
+{
+    struct sockaddr_in addr;
+    picoquic_cnx_t* cnx;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) != NULL) {
+        picoquic_set_callback(cnx, socket_command_callback, NULL);
+        cnx->maxdata_remote = (uint64_t)((int64_t)-1);
+        cnx->remote_parameters.initial_max_stream_data_bidi_local = 0x1000000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = 0x1000000;
+        cnx->max_stream_id_bidir_local = STREAM_ID_FROM_RANK(16, 1, 0);
+    }
+
+    return cnx;
+}
+
+static int socket_command_types_test(picoquic_quic_t* quic)
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = socket_command_create_cnx(quic);
+    uint64_t data_stream_id = STREAM_ID_FROM_RANK(0, 0, 0);
+    uint64_t active_stream_id = STREAM_ID_FROM_RANK(1, 0, 0);
+    uint64_t reset_stream_id = STREAM_ID_FROM_RANK(2, 0, 0);
+    uint64_t cnx_serial;
+    uint8_t data[100];
+    picoquic_stream_head* stream;
+
+    memset(data, 0xAA, sizeof(data));
+
+    if (cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx_serial = picoquic_get_cnx_serial(cnx);
+        if (picoquic_queue_add_to_stream(quic, cnx_serial, data_stream_id, data, sizeof(data), 0) != 0 ||
+            picoquic_queue_mark_active_stream(quic, cnx_serial, active_stream_id, 1) != 0 ||
+            picoquic_queue_add_to_stream(quic, cnx_serial, reset_stream_id, data, sizeof(data), 0) != 0 ||
+            picoquic_queue_reset_stream(quic, cnx_serial, reset_stream_id, 7) != 0 ||
+            picoquic_queue_add_to_stream(quic, cnx_serial + 1000, data_stream_id, data, sizeof(data), 0) != 0 ||
+            picoquic_queue_add_to_stream(quic, cnx_serial, data_stream_id, NULL, 0, 1) != 0) {
+            ret = -1;
+        }
+        else if (picoquic_process_commands(quic) != 6 || picoquic_process_commands(quic) != 0) {
+            DBG_PRINTF("%s", "Commands not processed as expected");
+            ret = -1;
+        }
+        else if (cnx->nb_bytes_queued != 2 * sizeof(data)) {
+            DBG_PRINTF("Queued %d bytes instead of %d", (int)cnx->nb_bytes_queued, (int)(2 * sizeof(data)));
+            ret = -1;
+        }
+        else if ((stream = picoquic_find_stream(cnx, data_stream_id, 0)) == NULL || !stream->fin_requested ||
+            (stream = picoquic_find_stream(cnx, active_stream_id, 0)) == NULL || !stream->is_active ||
+            (stream = picoquic_find_stream(cnx, reset_stream_id, 0)) == NULL || !stream->reset_requested ||
+            stream->local_error != 7) {
+            DBG_PRINTF("%s", "Stream commands not applied");
+            ret = -1;
+        }
+    }
+
+    /* Close, then delete the connection and check that its commands are dropped */
+    if (ret == 0) {
+        picoquic_state_enum previous_state = picoquic_get_cnx_state(cnx);
+
+        if (picoquic_queue_close(quic, cnx_serial, 0) != 0 || picoquic_process_commands(quic) != 1 ||
+            picoquic_get_cnx_state(cnx) == previous_state) {
+            DBG_PRINTF("%s", "Close command not applied");
+            ret = -1;
+        }
+        else {
+            picoquic_delete_cnx(cnx);
+            cnx = NULL;
+            if (picoquic_queue_add_to_stream(quic, cnx_serial, data_stream_id, data, sizeof(data), 0) != 0 ||
+                picoquic_process_commands(quic) != 1) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    return ret;
+}
+
+/* Application thread: queue the data in bursts, and wait until each burst
+ * was applied by the loop */
+static void socket_command_app_thread(void* arg)
+{
+    socket_command_test_ctx_t* ctx = (socket_command_test_ctx_t*)arg;
+    uint8_t data[SOCKET_COMMAND_TEST_LENGTH];
+    uint64_t current_time = picoquic_current_time();
+    int nb_queued = 0;
+
+    memset(data, 0, sizeof(data));
+
+    while (ctx->ret == 0 && nb_queued < SOCKET_COMMAND_TEST_NB) {
+        for (int i = 0; ctx->ret == 0 && i < SOCKET_COMMAND_TEST_BURST; i++) {
+            picoformat_32(data, (uint32_t)nb_queued);
+            ctx->push_time[nb_queued] = picoquic_current_time();
+            if (picoquic_queue_add_to_stream(ctx->quic, ctx->cnx_serial, ctx->stream_id, data, sizeof(data), 0) != 0) {
+                ctx->ret = -1;
+            }
+            else {
+                nb_queued++;
+            }
+        }
+
+        while (ctx->ret == 0 && picoquic_atomic_load(&ctx->nb_applied) < nb_queued) {
+            if (picoquic_event_loop_wait(ctx->app_loop, SOCKET_COMMAND_TEST_WAIT_MAX, &current_time) < 0) {
+                ctx->ret = -1;
+            }
+        }
+    }
+}
+
+/* Check that the data was added to the stream in the order in which it was queued */
+static int socket_command_check_order(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    int ret = 0;
+    uint32_t expected = 0;
+    picoquic_stream_head* stream = picoquic_find_stream(cnx, stream_id, 0);
+    picoquic_stream_data* data = (stream == NULL) ? NULL : stream->send_queue;
+
+    while (ret == 0 && data != NULL) {
+        if (data->length != SOCKET_COMMAND_TEST_LENGTH || PICOPARSE_32(data->bytes) != expected) {
+            ret = -1;
+        }
+        expected++;
+        data = data->next_stream_data;
+    }
+
+    if (ret == 0 && expected != SOCKET_COMMAND_TEST_NB) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int socket_command_latency_test(picoquic_quic_t* quic, socket_command_test_ctx_t* ctx)
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = socket_command_create_cnx(quic);
+    picoquic_event_loop_t* loop = NULL;
+    picoquic_thread_t app_thread = NULL;
+    uint64_t current_time = picoquic_current_time();
+    uint64_t start_time = current_time;
+    uint64_t latency_sum = 0;
+    uint64_t latency_max = 0;
+    int nb_waits = 0;
+
+    ctx->quic = quic;
+    ctx->stream_id = STREAM_ID_FROM_RANK(3, 0, 0);
+
+    if (cnx == NULL ||
+        (loop = picoquic_event_loop_create(quic, 1, PICOQUIC_MAX_PACKET_SIZE)) == NULL ||
+        picoquic_event_loop_enable_commands(loop) != 0 ||
+        (ctx->app_loop = picoquic_event_loop_create(NULL, 1, PICOQUIC_MAX_PACKET_SIZE)) == NULL ||
+        picoquic_event_loop_enable_wakeup(ctx->app_loop) != 0) {
+        DBG_PRINTF("%s", "Cannot create the loops");
+        ret = -1;
+    }
+    else {
+        ctx->cnx_serial = picoquic_get_cnx_serial(cnx);
+        /* Nothing is sent, the connection is only due when a command is applied */
+        picoquic_reinsert_by_wake_time(quic, cnx, UINT64_MAX);
+        ret = picoquic_create_thread(&app_thread, socket_command_app_thread, ctx);
+    }
+
+    while (ret == 0 && ctx->nb_applied < SOCKET_COMMAND_TEST_NB) {
+        int nb_applied;
+
+        if (picoquic_event_loop_wait(loop, SOCKET_COMMAND_TEST_WAIT_MAX, &current_time) < 0 ||
+            ++nb_waits > 16 * SOCKET_COMMAND_TEST_NB) {
+            ret = -1;
+            break;
+        }
+
+        /* The connection is due after the commands, as if packets were to be sent */
+        if (picoquic_event_loop_next_cnx(loop) == cnx) {
+            picoquic_reinsert_by_wake_time(quic, cnx, UINT64_MAX);
+        }
+
+        nb_applied = (int)(cnx->nb_bytes_queued / SOCKET_COMMAND_TEST_LENGTH);
+        for (int i = ctx->nb_applied; i < nb_applied; i++) {
+            uint64_t latency = current_time - ctx->push_time[i];
+
+            latency_sum += latency;
+            if (latency > latency_max) {
+                latency_max = latency;
+            }
+        }
+
+        if (nb_applied > ctx->nb_applied) {
+            picoquic_atomic_store(&ctx->nb_applied, nb_applied);
+            picoquic_event_loop_wakeup(ctx->app_loop);
+        }
+    }
+
+    if (ret != 0) {
+        ctx->ret = -1;
+        if (ctx->app_loop != NULL) {
+            picoquic_event_loop_wakeup(ctx->app_loop);
+        }
+    }
+
+    if (app_thread != NULL) {
+        picoquic_join_thread(app_thread);
+    }
+
+    if (ret == 0) {
+        ret = ctx->ret;
+    }
+
+    if (ret == 0 && socket_command_check_order(cnx, ctx->stream_id) != 0) {
+        DBG_PRINTF("%s", "Stream data not in the order of the commands");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        DBG_PRINTF("%d commands in %d us, %d waits, latency average %d us, max %d us",
+            SOCKET_COMMAND_TEST_NB, (int)(current_time - start_time), nb_waits,
+            (int)(latency_sum / SOCKET_COMMAND_TEST_NB), (int)latency_max);
+        if (latency_max > SOCKET_COMMAND_TEST_LATENCY_MAX) {
+            ret = -1;
+        }
+    }
+
+    if (ctx->app_loop != NULL) {
+        picoquic_event_loop_delete(ctx->app_loop);
+        ctx->app_loop = NULL;
+    }
+
+    if (loop != NULL) {
+        picoquic_event_loop_delete(loop);
+    }
+
+    return ret;
+}
+
+int socket_command_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+        picoquic_current_time(), NULL, NULL, NULL, 0);
+    socket_command_test_ctx_t* ctx = (socket_command_test_ctx_t*)malloc(sizeof(socket_command_test_ctx_t));
+
+    if (quic == NULL || ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(ctx, 0, sizeof(socket_command_test_ctx_t));
+        ret = socket_command_types_test(quic);
+
+        if (ret == 0) {
+            ret = socket_command_latency_test(quic, ctx);
+        }
+    }
+
+    if (ctx != NULL) {
+        free(ctx);
+    }
+
+    if (quic != NULL) {
+        /* The commands left in the queue are freed with the context */
+        if (picoquic_queue_close(quic, picoquic_get_cnx_serial(picoquic_get_first_cnx(quic)), 0) != 0) {
+            ret = -1;
+        }
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Seal the 1-RTT packets of several connections in the crypto pool, check
+ * that the result is identical to sealing in the network thread, that the
+ * packets can be opened in the pool, and compare the throughput.
+ */
+#define CRYPTO_POOL_TEST_NB_CNX 4
+#define CRYPTO_POOL_TEST_NB_PACKETS 32
+#define CRYPTO_POOL_TEST_HEADER 13
+#define CRYPTO_POOL_TEST_PAYLOAD 1200
+#define CRYPTO_POOL_TEST_ROUNDS 8
+#define CRYPTO_POOL_TEST_NB_JOBS (CRYPTO_POOL_TEST_NB_CNX * CRYPTO_POOL_TEST_NB_PACKETS)
+
+static void crypto_pool_test_header(uint8_t* packet, int cnx_index, uint64_t sequence_number)
+{
+    packet[0] = 0x43;
+    memset(packet + 1, cnx_index, 8);
+    picoformat_32(packet + 9, (uint32_t)sequence_number);
+}
+
+static void crypto_pool_test_payload(uint8_t* payload, int cnx_index, uint64_t sequence_number)
+{
+    for (size_t i = 0; i < CRYPTO_POOL_TEST_PAYLOAD; i++) {
+        payload[i] = (uint8_t)(i + cnx_index + 7 * sequence_number);
+    }
+}
+
+/* Format the packets of all connections, and the jobs that seal them */
+static void crypto_pool_test_format(picoquic_crypto_context_t* contexts, uint8_t* packets,
+    picoquic_crypto_job_t* jobs, uint64_t round)
+{
+    for (int c = 0; c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+        for (int i = 0; i < CRYPTO_POOL_TEST_NB_PACKETS; i++) {
+            int rank = c * CRYPTO_POOL_TEST_NB_PACKETS + i;
+            uint8_t* packet = packets + (size_t)rank * PICOQUIC_MAX_PACKET_SIZE;
+            picoquic_crypto_job_t* job = &jobs[rank];
+            uint64_t sequence_number = round * CRYPTO_POOL_TEST_NB_PACKETS + i;
+
+            crypto_pool_test_header(packet, c, sequence_number);
+            crypto_pool_test_payload(packet + CRYPTO_POOL_TEST_HEADER, c, sequence_number);
+
+            job->aead_context = contexts[c].aead_encrypt;
+            job->pn_enc = contexts[c].pn_enc;
+            job->header = packet;
+            job->header_length = CRYPTO_POOL_TEST_HEADER;
+            job->pn_offset = 9;
+            job->input = packet + CRYPTO_POOL_TEST_HEADER;
+            job->input_length = CRYPTO_POOL_TEST_PAYLOAD;
+            job->output = job->input;
+            job->sequence_number = sequence_number;
+            job->result = 0;
+        }
+    }
+}
+
+static void crypto_pool_test_run(picoquic_crypto_pool_t* pool, picoquic_crypto_batch_t* batches,
+    picoquic_crypto_job_t* jobs)
+{
+    if (pool == NULL) {
+        for (int i = 0; i < CRYPTO_POOL_TEST_NB_JOBS; i++) {
+            picoquic_crypto_job_run(&jobs[i]);
+        }
+    }
+    else {
+        for (int c = 0; c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+            batches[c].jobs = jobs + c * CRYPTO_POOL_TEST_NB_PACKETS;
+            batches[c].nb_jobs = CRYPTO_POOL_TEST_NB_PACKETS;
+            picoquic_crypto_pool_submit(pool, &batches[c], c % pool->nb_workers);
+        }
+        picoquic_crypto_pool_wait(pool);
+    }
+}
+
+/* Open the sealed packets in the pool, using the clear text headers */
+static int crypto_pool_test_open(picoquic_crypto_pool_t* pool, picoquic_crypto_context_t* contexts,
+    uint8_t* packets, uint8_t* headers, uint8_t* clear_text, picoquic_crypto_job_t* jobs, uint64_t round)
+{
+    int ret = 0;
+    picoquic_crypto_batch_t batches[CRYPTO_POOL_TEST_NB_CNX];
+    uint8_t expected[CRYPTO_POOL_TEST_PAYLOAD];
+
+    for (int c = 0; c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+        for (int i = 0; i < CRYPTO_POOL_TEST_NB_PACKETS; i++) {
+            int rank = c * CRYPTO_POOL_TEST_NB_PACKETS + i;
+            picoquic_crypto_job_t* job = &jobs[rank];
+            uint64_t sequence_number = round * CRYPTO_POOL_TEST_NB_PACKETS + i;
+
+            crypto_pool_test_header(headers + rank * CRYPTO_POOL_TEST_HEADER, c, sequence_number);
+            job->aead_context = contexts[c].aead_decrypt;
+            job->pn_enc = NULL;
+            job->header = headers + rank * CRYPTO_POOL_TEST_HEADER;
+            job->header_length = CRYPTO_POOL_TEST_HEADER;
+            job->pn_offset = 9;
+            job->input = packets + (size_t)rank * PICOQUIC_MAX_PACKET_SIZE + CRYPTO_POOL_TEST_HEADER;
+            job->input_length = jobs[rank].result;
+            job->output = clear_text + (size_t)rank * PICOQUIC_MAX_PACKET_SIZE;
+            job->sequence_number = sequence_number;
+        }
+    }
+
+    crypto_pool_test_run(pool, batches, jobs);
+
+    for (int c = 0; ret == 0 && c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+        for (int i = 0; ret == 0 && i < CRYPTO_POOL_TEST_NB_PACKETS; i++) {
+            int rank = c * CRYPTO_POOL_TEST_NB_PACKETS + i;
+
+            crypto_pool_test_payload(expected, c, jobs[rank].sequence_number);
+            if (jobs[rank].result != CRYPTO_POOL_TEST_PAYLOAD ||
+                memcmp(clear_text + (size_t)rank * PICOQUIC_MAX_PACKET_SIZE, expected, CRYPTO_POOL_TEST_PAYLOAD) != 0) {
+                DBG_PRINTF("Cannot open packet %d of connection %d\n", i, c);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int crypto_pool_test()
+{
+    int ret = 0;
+    const int nb_workers[] = { 0, 1, 2, 4 };
+    const int nb_configs = (int)(sizeof(nb_workers) / sizeof(int));
+    uint64_t duration[4] = { 0, 0, 0, 0 };
+    picoquic_crypto_context_t contexts[CRYPTO_POOL_TEST_NB_CNX];
+    picoquic_crypto_batch_t batches[CRYPTO_POOL_TEST_NB_CNX];
+    size_t buffer_size = (size_t)CRYPTO_POOL_TEST_NB_JOBS * PICOQUIC_MAX_PACKET_SIZE;
+    uint8_t* reference = (uint8_t*)malloc(buffer_size);
+    uint8_t* packets = (uint8_t*)malloc(buffer_size);
+    uint8_t* clear_text = (uint8_t*)malloc(buffer_size);
+    uint8_t* headers = (uint8_t*)malloc(CRYPTO_POOL_TEST_NB_JOBS * CRYPTO_POOL_TEST_HEADER);
+    picoquic_crypto_job_t* jobs = (picoquic_crypto_job_t*)calloc(CRYPTO_POOL_TEST_NB_JOBS, sizeof(picoquic_crypto_job_t));
+
+    memset(contexts, 0, sizeof(contexts));
+
+    if (reference == NULL || packets == NULL || clear_text == NULL || headers == NULL || jobs == NULL) {
+        ret = -1;
+    }
+
+    for (int c = 0; ret == 0 && c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+        uint8_t secret[32];
+
+        for (int i = 0; i < (int)sizeof(secret); i++) {
+            secret[i] = (uint8_t)(i + 17 * c);
+        }
+        contexts[c].aead_encrypt = picoquic_setup_test_aead_context(1, secret);
+        contexts[c].aead_decrypt = picoquic_setup_test_aead_context(0, secret);
+        contexts[c].pn_enc = picoquic_pn_enc_create_for_test(secret);
+
+        if (contexts[c].aead_encrypt == NULL || contexts[c].aead_decrypt == NULL || contexts[c].pn_enc == NULL) {
+            ret = -1;
+        }
+    }
+
+    /* The first configuration seals in the current thread, and provides the reference */
+    for (int config = 0; ret == 0 && config < nb_configs; config++) {
+        picoquic_crypto_pool_t* pool = NULL;
+
+        if (nb_workers[config] > 0 &&
+            (pool = picoquic_crypto_pool_create(nb_workers[config], CRYPTO_POOL_TEST_NB_CNX, CRYPTO_POOL_TEST_NB_PACKETS)) == NULL) {
+            DBG_PRINTF("Cannot create a pool of %d workers\n", nb_workers[config]);
+            ret = -1;
+            break;
+        }
+
+        for (uint64_t round = 0; ret == 0 && round < CRYPTO_POOL_TEST_ROUNDS; round++) {
+            uint64_t start_time;
+
+            crypto_pool_test_format(contexts, (config == 0) ? reference : packets, jobs, round);
+            start_time = picoquic_current_time();
+            crypto_pool_test_run(pool, batches, jobs);
+            duration[config] += picoquic_current_time() - start_time;
+
+            for (int i = 0; ret == 0 && i < CRYPTO_POOL_TEST_NB_JOBS; i++) {
+                if (jobs[i].result <= CRYPTO_POOL_TEST_PAYLOAD || jobs[i].result > PICOQUIC_MAX_PACKET_SIZE - CRYPTO_POOL_TEST_HEADER) {
+                    DBG_PRINTF("Cannot seal packet %d, %d workers\n", i, nb_workers[config]);
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0 && config > 0) {
+            for (int i = 0; ret == 0 && i < CRYPTO_POOL_TEST_NB_JOBS; i++) {
+                size_t offset = (size_t)i * PICOQUIC_MAX_PACKET_SIZE;
+
+                if (memcmp(packets + offset, reference + offset, CRYPTO_POOL_TEST_HEADER + jobs[i].result) != 0) {
+                    DBG_PRINTF("Packet %d sealed by %d workers differs\n", i, nb_workers[config]);
+                    ret = -1;
+                }
+            }
+
+            if (ret == 0) {
+                ret = crypto_pool_test_open(pool, contexts, packets, headers, clear_text, jobs, CRYPTO_POOL_TEST_ROUNDS - 1);
+            }
+        }
+
+        if (pool != NULL) {
+            picoquic_crypto_pool_delete(pool);
+        }
+    }
+
+    if (ret == 0) {
+        for (int config = 0; config < nb_configs; config++) {
+            DBG_PRINTF("%d workers: %d Mbps sealed\n", nb_workers[config],
+                (int)((8.0 * CRYPTO_POOL_TEST_PAYLOAD * CRYPTO_POOL_TEST_NB_JOBS * CRYPTO_POOL_TEST_ROUNDS) / (double)(duration[config] + 1)));
+        }
+    }
+
+    for (int c = 0; c < CRYPTO_POOL_TEST_NB_CNX; c++) {
+        picoquic_crypto_context_free(&contexts[c]);
+    }
+
+    if (reference != NULL) {
+        free(reference);
+    }
+
+    if (packets != NULL) {
+        free(packets);
+    }
+
+    if (clear_text != NULL) {
+        free(clear_text);
+    }
+
+    if (headers != NULL) {
+        free(headers);
+    }
+
+    if (jobs != NULL) {
+        free(jobs);
+    }
+
+    return ret;
+}
@@ -112,6 +112,25 @@ int splay_test() {
             }
         }
 
+        /* A missed lookup splays one of the neighbors of the value */
+        if (ret == 0) {
+            int absent = 6;
+
+            if (picosplay_find(tree, &absent) != NULL) {
+                DBG_PRINTF("%s", "Found a value that was not inserted.\n");
+                ret = -1;
+            }
+            else if (*(int*)tree->root->value != 5 && *(int*)tree->root->value != 7) {
+                DBG_PRINTF("After missing %d, expected root 5 or 7, got %d instead\n",
+                    absent, *(int*)tree->root->value);
+                ret = -1;
+            }
+            else if (check_node_sanity(tree->root, NULL, NULL, &compare_int) != 7) {
+                DBG_PRINTF("%s", "Tree not sane after a missed lookup.\n");
+                ret = -1;
+            }
+        }
+
         for (int i = 0; ret == 0 && i < 7; i++) {
             picosplay_delete(tree, &values[i]);
             /* Verify sanity and count after each deletion */
@@ -20,6 +20,8 @@
 */
 
 #include "picoquic_internal.h"
+#include <stdlib.h>
+#include <string.h>
 
 /*
  * Testing Arrival of Frame for Stream Zero
@@ -133,7 +135,9 @@ static int StreamZeroFrameOneTest(struct test_case_st* test)
 
     picoquic_cnx_t cnx = { 0 };
     uint64_t current_time = 0;
+    picoquic_stream_head* stream;
     
+    picoquic_init_stream_tree(&cnx);
     cnx.local_parameters.initial_max_stream_data_bidi_local = 0x10000;
     cnx.local_parameters.initial_max_stream_data_bidi_remote = 0x10000;
     cnx.remote_parameters.initial_max_stream_data_bidi_local = 0x10000;
@@ -148,36 +152,36 @@ static int StreamZeroFrameOneTest(struct test_case_st* test)
         }
     }
 
-    if (ret == 0 && cnx.first_stream == NULL) {
+    stream = picoquic_first_stream(&cnx);
+
+    if (ret == 0 && stream == NULL) {
         FAIL(test, "%s", "No stream created");
         ret = -1;
     }
 
-    if (ret == 0 && cnx.first_stream->stream_id != 0) {
+    if (ret == 0 && stream->stream_id != 0) {
         FAIL(test, "%s", "Other stream than 0");
         ret = -1;
     }
 
     if (ret == 0) {
         /* Check the content of all the data in the context */
-        picoquic_stream_data* data = cnx.first_stream->stream_data;
+        uint8_t* data;
+        size_t data_length;
         size_t data_rank = 0;
 
-        while (data != NULL) {
-            if (data->bytes == NULL) {
-                FAIL(test, "%s", "No data bytes");
-                ret = -1;
-            }
-
-            for (size_t i = 0; ret == 0 && i < data->length; i++) {
+        while ((data = picoquic_get_stream_data_span(stream, data_rank, &data_length)) != NULL) {
+            for (size_t i = 0; ret == 0 && i < data_length; i++) {
                 data_rank++;
-                if (data->bytes[i] != data_rank) {
-                    FAIL(test, "byte %" PRIst " is %u instead of %" PRIst, i, data->bytes[i], data_rank);
+                if (data[i] != data_rank) {
+                    FAIL(test, "byte %" PRIst " is %u instead of %" PRIst, i, data[i], data_rank);
                     ret = -1;
                 }
             }
 
-            data = data->next_stream_data;
+            if (ret != 0) {
+                break;
+            }
         }
 
         if (ret == 0 && data_rank != test->expected_length) {
@@ -186,6 +190,17 @@ static int StreamZeroFrameOneTest(struct test_case_st* test)
         }
     }
 
+    while ((stream = picoquic_first_stream(&cnx)) != NULL) {
+        picoquic_delete_stream(&cnx, stream);
+    }
+
+    if (ret == 0 && cnx.arena.stats.bytes_in_use != 0) {
+        DBG_PRINTF("%d bytes still in use after deleting the streams\n", (int)cnx.arena.stats.bytes_in_use);
+        ret = -1;
+    }
+
+    picoquic_arena_release(&cnx.arena);
+
     return ret;
 }
 
@@ -301,24 +316,22 @@ static int TlsStreamFrameOneTest(struct test_case_st* test)
 
     if (ret == 0) {
         /* Check the content of all the data in the context */
-        picoquic_stream_data* data = cnx.tls_stream[test_epoch].stream_data;
+        uint8_t* data;
+        size_t data_length;
         size_t data_rank = 0;
 
-        while (data != NULL) {
-            if (data->bytes == NULL) {
-                FAIL(test, "%s", "No data bytes");
-                ret = -1;
-            }
-
-            for (size_t i = 0; ret == 0 && i < data->length; i++) {
+        while ((data = picoquic_get_stream_data_span(&cnx.tls_stream[test_epoch], data_rank, &data_length)) != NULL) {
+            for (size_t i = 0; ret == 0 && i < data_length; i++) {
                 data_rank++;
-                if (data->bytes[i] != data_rank) {
-                    FAIL(test, "byte %" PRIst " is %u instead of %" PRIst, i, data->bytes[i], data_rank);
+                if (data[i] != data_rank) {
+                    FAIL(test, "byte %" PRIst " is %u instead of %" PRIst, i, data[i], data_rank);
                     ret = -1;
                 }
             }
 
-            data = data->next_stream_data;
+            if (ret != 0) {
+                break;
+            }
         }
 
         if (ret == 0 && data_rank != test->expected_length) {
@@ -327,6 +340,8 @@ static int TlsStreamFrameOneTest(struct test_case_st* test)
         }
     }
 
+    picoquic_clear_stream(&cnx.tls_stream[test_epoch]);
+
     return ret;
 }
 
@@ -340,3 +355,1122 @@ int TlsStreamFrameTest()
 
     return ret;
 }
+
+/*
+ * Test the stream tree: create a large number of streams in random order,
+ * verify that they can be retrieved, that the iteration returns them in
+ * order of stream ID, and that the ready stream search visits them in
+ * round robin order.
+ */
+
+#define STREAM_TREE_TEST_NB_STREAMS 4096
+
+int stream_tree_test()
+{
+    int ret = 0;
+    picoquic_cnx_t cnx = { 0 };
+    picoquic_stream_head* stream;
+    uint64_t random_state = 0x0123456789ABCDEFull;
+    uint64_t stream_rank[STREAM_TREE_TEST_NB_STREAMS];
+    uint64_t previous_id = 0;
+    int nb_streams = 0;
+
+    picoquic_init_stream_tree(&cnx);
+    cnx.client_mode = 1;
+    cnx.maxdata_remote = 0x100000;
+    cnx.high_priority_stream_id = (uint64_t)((int64_t)-1);
+    cnx.max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(STREAM_TREE_TEST_NB_STREAMS, 1, 0);
+
+    /* Create the streams in a random order */
+    for (int i = 0; i < STREAM_TREE_TEST_NB_STREAMS; i++) {
+        stream_rank[i] = i;
+    }
+    for (int i = STREAM_TREE_TEST_NB_STREAMS - 1; i > 0; i--) {
+        int j;
+        uint64_t x;
+        random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+        j = (int)((random_state >> 33) % (i + 1));
+        x = stream_rank[i];
+        stream_rank[i] = stream_rank[j];
+        stream_rank[j] = x;
+    }
+
+    for (int i = 0; ret == 0 && i < STREAM_TREE_TEST_NB_STREAMS; i++) {
+        uint64_t stream_id = STREAM_ID_FROM_RANK(stream_rank[i], 0, 0);
+
+        if (picoquic_find_stream(&cnx, stream_id, 1) == NULL) {
+            DBG_PRINTF("Cannot create stream %d\n", (int)stream_id);
+            ret = -1;
+        }
+    }
+
+    /* Verify that each stream can be found, and that no other is */
+    for (int i = 0; ret == 0 && i < STREAM_TREE_TEST_NB_STREAMS; i++) {
+        uint64_t stream_id = STREAM_ID_FROM_RANK(stream_rank[i], 0, 0);
+
+        stream = picoquic_find_stream(&cnx, stream_id, 0);
+        if (stream == NULL || stream->stream_id != stream_id) {
+            DBG_PRINTF("Cannot find stream %d\n", (int)stream_id);
+            ret = -1;
+        }
+        else if (picoquic_find_stream(&cnx, stream_id + 1, 0) != NULL) {
+            DBG_PRINTF("Found non existent stream %d\n", (int)stream_id + 1);
+            ret = -1;
+        }
+    }
+
+    /* Verify the iteration order */
+    for (stream = picoquic_first_stream(&cnx); ret == 0 && stream != NULL; stream = picoquic_next_stream(stream)) {
+        if (nb_streams > 0 && stream->stream_id <= previous_id) {
+            DBG_PRINTF("Stream %d listed after stream %d\n", (int)stream->stream_id, (int)previous_id);
+            ret = -1;
+        }
+        previous_id = stream->stream_id;
+        nb_streams++;
+    }
+
+    if (ret == 0 && nb_streams != STREAM_TREE_TEST_NB_STREAMS) {
+        DBG_PRINTF("Found %d streams instead of %d\n", nb_streams, STREAM_TREE_TEST_NB_STREAMS);
+        ret = -1;
+    }
+
+    /* Mark a few streams as active, and check the round robin order */
+    if (ret == 0) {
+        uint64_t active_rank[3] = { 4000, 7, 1000 };
+
+        for (int i = 0; i < 3; i++) {
+            stream = picoquic_find_stream(&cnx, STREAM_ID_FROM_RANK(active_rank[i], 0, 0), 0);
+            stream->maxdata_remote = 0x10000;
+            stream->is_active = 1;
+            picoquic_update_ready_stream(&cnx, stream, 0);
+        }
+
+        for (int i = 0; ret == 0 && i < 6; i++) {
+            uint64_t expected_id = STREAM_ID_FROM_RANK(active_rank[i % 3], 0, 0);
+
+            stream = picoquic_find_ready_stream(&cnx);
+            if (stream == NULL || stream->stream_id != expected_id) {
+                DBG_PRINTF("Round %d, expected stream %d, got %d\n", i, (int)expected_id,
+                    (stream == NULL) ? -1 : (int)stream->stream_id);
+                ret = -1;
+            }
+            else {
+                /* As if data was sent */
+                picoquic_update_ready_stream(&cnx, stream, 1);
+            }
+        }
+    }
+
+    while ((stream = picoquic_first_stream(&cnx)) != NULL) {
+        picoquic_delete_stream(&cnx, stream);
+    }
+
+    if (ret == 0 && cnx.arena.stats.bytes_in_use != 0) {
+        DBG_PRINTF("%d bytes still in use after deleting the streams\n", (int)cnx.arena.stats.bytes_in_use);
+        ret = -1;
+    }
+
+    picoquic_arena_release(&cnx.arena);
+
+    return ret;
+}
+
+/*
+ * Test the ready stream lists: streams are served by order of priority,
+ * in round robin within a priority level. Streams blocked by flow control
+ * or by the stream ID limit leave the lists until credit arrives.
+ */
+
+static int ready_stream_test_expect(picoquic_cnx_t* cnx, const uint64_t* expected_rank, int nb_rounds)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < nb_rounds; i++) {
+        picoquic_stream_head* stream = picoquic_find_ready_stream(cnx);
+        uint64_t expected_id = (expected_rank[i] == UINT64_MAX) ? UINT64_MAX : STREAM_ID_FROM_RANK(expected_rank[i], 0, 0);
+
+        if (stream == NULL && expected_id == UINT64_MAX) {
+            continue;
+        }
+        else if (stream == NULL || stream->stream_id != expected_id) {
+            DBG_PRINTF("Round %d, expected stream %d, got %d\n", i, (int)expected_id,
+                (stream == NULL) ? -1 : (int)stream->stream_id);
+            ret = -1;
+        }
+        else {
+            /* As if data was sent */
+            picoquic_update_ready_stream(cnx, stream, 1);
+        }
+    }
+
+    return ret;
+}
+
+int ready_stream_test()
+{
+    int ret = 0;
+    picoquic_cnx_t cnx = { 0 };
+    picoquic_stream_head* stream[9];
+    const uint64_t expect_urgent[] = { 4, 5, 4, 5 };
+    const uint64_t expect_urgent_blocked[] = { 5, 5 };
+    const uint64_t expect_default[] = { 0, 1, 2, 3, 0 };
+    const uint64_t expect_credit[] = { 4, 4 };
+    const uint64_t expect_control[] = { UINT64_MAX, 2 };
+    const uint64_t expect_new_limit[] = { 1, 3, 0, 2, 7, 8, 1 };
+    const uint64_t expect_low[] = { 6, 6 };
+
+    picoquic_init_stream_tree(&cnx);
+    cnx.client_mode = 1;
+    cnx.maxdata_remote = 0x100000;
+    cnx.high_priority_stream_id = (uint64_t)((int64_t)-1);
+    cnx.max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(6, 0, 0);
+
+    for (int i = 0; ret == 0 && i < 9; i++) {
+        if ((stream[i] = picoquic_find_stream(&cnx, STREAM_ID_FROM_RANK(i, 0, 0), 1)) == NULL) {
+            ret = -1;
+        }
+        else {
+            stream[i]->maxdata_remote = 0x10000;
+            stream[i]->is_active = 1;
+            if (i == 4 || i == 5) {
+                picoquic_update_stream_priority(&cnx, stream[i], 1);
+            }
+            else if (i == 6) {
+                picoquic_update_stream_priority(&cnx, stream[i], PICOQUIC_STREAM_PRIORITY_LEVELS - 1);
+            }
+            picoquic_update_ready_stream(&cnx, stream[i], 0);
+        }
+    }
+
+    if (ret == 0 && (stream[7]->is_ready || stream[8]->is_ready || !stream[7]->is_id_blocked || !stream[8]->is_id_blocked)) {
+        DBG_PRINTF("%s", "Stream over the stream ID limit is ready\n");
+        ret = -1;
+    }
+
+    /* The urgent streams are served first, in turn */
+    if (ret == 0) {
+        ret = ready_stream_test_expect(&cnx, expect_urgent, 4);
+    }
+
+    /* A stream blocked by flow control leaves the list */
+    if (ret == 0) {
+        stream[4]->sent_offset = stream[4]->maxdata_remote;
+        ret = ready_stream_test_expect(&cnx, expect_urgent_blocked, 2);
+        if (ret == 0 && (stream[4]->is_ready || !cnx.stream_blocked)) {
+            DBG_PRINTF("%s", "Blocked stream still ready\n");
+            ret = -1;
+        }
+    }
+
+    /* Then the default level is served once the urgent streams are blocked */
+    if (ret == 0) {
+        stream[5]->sent_offset = stream[5]->maxdata_remote;
+        picoquic_update_ready_stream(&cnx, stream[5], 0);
+        ret = ready_stream_test_expect(&cnx, expect_default, 5);
+    }
+
+    /* Credit for the blocked stream puts it back in the list */
+    if (ret == 0) {
+        stream[4]->maxdata_remote += 0x1000;
+        picoquic_update_ready_stream(&cnx, stream[4], 0);
+        ret = ready_stream_test_expect(&cnx, expect_credit, 2);
+        stream[4]->is_active = 0;
+        picoquic_update_ready_stream(&cnx, stream[4], 0);
+    }
+
+    /* When the connection is blocked, only control frames can be sent */
+    if (ret == 0) {
+        cnx.data_sent = cnx.maxdata_remote;
+        ret = ready_stream_test_expect(&cnx, expect_control, 1);
+        if (ret == 0 && !cnx.flow_blocked) {
+            DBG_PRINTF("%s", "Connection blocked not signalled\n");
+            ret = -1;
+        }
+        if (ret == 0) {
+            stream[2]->reset_requested = 1;
+            picoquic_update_ready_stream(&cnx, stream[2], 0);
+            ret = ready_stream_test_expect(&cnx, expect_control + 1, 1);
+        }
+        stream[2]->reset_requested = 0;
+        picoquic_update_ready_stream(&cnx, stream[2], 0);
+        cnx.data_sent = 0;
+    }
+
+    /* Raising the stream ID limit makes the waiting stream ready */
+    if (ret == 0) {
+        cnx.max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(16, 0, 0);
+        picoquic_update_ready_stream_list(&cnx);
+        ret = ready_stream_test_expect(&cnx, expect_new_limit, 7);
+    }
+
+    /* The least urgent stream is only served when all others are idle */
+    if (ret == 0) {
+        for (int i = 0; i < 9; i++) {
+            if (i != 6) {
+                stream[i]->is_active = 0;
+                picoquic_update_ready_stream(&cnx, stream[i], 0);
+            }
+        }
+        ret = ready_stream_test_expect(&cnx, expect_low, 2);
+    }
+
+    if (ret == 0) {
+        stream[6]->is_active = 0;
+        picoquic_update_ready_stream(&cnx, stream[6], 0);
+        if (picoquic_find_ready_stream(&cnx) != NULL) {
+            DBG_PRINTF("%s", "Ready stream found when all streams are idle\n");
+            ret = -1;
+        }
+    }
+
+    while (picoquic_first_stream(&cnx) != NULL) {
+        picoquic_delete_stream(&cnx, picoquic_first_stream(&cnx));
+    }
+
+    for (int i = 0; ret == 0 && i < PICOQUIC_STREAM_LISTS; i++) {
+        if (cnx.first_ready_stream[i] != NULL || cnx.last_ready_stream[i] != NULL) {
+            DBG_PRINTF("Ready list %d not empty after deleting the streams\n", i);
+            ret = -1;
+        }
+    }
+
+    picoquic_arena_release(&cnx.arena);
+
+    return ret;
+}
+
+/*
+ * Test the garbage collection of closed streams. Open and close a large number
+ * of local and remote streams, in batches that are closed out of order, and
+ * verify that the streams are deleted as soon as they are closed, that the
+ * memory of closed streams stays compact, and that late frames for the deleted
+ * streams are ignored.
+ */
+
+#define STREAM_GC_TEST_NB_BATCHES 4096
+#define STREAM_GC_TEST_BATCH_SIZE 16
+
+static int stream_gc_test_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(fin_or_event);
+    UNREFERENCED_PARAMETER(callback_ctx);
+#endif
+    return 0;
+}
+
+static size_t stream_gc_test_frame(uint8_t* bytes, uint64_t stream_id)
+{
+    size_t byte_index = 0;
+
+    bytes[byte_index++] = picoquic_frame_type_stream_range_min | 3; /* Length and Fin, no offset */
+    byte_index += picoquic_varint_encode(bytes + byte_index, 16, stream_id);
+    bytes[byte_index++] = 8;
+    memset(bytes + byte_index, 0x5A, 8);
+    byte_index += 8;
+
+    return byte_index;
+}
+
+static int stream_gc_test_receive(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    uint8_t bytes[32];
+    size_t length = stream_gc_test_frame(bytes, stream_id);
+
+    return (picoquic_decode_stream_frame(cnx, bytes, bytes + length, 0) == bytes + length) ? 0 : -1;
+}
+
+static int stream_gc_test_send(picoquic_cnx_t* cnx, uint64_t stream_id, picoquic_packet_t* packet)
+{
+    int ret = picoquic_add_to_stream(cnx, stream_id, packet->bytes, 8, 1);
+    picoquic_stream_head* stream = picoquic_find_stream(cnx, stream_id, 0);
+    size_t consumed = 0;
+
+    if (ret != 0 || stream == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = picoquic_prepare_stream_frame(cnx, stream, packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &consumed, NULL);
+        packet->offset = 0;
+        packet->length = (uint32_t)consumed;
+        packet->ptype = picoquic_packet_1rtt_protected;
+        packet->pc = picoquic_packet_context_application;
+        picoquic_describe_packet_frames(packet);
+
+        if (ret == 0 && (consumed == 0 || !stream->fin_sent)) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int stream_gc_test_check_ranks(picoquic_cnx_t* cnx, int stream_type, uint64_t nb_closed)
+{
+    int ret = 0;
+    picoquic_sack_list_t* ranks = &cnx->closed_stream_ranks[stream_type];
+
+    if (ranks->nb_ranges != 1 || ranks->ranges[0].start_of_sack_range != 0 ||
+        ranks->ranges[0].end_of_sack_range + 1 != nb_closed) {
+        DBG_PRINTF("Closed streams of type %d not remembered as [0, %d]\n", stream_type, (int)nb_closed - 1);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int stream_gc_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_t* packets = (picoquic_packet_t*)malloc(2 * STREAM_GC_TEST_BATCH_SIZE * sizeof(picoquic_packet_t));
+    uint8_t* packet_bytes = (uint8_t*)malloc(2 * STREAM_GC_TEST_BATCH_SIZE * PICOQUIC_MAX_PACKET_SIZE);
+    struct sockaddr_in addr;
+    uint64_t bidir_computed = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL || packets == NULL || packet_bytes == NULL) {
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(packets, 0, 2 * STREAM_GC_TEST_BATCH_SIZE * sizeof(picoquic_packet_t));
+        memset(packet_bytes, 0, 2 * STREAM_GC_TEST_BATCH_SIZE * PICOQUIC_MAX_PACKET_SIZE);
+        for (int i = 0; i < 2 * STREAM_GC_TEST_BATCH_SIZE; i++) {
+            packets[i].bytes = packet_bytes + (size_t)i * PICOQUIC_MAX_PACKET_SIZE;
+        }
+        picoquic_set_callback(cnx, stream_gc_test_callback, NULL);
+        cnx->maxdata_local = (uint64_t)((int64_t)-1);
+        cnx->maxdata_remote = (uint64_t)((int64_t)-1);
+        cnx->local_parameters.initial_max_stream_data_bidi_local = 0x10000;
+        cnx->local_parameters.initial_max_stream_data_bidi_remote = 0x10000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_local = 0x10000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = 0x10000;
+        cnx->max_stream_id_bidir_local = STREAM_ID_FROM_RANK(STREAM_GC_TEST_NB_BATCHES * STREAM_GC_TEST_BATCH_SIZE, 1, 0);
+        cnx->max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(STREAM_GC_TEST_NB_BATCHES * STREAM_GC_TEST_BATCH_SIZE, 0, 0);
+        bidir_computed = cnx->max_stream_id_bidir_local_computed;
+    }
+
+    for (int batch = 0; ret == 0 && batch < STREAM_GC_TEST_NB_BATCHES; batch++) {
+        uint64_t first_rank = (uint64_t)batch * STREAM_GC_TEST_BATCH_SIZE;
+
+        /* Open streams in both directions. Local streams get their response
+         * before the ack for even ranks, after the ack for odd ranks. */
+        for (int i = 0; ret == 0 && i < STREAM_GC_TEST_BATCH_SIZE; i++) {
+            uint64_t local_id = STREAM_ID_FROM_RANK(first_rank + i, 0, 0);
+            uint64_t remote_id = STREAM_ID_FROM_RANK(first_rank + i, 1, 0);
+
+            ret = stream_gc_test_send(cnx, local_id, &packets[2 * i]);
+            if (ret == 0 && (i & 1) == 0) {
+                ret = stream_gc_test_receive(cnx, local_id);
+            }
+            if (ret == 0) {
+                ret = stream_gc_test_receive(cnx, remote_id);
+            }
+            if (ret == 0) {
+                ret = stream_gc_test_send(cnx, remote_id, &packets[2 * i + 1]);
+            }
+            if (ret == 0 && picoquic_find_stream(cnx, remote_id, 0) == NULL) {
+                DBG_PRINTF("Stream %d deleted before the ack\n", (int)remote_id);
+                ret = -1;
+            }
+        }
+
+        /* Acknowledge in reverse order, then close the odd local streams */
+        for (int i = 2 * STREAM_GC_TEST_BATCH_SIZE - 1; ret == 0 && i >= 0; i--) {
+            picoquic_process_possible_ack_of_ack_frame(cnx, &packets[i]);
+        }
+
+        for (int i = 1; ret == 0 && i < STREAM_GC_TEST_BATCH_SIZE; i += 2) {
+            ret = stream_gc_test_receive(cnx, STREAM_ID_FROM_RANK(first_rank + i, 0, 0));
+        }
+
+        if (ret == 0 && picoquic_first_stream(cnx) != NULL) {
+            DBG_PRINTF("Stream %d not deleted after batch %d\n", (int)picoquic_first_stream(cnx)->stream_id, batch);
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            ret = stream_gc_test_check_ranks(cnx, 0, first_rank + STREAM_GC_TEST_BATCH_SIZE);
+        }
+
+        if (ret == 0) {
+            ret = stream_gc_test_check_ranks(cnx, 1, first_rank + STREAM_GC_TEST_BATCH_SIZE);
+        }
+    }
+
+    if (ret == 0 && cnx->max_stream_id_bidir_local_computed !=
+        bidir_computed + 4 * STREAM_GC_TEST_NB_BATCHES * STREAM_GC_TEST_BATCH_SIZE) {
+        DBG_PRINTF("%s", "Max stream ID not updated for the deleted streams\n");
+        ret = -1;
+    }
+
+    /* Late frames for deleted streams are ignored, and the streams cannot be reused */
+    if (ret == 0) {
+        uint8_t late_frames[] = {
+            picoquic_frame_type_reset_stream, 0x40, 0x15, 0, 0, 8,
+            picoquic_frame_type_max_stream_data, 0x40, 0x20, 0x44, 0,
+            picoquic_frame_type_stop_sending, 0x40, 0x24, 0, 0
+        };
+
+        if (stream_gc_test_receive(cnx, STREAM_ID_FROM_RANK(5, 0, 0)) != 0 ||
+            stream_gc_test_receive(cnx, STREAM_ID_FROM_RANK(6, 1, 0)) != 0 ||
+            picoquic_decode_frames(cnx, cnx->path[0], late_frames, sizeof(late_frames), 3, NULL, NULL, 0) != 0) {
+            DBG_PRINTF("%s", "Late frame for a deleted stream was rejected\n");
+            ret = -1;
+        }
+        else if (picoquic_first_stream(cnx) != NULL || cnx->local_error != 0) {
+            DBG_PRINTF("%s", "Late frame for a deleted stream was not ignored\n");
+            ret = -1;
+        }
+        else if (picoquic_add_to_stream(cnx, STREAM_ID_FROM_RANK(3, 0, 0), late_frames, 1, 1) != PICOQUIC_ERROR_STREAM_ALREADY_CLOSED ||
+            picoquic_reset_stream(cnx, STREAM_ID_FROM_RANK(3, 0, 0), 0) != PICOQUIC_ERROR_STREAM_ALREADY_CLOSED) {
+            DBG_PRINTF("%s", "Deleted stream could be reused\n");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (packets != NULL) {
+        free(packets);
+    }
+
+    if (packet_bytes != NULL) {
+        free(packet_bytes);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the reassembly of a large stream received out of order. The frames
+ * arrive shuffled in small blocks, with some duplicates and overlaps. The
+ * data must be delivered in order, in at most two spans per frame, and
+ * the receive ring must not be reallocated once it has grown to cover the
+ * reordering window.
+ */
+
+#define STREAM_REASSEMBLY_NB_FRAMES 4096
+#define STREAM_REASSEMBLY_FRAME_SIZE 1000
+#define STREAM_REASSEMBLY_REORDER 8
+#define STREAM_REASSEMBLY_WARM_UP 64
+
+typedef struct st_stream_reassembly_test_ctx_t {
+    uint64_t next_offset;
+    int nb_calls;
+    int fin_received;
+    int error;
+} stream_reassembly_test_ctx_t;
+
+static uint8_t stream_reassembly_test_byte(uint64_t offset)
+{
+    return (uint8_t)(offset * 7 + (offset >> 8));
+}
+
+static int stream_reassembly_test_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx)
+{
+    stream_reassembly_test_ctx_t* ctx = (stream_reassembly_test_ctx_t*)callback_ctx;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+#endif
+
+    ctx->nb_calls++;
+
+    if (fin_or_event != picoquic_callback_stream_data && fin_or_event != picoquic_callback_stream_fin) {
+        ctx->error = 1;
+    } else {
+        for (size_t i = 0; i < length; i++) {
+            if (bytes[i] != stream_reassembly_test_byte(ctx->next_offset + i)) {
+                ctx->error = 1;
+                break;
+            }
+        }
+        ctx->next_offset += length;
+        if (fin_or_event == picoquic_callback_stream_fin) {
+            ctx->fin_received = 1;
+        }
+    }
+
+    return 0;
+}
+
+static int stream_reassembly_test_receive(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t offset, size_t length, int fin)
+{
+    uint8_t bytes[32 + STREAM_REASSEMBLY_FRAME_SIZE];
+    size_t byte_index = 0;
+
+    bytes[byte_index++] = picoquic_frame_type_stream_range_min | 6 | fin; /* Offset and length */
+    byte_index += picoquic_varint_encode(bytes + byte_index, 16, stream_id);
+    byte_index += picoquic_varint_encode(bytes + byte_index, 16, offset);
+    byte_index += picoquic_varint_encode(bytes + byte_index, 16, length);
+    for (size_t i = 0; i < length; i++) {
+        bytes[byte_index++] = stream_reassembly_test_byte(offset + i);
+    }
+
+    return (picoquic_decode_stream_frame(cnx, bytes, bytes + byte_index, 0) == bytes + byte_index) ? 0 : -1;
+}
+
+int stream_reassembly_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_stream_head* stream = NULL;
+    stream_reassembly_test_ctx_t ctx;
+    uint64_t stream_id = STREAM_ID_FROM_RANK(0, 0, 0);
+    uint64_t random_state = 0xC0FFEEull;
+    uint8_t* ring = NULL;
+    size_t ring_size = 0;
+    int order[STREAM_REASSEMBLY_REORDER];
+    struct sockaddr_in addr;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_set_callback(cnx, stream_reassembly_test_callback, &ctx);
+        cnx->maxdata_local = (uint64_t)((int64_t)-1);
+        cnx->local_parameters.initial_max_stream_data_bidi_local = 0x1000000;
+        cnx->local_parameters.initial_max_stream_data_bidi_remote = 0x1000000;
+        if ((stream = picoquic_create_stream(cnx, stream_id)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    for (int block = 0; ret == 0 && block < STREAM_REASSEMBLY_NB_FRAMES; block += STREAM_REASSEMBLY_REORDER) {
+        /* Shuffle the frames of the block */
+        for (int i = 0; i < STREAM_REASSEMBLY_REORDER; i++) {
+            order[i] = block + i;
+        }
+        for (int i = STREAM_REASSEMBLY_REORDER - 1; i > 0; i--) {
+            int j;
+            int x;
+
+            random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+            j = (int)((random_state >> 33) % (uint64_t)(i + 1));
+            x = order[i];
+            order[i] = order[j];
+            order[j] = x;
+        }
+
+        for (int i = 0; ret == 0 && i < STREAM_REASSEMBLY_REORDER; i++) {
+            uint64_t offset = (uint64_t)order[i] * STREAM_REASSEMBLY_FRAME_SIZE;
+            int nb_calls = ctx.nb_calls;
+
+            ret = stream_reassembly_test_receive(cnx, stream_id, offset, STREAM_REASSEMBLY_FRAME_SIZE, 0);
+
+            if (ret == 0 && (order[i] % 5) == 0) {
+                /* Repeat the frame, and send an overlapping one */
+                ret = stream_reassembly_test_receive(cnx, stream_id, offset, STREAM_REASSEMBLY_FRAME_SIZE, 0);
+                if (ret == 0 && offset >= STREAM_REASSEMBLY_FRAME_SIZE / 2) {
+                    ret = stream_reassembly_test_receive(cnx, stream_id, offset - STREAM_REASSEMBLY_FRAME_SIZE / 2,
+                        STREAM_REASSEMBLY_FRAME_SIZE, 0);
+                }
+            }
+
+            if (ret == 0 && ctx.nb_calls - nb_calls > 2) {
+                DBG_PRINTF("Frame %d delivered in %d calls", order[i], ctx.nb_calls - nb_calls);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (ctx.error || ctx.next_offset != (uint64_t)(block + STREAM_REASSEMBLY_REORDER) * STREAM_REASSEMBLY_FRAME_SIZE)) {
+            DBG_PRINTF("Data not delivered in order after block %d", block);
+            ret = -1;
+        }
+
+        if (ret == 0 && block == STREAM_REASSEMBLY_WARM_UP) {
+            ring = stream->receive_buffer;
+            ring_size = stream->receive_buffer_size;
+        }
+    }
+
+    if (ret == 0 && (stream->receive_buffer != ring || stream->receive_buffer_size != ring_size)) {
+        DBG_PRINTF("Receive ring reallocated after warm up, size %d", (int)stream->receive_buffer_size);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = stream_reassembly_test_receive(cnx, stream_id,
+            (uint64_t)STREAM_REASSEMBLY_NB_FRAMES * STREAM_REASSEMBLY_FRAME_SIZE, 0, 1);
+        if (ret == 0 && (!ctx.fin_received || ctx.error)) {
+            DBG_PRINTF("%s", "Fin not delivered");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/*
+ * Test the zero copy send API. Large application buffers are queued without
+ * copy, sent in stream frames, and released exactly once after all their
+ * bytes were acknowledged. Buffers queued on a stream that is reset are released
+ * when the reset is sent, and a failed call does not take ownership.
+ */
+
+#define ZERO_COPY_TEST_NB_BUFFERS 3
+#define ZERO_COPY_TEST_BUFFER_SIZE 100000
+
+typedef struct st_zero_copy_test_ctx_t {
+    uint8_t* buffers[ZERO_COPY_TEST_NB_BUFFERS + 1];
+    int nb_released[ZERO_COPY_TEST_NB_BUFFERS + 1];
+    int error;
+} zero_copy_test_ctx_t;
+
+static void zero_copy_test_release(uint8_t* bytes, size_t length, void* release_ctx)
+{
+    zero_copy_test_ctx_t* ctx = (zero_copy_test_ctx_t*)release_ctx;
+    int found = 0;
+
+    for (int i = 0; i <= ZERO_COPY_TEST_NB_BUFFERS; i++) {
+        if (bytes == ctx->buffers[i] && length == ZERO_COPY_TEST_BUFFER_SIZE) {
+            ctx->nb_released[i]++;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        ctx->error = 1;
+    }
+}
+
+int zero_copy_send_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_stream_head* stream = NULL;
+    zero_copy_test_ctx_t ctx;
+    picoquic_iovec_t iov[ZERO_COPY_TEST_NB_BUFFERS];
+    uint64_t stream_id = STREAM_ID_FROM_RANK(0, 0, 0);
+    uint64_t reset_stream_id = STREAM_ID_FROM_RANK(1, 0, 0);
+    uint64_t sent_offset = 0;
+    uint64_t acked_offset = 0;
+    struct sockaddr_in addr;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    for (int i = 0; ret == 0 && i <= ZERO_COPY_TEST_NB_BUFFERS; i++) {
+        if ((ctx.buffers[i] = (uint8_t*)malloc(ZERO_COPY_TEST_BUFFER_SIZE)) == NULL) {
+            ret = -1;
+        } else {
+            for (size_t j = 0; j < ZERO_COPY_TEST_BUFFER_SIZE; j++) {
+                ctx.buffers[i][j] = (uint8_t)(i + j);
+            }
+            if (i < ZERO_COPY_TEST_NB_BUFFERS) {
+                iov[i].base = ctx.buffers[i];
+                iov[i].len = ZERO_COPY_TEST_BUFFER_SIZE;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+    }
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx->maxdata_remote = (uint64_t)((int64_t)-1);
+        cnx->remote_parameters.initial_max_stream_data_bidi_local = 0x1000000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = 0x1000000;
+        cnx->max_stream_id_bidir_local = STREAM_ID_FROM_RANK(16, 1, 0);
+
+        if (picoquic_add_to_stream_zero_copy(cnx, stream_id, iov, ZERO_COPY_TEST_NB_BUFFERS, 1, NULL, &ctx) == 0) {
+            DBG_PRINTF("%s", "Zero copy call accepted without release function");
+            ret = -1;
+        }
+        else if (picoquic_add_to_stream_zero_copy(cnx, stream_id, iov, ZERO_COPY_TEST_NB_BUFFERS, 1,
+            zero_copy_test_release, &ctx) != 0 ||
+            (stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL) {
+            ret = -1;
+        }
+        else if (stream->send_queue == NULL || stream->send_queue->bytes != ctx.buffers[0] ||
+            stream->send_queue_last == NULL || stream->send_queue_last->bytes != ctx.buffers[ZERO_COPY_TEST_NB_BUFFERS - 1]) {
+            DBG_PRINTF("%s", "Buffers were not queued by reference");
+            ret = -1;
+        }
+    }
+
+    while (ret == 0 && !stream->fin_sent) {
+        picoquic_packet_t* packet = picoquic_create_packet(quic);
+        uint8_t* bytes = (packet == NULL) ? NULL : packet->bytes;
+        size_t consumed = 0;
+
+        if (packet == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = picoquic_prepare_stream_frame(cnx, stream, bytes, 1400, &consumed, NULL);
+        }
+
+        if (ret == 0) {
+            uint64_t frame_stream_id = 0;
+            uint64_t offset = 0;
+            size_t data_length = 0;
+            int fin = 0;
+            size_t header_length = 0;
+
+            if (consumed == 0 || picoquic_parse_stream_header(bytes, consumed, &frame_stream_id, &offset,
+                &data_length, &fin, &header_length) != 0 || frame_stream_id != stream_id || offset != sent_offset) {
+                DBG_PRINTF("Unexpected frame at offset %d", (int)sent_offset);
+                ret = -1;
+            } else {
+                for (size_t i = 0; ret == 0 && i < data_length; i++) {
+                    uint64_t data_offset = offset + i;
+                    uint8_t expected = (uint8_t)(data_offset / ZERO_COPY_TEST_BUFFER_SIZE + data_offset % ZERO_COPY_TEST_BUFFER_SIZE);
+
+                    if (bytes[header_length + i] != expected) {
+                        DBG_PRINTF("Unexpected byte at offset %d", (int)data_offset);
+                        ret = -1;
+                    }
+                }
+                sent_offset += data_length;
+            }
+        }
+
+        /* A buffer is released as soon as its last byte is acknowledged, and not before */
+        for (int pass = 0; ret == 0 && pass < 2; pass++) {
+            int buffer_index = (int)(acked_offset / ZERO_COPY_TEST_BUFFER_SIZE);
+
+            for (int i = 0; ret == 0 && i < ZERO_COPY_TEST_NB_BUFFERS; i++) {
+                if (ctx.nb_released[i] != ((i < buffer_index) ? 1 : 0)) {
+                    DBG_PRINTF("Buffer %d released %d times at offset %d", i, ctx.nb_released[i], (int)acked_offset);
+                    ret = -1;
+                }
+            }
+
+            if (ret == 0 && pass == 0) {
+                packet->length = (uint32_t)consumed;
+                packet->ptype = picoquic_packet_1rtt_protected;
+                packet->pc = picoquic_packet_context_application;
+                picoquic_describe_packet_frames(packet);
+                picoquic_process_possible_ack_of_ack_frame(cnx, packet);
+                acked_offset = sent_offset;
+            }
+        }
+
+        if (packet != NULL) {
+            picoquic_recycle_packet(quic, packet);
+        }
+    }
+
+    if (ret == 0 && (sent_offset != ZERO_COPY_TEST_NB_BUFFERS * ZERO_COPY_TEST_BUFFER_SIZE ||
+        stream->send_queue != NULL || stream->send_queue_last != NULL || stream->send_retained != NULL)) {
+        DBG_PRINTF("%s", "Queue not empty after sending all data");
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < ZERO_COPY_TEST_NB_BUFFERS; i++) {
+        if (ctx.nb_released[i] != 1) {
+            DBG_PRINTF("Buffer %d released %d times", i, ctx.nb_released[i]);
+            ret = -1;
+        }
+    }
+
+    /* Data queued on a stream that is reset is released when the reset is sent */
+    if (ret == 0) {
+        uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+        size_t consumed = 0;
+
+        iov[0].base = ctx.buffers[ZERO_COPY_TEST_NB_BUFFERS];
+
+        if (picoquic_add_to_stream_zero_copy(cnx, reset_stream_id, iov, 1, 0, zero_copy_test_release, &ctx) != 0 ||
+            picoquic_reset_stream(cnx, reset_stream_id, 0) != 0 ||
+            (stream = picoquic_find_stream(cnx, reset_stream_id, 0)) == NULL ||
+            picoquic_prepare_stream_frame(cnx, stream, bytes, sizeof(bytes), &consumed, NULL) != 0) {
+            ret = -1;
+        }
+        else if (ctx.nb_released[ZERO_COPY_TEST_NB_BUFFERS] != 1 || ctx.error) {
+            DBG_PRINTF("%s", "Buffer not released after reset");
+            ret = -1;
+        }
+    }
+
+    /* A call that fails queues nothing, not even the fin */
+    if (ret == 0) {
+        if (picoquic_add_to_stream_zero_copy(cnx, reset_stream_id, iov, 1, 1, zero_copy_test_release, &ctx) == 0) {
+            DBG_PRINTF("%s", "Data accepted after reset");
+            ret = -1;
+        }
+        else if ((stream = picoquic_find_stream(cnx, reset_stream_id, 0)) == NULL || stream->fin_requested ||
+            stream->send_queue != NULL || ctx.nb_released[ZERO_COPY_TEST_NB_BUFFERS] != 1) {
+            DBG_PRINTF("%s", "Failed call changed the stream");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    for (int i = 0; i <= ZERO_COPY_TEST_NB_BUFFERS; i++) {
+        if (ctx.buffers[i] != NULL) {
+            free(ctx.buffers[i]);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Test the retransmission of stream frames from the data retained by the
+ * stream. Sent packets only keep a description of their stream frames. Lost
+ * frames are rebuilt with the same offset, length and content as the original,
+ * and the retained data is released once it is acknowledged.
+ */
+
+#define STREAM_RETRANSMIT_TEST_LENGTH 65536
+#define STREAM_RETRANSMIT_TEST_CHUNK 4096
+#define STREAM_RETRANSMIT_TEST_MAX_PACKETS 128
+
+static uint8_t stream_retransmit_test_byte(uint64_t offset)
+{
+    return (uint8_t)(offset * 7 + (offset >> 8));
+}
+
+static int stream_retransmit_test_check(picoquic_stream_head* stream, picoquic_packet_t* packet)
+{
+    int ret = 0;
+    size_t cursor = 0;
+    picoquic_frame_desc_t scratch;
+    picoquic_frame_desc_t* desc;
+
+    while (ret == 0 && (desc = picoquic_next_frame_desc(packet, &cursor, &scratch)) != NULL) {
+        uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+        size_t consumed = 0;
+        uint64_t stream_id = 0;
+        uint64_t offset = 0;
+        size_t data_length = 0;
+        int fin = 0;
+        size_t header_length = 0;
+
+        if ((desc->flags & PICOQUIC_FRAME_DESC_NOT_STORED) == 0) {
+            DBG_PRINTF("Frame of type 0x%x stored in packet %d", desc->frame_type, (int)packet->sequence_number);
+            ret = -1;
+        }
+        else if (picoquic_rebuild_stream_frame(stream, desc, bytes, sizeof(bytes), &consumed) != 0 ||
+            picoquic_parse_stream_header(bytes, consumed, &stream_id, &offset, &data_length, &fin, &header_length) != 0) {
+            DBG_PRINTF("Cannot rebuild the frame at offset %d", (int)desc->offset);
+            ret = -1;
+        }
+        else if (stream_id != stream->stream_id || offset != desc->offset || data_length != desc->data_length ||
+            fin != ((desc->flags & PICOQUIC_FRAME_DESC_FIN) != 0) || header_length + data_length != consumed) {
+            DBG_PRINTF("Rebuilt frame at offset %d does not match the original", (int)desc->offset);
+            ret = -1;
+        }
+        else {
+            for (size_t i = 0; ret == 0 && i < data_length; i++) {
+                if (bytes[header_length + i] != stream_retransmit_test_byte(offset + i)) {
+                    DBG_PRINTF("Unexpected byte at offset %d", (int)(offset + i));
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+int stream_retransmit_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_stream_head* stream = NULL;
+    picoquic_packet_t* packets[STREAM_RETRANSMIT_TEST_MAX_PACKETS];
+    uint8_t* data = (uint8_t*)malloc(STREAM_RETRANSMIT_TEST_LENGTH);
+    uint64_t stream_id = STREAM_ID_FROM_RANK(0, 0, 0);
+    size_t nb_packets = 0;
+    size_t compact_memory = 0;
+    size_t verbatim_memory = 0;
+    const uint8_t ack_frame[] = { picoquic_frame_type_ack, 0, 0, 0, 0 };
+    const size_t ack_length = sizeof(ack_frame);
+    picoquic_packet_pool_stats_t stats;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL || data == NULL) {
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&addr, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx->maxdata_remote = (uint64_t)((int64_t)-1);
+        cnx->remote_parameters.initial_max_stream_data_bidi_local = 0x1000000;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = 0x1000000;
+        cnx->max_stream_id_bidir_local = STREAM_ID_FROM_RANK(16, 1, 0);
+        cnx->max_stream_id_bidir_remote = STREAM_ID_FROM_RANK(16, 0, 0);
+
+        for (size_t i = 0; i < STREAM_RETRANSMIT_TEST_LENGTH; i++) {
+            data[i] = stream_retransmit_test_byte(i);
+        }
+
+        for (size_t i = 0; ret == 0 && i < STREAM_RETRANSMIT_TEST_LENGTH; i += STREAM_RETRANSMIT_TEST_CHUNK) {
+            ret = picoquic_add_to_stream(cnx, stream_id, data + i, STREAM_RETRANSMIT_TEST_CHUNK,
+                i + STREAM_RETRANSMIT_TEST_CHUNK >= STREAM_RETRANSMIT_TEST_LENGTH);
+        }
+
+        if (ret != 0 || (stream = picoquic_find_stream(cnx, stream_id, 0)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    /* Send the whole stream. The queued packets only keep their descriptions */
+    while (ret == 0 && !stream->fin_sent) {
+        picoquic_packet_t* packet = picoquic_create_packet(quic);
+        size_t consumed = 0;
+
+        if (packet == NULL || nb_packets >= STREAM_RETRANSMIT_TEST_MAX_PACKETS) {
+            if (packet != NULL) {
+                picoquic_recycle_packet(quic, packet);
+            }
+            ret = -1;
+        }
+        else if ((ret = picoquic_prepare_stream_frame(cnx, stream, packet->bytes + ack_length, 1200 - ack_length,
+            &consumed, NULL)) != 0) {
+            picoquic_recycle_packet(quic, packet);
+        }
+        else {
+            /* Even packets also carry a short ACK frame, kept in a small buffer */
+            int has_ack = (nb_packets & 1) == 0;
+
+            if (has_ack) {
+                memcpy(packet->bytes, ack_frame, ack_length);
+            }
+            else {
+                memmove(packet->bytes, packet->bytes + ack_length, consumed);
+            }
+            consumed += (has_ack) ? ack_length : 0;
+            packet->sequence_number = cnx->pkt_ctx[picoquic_packet_context_application].send_sequence++;
+            packet->pc = picoquic_packet_context_application;
+            packet->ptype = picoquic_packet_1rtt_protected;
+            packet->send_path = cnx->path[0];
+            packet->length = (uint32_t)consumed;
+            picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, consumed, 0);
+            packets[nb_packets++] = packet;
+
+            if (!packet->is_compacted || (has_ack) != (packet->bytes != NULL) || (has_ack) != packet->is_small_buffer ||
+                (has_ack && memcmp(packet->bytes, ack_frame, ack_length) != 0)) {
+                DBG_PRINTF("Packet %d not compacted", (int)packet->sequence_number);
+                ret = -1;
+            }
+            compact_memory += sizeof(picoquic_packet_t) + ((has_ack) ? PICOQUIC_SMALL_PACKET_BUFFER_SIZE : 0);
+            verbatim_memory += sizeof(picoquic_packet_t) + PICOQUIC_MAX_PACKET_SIZE;
+        }
+    }
+
+    if (ret == 0) {
+        DBG_PRINTF("Memory for %d packets in flight: %d bytes, %d if stored verbatim",
+            (int)nb_packets, (int)compact_memory, (int)verbatim_memory);
+    }
+
+    /* One packet in four is lost, the others are acknowledged */
+    for (size_t i = 0; ret == 0 && i < nb_packets; i++) {
+        if ((i & 3) != 1) {
+            picoquic_process_possible_ack_of_ack_frame(cnx, packets[i]);
+            (void)picoquic_dequeue_retransmit_packet(cnx, packets[i], 1);
+            packets[i] = NULL;
+        }
+    }
+
+    /* Data is released by whole chunks, up to the chunk of the first lost frame */
+    if (ret == 0 && (stream->send_retained == NULL || stream->retained_offset !=
+        packets[1]->frame_desc[0].offset - packets[1]->frame_desc[0].offset % STREAM_RETRANSMIT_TEST_CHUNK)) {
+        DBG_PRINTF("%s", "Retained data does not start at the first lost frame");
+        ret = -1;
+    }
+
+    for (size_t i = 1; ret == 0 && i < nb_packets; i += 4) {
+        ret = stream_retransmit_test_check(stream, packets[i]);
+    }
+
+    /* Once acknowledged, the lost frames need not be repeated and the data is released */
+    for (size_t i = 1; ret == 0 && i < nb_packets; i += 4) {
+        uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+        size_t consumed = 0;
+
+        picoquic_process_possible_ack_of_ack_frame(cnx, packets[i]);
+
+        if (picoquic_rebuild_stream_frame(stream, &packets[i]->frame_desc[0], bytes, sizeof(bytes), &consumed) != 0 ||
+            (consumed != 0 && (packets[i]->frame_desc[0].flags & PICOQUIC_FRAME_DESC_FIN) == 0)) {
+            DBG_PRINTF("Acknowledged frame at offset %d rebuilt", (int)packets[i]->frame_desc[0].offset);
+            ret = -1;
+        }
+        (void)picoquic_dequeue_retransmit_packet(cnx, packets[i], 1);
+        packets[i] = NULL;
+    }
+
+    if (ret == 0 && (stream->send_retained != NULL || stream->send_queue != NULL ||
+        stream->retained_offset != STREAM_RETRANSMIT_TEST_LENGTH)) {
+        DBG_PRINTF("%s", "Stream data not released after all acknowledgements");
+        ret = -1;
+    }
+
+    /* The small buffers of the ACK frames are back in the pool */
+    if (ret == 0) {
+        picoquic_get_packet_pool_stats(quic, &stats);
+        if (stats.nb_small_buffers_in_pool != (nb_packets + 1) / 2) {
+            DBG_PRINTF("%d small buffers in pool, expected %d", (int)stats.nb_small_buffers_in_pool, (int)(nb_packets + 1) / 2);
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (data != NULL) {
+        free(data);
+    }
+
+    return ret;
+}
@@ -846,7 +846,7 @@ int tls_api_one_sim_round(picoquic_test_tls_api_ctx_t* test_ctx,
 
                         target_link = test_ctx->s_to_c_link;
                     }
-                    picoquic_delete_stateless_packet(sp);
+                    picoquic_recycle_stateless_packet(test_ctx->qserver, sp);
                 }
             }
             else if (next_action == 2) {
@@ -2445,6 +2445,106 @@ int mtu_discovery_test()
     return ret;
 }
 
+/*
+ * Prepare series of segments at the server, as for UDP segmentation offload.
+ * Verify that all segments but the last have the segment size, that the
+ * series start with a full size packet, and that the client accepts each
+ * segment as a separate packet. The transfer then completes through the
+ * simulated links.
+ */
+
+int gso_prepare_test()
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    uint8_t* send_buffer = NULL;
+    size_t send_buffer_max = PICOQUIC_MAX_SEGMENTS_PER_SEND * PICOQUIC_MAX_PACKET_SIZE;
+    int max_segments = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    int ret = tls_api_init_ctx(&test_ctx, PICOQUIC_INTERNAL_TEST_VERSION_1,
+        PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 0, 0);
+
+    if (ret == 0 && (send_buffer = (uint8_t*)malloc(send_buffer_max)) == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+    }
+
+    for (int i = 0; ret == 0 && i < 10000 && !test_ctx->test_finished && max_segments < 2; i++) {
+        int was_active = 0;
+        size_t send_length = 0;
+        size_t segment_size = 0;
+        struct sockaddr_storage addr_to;
+        int addr_to_len = 0;
+        struct sockaddr_storage addr_from;
+        int addr_from_len = 0;
+
+        if (test_ctx->cnx_server->next_wake_time <= simulated_time) {
+            ret = picoquic_prepare_segments(test_ctx->cnx_server, simulated_time, send_buffer, send_buffer_max,
+                &send_length, &segment_size, &addr_to, &addr_to_len, &addr_from, &addr_from_len);
+
+            if (ret == 0 && send_length > 0) {
+                int nb_segments = (int)((send_length + segment_size - 1) / segment_size);
+
+                if (nb_segments > 1 && segment_size < test_ctx->cnx_server->path[0]->send_mtu) {
+                    DBG_PRINTF("Series of %d segments of %d bytes, below the MTU", nb_segments, (int)segment_size);
+                    ret = -1;
+                }
+
+                for (size_t offset = 0; ret == 0 && offset < send_length; offset += segment_size) {
+                    size_t length = (send_length - offset > segment_size) ? segment_size : send_length - offset;
+
+                    if (picoquic_incoming_packet(test_ctx->qclient, send_buffer + offset, (uint32_t)length,
+                        (struct sockaddr*)&test_ctx->server_addr, (struct sockaddr*)&test_ctx->client_addr, 0, 0,
+                        simulated_time) != 0) {
+                        DBG_PRINTF("Segment at offset %d not accepted", (int)offset);
+                        ret = -1;
+                    }
+                }
+
+                if (nb_segments > max_segments) {
+                    max_segments = nb_segments;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            ret = tls_api_one_sim_round(test_ctx, &simulated_time, 0, &was_active);
+        }
+    }
+
+    if (ret == 0 && max_segments < 2) {
+        DBG_PRINTF("No series of segments, max %d", max_segments);
+        ret = -1;
+    }
+
+    /* Complete the transfer */
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_verify(test_ctx);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    if (send_buffer != NULL) {
+        free(send_buffer);
+    }
+
+    return ret;
+}
+
 /*
  * Trying to reproduce the scenario that resulted in
  * spurious retransmissions,and checking that it is fixed.
@@ -4188,7 +4288,7 @@ int retire_cnxid_test()
             DBG_PRINTF("Could not retrieve cnx ID #%d.\n", i-1);
         } else {
             ret = picoquic_queue_retire_connection_id_frame(test_ctx->cnx_client, stashed->sequence);
-            free(stashed);
+            picoquic_delete_cnxid_stash(test_ctx->cnx_client, stashed);
         }
     }
 
@@ -4889,14 +4989,14 @@ int false_migration_inject(picoquic_test_tls_api_ctx_t* test_ctx, int target_cli
     picoquic_cnx_t * cnx = (target_client) ? test_ctx->cnx_client : test_ctx->cnx_server;
     picoquictest_sim_link_t* target_link = (target_client) ? test_ctx->c_to_s_link : test_ctx->s_to_c_link;
     picoquictest_sim_packet_t* sim_packet = picoquictest_sim_link_create_packet();
-    picoquic_packet_t * packet = picoquic_create_packet();
+    picoquic_packet_t * packet = (cnx == NULL) ? NULL : picoquic_create_packet(cnx->quic);
 
     if (sim_packet == NULL || packet == NULL || cnx == NULL) {
         if (sim_packet != NULL) {
             free(sim_packet);
         }
         if (packet != NULL) {
-            free(packet);
+            picoquic_recycle_packet(cnx->quic, packet);
         }
         ret = -1;
     }